@@ -6,11 +6,14 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
 
+#include "packet_queue.h"
 #include "qlib.h"
 
 /******************************************************************************
@@ -24,7 +27,6 @@
  * [] Implement graceful shutdown, clean queues and deallocate memory
  *
  *
- * [] qlib: add proper timeout for msgQSend
  *****************************************************************************/
 
 /******************************************************************************
@@ -39,16 +41,199 @@ enum {
 	OVL_HEIGHT = 610,
 };
 
+/**
+ * What the renderer does when the encoder has no free input buffer
+ * (see TryGetEncoderInputBuffer)
+ */
+enum EncoderInputPolicy {
+	/* skip the frame which has just been rendered */
+	ENCODER_INPUT_DROP_NEWEST,
+	/* reclaim the oldest frame still waiting for the encoder */
+	ENCODER_INPUT_DROP_OLDEST,
+	/* wait up to ENCODER_INPUT_DEADLINE_MS, then drop the newest frame */
+	ENCODER_INPUT_BLOCK_DEADLINE,
+};
+
+#define ENCODER_INPUT_POLICY ENCODER_INPUT_DROP_NEWEST
+
+/**
+ * How rendered frames reach the appsrc of their output
+ */
+enum EncoderPushMode {
+	/**
+	 * The rendering thread pushes every frame right after the readback.
+	 * The appsrc queue is bounded by max-bytes and leaks according to
+	 * ENCODER_INPUT_POLICY, offline it blocks the renderer instead.
+	 */
+	ENCODER_PUSH_DIRECT,
+	/**
+	 * need-data schedules an idle callback on the GStreamer main loop,
+	 * which pulls the frames from a queue filled by the renderer
+	 */
+	ENCODER_PULL_IDLE,
+};
+
+#define ENCODER_PUSH_MODE ENCODER_PUSH_DIRECT
+
+/**
+ * Where the rendered frames are encoded (see EncoderSinkOps)
+ */
+enum EncoderSink {
+	/* RGB frames into the GStreamer pipeline of GetGstPipelineString */
+	ENCODER_SINK_GSTREAMER,
+	/**
+	 * I420 frames, converted on the GPU, encoded with libavcodec and
+	 * muxed with libavformat on the rendering thread
+	 */
+	ENCODER_SINK_AVCODEC,
+	/**
+	 * No encoding: the frames are read back straight into a ring in
+	 * shared memory for other processes on the machine, see
+	 * shm_frame_ring.h
+	 */
+	ENCODER_SINK_SHM,
+	/**
+	 * No encoding: I420 frames streamed as Y4M to stdout or a named
+	 * pipe (PIPE_SINK_PATH), for ffmpeg or analysis tools
+	 */
+	ENCODER_SINK_PIPE,
+};
+
+#define ENCODER_SINK ENCODER_SINK_GSTREAMER
+
+/**
+ * ENCODER_SINK_SHM: readers of output output_idx connect to the socket
+ * GetOutputPath derives from SHM_SINK_SOCKET_PATH. The ring holds
+ * SHM_SINK_SLOTS frames, a reader more than SHM_SINK_SLOTS - 1 frames
+ * behind misses frames instead of holding up the renderer.
+ */
+#define SHM_SINK_SOCKET_PATH "/tmp/defish_frames.sock"
+#define SHM_SINK_PIXEL_FORMAT ENCODER_FORMAT_RGB24
+
+enum {
+	SHM_SINK_SLOTS = 4,
+};
+
+/**
+ * ENCODER_SINK_AVCODEC: the encoder by name, and the container by name
+ * or NULL to guess it from the output file name (.ts gives MPEG-TS).
+ * Timestamps are in microseconds, which encoders limited to 16-bit
+ * time bases (mpeg4) do not accept.
+ */
+#define AVCODEC_SINK_CODEC "libx264"
+#define AVCODEC_SINK_FORMAT NULL
+
+enum {
+	/* slice threads of the encoder, frame threads would add latency */
+	AVCODEC_SINK_THREADS = 4,
+	AVCODEC_SINK_GOP = 2 * OUTPUT_FRAMERATE,
+	AVCODEC_SINK_BITRATE = 8000000,
+};
+
 enum {
 	DECODER_QUEUE_DEPTH = 2,
 	ENCODER_QUEUE_DEPTH = 4,
+	ENCODER_INPUT_DEADLINE_MS = 10,
+
+	/**
+	 * Row alignment in bytes of the output buffers, which come from a
+	 * GstVideoBufferPool of ENCODER_QUEUE_DEPTH buffers per output
+	 */
+	ENCODER_BUFFER_ALIGNMENT = 32,
+
+	/**
+	 * Live mode: render the output frames at fixed ticks of
+	 * OUTPUT_FRAMERATE on CLOCK_MONOTONIC from the newest camera frames,
+	 * instead of as fast as the display swaps. The buffers are stamped
+	 * with the tick time on the pipeline clock, and a tick without any
+	 * new picture re-pushes the previous buffer without a readback.
+	 * Ticks the renderer was too late for are skipped, not caught up.
+	 */
+	OUTPUT_CADENCE_SCHEDULER = 1,
+
+	/**
+	 * Output frames in flight in the renderer. With 1, each frame is
+	 * merged and read back before the next one starts, and the readback
+	 * waits for the GPU. With N > 1, every rig has N sets of camera
+	 * layers, merge targets and pixel buffer objects: the merge of a
+	 * frame is read back into a PBO behind a fence, and the pixels are
+	 * copied out to the encoder once the camera passes of the next
+	 * frame have been issued. This adds N - 1 frames of latency and a
+	 * CPU copy per output frame, where depth 1 reads back straight into
+	 * the pool buffer, AVFrame or shared slot of the sink.
+	 */
+	RENDER_PIPELINE_DEPTH = 1,
 
 	NUM_SRC_STREAMS = 4,
 
+	/**
+	 * Independent camera rigs (vehicles) stitched by one process, each
+	 * with NUM_SRC_STREAMS cameras and an output of its own. The rigs
+	 * share the decoder worker pool, the GL context and the GStreamer
+	 * thread. Source src_idx is camera src_idx % NUM_SRC_STREAMS of
+	 * rig src_idx / NUM_SRC_STREAMS.
+	 */
+	NUM_RIGS = 1,
+	NUM_SOURCES = NUM_RIGS * NUM_SRC_STREAMS,
+
+	/**
+	 * Threads decoding packets for all sources. Sources are not bound
+	 * to a thread, see the decoder worker pool in pipeline_src.c
+	 */
+	DECODER_WORKER_THREADS = 2,
+
+	/**
+	 * When set, FrameQueuesDecoded of a network camera (rtp://, udp://,
+	 * tcp://) behaves as a mailbox: a freshly decoded frame replaces the
+	 * one still pending for the renderer, and the displaced AVFrame goes
+	 * straight back to the decoder. File sources keep the FIFO, which
+	 * paces their decoder.
+	 * The renderer then always gets the newest picture of each camera.
+	 * Set to 0 for plain FIFO when every decoded frame must be rendered.
+	 */
+	DECODER_QUEUE_MAILBOX = 1,
+
+	/**
+	 * Change detection: the decoder compares a grid of luma samples of
+	 * every frame with the last changed frame of the camera. Unchanged
+	 * frames are neither uploaded nor rendered, and when no layer of a
+	 * rig changed, its merge, readback and encoding are skipped too.
+	 * A frame is unchanged when the mean absolute difference of the
+	 * samples is at most CHANGE_DETECT_MAX_MEAN_SAD and no sample differs
+	 * by more than CHANGE_DETECT_MAX_SAMPLE_DIFF (8-bit levels).
+	 * Motion between the samples goes unnoticed, so this is off by
+	 * default: only enable it where a frozen layer is acceptable.
+	 */
+	CHANGE_DETECTION = 0,
+	CHANGE_DETECT_GRID_COLS = 64,
+	CHANGE_DETECT_GRID_ROWS = 36,
+	CHANGE_DETECT_MAX_MEAN_SAD = 1,
+	CHANGE_DETECT_MAX_SAMPLE_DIFF = 8,
+
 	PRINT_DEBUG_DECODER = 0,
 	PRINT_DEBUG_ENCODER = 0,
 	PRINT_DEBUG_RENDERER = 0,
 	PRINT_DEBUG_FPS = 1,
+	PRINT_DEBUG_SHADER_COST = 0,
+	/* render thread CPU and GPU busy time, see RENDER_PIPELINE_DEPTH */
+	PRINT_DEBUG_UTILISATION = 0,
+
+	/**
+	 * Bake each camera's parameters into its own shader program instead
+	 * of passing them as uniforms. The uniform-driven program is used
+	 * while a variant is being compiled. Without
+	 * GL_KHR_parallel_shader_compile the render thread waits for each
+	 * compile on the frame after it started, hence off by default.
+	 */
+	CAMERA_SHADER_SPECIALISE = 0,
+
+	/**
+	 * With PRINT_DEBUG_SHADER_COST and timer queries available, every
+	 * SHADER_COST_AB_PERIOD-th frame uses the slower uniform-driven
+	 * program so that both modes get measured. Keep it off in production.
+	 */
+	SHADER_COST_AB_PERIOD = 16,
+	SHADER_COST_PRINT_PERIOD = 256,
 };
 
 #if defined(__APPLE__)
@@ -59,6 +244,36 @@ enum {
 
 #define SRC_FILE_PATH(suffix) SRC_FILE_PREFIX suffix
 
+/**
+ * Live network cameras (rtp://, udp://, tcp:// URLs or .sdp files)
+ * are opened with the low-latency profile below instead of the default
+ * probing and buffering used for files.
+ */
+enum {
+	/* bytes and microseconds of input inspected to find the stream info */
+	LIVE_PROBESIZE = 32768,
+	LIVE_ANALYZEDURATION_US = 100000,
+
+	/* packets kept by the RTP demuxer to undo network reordering */
+	LIVE_JITTER_DEPTH = 16,
+
+	/* no packet for this long means the stream was lost */
+	LIVE_STALL_TIMEOUT_MS = 2000,
+	LIVE_RECONNECT_DELAY_MS = 500,
+};
+
+/**
+ * Compressed packets buffered between the demuxer and the decoder of
+ * each source. The demuxer stops reading once either limit is reached.
+ */
+enum {
+	PACKET_QUEUE_MAX_BYTES = 4 * 1024 * 1024,
+	PACKET_QUEUE_MAX_DURATION_MS = 500,
+
+	/* the file demux thread sleeps this long when no source can progress */
+	DEMUX_IDLE_SLEEP_US = 2000,
+};
+
 #define SRC_PATHS_INITIALIZER {\
 	SRC_FILE_PATH("left.mp4"), \
 	SRC_FILE_PATH("right.mp4"), \
@@ -66,15 +281,219 @@ enum {
 	SRC_FILE_PATH("rear.mp4"), \
 }
 
+/**
+ * Every rig defaults to the cameras above, which makes it easy to
+ * load-test NUM_RIGS > 1 with a single recording
+ */
+static inline const char *GetDefaultSourcePath(size_t src_idx)
+{
+	static const char *paths[NUM_SRC_STREAMS] = SRC_PATHS_INITIALIZER;
+	return paths[src_idx % NUM_SRC_STREAMS];
+}
+
+static inline size_t GetSourceIndex(size_t rig, size_t cam)
+{
+	return rig * NUM_SRC_STREAMS + cam;
+}
+
+/**
+ * Every rig is encoded at each of these resolutions. The first one is
+ * the master the cameras are rendered at, every other one is blitted on
+ * the GPU from the one before it, so they are listed largest first.
+ * Each resolution has its own readback and encoder queue, and I420
+ * output needs even dimensions. Output output_idx is resolution
+ * output_idx % NUM_OUTPUT_RESOLUTIONS of rig
+ * output_idx / NUM_OUTPUT_RESOLUTIONS.
+ *
+ * Only the master is encoded by default. Raising NUM_OUTPUT_RESOLUTIONS
+ * to 3 adds the 640x480 preview and the 320x240 thumbnail.
+ */
+#define OUTPUT_RESOLUTIONS_INITIALIZER {\
+	{ OUTPUT_WIDTH, OUTPUT_HEIGHT }, \
+	{ 640, 480 }, \
+	{ 320, 240 }, \
+}
+
+enum {
+	NUM_OUTPUT_RESOLUTIONS = 1,
+	NUM_OUTPUTS = NUM_RIGS * NUM_OUTPUT_RESOLUTIONS,
+};
+
+struct OutputResolution {
+	int width;
+	int height;
+};
+
+static inline struct OutputResolution GetOutputResolution(size_t output_idx)
+{
+	/* the first NUM_OUTPUT_RESOLUTIONS entries are used */
+	static const struct OutputResolution resolutions[] =
+		OUTPUT_RESOLUTIONS_INITIALIZER;
+	return resolutions[output_idx % NUM_OUTPUT_RESOLUTIONS];
+}
+
+static inline size_t GetOutputIndex(size_t rig, size_t resolution)
+{
+	return rig * NUM_OUTPUT_RESOLUTIONS + resolution;
+}
+
+/**
+ * Record mode: when set, the decoded frames of camera N are also written
+ * to RAW_RECORD_DIR "/camN.dfraw" (see raw_frame_file.h).
+ * Listing such files in SRC_PATHS_INITIALIZER replays them without any
+ * decoding, e.g. to benchmark the renderer and the encoder alone.
+ */
+#define RAW_RECORD_DIR NULL
+
+/**
+ * Sources named SHM_SOURCE_PREFIX followed by a socket path are cameras
+ * decoded by another process, which publishes I420 frames into a ring in
+ * shared memory returning its slots (see shm_frame_ring.h and
+ * shm_test_producer.c). The frames are rendered straight from the ring.
+ */
+#define SHM_SOURCE_PREFIX "shm://"
+
+enum {
+	/* pace the replay by the recorded PTS, 0 replays as fast as possible */
+	REPLAY_REALTIME = 1,
+	/* start over at the end of the recording */
+	REPLAY_LOOP = 1,
+};
+
+/**
+ * Where the threads of each pipeline stage run, see thread_placement.c.
+ * The defaults leave everything to the OS scheduler.
+ *
+ * Example for a dual-socket machine with the GPU attached to node 0:
+ * [PIPELINE_STAGE_RENDER] = { .cpuMask = 0x1, .fifoPriority = 10, .numaNode = 0 },
+ * [PIPELINE_STAGE_DECODE] = { .cpuMask = 0xe, .nice = -5, .numaNode = 0 },
+ */
+#define STAGE_PLACEMENT_INITIALIZER { \
+	[PIPELINE_STAGE_DEMUX] = { .cpuMask = 0, .fifoPriority = 0, .nice = 0, .numaNode = -1 }, \
+	[PIPELINE_STAGE_DECODE] = { .cpuMask = 0, .fifoPriority = 0, .nice = 0, .numaNode = -1 }, \
+	[PIPELINE_STAGE_RENDER] = { .cpuMask = 0, .fifoPriority = 0, .nice = 0, .numaNode = -1 }, \
+	[PIPELINE_STAGE_ENCODE] = { .cpuMask = 0, .fifoPriority = 0, .nice = 0, .numaNode = -1 }, \
+}
+
+/**
+ * Directory for cached GLSL program binaries, NULL disables the cache
+ */
+#define SHADER_CACHE_DIR "shader_cache"
+
+/**
+ * A %s in the pipeline is replaced by the path of the output,
+ * derived from LIVE_DEFAULT_OUTPUT by GetOutputPath
+ */
 static inline const char *GetGstPipelineString(void)
 {
     //return "appsrc name=imagesrc ! ffmpegcolorspace ! x264enc ! rtph264pay ! udpsink host=127.0.0.1";
-    //return "appsrc name=imagesrc ! ffmpegcolorspace ! x264enc ! rtph264pay ! filesink location=out.mp4";
-    //return "appsrc name=imagesrc ! filesink location=out.mp4";
+    //return "appsrc name=imagesrc ! ffmpegcolorspace ! x264enc ! rtph264pay ! filesink location=%s";
+    //return "appsrc name=imagesrc ! filesink location=%s";
     //return "appsrc name=imagesrc ! fakesink";
-	return "appsrc name=imagesrc ! autovideoconvert ! avenc_mjpeg bitrate=3000000 ! filesink location=out.mp4";
+	return "appsrc name=imagesrc ! autovideoconvert ! avenc_mjpeg bitrate=3000000 ! filesink location=%s";
+}
+
+#define LIVE_DEFAULT_OUTPUT "out.mp4"
+
+/**
+ * ENCODER_SINK_PIPE: where the raw frames go instead of the pipeline
+ * above. "-" streams output 0 to stdout, any other path is a named pipe
+ * per output (created when missing, suffixed by GetOutputPath).
+ * PIPE_SINK_Y4M 0 writes bare I420 planes without the Y4M framing.
+ * Each output has PIPE_SINK_BUFFERS page-aligned frames in flight.
+ */
+#define PIPE_SINK_PATH "-"
+
+enum {
+	PIPE_SINK_Y4M = 1,
+	PIPE_SINK_BUFFERS = 4,
+};
+
+/**
+ * Live output branches. The frame is encoded once by the elements of
+ * GetGstPipelineString between the appsrc and its sink, and a tee feeds
+ * every enabled encoded branch, the preview branch taps the raw frames
+ * before the encoder. Each branch sits behind its own queue which drops
+ * the oldest buffers beyond LIVE_BRANCH_QUEUE_BUFFERS, so a stalled
+ * branch (a network client) never holds back the others or the renderer.
+ * 0 uses GetGstPipelineString as is.
+ *
+ * LIVE_GST_RTP_PAYLOADER has to match the encoder of that pipeline.
+ * Example: (LIVE_BRANCH_FILE | LIVE_BRANCH_RTP)
+ */
+enum LiveOutputBranch {
+	/* the encoded stream to the path of the output */
+	LIVE_BRANCH_FILE = 1 << 0,
+	/* RTP over UDP to LIVE_RTP_HOST, port LIVE_RTP_PORT + 2 * output_idx */
+	LIVE_BRANCH_RTP = 1 << 1,
+	/* a local window with the raw frames */
+	LIVE_BRANCH_PREVIEW = 1 << 2,
+};
+
+#define LIVE_OUTPUT_BRANCHES 0
+#define LIVE_GST_RTP_PAYLOADER "rtpjpegpay"
+#define LIVE_RTP_HOST "127.0.0.1"
+
+enum {
+	LIVE_RTP_PORT = 5000,
+	LIVE_BRANCH_QUEUE_BUFFERS = 8,
+};
+
+/**
+ * Offline mode output, %s is the output file. It needs a container
+ * which keeps the source-derived timestamps.
+ */
+static inline const char *GetOfflineGstPipelineFormat(void)
+{
+	return "appsrc name=imagesrc ! autovideoconvert ! avenc_mjpeg bitrate=3000000 ! matroskamux ! filesink location=%s";
 }
 
+#define OFFLINE_DEFAULT_OUTPUT "offline.mkv"
+
+enum {
+	OFFLINE_DEFAULT_CHUNK_SECONDS = 60,
+};
+
+/******************************************************************************
+ * Run-time options, parsed from the command line in winsys_glfw.c
+ *****************************************************************************/
+struct AppOptions {
+	/**
+	 * Offline (batch) mode: every synchronised set of camera frames is
+	 * processed exactly once, in lock-step and as fast as possible,
+	 * until the first source ends. Nothing is dropped: the decoder
+	 * queues are FIFOs and the renderer waits for the decoders and
+	 * for the encoder.
+	 */
+	bool offline;
+	const char *outputPath;
+
+	/**
+	 * All rigs, rig after rig. NULL entries keep the paths from
+	 * SRC_PATHS_INITIALIZER (see GetDefaultSourcePath).
+	 */
+	const char *sourcePaths[NUM_SOURCES];
+
+	/**
+	 * Offline mode: only the frames in [rangeStartUs, rangeEndUs),
+	 * relative to the start of each source, are processed.
+	 * The chunked driver passes each child process its chunk this way.
+	 */
+	int64_t rangeStartUs;
+	int64_t rangeEndUs;
+
+	/**
+	 * Chunked offline processing (see offline_driver.c): with jobs > 0
+	 * the inputs are split into keyframe-aligned chunks of at least
+	 * chunkSeconds, processed by up to jobs child processes in parallel
+	 * and concatenated into outputPath.
+	 */
+	int jobs;
+	int chunkSeconds;
+};
+
+extern struct AppOptions gAppOptions;
+
 /******************************************************************************
  * Debug print macros
  *****************************************************************************/
@@ -95,6 +514,68 @@ static inline const char *GetGstPipelineString(void)
 #define DPRINT_RENDERER(fmt, args...) DPRINT_SUBSYS(RENDERER, fmt, ##args)
 #define DPRINT_ENCODER(fmt, args...) DPRINT_SUBSYS(ENCODER, fmt, ##args)
 #define DPRINT_FPS(fmt, args...) DPRINT_SUBSYS(FPS, fmt, ##args)
+#define DPRINT_SHADER_COST(fmt, args...) DPRINT_SUBSYS(SHADER_COST, fmt, ##args)
+#define DPRINT_UTILISATION(fmt, args...) DPRINT_SUBSYS(UTILISATION, fmt, ##args)
+
+/******************************************************************************
+ * Latency measurement
+ *****************************************************************************/
+
+/**
+ * Points in the pipeline where a frame gets timestamped on its way
+ * from the camera file/stream to the GStreamer appsrc.
+ */
+enum LatencyTimestamp {
+	LATENCY_TS_DEMUX,
+	LATENCY_TS_DECODED,
+	LATENCY_TS_UPLOADED,
+	LATENCY_TS_RENDERED,
+	LATENCY_TS_READBACK,
+	LATENCY_TS_PUSHED,
+	NUM_LATENCY_TIMESTAMPS,
+};
+
+/**
+ * Latency histograms: one per pipeline stage (the interval between two
+ * consecutive timestamps above) and one end-to-end (demux to push).
+ */
+enum {
+	NUM_LATENCY_STAGES = NUM_LATENCY_TIMESTAMPS - 1,
+	LATENCY_END_TO_END = NUM_LATENCY_STAGES,
+	NUM_LATENCY_HISTOGRAMS,
+
+	/* bucket N counts the samples in [2^(N-1), 2^N) microseconds */
+	NUM_LATENCY_BUCKETS = 24,
+};
+
+struct LatencyHistogram {
+	uint64_t count;
+	uint64_t sumUs;
+	uint64_t maxUs;
+	uint64_t buckets[NUM_LATENCY_BUCKETS];
+};
+
+static inline uint64_t GetTimestampUs(void)
+{
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+/******************************************************************************
+ * Startup timing
+ *****************************************************************************/
+
+/**
+ * GetTimestampUs() at the start of main()
+ */
+extern uint64_t StartupTimeUs;
+
+static inline void PrintStartupPhase(const char *phase, uint64_t phaseStartUs)
+{
+	fprintf(stderr, "Startup: %-20s %8.2f ms\n",
+			phase, (GetTimestampUs() - phaseStartUs) / 1000.0);
+}
 
 /******************************************************************************
  * Buffer management
@@ -121,9 +602,114 @@ struct FrameData
 	 * to communicate with the processing part (defisheye renderer)
 	 */
 	void *rawPixelData;
+
+	/**
+	 * Bytes per row of rawPixelData, rows may be padded for alignment
+	 */
+	size_t rawPixelStride;
+
+	/**
+	 * ENCODER_FORMAT_I420: rawPixelData is the luma plane, followed by
+	 * the U and V planes at half the resolution
+	 */
+	void *rawChromaData[2];
+	size_t rawChromaStride;
+
+	/**
+	 * The encoder's own handle of the output buffer (a GstBuffer),
+	 * rawPixelData is only mapped while the renderer owns it
+	 */
+	void *encoderBuffer;
+
+	/**
+	 * GetTimestampUs() values taken as the frame passes each stage.
+	 * For the output frame, the source stamps are those of the oldest
+	 * camera frame that was rendered into it.
+	 * Zero means "not stamped".
+	 */
+	uint64_t timestampsUs[NUM_LATENCY_TIMESTAMPS];
+
+	/**
+	 * Presentation time of the camera frame in microseconds, or
+	 * AV_NOPTS_VALUE. For the output frame in offline mode, that of
+	 * the frame set (the first camera).
+	 */
+	int64_t sourcePtsUs;
+
+	/**
+	 * Offline mode: the last message of the stream, carries no frame
+	 */
+	bool endOfStream;
+
+	/**
+	 * Camera frame: change detection found it equal to the last
+	 * changed frame of the camera (see CHANGE_DETECTION)
+	 */
+	bool unchanged;
+
+	/**
+	 * Output frame: number of output frames skipped by change detection
+	 * right before this one, the encoder keeps the timeline for them
+	 */
+	uint32_t skippedOutputFrames;
+
+	/**
+	 * Output frame (OUTPUT_CADENCE_SCHEDULER): the GetTimestampUs()
+	 * output tick it was rendered for, zero when not scheduled
+	 */
+	uint64_t outputTickUs;
+
+	/**
+	 * Output frame: carries no pixels, the encoder pushes the previous
+	 * buffer of the output once more for outputTickUs
+	 */
+	bool repeatLast;
 };
 
 
+/******************************************************************************
+ * Thread placement
+ *****************************************************************************/
+enum PipelineStage {
+	PIPELINE_STAGE_DEMUX,
+	PIPELINE_STAGE_DECODE,
+	PIPELINE_STAGE_RENDER,
+	PIPELINE_STAGE_ENCODE,
+	NUM_PIPELINE_STAGES,
+};
+
+struct StagePlacement {
+	/* bit N allows CPU N, 0 leaves the affinity alone */
+	uint64_t cpuMask;
+
+	/* 1..99 runs the threads SCHED_FIFO (needs CAP_SYS_NICE) */
+	int fifoPriority;
+
+	/* nice level of SCHED_OTHER threads */
+	int nice;
+
+	/* NUMA node the stage runs on, -1 for no memory policy */
+	int numaNode;
+};
+
+/**
+ * Must be called by every stage thread when it starts. Threads created
+ * afterwards (libavcodec and GStreamer internals) inherit the placement.
+ * The result is reported on stderr.
+ *
+ * Buffers a stage produces for another one are preferably allocated on
+ * the node of the consuming stage, so the decoder threads get the memory
+ * policy of the renderer.
+ */
+void ApplyStagePlacement(enum PipelineStage stage);
+
+/**
+ * Page-aligned buffer placed on the NUMA node of the consuming stage.
+ * The encoder buffer pools allocate their memory through this.
+ */
+void *AllocStageBuffer(enum PipelineStage consumer, size_t size);
+void FreeStageBuffer(void *buffer, size_t size);
+
 /******************************************************************************
  * Decoding/Source through FFMPEG
  *****************************************************************************/
@@ -132,26 +718,140 @@ void WaitAndReleaseDecoders(void);
 void ReturnFrameToDecoderQueue(AVFrame *frame, int index);
 bool TryReceiveDecodedFrame(struct FrameData *frameData, int src_idx);
 
+/**
+ * Offline mode: blocks until the next frame of the source is decoded,
+ * returns false at the end of the source
+ */
+bool WaitDecodedFrame(struct FrameData *frameData, int src_idx);
+
+/**
+ * Fill level of the packet queue between the demuxer and the decoder
+ * of a source, safe to call from any thread
+ */
+void GetSourcePacketQueueStats(int src_idx, struct PacketQueueStats *stats);
+
 /******************************************************************************
- * Encoding/Streaming through GStreamer
+ * Encoding/Streaming
  *****************************************************************************/
 
-void InitializeGStreamerServer(void);
-void WaitAndReleaseGStreamerServer(void);
+/**
+ * What the renderer reads back into the encoder input buffers
+ */
+enum EncoderPixelFormat {
+	/* packed 8-bit RGB */
+	ENCODER_FORMAT_RGB24,
+	/* 8-bit planar YUV 4:2:0, BT.601 limited range */
+	ENCODER_FORMAT_I420,
+};
+
+/**
+ * An encoder backend, selected by ENCODER_SINK. The functions below
+ * dispatch to it, so the renderer does not depend on the backend.
+ */
+struct EncoderSinkOps {
+	const char *name;
+	enum EncoderPixelFormat pixelFormat;
+	void (*initialize)(void);
+	void (*waitAndRelease)(void);
+	bool (*tryGetInputBuffer)(struct FrameData *frameData, size_t output_idx);
+	void (*submitInputBuffer)(struct FrameData *frameData, size_t output_idx);
+	void (*submitEndOfStream)(size_t output_idx);
+	void (*submitRepeatFrame)(size_t output_idx, uint64_t outputTickUs);
+	size_t (*getDroppedFrameCount)(size_t output_idx);
+};
+
+extern const struct EncoderSinkOps GStreamerSinkOps;
+extern const struct EncoderSinkOps AvcodecSinkOps;
+extern const struct EncoderSinkOps ShmSinkOps;
+extern const struct EncoderSinkOps PipeSinkOps;
+
+void InitializeEncoderSink(void);
+void WaitAndReleaseEncoderSink(void);
+enum EncoderPixelFormat GetEncoderPixelFormat(void);
 
 /**
  * The processing pipeline will drop frames if the encoder
- * (GStreamer) is not fast enough to encode.
+ * is not fast enough to encode.
  *
- * This design can be changed inside the implementation of
- * TryGetEncoderInputBuffer by changing msgQReceive timeout value.
+ * Which frame gets dropped, and whether the renderer may wait for
+ * the encoder at all, is selected by ENCODER_INPUT_POLICY.
+ * The renderer never blocks indefinitely on the encoder.
+ */
+bool TryGetEncoderInputBuffer(struct FrameData *frameData, size_t output_idx);
+void SubmitEncoderInputBuffer(struct FrameData *frameData, size_t output_idx);
+
+/**
+ * Offline mode: no more frames will be submitted, the encoder finishes
+ * the output file
+ */
+void SubmitEncoderEndOfStream(size_t output_idx);
+
+/**
+ * Output cadence: nothing changed for this tick, the encoder repeats
+ * the previous buffer. Never blocks, the repeat is dropped instead.
  */
-bool TryGetEncoderInputBuffer(struct FrameData *frameData);
-void SubmitEncoderInputBuffer(struct FrameData *frameData);
+void SubmitEncoderRepeatFrame(size_t output_idx, uint64_t outputTickUs);
+size_t GetEncoderDroppedFrameCount(size_t output_idx);
+
+/**
+ * The master resolution of rig 0 writes to path itself. The other
+ * outputs insert ".rigN" for rig N and ".WxH" for the scaled resolutions
+ * before the extension, e.g. "out.rig1.320x240.mp4".
+ */
+void GetOutputPath(char *buffer, size_t size, const char *path, size_t output_idx);
+
+/******************************************************************************
+ * Chunked offline processing
+ *****************************************************************************/
+
+/**
+ * Runs the whole chunked job in place of the pipeline and returns the
+ * process exit code. argv0 is used to start the child processes.
+ */
+int RunChunkedOfflineDriver(const char *argv0);
 
 /******************************************************************************
  * Misc pipeline functions
  *****************************************************************************/
-void RenderPipelineWithGL(void);
+/**
+ * Renders one output frame for every rig. Returns false once offline
+ * processing has completed for all of them.
+ */
+bool RenderPipelineWithGL(void);
+
+/**
+ * Hands the output frames still in flight (RENDER_PIPELINE_DEPTH) to
+ * the encoder. Call on the rendering thread before the GL context goes.
+ */
+void FlushRenderPipeline(void);
+
+/**
+ * Must be called (on the rendering thread) after changing
+ * the calibration of a camera in AllCameraParams
+ */
+void NotifyCameraParamsChanged(int src_idx);
+
+/**
+ * Latency statistics, safe to call from any thread
+ */
+void LatencyStatsRecord(const struct FrameData *frameData);
+void LatencyStatsGet(struct LatencyHistogram histograms[NUM_LATENCY_HISTOGRAMS]);
+void LatencyStatsDump(FILE *out);
+
+/**
+ * Change detection statistics (CHANGE_DETECTION), recorded by the
+ * renderer and safe to query from any thread
+ */
+struct ChangeDetectionStats {
+	uint64_t cameraFrames;
+	uint64_t cameraFramesSkipped;
+	uint64_t outputFrames;
+	uint64_t outputFramesSkipped;
+};
+
+void ChangeStatsRecordCamera(bool skipped);
+void ChangeStatsRecordOutput(bool skipped);
+void ChangeStatsGet(struct ChangeDetectionStats *stats);
+void ChangeStatsDump(FILE *out);
 
 #endif
@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <libavformat/avformat.h>
+
+#include "defish_app.h"
+
+/******************************************************************************
+ * Chunked offline processing.
+ *
+ * Long recordings are split into chunks starting at keyframes of the
+ * first camera. Every chunk is processed by a separate instance of this
+ * program in offline mode (-b -S start -E end), up to gAppOptions.jobs
+ * of them at a time, and the encoded chunks are then concatenated
+ * without re-encoding.
+ *
+ * All cameras are assumed to share one timeline: the other cameras are
+ * cut at the same offsets from their own starts, each child seeking to
+ * the keyframe before its range and dropping the frames outside it.
+ * A child decodes a little past the end of its range, so that the
+ * leading B-frames of an open GOP at the boundary, which the next
+ * child cannot decode, are output by this one.
+ * Every output (rig and resolution) is concatenated separately, and
+ * the chunks follow the first camera of the first rig.
+ *****************************************************************************/
+
+enum {
+	OFFLINE_MAX_CHUNKS = 4096,
+	OFFLINE_PATH_SIZE = 512,
+	OFFLINE_ARG_SIZE = 32,
+};
+
+struct OfflineChunk {
+	int64_t startUs;
+	int64_t endUs;
+	char outputPath[OFFLINE_PATH_SIZE];
+
+	pid_t pid;
+	uint64_t launchUs;
+	uint64_t elapsedUs;
+	bool done;
+	bool failed;
+};
+
+struct OfflineDriver {
+	const char *argv0;
+	const char *sourcePaths[NUM_SOURCES];
+
+	struct OfflineChunk chunks[OFFLINE_MAX_CHUNKS];
+	size_t numChunks;
+	int64_t durationUs;
+};
+
+static struct OfflineDriver gDriver;
+
+/******************************************************************************
+ * Splitting
+ *****************************************************************************/
+
+/**
+ * Chunks end at the pts of the first keyframe at least chunkSeconds
+ * past their start, so that every child can start decoding at its
+ * first frame
+ */
+static bool SplitIntoChunks(struct OfflineDriver *driver)
+{
+	AVFormatContext *format_context = NULL;
+	AVPacket packet;
+	const char *path = driver->sourcePaths[0];
+	int64_t chunkUs = (int64_t)gAppOptions.chunkSeconds * AV_TIME_BASE;
+	int64_t chunkStartUs = 0;
+	int stream;
+	bool ok = false;
+
+	if (avformat_open_input(&format_context, path, NULL, NULL) < 0) {
+		fprintf(stderr, "Offline: failed to open '%s'\n", path);
+		return false;
+	}
+	if (avformat_find_stream_info(format_context, NULL) < 0) {
+		goto done;
+	}
+	stream = av_find_best_stream(format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if (stream < 0) {
+		fprintf(stderr, "Offline: no video stream in '%s'\n", path);
+		goto done;
+	}
+
+	AVStream *st = format_context->streams[stream];
+	int64_t streamStartUs = (st->start_time == AV_NOPTS_VALUE) ? 0
+		: av_rescale_q(st->start_time, st->time_base, AV_TIME_BASE_Q);
+
+	/**
+	 * Only the container is read, which is fast next to decoding
+	 */
+	av_init_packet(&packet);
+	while (av_read_frame(format_context, &packet) >= 0)
+	{
+		if ((packet.stream_index == stream) && (packet.pts != AV_NOPTS_VALUE))
+		{
+			int64_t ptsUs = av_rescale_q(packet.pts, st->time_base, AV_TIME_BASE_Q)
+				- streamStartUs;
+			int64_t endUs = ptsUs + av_rescale_q(packet.duration, st->time_base, AV_TIME_BASE_Q);
+
+			if ((packet.flags & AV_PKT_FLAG_KEY)
+				&& (ptsUs >= chunkStartUs + chunkUs)
+				&& (driver->numChunks + 1 < OFFLINE_MAX_CHUNKS))
+			{
+				driver->chunks[driver->numChunks].startUs = chunkStartUs;
+				driver->chunks[driver->numChunks].endUs = ptsUs;
+				driver->numChunks++;
+				chunkStartUs = ptsUs;
+			}
+			if (endUs > driver->durationUs) {
+				driver->durationUs = endUs;
+			}
+		}
+		av_packet_unref(&packet);
+	}
+
+	/* the last chunk runs to the end of the inputs */
+	driver->chunks[driver->numChunks].startUs = chunkStartUs;
+	driver->chunks[driver->numChunks].endUs = INT64_MAX;
+	driver->numChunks++;
+	ok = true;
+
+done:
+	avformat_close_input(&format_context);
+	return ok;
+}
+
+/******************************************************************************
+ * Child processes
+ *****************************************************************************/
+static bool LaunchChunk(struct OfflineDriver *driver, struct OfflineChunk *chunk)
+{
+	char startArg[OFFLINE_ARG_SIZE];
+	char endArg[OFFLINE_ARG_SIZE];
+	const char *argv[8 + NUM_SOURCES + 1] = {};
+	size_t argc = 0;
+	size_t src_idx;
+
+	snprintf(startArg, sizeof(startArg), "%lld", (long long)chunk->startUs);
+	snprintf(endArg, sizeof(endArg), "%lld", (long long)chunk->endUs);
+
+	argv[argc++] = driver->argv0;
+	argv[argc++] = "-b";
+	argv[argc++] = "-o";
+	argv[argc++] = chunk->outputPath;
+	argv[argc++] = "-S";
+	argv[argc++] = startArg;
+	argv[argc++] = "-E";
+	argv[argc++] = endArg;
+	for (src_idx = 0; src_idx < NUM_SOURCES; src_idx++) {
+		argv[argc++] = driver->sourcePaths[src_idx];
+	}
+
+	chunk->launchUs = GetTimestampUs();
+	chunk->pid = fork();
+	if (chunk->pid < 0) {
+		fprintf(stderr, "Offline: fork failed: %s\n", strerror(errno));
+		return false;
+	}
+	if (chunk->pid == 0) {
+		execvp(driver->argv0, (char * const*)argv);
+		fprintf(stderr, "Offline: failed to start '%s': %s\n",
+				driver->argv0, strerror(errno));
+		_exit(127);
+	}
+	return true;
+}
+
+static struct OfflineChunk *FindChunkByPid(struct OfflineDriver *driver, pid_t pid)
+{
+	size_t i;
+	for (i = 0; i < driver->numChunks; i++) {
+		if (driver->chunks[i].pid == pid) {
+			return &driver->chunks[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Keeps up to gAppOptions.jobs children running until every chunk
+ * is processed. Returns false if any of them failed.
+ */
+static bool RunChunks(struct OfflineDriver *driver)
+{
+	size_t next = 0;
+	size_t running = 0;
+	size_t finished = 0;
+	bool ok = true;
+
+	while (finished < driver->numChunks)
+	{
+		while (ok && (next < driver->numChunks) && (running < (size_t)gAppOptions.jobs))
+		{
+			if (!LaunchChunk(driver, &driver->chunks[next])) {
+				ok = false;
+				break;
+			}
+			next++;
+			running++;
+		}
+		if (!running) {
+			break;
+		}
+
+		int status = 0;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Offline: waitpid failed: %s\n", strerror(errno));
+			return false;
+		}
+
+		struct OfflineChunk *chunk = FindChunkByPid(driver, pid);
+		if (!chunk) {
+			continue;
+		}
+		running--;
+		finished++;
+		chunk->done = true;
+		chunk->elapsedUs = GetTimestampUs() - chunk->launchUs;
+		chunk->failed = !WIFEXITED(status) || (WEXITSTATUS(status) != 0);
+		if (chunk->failed) {
+			ok = false;
+		}
+
+		fprintf(stderr, "Offline: chunk %zu [%.1f s, %.1f s) %s in %.1f s (%zu/%zu)\n",
+				(size_t)(chunk - driver->chunks),
+				chunk->startUs / 1e6,
+				(chunk->endUs == INT64_MAX ? driver->durationUs : chunk->endUs) / 1e6,
+				chunk->failed ? "FAILED" : "done",
+				chunk->elapsedUs / 1e6,
+				finished, driver->numChunks);
+	}
+	return ok;
+}
+
+/******************************************************************************
+ * Concatenation
+ *****************************************************************************/
+
+/**
+ * Appends one chunk, moving its timestamps to the start of its range
+ */
+static bool AppendChunk(AVFormatContext *output,
+		const struct OfflineChunk *chunk,
+		size_t output_idx,
+		bool first)
+{
+	char path[OFFLINE_PATH_SIZE];
+	AVFormatContext *input = NULL;
+	AVPacket packet;
+	bool ok = false;
+	int stream;
+
+	GetOutputPath(path, sizeof(path), chunk->outputPath, output_idx);
+	if ((avformat_open_input(&input, path, NULL, NULL) < 0)
+		|| (avformat_find_stream_info(input, NULL) < 0))
+	{
+		fprintf(stderr, "Offline: failed to open the chunk '%s'\n", path);
+		goto done;
+	}
+	stream = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if (stream < 0) {
+		goto done;
+	}
+
+	AVStream *in = input->streams[stream];
+	AVStream *out = output->streams[0];
+	if (first)
+	{
+		if (avcodec_parameters_copy(out->codecpar, in->codecpar) < 0) {
+			goto done;
+		}
+		out->codecpar->codec_tag = 0;
+		out->time_base = in->time_base;
+		if (avformat_write_header(output, NULL) < 0) {
+			fprintf(stderr, "Offline: failed to write the output header\n");
+			goto done;
+		}
+	}
+
+	int64_t offset = av_rescale_q(chunk->startUs, AV_TIME_BASE_Q, in->time_base);
+	av_init_packet(&packet);
+	while (av_read_frame(input, &packet) >= 0)
+	{
+		if (packet.stream_index != stream) {
+			av_packet_unref(&packet);
+			continue;
+		}
+		if (packet.pts != AV_NOPTS_VALUE) {
+			packet.pts += offset;
+		}
+		if (packet.dts != AV_NOPTS_VALUE) {
+			packet.dts += offset;
+		}
+		av_packet_rescale_ts(&packet, in->time_base, out->time_base);
+		packet.stream_index = 0;
+		packet.pos = -1;
+
+		/* takes the packet reference */
+		if (av_interleaved_write_frame(output, &packet) < 0) {
+			fprintf(stderr, "Offline: failed to write a packet of '%s'\n", path);
+			goto done;
+		}
+	}
+	ok = true;
+
+done:
+	if (input) {
+		avformat_close_input(&input);
+	}
+	return ok;
+}
+
+static bool ConcatenateChunks(struct OfflineDriver *driver, size_t output_idx)
+{
+	AVFormatContext *output = NULL;
+	char outputPath[OFFLINE_PATH_SIZE];
+	bool headerWritten = false;
+	bool ok = false;
+	size_t i;
+
+	GetOutputPath(outputPath, sizeof(outputPath), gAppOptions.outputPath, output_idx);
+	if (avformat_alloc_output_context2(&output, NULL, NULL, outputPath) < 0) {
+		fprintf(stderr, "Offline: unsupported output '%s'\n", outputPath);
+		return false;
+	}
+	if (!avformat_new_stream(output, NULL)) {
+		goto done;
+	}
+	if (!(output->oformat->flags & AVFMT_NOFILE)
+		&& (avio_open(&output->pb, outputPath, AVIO_FLAG_WRITE) < 0))
+	{
+		fprintf(stderr, "Offline: failed to create '%s'\n", outputPath);
+		goto done;
+	}
+
+	for (i = 0; i < driver->numChunks; i++)
+	{
+		if (!AppendChunk(output, &driver->chunks[i], output_idx, (i == 0))) {
+			goto done;
+		}
+		headerWritten = true;
+	}
+	ok = true;
+
+done:
+	if (headerWritten) {
+		ok = (av_write_trailer(output) == 0) && ok;
+	}
+	if (output->pb && !(output->oformat->flags & AVFMT_NOFILE)) {
+		avio_closep(&output->pb);
+	}
+	avformat_free_context(output);
+	return ok;
+}
+
+static void RemoveChunkFiles(struct OfflineDriver *driver)
+{
+	char path[OFFLINE_PATH_SIZE];
+	size_t i;
+	size_t output_idx;
+	for (i = 0; i < driver->numChunks; i++)
+	{
+		for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++) {
+			GetOutputPath(path, sizeof(path), driver->chunks[i].outputPath, output_idx);
+			unlink(path);
+		}
+	}
+}
+
+/******************************************************************************
+ * Public API
+ *****************************************************************************/
+int RunChunkedOfflineDriver(const char *argv0)
+{
+	struct OfflineDriver *driver = &gDriver;
+	uint64_t startUs = GetTimestampUs();
+	uint64_t sumUs = 0;
+	size_t i;
+	bool ok = false;
+
+	driver->argv0 = argv0;
+	for (i = 0; i < NUM_SOURCES; i++) {
+		driver->sourcePaths[i] = gAppOptions.sourcePaths[i]
+			? gAppOptions.sourcePaths[i] : GetDefaultSourcePath(i);
+	}
+	if (gAppOptions.chunkSeconds <= 0) {
+		gAppOptions.chunkSeconds = OFFLINE_DEFAULT_CHUNK_SECONDS;
+	}
+
+	av_register_all();
+	if (!SplitIntoChunks(driver)) {
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < driver->numChunks; i++) {
+		snprintf(driver->chunks[i].outputPath, OFFLINE_PATH_SIZE,
+				"%s.chunk%03zu.mkv", gAppOptions.outputPath, i);
+	}
+
+	fprintf(stderr, "Offline: %.1f s of input in %zu chunks, %d jobs\n",
+			driver->durationUs / 1e6, driver->numChunks, gAppOptions.jobs);
+
+	if (RunChunks(driver))
+	{
+		ok = true;
+		for (i = 0; i < NUM_OUTPUTS; i++) {
+			ok = ConcatenateChunks(driver, i) && ok;
+		}
+	}
+	RemoveChunkFiles(driver);
+
+	uint64_t wallUs = GetTimestampUs() - startUs;
+	for (i = 0; i < driver->numChunks; i++) {
+		sumUs += driver->chunks[i].elapsedUs;
+	}
+	fprintf(stderr, "Offline: %s '%s' in %.1f s, chunks took %.1f s in total,"
+			" %.2fx speedup, %.2fx real time\n",
+			ok ? "wrote" : "FAILED to write",
+			gAppOptions.outputPath,
+			wallUs / 1e6,
+			sumUs / 1e6,
+			wallUs ? (double)sumUs / wallUs : 0.0,
+			wallUs ? (double)driver->durationUs / wallUs : 0.0);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
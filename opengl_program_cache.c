@@ -0,0 +1,315 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "opengl_program_cache.h"
+#include "opengl_utils.h"
+
+enum {
+	PROGRAM_CACHE_MAGIC = 0x43504644, /* "DFPC" */
+	PROGRAM_CACHE_VERSION = 1,
+	PROGRAM_CACHE_PATH_MAX = OGL_PROGRAM_CACHE_PATH_MAX,
+};
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+struct ProgramCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t binaryFormat;
+	uint32_t binaryLength;
+} __attribute__((packed));
+
+/******************************************************************************
+ * Cache key
+ *****************************************************************************/
+static uint64_t fnv1a64(uint64_t hash, const char *str)
+{
+	if (!str) {
+		str = "";
+	}
+	while (*str) {
+		hash ^= (uint8_t)*str++;
+		hash *= 0x100000001b3ULL;
+	}
+	/* separator, so that ("ab", "c") and ("a", "bc") differ */
+	hash ^= 0xff;
+	hash *= 0x100000001b3ULL;
+	return hash;
+}
+
+static uint64_t ProgramCacheKey(const char *vsrc, const char *fsrc)
+{
+	uint64_t key = 0xcbf29ce484222325ULL;
+	key = fnv1a64(key, vsrc);
+	key = fnv1a64(key, fsrc);
+	key = fnv1a64(key, (const char*)glGetString(GL_VENDOR));
+	key = fnv1a64(key, (const char*)glGetString(GL_RENDERER));
+	key = fnv1a64(key, (const char*)glGetString(GL_VERSION));
+	key = fnv1a64(key, (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION));
+	return key;
+}
+
+static void ProgramCachePath(char *path, const char *cacheDir, uint64_t key)
+{
+	snprintf(path, PROGRAM_CACHE_PATH_MAX, "%s/%016llx.bin",
+			cacheDir, (unsigned long long)key);
+}
+
+/**
+ * Program binaries are core since GL 4.1 and otherwise come with
+ * ARB_get_program_binary. Query without ogl() so that an old driver
+ * rejecting the enum does not abort the application.
+ */
+static int ProgramBinarySupported(void)
+{
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	if (glGetError() != GL_NO_ERROR) {
+		return 0;
+	}
+	return numFormats > 0;
+}
+
+/******************************************************************************
+ * Loading and storing binaries
+ *****************************************************************************/
+static GLuint LoadCachedProgram(const char *path, uint64_t key)
+{
+	GLuint program = 0;
+	FILE *fin = NULL;
+	void *binary = NULL;
+	struct ProgramCacheHeader header = {};
+
+	fin = fopen(path, "rb");
+	if (!fin) {
+		goto done;
+	}
+	if (1 != fread(&header, sizeof(header), 1, fin)) {
+		goto done;
+	}
+	if ((header.magic != PROGRAM_CACHE_MAGIC)
+		|| (header.version != PROGRAM_CACHE_VERSION)
+		|| (header.key != key)
+		|| !header.binaryLength)
+	{
+		goto done;
+	}
+
+	binary = malloc(header.binaryLength);
+	if (!binary || (1 != fread(binary, header.binaryLength, 1, fin))) {
+		goto done;
+	}
+
+	ogl(program = glCreateProgram());
+	glProgramBinary(program, header.binaryFormat, binary, header.binaryLength);
+
+	/* a driver which changed underneath us rejects the binary */
+	GLint linkStatus = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
+	if ((glGetError() != GL_NO_ERROR) || (linkStatus != GL_TRUE)) {
+		ogl(glDeleteProgram(program));
+		program = 0;
+	}
+
+done:
+	if (binary) {
+		free(binary);
+	}
+	if (fin) {
+		fclose(fin);
+	}
+	return program;
+}
+
+static void StoreCachedProgram(const char *cacheDir, const char *path,
+		uint64_t key, GLuint program)
+{
+	char tmpPath[PROGRAM_CACHE_PATH_MAX];
+	FILE *fout = NULL;
+	void *binary = NULL;
+	struct ProgramCacheHeader header = {};
+	GLint binaryLength = 0;
+	GLenum binaryFormat = 0;
+
+	ogl(glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binaryLength));
+	if (binaryLength <= 0) {
+		goto done;
+	}
+	binary = malloc(binaryLength);
+	if (!binary) {
+		goto done;
+	}
+	ogl(glGetProgramBinary(program, binaryLength, NULL, &binaryFormat, binary));
+
+	if (mkdir(cacheDir, 0755) && (errno != EEXIST)) {
+		goto done;
+	}
+
+	/**
+	 * Write to a temporary file and rename it, so that another instance
+	 * never reads a half-written binary
+	 */
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+	fout = fopen(tmpPath, "wb");
+	if (!fout) {
+		goto done;
+	}
+
+	header.magic = PROGRAM_CACHE_MAGIC;
+	header.version = PROGRAM_CACHE_VERSION;
+	header.key = key;
+	header.binaryFormat = binaryFormat;
+	header.binaryLength = binaryLength;
+
+	int ok = (1 == fwrite(&header, sizeof(header), 1, fout))
+		&& (1 == fwrite(binary, binaryLength, 1, fout));
+	ok = (0 == fclose(fout)) && ok;
+	fout = NULL;
+
+	if (!ok || rename(tmpPath, path)) {
+		remove(tmpPath);
+	}
+
+done:
+	if (binary) {
+		free(binary);
+	}
+}
+
+/******************************************************************************
+ * Compilation from source
+ *****************************************************************************/
+static GLuint IssueCompileProgram(const char *vsrc, const char *fsrc, int retrievable)
+{
+	GLuint program;
+	ogl(program = glCreateProgram());
+
+	GLuint vert, frag;
+	ogl(vert = glCreateShader(GL_VERTEX_SHADER));
+	ogl(frag = glCreateShader(GL_FRAGMENT_SHADER));
+
+	ogl(glShaderSource(vert, 1, &vsrc, NULL));
+	ogl(glCompileShader(vert));
+	oglShaderLog(vert);
+
+	ogl(glShaderSource(frag, 1, &fsrc, NULL));
+	ogl(glCompileShader(frag));
+	oglShaderLog(frag);
+
+	ogl(glAttachShader(program, frag));
+	ogl(glAttachShader(program, vert));
+
+	ogl(glBindAttribLocation(program, 0, "position"));
+	ogl(glBindAttribLocation(program, 2, "texcoord"));
+	ogl(glBindFragDataLocation(program, 0, "out_color"));
+
+	if (retrievable) {
+		ogl(glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+	}
+
+	ogl(glLinkProgram(program));
+
+	/**
+	 * The program keeps the compiled code, the shader objects can go.
+	 * Deleting attached shaders only flags them, so this does not wait
+	 * for the compilation either.
+	 */
+	ogl(glDetachShader(program, frag));
+	ogl(glDetachShader(program, vert));
+	ogl(glDeleteShader(frag));
+	ogl(glDeleteShader(vert));
+
+	return program;
+}
+
+static int ParallelShaderCompileSupported(void)
+{
+	static int supported = -1;
+	if (supported < 0) {
+		GLint numExtensions = 0;
+		GLint i;
+		supported = 0;
+		ogl(glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions));
+		for (i = 0; i < numExtensions; i++) {
+			const char *ext = NULL;
+			ogl(ext = (const char*)glGetStringi(GL_EXTENSIONS, i));
+			if (ext && (!strcmp(ext, "GL_KHR_parallel_shader_compile")
+					|| !strcmp(ext, "GL_ARB_parallel_shader_compile"))) {
+				supported = 1;
+				break;
+			}
+		}
+	}
+	return supported;
+}
+
+void oglBeginProgramCached(const char *cacheDir,
+		const char *vsrc,
+		const char *fsrc,
+		struct OglPendingProgram *pending)
+{
+	memset(pending, 0, sizeof(*pending));
+
+	if (!cacheDir || !ProgramBinarySupported()) {
+		pending->program = IssueCompileProgram(vsrc, fsrc, 0);
+		return;
+	}
+
+	pending->key = ProgramCacheKey(vsrc, fsrc);
+	ProgramCachePath(pending->path, cacheDir, pending->key);
+
+	pending->program = LoadCachedProgram(pending->path, pending->key);
+	if (pending->program) {
+		return;
+	}
+
+	snprintf(pending->cacheDir, sizeof(pending->cacheDir), "%s", cacheDir);
+	pending->needsStore = 1;
+	pending->program = IssueCompileProgram(vsrc, fsrc, 1);
+}
+
+int oglPendingProgramReady(struct OglPendingProgram *pending)
+{
+	GLint completed = GL_TRUE;
+	if (pending->program && ParallelShaderCompileSupported()) {
+		ogl(glGetProgramiv(pending->program, GL_COMPLETION_STATUS_KHR, &completed));
+	}
+	return completed == GL_TRUE;
+}
+
+GLuint oglFinishProgramCached(struct OglPendingProgram *pending)
+{
+	GLuint program = pending->program;
+	GLint linkStatus = GL_FALSE;
+
+	ogl(glGetProgramiv(program, GL_LINK_STATUS, &linkStatus));
+	if (linkStatus != GL_TRUE) {
+		ogl(oglProgramLog(program));
+		ogl(glDeleteProgram(program));
+		program = 0;
+	}
+	else if (pending->needsStore) {
+		StoreCachedProgram(pending->cacheDir, pending->path, pending->key, program);
+	}
+
+	memset(pending, 0, sizeof(*pending));
+	return program;
+}
+
+GLuint oglCreateProgramCached(const char *cacheDir,
+		const char *vsrc,
+		const char *fsrc)
+{
+	struct OglPendingProgram pending;
+	oglBeginProgramCached(cacheDir, vsrc, fsrc, &pending);
+	return oglFinishProgramCached(&pending);
+}
@@ -0,0 +1,54 @@
+#ifndef __OPENGL_PROGRAM_CACHE__H__
+#define __OPENGL_PROGRAM_CACHE__H__
+
+#include <stdint.h>
+
+#include "opengl_common.h"
+
+/******************************************************************************
+ * On-disk cache of linked GLSL programs (glGetProgramBinary/glProgramBinary).
+ *
+ * Entries are keyed by a hash of the shader sources and the GL vendor,
+ * renderer and driver version strings, so a driver update or a shader
+ * change simply misses the cache.
+ * When the driver does not support program binaries or the cached binary
+ * is rejected, the program is compiled from source.
+ *
+ * Attribute and fragment output locations are fixed by the helper:
+ * "position" = 0, "texcoord" = 2, "out_color" = 0.
+ *****************************************************************************/
+GLuint oglCreateProgramCached(const char *cacheDir,
+		const char *vsrc,
+		const char *fsrc);
+
+/**
+ * Non-blocking variant for building programs while rendering.
+ *
+ * oglBeginProgramCached loads the program from the cache or issues the
+ * compile and link without waiting for the result.
+ * With KHR/ARB_parallel_shader_compile the driver builds it on its own
+ * threads and oglPendingProgramReady reports when it is done; without
+ * the extension it always reports ready and the wait happens in
+ * oglFinishProgramCached.
+ * oglFinishProgramCached returns the program, or 0 if it failed to link.
+ */
+enum {
+	OGL_PROGRAM_CACHE_PATH_MAX = 512,
+};
+
+struct OglPendingProgram {
+	GLuint program;
+	uint64_t key;
+	int needsStore;
+	char cacheDir[OGL_PROGRAM_CACHE_PATH_MAX];
+	char path[OGL_PROGRAM_CACHE_PATH_MAX];
+};
+
+void oglBeginProgramCached(const char *cacheDir,
+		const char *vsrc,
+		const char *fsrc,
+		struct OglPendingProgram *pending);
+int oglPendingProgramReady(struct OglPendingProgram *pending);
+GLuint oglFinishProgramCached(struct OglPendingProgram *pending);
+
+#endif //__OPENGL_PROGRAM_CACHE__H__
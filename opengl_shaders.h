@@ -6,10 +6,21 @@
 #define SHADER_QUOTE(A) #A
 #define GLSL_VERSION "#version 150 core\n"
 
-const char * const FRAG_PROCESS_CAMERA = GLSL_VERSION SHADER_QUOTE(
-	in vec3 vert_texcoord;
-	out vec4 out_color;
-
+/**
+ * The camera processing shader is assembled from two parts:
+ * a prelude which provides the CAM_* camera parameters and
+ * CamQuadMapping(), and the common body (FRAG_PROCESS_CAMERA_BODY).
+ *
+ * FRAG_PROCESS_CAMERA_UNIFORM_PARAMS reads the parameters from the
+ * Params uniform, so one program serves every camera.
+ *
+ * FRAG_PROCESS_CAMERA_CONST_PARAMS_FMT is a printf format which bakes
+ * the parameters of one camera (and the homography derived from its
+ * trapezeROI) into constants, letting the compiler fold them.
+ * Arguments: lensCentre[2], postScale[2], strength, zoom, aspectRatio,
+ * and the 3x3 mapping matrix in column-major order.
+ */
+const char * const FRAG_PROCESS_CAMERA_UNIFORM_PARAMS = GLSL_VERSION SHADER_QUOTE(
 	struct sParams {
 		vec2 lensCentre;
 		vec2 postScale;
@@ -20,18 +31,89 @@ const char * const FRAG_PROCESS_CAMERA = GLSL_VERSION SHADER_QUOTE(
 	};
 	uniform sParams Params;
 
+	mat3 CamQuadMapping()
+	{
+		/**
+		 * For verifying that the function works correctly,
+		 * first test with the identity quad
+		const vec2 p0 = vec2(0, 0);
+		const vec2 p1 = vec2(1, 0);
+		const vec2 p2 = vec2(1, 1);
+		const vec2 p3 = vec2(0, 1);
+		 */
+
+		vec2 p0 = Params.trapezeROI[0];
+		vec2 p1 = Params.trapezeROI[1];
+		vec2 p2 = Params.trapezeROI[2];
+		vec2 p3 = Params.trapezeROI[3];
+
+		vec2 dp1 = p1 - p2;
+		vec2 dp2 = p3 - p2;
+		vec2 s = p0 - p1 + p2 - p3;
+
+		float g = (s.x * dp2.y - s.y * dp2.x) / (dp1.x * dp2.y - dp1.y * dp2.x);
+		float h = (dp1.x * s.y - dp1.y * s.x) / (dp1.x * dp2.y - dp1.y * dp2.x);
+		float a = p1.x - p0.x + g * p1.x;
+		float b = p3.x - p0.x + h * p3.x;
+		float c = p0.x;
+		float d = p1.y - p0.y + g * p1.y;
+		float e = p3.y - p0.y + h * p3.y;
+		float f = p0.y;
+		float i = 1.0;
+
+		return mat3(
+				a, d, g,
+				b, e, h,
+				c, f, i);
+	}
+)
+	"\n#define CAM_LENS_CENTRE Params.lensCentre\n"
+	"#define CAM_POST_SCALE Params.postScale\n"
+	"#define CAM_STRENGTH Params.strength\n"
+	"#define CAM_ZOOM Params.zoom\n"
+	"#define CAM_ASPECT_RATIO Params.aspectRatio\n";
+
+const char * const FRAG_PROCESS_CAMERA_CONST_PARAMS_FMT = GLSL_VERSION
+	"const vec2 CAM_LENS_CENTRE = vec2(%#.9g, %#.9g);\n"
+	"const vec2 CAM_POST_SCALE = vec2(%#.9g, %#.9g);\n"
+	"const float CAM_STRENGTH = %#.9g;\n"
+	"const float CAM_ZOOM = %#.9g;\n"
+	"const float CAM_ASPECT_RATIO = %#.9g;\n"
+	"const mat3 CAM_QUAD_MAPPING = mat3(\n"
+	"	%#.9g, %#.9g, %#.9g,\n"
+	"	%#.9g, %#.9g, %#.9g,\n"
+	"	%#.9g, %#.9g, %#.9g);\n"
+	"mat3 CamQuadMapping() { return CAM_QUAD_MAPPING; }\n";
+
+const char * const FRAG_PROCESS_CAMERA_BODY = SHADER_QUOTE(
+	in vec3 vert_texcoord;
+	out vec4 out_color;
+
 	uniform sampler2D texture_Y;
 	uniform sampler2D texture_U;
 	uniform sampler2D texture_V;
 
+	/**
+	 * Source format description, set per uploaded frame:
+	 * chromaInterleaved - UV in texture_U as RG (NV12/P010) rather than
+	 *   separate U and V planes
+	 * sampleScale - maps LSB-aligned high bit depth samples to [0, 1]
+	 * yuvOffset, yuv2rgb - black level/chroma zero and the colour matrix
+	 *   for the colourspace and range of the source
+	 */
+	uniform int chromaInterleaved;
+	uniform float sampleScale;
+	uniform vec3 yuvOffset;
+	uniform mat3 yuv2rgb;
+
 	vec2 defisheye_web(vec2 in_texcoord)
 	{
 		//translate to origin so that center is 0,0
 		//const float aspect = (1280 / 960.0);
 		//vec2 lensCentre = vec2(-0.15, -0.15);
 
-		float aspect = Params.aspectRatio;
-		vec2 lensCentre = Params.lensCentre;
+		float aspect = CAM_ASPECT_RATIO;
+		vec2 lensCentre = CAM_LENS_CENTRE;
 
 		//translate to the center. maps [0, 1] -> [-0.5, 0.5]
 		const vec2 origin = vec2(0.5, 0.5);
@@ -40,8 +122,8 @@ const char * const FRAG_PROCESS_CAMERA = GLSL_VERSION SHADER_QUOTE(
 		//also, correct the aspect ratio
 		vec2 tc = 2.0 * (in_texcoord * vec2 (1.0, aspect) - origin);
 
-		float strength = Params.strength;
-		float zoom = Params.zoom;
+		float strength = CAM_STRENGTH;
+		float zoom = CAM_ZOOM;
 
 		vec2 vd = tc - lensCentre;
 		float r = sqrt(dot(vd, vd)) / strength;
@@ -53,7 +135,7 @@ const char * const FRAG_PROCESS_CAMERA = GLSL_VERSION SHADER_QUOTE(
 
 		//map back from [-1.0, 1.0] to [-0.5, 0.5]
 		vec2 ret = 0.5 * (tc * theta * zoom);
-		ret *= Params.postScale;
+		ret *= CAM_POST_SCALE;
 		return ret + origin;
 	}
 
@@ -61,55 +143,22 @@ const char * const FRAG_PROCESS_CAMERA = GLSL_VERSION SHADER_QUOTE(
 	{
 		vec3 yuv;
 
-		yuv.x = texture(texture_Y, xvert_texcoord).r - 0.0625;
-		yuv.y = texture(texture_U, xvert_texcoord).r - 0.5;
-		yuv.z = texture(texture_V, xvert_texcoord).r - 0.5;
+		yuv.x = texture(texture_Y, xvert_texcoord).r;
+		if (chromaInterleaved != 0) {
+			yuv.yz = texture(texture_U, xvert_texcoord).rg;
+		}
+		else {
+			yuv.y = texture(texture_U, xvert_texcoord).r;
+			yuv.z = texture(texture_V, xvert_texcoord).r;
+		}
 
-		mat3 yuv2rgb = mat3(
-			1.164, 1.164, 1.164,
-			0, -0.391, 2.018,
-			1.596, -0.813, 0
-		);
-		return yuv2rgb * yuv;
+		return yuv2rgb * (yuv * sampleScale - yuvOffset);
 	}
 
 	vec2 map_to_quad(vec2 coord)
 	{
-		/**
-		 * For verifying that the function works correctly,
-		 * first test with the identity quad
-		const vec2 p0 = vec2(0, 0);
-		const vec2 p1 = vec2(1, 0);
-		const vec2 p2 = vec2(1, 1);
-		const vec2 p3 = vec2(0, 1);
-		 */
-
-		vec2 p0 = Params.trapezeROI[0];
-		vec2 p1 = Params.trapezeROI[1];
-		vec2 p2 = Params.trapezeROI[2];
-		vec2 p3 = Params.trapezeROI[3];
-
-		vec2 dp1 = p1 - p2;
-		vec2 dp2 = p3 - p2;
-		vec2 s = p0 - p1 + p2 - p3;
-
-		float g = (s.x * dp2.y - s.y * dp2.x) / (dp1.x * dp2.y - dp1.y * dp2.x);
-		float h = (dp1.x * s.y - dp1.y * s.x) / (dp1.x * dp2.y - dp1.y * dp2.x);
-		float a = p1.x - p0.x + g * p1.x;
-		float b = p3.x - p0.x + h * p3.x;
-		float c = p0.x;
-		float d = p1.y - p0.y + g * p1.y;
-		float e = p3.y - p0.y + h * p3.y;
-		float f = p0.y;
-		float i = 1.0;
-
-		mat3 mapping = mat3(
-				a, d, g,
-				b, e, h,
-				c, f, i);
-
 		vec3 coord_hom = vec3(coord.xy, 1.0);
-		vec3 mapped_hom = mapping * coord_hom;
+		vec3 mapped_hom = CamQuadMapping() * coord_hom;
 		return mapped_hom.xy / mapped_hom.z;
 	}
 
@@ -167,25 +216,47 @@ const char * const FRAG_MERGE_LAYERS = GLSL_VERSION SHADER_QUOTE(
 	}
 );
 
-#undef GLSL_VERSION
-#undef SHADER_QUOTE
+/**
+ * One plane of I420 from the merged RGB picture, drawn into a
+ * single-channel target of the plane's size: luma per pixel, chroma
+ * from the average of each 2x2 block. BT.601, limited range.
+ */
+const char * const FRAG_RGB_TO_YUV_PLANE = GLSL_VERSION SHADER_QUOTE(
+	in vec3 vert_texcoord;
+	out vec4 out_color;
 
-static inline void oglShaderLog(int sid) {
-	GLint logLen;
-	GLsizei realLen;
+	uniform sampler2D textureRgb;
+	uniform int plane;
 
-	glGetShaderiv(sid, GL_INFO_LOG_LENGTH, &logLen);
-	if (!logLen) {
-		return;
-	}
-	char* log = (char*)malloc(logLen);
-	if (!log) {
-		fprintf(stderr, "Failed to allocate memory for the shader log");
-		return;
+	void main(void) {
+		ivec2 pos = ivec2(gl_FragCoord.xy);
+		vec3 rgb;
+		if (plane == 0) {
+			rgb = texelFetch(textureRgb, pos, 0).rgb;
+		}
+		else {
+			ivec2 base = pos * 2;
+			rgb = 0.25 * (texelFetch(textureRgb, base, 0).rgb
+				+ texelFetch(textureRgb, base + ivec2(1, 0), 0).rgb
+				+ texelFetch(textureRgb, base + ivec2(0, 1), 0).rgb
+				+ texelFetch(textureRgb, base + ivec2(1, 1), 0).rgb);
+		}
+
+		float value;
+		if (plane == 0) {
+			value = dot(rgb, vec3(0.257, 0.504, 0.098)) + 16.0 / 255.0;
+		}
+		else if (plane == 1) {
+			value = dot(rgb, vec3(-0.148, -0.291, 0.439)) + 128.0 / 255.0;
+		}
+		else {
+			value = dot(rgb, vec3(0.439, -0.368, -0.071)) + 128.0 / 255.0;
+		}
+		out_color = vec4(value, 0.0, 0.0, 1.0);
 	}
-	glGetShaderInfoLog(sid, logLen, &realLen, log);
-	fprintf(stderr, "shader %d log %s", sid, log);
-	free(log);
-}
+);
+
+#undef GLSL_VERSION
+#undef SHADER_QUOTE
 
 #endif //__OPENGL_SHADERS__H__
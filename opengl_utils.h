@@ -30,6 +30,24 @@ static inline void oglProgramLog(int pid) {
 	free(log);
 }
 
+static inline void oglShaderLog(int sid) {
+	GLint logLen;
+	GLsizei realLen;
+
+	glGetShaderiv(sid, GL_INFO_LOG_LENGTH, &logLen);
+	if (!logLen) {
+		return;
+	}
+	char* log = (char*)malloc(logLen);
+	if (!log) {
+		fprintf(stderr, "Failed to allocate memory for the shader log");
+		return;
+	}
+	glGetShaderInfoLog(sid, logLen, &realLen, log);
+	fprintf(stderr, "shader %d log %s", sid, log);
+	free(log);
+}
+
 static inline void projMatrix(GLfloat *data,
 	GLfloat fovy, GLfloat aspect,
 	GLfloat z_near, GLfloat z_far)
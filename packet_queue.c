@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "packet_queue.h"
+#include "qlib.h"
+
+struct pkt_q_node {
+	struct PacketQueueEntry entry;
+	struct pkt_q_node *next;
+};
+
+struct pkt_q {
+	struct pkt_q_node *head;
+	struct pkt_q_node *tail;
+	struct PacketQueueStats stats;
+	uint8_t isDestroyed;
+
+	pthread_mutex_t q_mutex;
+	pthread_cond_t q_cond;
+};
+
+/**
+ * Same deadline computation as in qlib
+ */
+static void pktQDeadline(struct timespec *ts, int timeout)
+{
+	struct timeval now = {};
+	gettimeofday(&now, NULL);
+
+	uint64_t nsec = now.tv_usec * 1000ULL + (uint64_t)timeout * 1000000ULL;
+	ts->tv_sec = now.tv_sec + nsec / 1000000000ULL;
+	ts->tv_nsec = nsec % 1000000000ULL;
+}
+
+/**
+ * Must be called with the mutex held
+ */
+static bool pktQIsFullLocked(struct pkt_q *q)
+{
+	if (!q->stats.packets) {
+		return false;
+	}
+	return (q->stats.bytes >= q->stats.maxBytes)
+		|| (q->stats.durationUs >= q->stats.maxDurationUs);
+}
+
+/**
+ * Waits on the queue condition, returns false on timeout
+ */
+static bool pktQWaitLocked(struct pkt_q *q, int timeout, const struct timespec *ts)
+{
+	if (timeout == MSG_Q_WAIT_FOREVER) {
+		pthread_cond_wait(&q->q_cond, &q->q_mutex);
+		return true;
+	}
+	return 0 == pthread_cond_timedwait(&q->q_cond, &q->q_mutex, ts);
+}
+
+PKT_Q_ID pktQCreate(size_t maxBytes, int64_t maxDurationUs)
+{
+	struct pkt_q *q = calloc(1, sizeof(struct pkt_q));
+	if (!q) {
+		return NULL;
+	}
+
+	q->stats.maxBytes = maxBytes;
+	q->stats.maxDurationUs = maxDurationUs;
+
+	if (pthread_mutex_init(&q->q_mutex, NULL)) {
+		free(q);
+		return NULL;
+	}
+	if (pthread_cond_init(&q->q_cond, NULL)) {
+		pthread_mutex_destroy(&q->q_mutex);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+void pktQEntryRelease(struct PacketQueueEntry *entry)
+{
+	av_packet_unref(&entry->packet);
+	if (entry->codecpar) {
+		avcodec_parameters_free(&entry->codecpar);
+	}
+}
+
+PKT_Q_STATUS pktQDelete(PKT_Q_ID pktQId)
+{
+	if (!pktQId) {
+		return PKT_Q_ERROR;
+	}
+
+	pthread_mutex_lock(&pktQId->q_mutex);
+	pktQId->isDestroyed = 1;
+	while (pktQId->head) {
+		struct pkt_q_node *node = pktQId->head;
+		pktQId->head = node->next;
+		pktQEntryRelease(&node->entry);
+		free(node);
+	}
+	pktQId->tail = NULL;
+	pktQId->stats.packets = 0;
+	pktQId->stats.bytes = 0;
+	pktQId->stats.durationUs = 0;
+	pthread_mutex_unlock(&pktQId->q_mutex);
+	pthread_cond_broadcast(&pktQId->q_cond);
+	return PKT_Q_OK;
+}
+
+PKT_Q_STATUS pktQPut(PKT_Q_ID pktQId, struct PacketQueueEntry *entry, int timeout)
+{
+	PKT_Q_STATUS rc = PKT_Q_ERROR;
+	struct timespec ts = {};
+
+	if (!pktQId) {
+		return PKT_Q_ERROR;
+	}
+
+	struct pkt_q_node *node = malloc(sizeof(struct pkt_q_node));
+	if (!node) {
+		return PKT_Q_ERROR;
+	}
+
+	if (timeout != MSG_Q_WAIT_FOREVER) {
+		pktQDeadline(&ts, timeout);
+	}
+
+	pthread_mutex_lock(&pktQId->q_mutex);
+	if (!pktQId->isDestroyed && pktQIsFullLocked(pktQId)) {
+		pktQId->stats.putWaits++;
+	}
+	while (!pktQId->isDestroyed && pktQIsFullLocked(pktQId)) {
+		if (!pktQWaitLocked(pktQId, timeout, &ts)) {
+			rc = PKT_Q_TIMEOUT;
+			goto failed;
+		}
+	}
+	if (pktQId->isDestroyed) {
+		goto failed;
+	}
+
+	node->entry = *entry;
+	node->next = NULL;
+	av_packet_move_ref(&node->entry.packet, &entry->packet);
+	entry->codecpar = NULL;
+
+	if (pktQId->tail) {
+		pktQId->tail->next = node;
+	} else {
+		pktQId->head = node;
+	}
+	pktQId->tail = node;
+
+	struct PacketQueueStats *stats = &pktQId->stats;
+	stats->packets++;
+	stats->bytes += node->entry.packet.size;
+	stats->durationUs += node->entry.durationUs;
+	stats->totalPackets++;
+	if (stats->bytes > stats->peakBytes) {
+		stats->peakBytes = stats->bytes;
+	}
+	if (stats->durationUs > stats->peakDurationUs) {
+		stats->peakDurationUs = stats->durationUs;
+	}
+
+	pthread_mutex_unlock(&pktQId->q_mutex);
+	pthread_cond_broadcast(&pktQId->q_cond);
+	return PKT_Q_OK;
+
+failed:
+	pthread_mutex_unlock(&pktQId->q_mutex);
+	free(node);
+	return rc;
+}
+
+PKT_Q_STATUS pktQGet(PKT_Q_ID pktQId, struct PacketQueueEntry *entry, int timeout)
+{
+	PKT_Q_STATUS rc = PKT_Q_ERROR;
+	struct timespec ts = {};
+
+	if (!pktQId) {
+		return PKT_Q_ERROR;
+	}
+
+	if (timeout != MSG_Q_WAIT_FOREVER) {
+		pktQDeadline(&ts, timeout);
+	}
+
+	pthread_mutex_lock(&pktQId->q_mutex);
+	if (!pktQId->isDestroyed && !pktQId->head) {
+		pktQId->stats.getWaits++;
+	}
+	while (!pktQId->isDestroyed && !pktQId->head) {
+		if (!pktQWaitLocked(pktQId, timeout, &ts)) {
+			rc = PKT_Q_TIMEOUT;
+			goto failed;
+		}
+	}
+	if (pktQId->isDestroyed) {
+		goto failed;
+	}
+
+	struct pkt_q_node *node = pktQId->head;
+	pktQId->head = node->next;
+	if (!pktQId->head) {
+		pktQId->tail = NULL;
+	}
+
+	pktQId->stats.packets--;
+	pktQId->stats.bytes -= node->entry.packet.size;
+	pktQId->stats.durationUs -= node->entry.durationUs;
+
+	pthread_mutex_unlock(&pktQId->q_mutex);
+	pthread_cond_broadcast(&pktQId->q_cond);
+
+	*entry = node->entry;
+	free(node);
+	return PKT_Q_OK;
+
+failed:
+	pthread_mutex_unlock(&pktQId->q_mutex);
+	return rc;
+}
+
+bool pktQIsFull(PKT_Q_ID pktQId)
+{
+	bool full = true;
+	if (!pktQId) {
+		return full;
+	}
+	pthread_mutex_lock(&pktQId->q_mutex);
+	full = pktQId->isDestroyed || pktQIsFullLocked(pktQId);
+	pthread_mutex_unlock(&pktQId->q_mutex);
+	return full;
+}
+
+int pktQNumEntries(PKT_Q_ID pktQId)
+{
+	int entries = PKT_Q_ERROR;
+	if (!pktQId) {
+		return entries;
+	}
+	pthread_mutex_lock(&pktQId->q_mutex);
+	if (!pktQId->isDestroyed) {
+		entries = pktQId->stats.packets;
+	}
+	pthread_mutex_unlock(&pktQId->q_mutex);
+	return entries;
+}
+
+void pktQGetStats(PKT_Q_ID pktQId, struct PacketQueueStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!pktQId) {
+		return;
+	}
+	pthread_mutex_lock(&pktQId->q_mutex);
+	*stats = pktQId->stats;
+	pthread_mutex_unlock(&pktQId->q_mutex);
+}
@@ -0,0 +1,101 @@
+#ifndef __PACKET_QUEUE__H__
+#define __PACKET_QUEUE__H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+/******************************************************************************
+ * Bounded queue of compressed packets between the demuxer and the decoder.
+ *
+ * Unlike qlib message queues, the bound is the amount of data queued:
+ * a put blocks once either the byte size or the playback duration of the
+ * queued packets reaches its limit. An empty queue always accepts one
+ * packet so that a single huge keyframe can not deadlock the pipeline.
+ *
+ * Besides packets, the queue carries in-band markers (see PKT_Q_FLAG_*).
+ *****************************************************************************/
+struct pkt_q;
+typedef struct pkt_q *PKT_Q_ID;
+
+#define PKT_Q_STATUS int
+#define PKT_Q_OK 0
+#define PKT_Q_ERROR (-1)
+#define PKT_Q_TIMEOUT (-2)
+
+/**
+ * The entry carries no packet data:
+ * NEW_STREAM - the input was (re)opened, codecpar describes the stream
+ * EOS - the input ended, no more packets will follow
+ */
+#define PKT_Q_FLAG_NEW_STREAM 0x01
+#define PKT_Q_FLAG_EOS 0x02
+
+struct PacketQueueEntry {
+	AVPacket packet;
+	int flags;
+
+	/* owned by the entry, valid with PKT_Q_FLAG_NEW_STREAM */
+	AVCodecParameters *codecpar;
+	AVRational timeBase;
+	int64_t streamStartUs;
+
+	/* duration used for the fill level accounting */
+	int64_t durationUs;
+
+	/* GetTimestampUs() when the packet was read */
+	uint64_t demuxUs;
+};
+
+struct PacketQueueStats {
+	size_t packets;
+	size_t bytes;
+	int64_t durationUs;
+
+	size_t maxBytes;
+	int64_t maxDurationUs;
+
+	/* high watermarks and totals since creation */
+	size_t peakBytes;
+	int64_t peakDurationUs;
+	uint64_t totalPackets;
+	uint64_t putWaits;
+	uint64_t getWaits;
+};
+
+PKT_Q_ID pktQCreate(size_t maxBytes, int64_t maxDurationUs);
+
+/**
+ * Like msgQDelete: wakes up all waiters and makes every further
+ * operation fail. Queued entries are released.
+ */
+PKT_Q_STATUS pktQDelete(PKT_Q_ID pktQId);
+
+/**
+ * Timeouts are in milliseconds, MSG_Q_NO_WAIT/MSG_Q_WAIT_FOREVER semantics.
+ * pktQPut takes over the packet reference and the codecpar of the entry.
+ */
+PKT_Q_STATUS pktQPut(PKT_Q_ID pktQId, struct PacketQueueEntry *entry, int timeout);
+PKT_Q_STATUS pktQGet(PKT_Q_ID pktQId, struct PacketQueueEntry *entry, int timeout);
+
+/**
+ * True when a put would block
+ */
+bool pktQIsFull(PKT_Q_ID pktQId);
+
+/**
+ * Number of queued entries (packets and markers), -1 on error
+ */
+int pktQNumEntries(PKT_Q_ID pktQId);
+
+void pktQGetStats(PKT_Q_ID pktQId, struct PacketQueueStats *stats);
+
+/**
+ * Releases the packet reference and the codecpar held by an entry
+ * obtained from pktQGet
+ */
+void pktQEntryRelease(struct PacketQueueEntry *entry);
+
+#endif //__PACKET_QUEUE__H__
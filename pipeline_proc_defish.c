@@ -1,6 +1,10 @@
+#include <errno.h>
+#include <math.h>
+
 #include "defish_app.h"
 #include "opengl_shaders.h"
 #include "opengl_utils.h"
+#include "opengl_program_cache.h"
 #include "qlib.h"
 #include "bmp_loader.h"
 
@@ -199,71 +203,381 @@ struct CameraParams {
 	GLfloat trapezeROI[8];
 };
 
-struct CameraParams AllCameraParams[] = {
-	/* left */
-	{
-		.lensCentre = { -0.15f, -0.15f, },
-		.postScale = { 0.2f, 0.3f, },
-		.aspectRatio = 1280.0f / 960.0f,
-		.strength = 0.4468,
-		.zoom = 6.8180,
-		.trapezeROI = {
-			276.0f / 1280.0f, 312.0f / 960.0f,
-			-200.0f / 1280.0f, 572.0f / 960.0f,
-			1272.0f / 1280.0f, 500.0f / 960.0f,
-			822.0f / 1280.0f, 320.0f / 960.0f,
-		},
-	},
-
-	/* right */
-	{
-		.lensCentre = { -0.0f, -0.15f, },
-		.postScale = { 0.2f, 0.3f, },
-		.aspectRatio = 1280.0f / 960.0f,
-		.strength = 0.6468,
-		.zoom = 4.6180,
-
-		.trapezeROI = {
-			-0.2500, 0.2500,
-			-0.2500, 0.7500,
-			1.2500, 0.7500,
-			1.2500, 0.2500,
-		},
-	},
-
-	/* front */
-	{
-		.lensCentre = { 0.10f, -0.15f, },
-		.postScale = { 0.3f, 0.3f, },
-		.aspectRatio = 1280.0f / 960.0f,
-		.strength = 0.4468,
-		.zoom = 5.4180,
-		.trapezeROI = {
-			0, 0,
-			0, 0.4,
-			1, 0.4,
-			1, 0,
-		},
-	},
-	/* rear */
-	{
-		.lensCentre = { -0.15f, -0.15f, },
-		.postScale = { 0.15f, 0.2f, },
-		.aspectRatio = 1280.0f / 960.0f,
-		.strength = 0.6668,
-		.zoom = 5.9180,
-		.trapezeROI = {
-			0.0f / 1280.0f, 350.0f / 960.0f,
-			0.0f / 1280.0f, 550.0f / 960.0f,
-			1780.0f / 1280.0f, 550.0f / 960.0f,
-			1780.0f / 1280.0f, 350.0f / 960.0f,
-		},
-	},
+/**
+ * Calibration of the cameras of one rig, by default every rig uses
+ * the same one
+ */
+#define CAMERA_PARAMS_INITIALIZER { \
+	/* left */ \
+	{ \
+		.lensCentre = { -0.15f, -0.15f, }, \
+		.postScale = { 0.2f, 0.3f, }, \
+		.aspectRatio = 1280.0f / 960.0f, \
+		.strength = 0.4468, \
+		.zoom = 6.8180, \
+		.trapezeROI = { \
+			276.0f / 1280.0f, 312.0f / 960.0f, \
+			-200.0f / 1280.0f, 572.0f / 960.0f, \
+			1272.0f / 1280.0f, 500.0f / 960.0f, \
+			822.0f / 1280.0f, 320.0f / 960.0f, \
+		}, \
+	}, \
+	\
+	/* right */ \
+	{ \
+		.lensCentre = { -0.0f, -0.15f, }, \
+		.postScale = { 0.2f, 0.3f, }, \
+		.aspectRatio = 1280.0f / 960.0f, \
+		.strength = 0.6468, \
+		.zoom = 4.6180, \
+	\
+		.trapezeROI = { \
+			-0.2500, 0.2500, \
+			-0.2500, 0.7500, \
+			1.2500, 0.7500, \
+			1.2500, 0.2500, \
+		}, \
+	}, \
+	\
+	/* front */ \
+	{ \
+		.lensCentre = { 0.10f, -0.15f, }, \
+		.postScale = { 0.3f, 0.3f, }, \
+		.aspectRatio = 1280.0f / 960.0f, \
+		.strength = 0.4468, \
+		.zoom = 5.4180, \
+		.trapezeROI = { \
+			0, 0, \
+			0, 0.4, \
+			1, 0.4, \
+			1, 0, \
+		}, \
+	}, \
+	/* rear */ \
+	{ \
+		.lensCentre = { -0.15f, -0.15f, }, \
+		.postScale = { 0.15f, 0.2f, }, \
+		.aspectRatio = 1280.0f / 960.0f, \
+		.strength = 0.6668, \
+		.zoom = 5.9180, \
+		.trapezeROI = { \
+			0.0f / 1280.0f, 350.0f / 960.0f, \
+			0.0f / 1280.0f, 550.0f / 960.0f, \
+			1780.0f / 1280.0f, 550.0f / 960.0f, \
+			1780.0f / 1280.0f, 350.0f / 960.0f, \
+		}, \
+	}, \
+}
+
+struct CameraParams AllCameraParams[NUM_RIGS][NUM_SRC_STREAMS] = {
+	[0 ... NUM_RIGS - 1] = CAMERA_PARAMS_INITIALIZER,
+};
+
+static struct CameraParams *GetCameraParams(size_t src_idx)
+{
+	return &AllCameraParams[src_idx / NUM_SRC_STREAMS][src_idx % NUM_SRC_STREAMS];
+}
+
+/**
+ * Bumped by NotifyCameraParamsChanged so that the specialised shader
+ * variant of the camera gets rebuilt. Starts at 1 so that the variants
+ * are built on the first frames.
+ */
+static unsigned CameraParamsGeneration[NUM_SOURCES] = {
+	[0 ... NUM_SOURCES - 1] = 1,
+};
+
+void NotifyCameraParamsChanged(int src_idx)
+{
+	CameraParamsGeneration[src_idx]++;
+}
+
+/**
+ * CPU version of the homography which the uniform-driven shader
+ * computes per fragment (see CamQuadMapping in opengl_shaders.h).
+ * The result is a column-major 3x3 matrix. Returns false for a
+ * degenerate ROI, whose mapping has no finite constants.
+ */
+static bool ComputeQuadMapping(const GLfloat *roi, GLfloat mapping[9])
+{
+	static const GLfloat MinQuadDeterminant = 1e-6f;
+
+	GLfloat p0x = roi[0], p0y = roi[1];
+	GLfloat p1x = roi[2], p1y = roi[3];
+	GLfloat p2x = roi[4], p2y = roi[5];
+	GLfloat p3x = roi[6], p3y = roi[7];
+
+	GLfloat dp1x = p1x - p2x, dp1y = p1y - p2y;
+	GLfloat dp2x = p3x - p2x, dp2y = p3y - p2y;
+	GLfloat sx = p0x - p1x + p2x - p3x;
+	GLfloat sy = p0y - p1y + p2y - p3y;
+
+	GLfloat det = dp1x * dp2y - dp1y * dp2x;
+	if (fabsf(det) < MinQuadDeterminant) {
+		return false;
+	}
+	GLfloat g = (sx * dp2y - sy * dp2x) / det;
+	GLfloat h = (dp1x * sy - dp1y * sx) / det;
+
+	mapping[0] = p1x - p0x + g * p1x;
+	mapping[1] = p1y - p0y + g * p1y;
+	mapping[2] = g;
+	mapping[3] = p3x - p0x + h * p3x;
+	mapping[4] = p3y - p0y + h * p3y;
+	mapping[5] = h;
+	mapping[6] = p0x;
+	mapping[7] = p0y;
+	mapping[8] = 1.0f;
+	return true;
+}
+
+/******************************************************************************
+ * Source pixel formats
+ *****************************************************************************/
+
+/**
+ * How the planes of a decoded frame map to the source textures.
+ * Every format is sampled directly, there is no CPU conversion pass.
+ */
+struct SourceFormatLayout {
+	enum AVPixelFormat format;
+	size_t numPlanes;
+	int chromaInterleaved;
+	int fullRange;
+
+	/* per component */
+	size_t bytesPerSample;
+	GLenum dataType;
+	GLenum internalFormatR;
+	GLenum internalFormatRG;
+
+	/* normalised sample -> [0, 1] */
+	GLfloat sampleScale;
+};
+
+static const struct SourceFormatLayout SourceFormatLayouts[] = {
+	{ AV_PIX_FMT_YUV420P, 3, 0, 0, 1, GL_UNSIGNED_BYTE, GL_R8, GL_RG8, 1.0f, },
+	{ AV_PIX_FMT_YUVJ420P, 3, 0, 1, 1, GL_UNSIGNED_BYTE, GL_R8, GL_RG8, 1.0f, },
+	{ AV_PIX_FMT_NV12, 2, 1, 0, 1, GL_UNSIGNED_BYTE, GL_R8, GL_RG8, 1.0f, },
+	/* 10 bits in the MSBs of 16 */
+	{ AV_PIX_FMT_P010LE, 2, 1, 0, 2, GL_UNSIGNED_SHORT, GL_R16, GL_RG16, 1.0f, },
+	/* 10 bits in the LSBs of 16 */
+	{ AV_PIX_FMT_YUV420P10LE, 3, 0, 0, 2, GL_UNSIGNED_SHORT, GL_R16, GL_RG16, 65535.0f / 1023.0f, },
 };
 
+static const struct SourceFormatLayout *FindSourceFormatLayout(int format)
+{
+	size_t i;
+	for (i = 0; i < sizeof(SourceFormatLayouts) / sizeof(SourceFormatLayouts[0]); i++)
+	{
+		if (SourceFormatLayouts[i].format == format) {
+			return &SourceFormatLayouts[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Builds the YCbCr -> RGB matrix (column-major) and the offsets
+ * subtracted before it, for the colourspace and range of the frame.
+ */
+static void ComputeColourConversion(const AVFrame *frame,
+		const struct SourceFormatLayout *layout,
+		GLfloat matrix[9],
+		GLfloat offset[3])
+{
+	GLfloat kr = 0.299f, kb = 0.114f;
+	switch (frame->colorspace) {
+	case AVCOL_SPC_BT709:
+		kr = 0.2126f;
+		kb = 0.0722f;
+		break;
+	case AVCOL_SPC_BT2020_NCL:
+	case AVCOL_SPC_BT2020_CL:
+		kr = 0.2627f;
+		kb = 0.0593f;
+		break;
+	default:
+		/* BT.601, also the best guess for unspecified SD/HD sources */
+		break;
+	}
+	GLfloat kg = 1.0f - kr - kb;
+
+	bool fullRange = layout->fullRange || (frame->color_range == AVCOL_RANGE_JPEG);
+	GLfloat yScale = fullRange ? 1.0f : 255.0f / 219.0f;
+	GLfloat cScale = fullRange ? 1.0f : 255.0f / 224.0f;
+
+	offset[0] = fullRange ? 0.0f : 16.0f / 255.0f;
+	offset[1] = 0.5f;
+	offset[2] = 0.5f;
+
+	/* Y column */
+	matrix[0] = yScale;
+	matrix[1] = yScale;
+	matrix[2] = yScale;
+	/* Cb column */
+	matrix[3] = 0.0f;
+	matrix[4] = -cScale * 2.0f * kb * (1.0f - kb) / kg;
+	matrix[5] = cScale * 2.0f * (1.0f - kb);
+	/* Cr column */
+	matrix[6] = cScale * 2.0f * (1.0f - kr);
+	matrix[7] = -cScale * 2.0f * kr * (1.0f - kr) / kg;
+	matrix[8] = 0.0f;
+}
+
 /******************************************************************************
  * OpenGL Context
  *****************************************************************************/
+
+/**
+ * Locations of the source format uniforms of a camera processing program
+ */
+struct SourceFormatUniforms {
+	GLint _chromaInterleaved;
+	GLint _sampleScale;
+	GLint _yuvOffset;
+	GLint _yuv2rgb;
+};
+
+enum CameraShaderMode {
+	CAMERA_SHADER_UNIFORM,
+	CAMERA_SHADER_SPECIALISED,
+	NUM_CAMERA_SHADER_MODES,
+};
+
+/**
+ * Camera processing program with the parameters of one camera
+ * compiled in as constants (CAMERA_SHADER_SPECIALISE)
+ */
+struct CameraShaderVariant
+{
+	GLuint _program;
+	GLuint _textureLocationUniform[NUM_TEXTURES_DEFISH_SRC];
+	struct SourceFormatUniforms _formatUniforms;
+	unsigned _paramsGeneration;
+
+	/**
+	 * The variant being built in the background while
+	 * the uniform-driven program is used
+	 */
+	struct OglPendingProgram _pending;
+	int _pendingActive;
+	unsigned _pendingGeneration;
+	unsigned _failedGeneration;
+};
+
+/**
+ * GPU time spent in the camera passes, per shader mode
+ */
+struct FragmentCost
+{
+	uint64_t _gpuTimeNs;
+	uint64_t _numDraws;
+};
+
+/**
+ * Offline mode progress, for the throughput report
+ */
+struct OfflineProgress {
+	bool finished;
+	uint64_t frameSets;
+	uint64_t startUs;
+	int64_t firstPtsUs;
+	int64_t lastPtsUs;
+};
+
+/**
+ * What the encoder gets for an output frame in flight
+ * (RENDER_PIPELINE_DEPTH > 1), once the frames before it got theirs
+ */
+enum PendingOutputKind {
+	PENDING_OUTPUT_NONE,
+	/* the pixels are on their way into the PBOs of the slot */
+	PENDING_OUTPUT_READBACK,
+	/* nothing changed, the previous frame is repeated for the tick */
+	PENDING_OUTPUT_REPEAT,
+	/* nothing changed and no tick, the encoder accounts for a skip */
+	PENDING_OUTPUT_SKIPPED,
+};
+
+struct PendingOutputFrame
+{
+	enum PendingOutputKind _kind;
+	GLsync _fence;
+	uint64_t _timestampsUs[NUM_LATENCY_TIMESTAMPS];
+	int64_t _ptsUs;
+	uint64_t _tickUs;
+};
+
+/**
+ * What each rig keeps between frames: a camera layer is only redrawn
+ * when the camera delivers a new picture
+ */
+struct RigRenderState
+{
+	/**
+	 * RENDER_PIPELINE_DEPTH sets of camera layers. A camera pass draws
+	 * into the set of the frame being rendered, and the merge samples
+	 * each camera from the set holding its newest picture, so a layer
+	 * is never redrawn while an earlier merge may still read it.
+	 */
+	GLuint _layeredFramebuffers[RENDER_PIPELINE_DEPTH][NUM_FB_ARRAY_LAYERS];
+	GLuint _textureFbColorbuffer[RENDER_PIPELINE_DEPTH][NUM_FB_ARRAY_LAYERS];
+	size_t _latestLayerSet[NUM_FB_ARRAY_LAYERS];
+
+	/**
+	 * RENDER_PIPELINE_DEPTH > 1: the merge target and the PBOs with
+	 * the readback of every resolution, per frame in flight
+	 */
+	GLuint _mergedFramebuffers[RENDER_PIPELINE_DEPTH];
+	GLuint _mergedTextures[RENDER_PIPELINE_DEPTH];
+	GLuint _readbackBuffers[RENDER_PIPELINE_DEPTH][NUM_OUTPUT_RESOLUTIONS];
+	struct PendingOutputFrame _pending[RENDER_PIPELINE_DEPTH];
+
+	struct OfflineProgress _offline;
+
+	/**
+	 * Change detection: the camera parameters generation each layer
+	 * was last drawn with (0 when never drawn), whether an output
+	 * frame was ever submitted, and how many were skipped since
+	 */
+	unsigned _layerGeneration[NUM_FB_ARRAY_LAYERS];
+	bool _outputSubmitted;
+	uint32_t _skippedOutputFrames;
+};
+
+/**
+ * PRINT_DEBUG_UTILISATION: the render thread CPU time and the part of it
+ * spent reading back, and the GPU time. The latter adds up GL_TIMESTAMP
+ * pairs around each piece of GPU work: every camera upload and draw, the
+ * merge, and every blit and readback. The render thread waits for the
+ * decoders, copies pixels and feeds the encoder between these spans, so
+ * the GPU time leaves out when the GPU sat idle meanwhile. A timestamp
+ * is taken once all earlier commands are done, so the spans never
+ * overlap.
+ */
+enum {
+	UTILISATION_QUERY_FRAMES = RENDER_PIPELINE_DEPTH + 2,
+	UTILISATION_MAX_SPANS = NUM_RIGS * (NUM_SRC_STREAMS + 1 + 2 * NUM_OUTPUT_RESOLUTIONS),
+};
+
+struct RenderUtilisation
+{
+	int _timestampsSupported;
+	GLuint _queries[UTILISATION_QUERY_FRAMES][UTILISATION_MAX_SPANS][2];
+	size_t _numSpans[UTILISATION_QUERY_FRAMES];
+	int _queryPending[UTILISATION_QUERY_FRAMES];
+
+	/* the frame being rendered is measured, and its query set */
+	int _frameMeasured;
+	size_t _frameQuerySet;
+	uint64_t _gpuBusyNs;
+	uint64_t _readbackUs;
+	uint64_t _periodStartUs;
+	uint64_t _periodStartCpuUs;
+	uint64_t _frames;
+};
+
 typedef struct RenderingContext
 {
 	/**
@@ -290,15 +604,22 @@ typedef struct RenderingContext
 	GLuint _paramAspectRatioUniform;
 
 	GLuint _textureLocationUniform[NUM_TEXTURES_DEFISH_SRC];
+	struct SourceFormatUniforms _formatUniforms;
 	GLuint _textures[NUM_TEXTURES_DEFISH_SRC];
 
 	/**
-	 * The layered framebuffer and the merging shader
+	 * Format of the frame currently in _textures
+	 */
+	const struct SourceFormatLayout *_sourceLayout;
+	GLfloat _sourceYuv2Rgb[9];
+	GLfloat _sourceYuvOffset[3];
+
+	/**
+	 * The merging shader, the layered framebuffers are per rig
 	 */
-	GLuint _layeredFramebuffers[NUM_FB_ARRAY_LAYERS];
-	GLuint _textureFbColorbuffer[NUM_FB_ARRAY_LAYERS];
 	GLuint _textureFbUniform[NUM_FB_ARRAY_LAYERS];
 	GLuint _programId_MergeSources;
+	struct RigRenderState _rigs[NUM_RIGS];
 
 	/**
 	 * The car overlay for the merging shader
@@ -306,6 +627,44 @@ typedef struct RenderingContext
 	GLuint _textureCarOverlay;
 	GLuint _textureCarOverlayUniform;
 
+	/**
+	 * ENCODER_FORMAT_I420: the merged picture copied into a texture,
+	 * and the single-channel targets the planes are converted into
+	 */
+	GLuint _programId_RgbToYuv;
+	GLint _yuvPlaneUniform;
+	GLuint _textureConvertSrc;
+	GLuint _texturePlanes[3];
+	GLuint _framebufferPlanes[3];
+
+	/**
+	 * The scaled-down outputs the merged picture is blitted into,
+	 * entry 0 stands for the default framebuffer with the master
+	 */
+	GLuint _textureScaled[NUM_OUTPUT_RESOLUTIONS];
+	GLuint _framebufferScaled[NUM_OUTPUT_RESOLUTIONS];
+
+	/**
+	 * Specialised per-camera programs and the measurement
+	 * of the camera pass cost for both shader modes
+	 */
+	struct CameraShaderVariant _cameraVariants[NUM_SOURCES];
+	int _timerQueriesSupported;
+	GLuint _timerQueries[NUM_SOURCES];
+	int _timerQueryPending[NUM_SOURCES];
+	enum CameraShaderMode _timerQueryMode[NUM_SOURCES];
+	struct FragmentCost _fragmentCost[NUM_CAMERA_SHADER_MODES];
+	size_t _frameCounter;
+
+	/**
+	 * Output cadence (OUTPUT_CADENCE_SCHEDULER): the next output tick
+	 * and the ticks the renderer was too late for
+	 */
+	uint64_t _nextOutputTickUs;
+	uint64_t _missedOutputTicks;
+
+	struct RenderUtilisation _utilisation;
+
 	/**
 	 * The flag indicating that the context was initialized
 	 */
@@ -317,138 +676,809 @@ static RenderingContext_t gRenderingContext;
 /******************************************************************************
  * Merging four streams into one picture
  *****************************************************************************/
-static void DownloadFramebuffer(struct RenderingContext *rctx)
+static void GetPlaneSize(size_t plane, struct OutputResolution res, GLsizei *width, GLsizei *height)
+{
+	*width = plane ? (res.width / 2) : res.width;
+	*height = plane ? (res.height / 2) : res.height;
+}
+
+/**
+ * ENCODER_FORMAT_I420: converts the picture in the read framebuffer on
+ * the GPU and reads back the three planes, which is half of the RGB
+ * readback and leaves no colour conversion to the encoder. Scaled
+ * outputs use the bottom-left corner of the master-sized targets.
+ */
+static void ReadbackI420(struct RenderingContext *rctx,
+		struct FrameData *frameData,
+		struct OutputResolution res)
 {
+	ogl(glActiveTexture(GL_TEXTURE0));
+	ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureConvertSrc));
+	ogl(glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, res.width, res.height));
+
+	ogl(glUseProgram(rctx->_programId_RgbToYuv));
+	ogl(glBindVertexArray(rctx->_vao));
+	ogl(glBindBuffer(GL_ARRAY_BUFFER, rctx->_vbo));
+	ogl(glBufferData(GL_ARRAY_BUFFER,
+		sizeof(QuadData), QuadData, GL_STATIC_DRAW));
+	ogl(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, rctx->_vbo_idx));
+	ogl(glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+		sizeof(QuadIndices), QuadIndices, GL_STATIC_DRAW));
+	ogl(glVertexAttribPointer(rctx->_positionAttr, VertexStride,
+		GL_FLOAT, GL_FALSE, 0,
+		(GLvoid*)(CoordOffset * sizeof(GLfloat))));
+	ogl(glEnableVertexAttribArray(rctx->_positionAttr));
+
 	ogl(glPixelStorei(GL_PACK_ALIGNMENT, 1));
-	ogl(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
-	ogl(glPixelStorei(GL_PACK_ROW_LENGTH, 0));
-	ogl(glPixelStorei(GL_PACK_SKIP_ROWS, 0));
-	ogl(glPixelStorei(GL_PACK_SKIP_PIXELS, 0));
 
-	struct FrameData frameData = {};
-	if (!TryGetEncoderInputBuffer(&frameData))
-	{
-		return;
-	}
-	if (!frameData.rawPixelData)
+	size_t plane;
+	for (plane = 0; plane < 3; plane++)
 	{
-		fprintf(stderr, "%s: frameData.rawPixelData is NULL\n", __func__);
-		return;
+		GLsizei width;
+		GLsizei height;
+		GetPlaneSize(plane, res, &width, &height);
+
+		ogl(glBindFramebuffer(GL_FRAMEBUFFER, rctx->_framebufferPlanes[plane]));
+		ogl(glViewport(0, 0, width, height));
+		ogl(glUniform1i(rctx->_yuvPlaneUniform, plane));
+		ogl(glDrawElements(GL_TRIANGLES, NumIndices, GL_UNSIGNED_INT, 0));
+
+		void *data = plane ? frameData->rawChromaData[plane - 1] : frameData->rawPixelData;
+		size_t stride = plane ? frameData->rawChromaStride : frameData->rawPixelStride;
+		ogl(glPixelStorei(GL_PACK_ROW_LENGTH, stride));
+		ogl(glReadPixels(0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, data));
 	}
-	ogl(glReadPixels(0, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, frameData.rawPixelData));
 
-	SubmitEncoderInputBuffer(&frameData);
+	ogl(glDisableVertexAttribArray(rctx->_positionAttr));
+	ogl(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+	ogl(glBindBuffer(GL_ARRAY_BUFFER, 0));
+	ogl(glBindVertexArray(0));
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	ogl(glViewport(0, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT));
 }
 
-static void BindTextureUniformsForMerging(struct RenderingContext *rctx)
+/**
+ * The rows of the output buffers may be padded for alignment. The sinks
+ * pad RGB rows by whole pixels, which GL_PACK_ROW_LENGTH can express.
+ */
+static void SetReadbackRowStride(size_t stride)
 {
-	size_t fbIdx;
-	for (fbIdx = 0; fbIdx < NUM_FB_ARRAY_LAYERS; fbIdx++)
-	{
-		static const char *texNames[4] = {
-			"textureSrc0",
-			"textureSrc1",
-			"textureSrc2",
-			"textureSrc3",
-		};
-		ogl(rctx->_textureFbUniform[fbIdx] = glGetUniformLocation(rctx->_programId_MergeSources, texNames[fbIdx]));
-		ogl(glUniform1i(rctx->_textureFbUniform[fbIdx], rctx->_textureFbColorbuffer[fbIdx]));
+	assert((stride % 3) == 0);
+	ogl(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+	ogl(glPixelStorei(GL_PACK_ROW_LENGTH, stride / 3));
+}
+
+/******************************************************************************
+ * Render thread and GPU utilisation (GL_TIMESTAMP queries)
+ *****************************************************************************/
+static uint64_t GetThreadCpuTimeUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void InitializeUtilisation(RenderingContext_t *rctx)
+{
+	struct RenderUtilisation *util = &rctx->_utilisation;
+	if (!PRINT_DEBUG_UTILISATION) {
+		return;
 	}
 
-	ogl(rctx->_textureCarOverlayUniform = glGetUniformLocation(rctx->_programId_MergeSources, "textureOverlayCar"));
-	ogl(glUniform1i(rctx->_textureCarOverlayUniform, rctx->_textureCarOverlay));
+	GLint counterBits = 0;
+	glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &counterBits);
+	util->_timestampsSupported = (glGetError() == GL_NO_ERROR) && (counterBits > 0);
+	if (util->_timestampsSupported) {
+		ogl(glGenQueries(2 * UTILISATION_QUERY_FRAMES * UTILISATION_MAX_SPANS, &util->_queries[0][0][0]));
+	}
+	util->_periodStartUs = GetTimestampUs();
+	util->_periodStartCpuUs = GetThreadCpuTimeUs();
 }
 
-static void InitializeCarOverlay(struct RenderingContext *rctx)
+/**
+ * Adds up the GPU spans of an earlier frame without stalling. Returns
+ * false while its queries are still in flight. The timestamps complete
+ * in order, so the last one being available is enough.
+ */
+static bool CollectUtilisationQueries(struct RenderUtilisation *util, size_t set)
 {
-	ogl(glGenTextures(1, &rctx->_textureCarOverlay));
-	ogl(glActiveTexture(GL_TEXTURE0));
-	ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureCarOverlay));
-	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
-	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
-	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER));
-	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER));
+	size_t span;
+	if (!util->_queryPending[set]) {
+		return true;
+	}
 
-	ogl(glTexImage2D(
-		GL_TEXTURE_2D,
-		0,
-		GL_RGB,
-		OVL_WIDTH,
-		OVL_HEIGHT,
-		0,
-		GL_BGRA,
-		GL_UNSIGNED_BYTE,
-		NULL));
+	GLint available = 0;
+	ogl(glGetQueryObjectiv(util->_queries[set][util->_numSpans[set] - 1][1],
+				GL_QUERY_RESULT_AVAILABLE, &available));
+	if (!available) {
+		return false;
+	}
 
-	Retcode rc = RC_FAILED;
-	void *bmp_data = NULL;
-	struct BmpHeader bmp_header = {};
-	size_t data_size = OVL_WIDTH * OVL_HEIGHT * 4;
+	for (span = 0; span < util->_numSpans[set]; span++)
+	{
+		GLuint64 startNs = 0;
+		GLuint64 endNs = 0;
+		ogl(glGetQueryObjectui64v(util->_queries[set][span][0], GL_QUERY_RESULT, &startNs));
+		ogl(glGetQueryObjectui64v(util->_queries[set][span][1], GL_QUERY_RESULT, &endNs));
+		if (endNs > startNs) {
+			util->_gpuBusyNs += endNs - startNs;
+		}
+	}
+	util->_queryPending[set] = 0;
+	return true;
+}
 
-	bmp_data = malloc(data_size);
-	CHECK(NULL != bmp_data);
+/**
+ * A frame whose query set is still busy is not measured, and the GPU
+ * time then reads low rather than stalling the pipeline
+ */
+static void BeginFrameUtilisation(RenderingContext_t *rctx)
+{
+	struct RenderUtilisation *util = &rctx->_utilisation;
+	size_t set = rctx->_frameCounter % UTILISATION_QUERY_FRAMES;
 
-	rc = BmpRead("car.bmp", BMP_RGBA8888, &bmp_header, bmp_data, data_size);
-	CHECK(RC_FAILED != rc);
+	util->_frameQuerySet = set;
+	util->_frameMeasured = util->_timestampsSupported && CollectUtilisationQueries(util, set);
+	if (util->_frameMeasured) {
+		util->_numSpans[set] = 0;
+	}
+}
 
-	ogl(glTexImage2D(
-		GL_TEXTURE_2D,
-		0,
-		GL_RGB,
-		OVL_WIDTH,
-		OVL_HEIGHT,
-		0,
-		GL_BGRA,
-		GL_UNSIGNED_BYTE,
-		bmp_data));
+static void BeginGpuSpan(RenderingContext_t *rctx)
+{
+	struct RenderUtilisation *util = &rctx->_utilisation;
+	size_t set = util->_frameQuerySet;
+	if (util->_frameMeasured && (util->_numSpans[set] < UTILISATION_MAX_SPANS)) {
+		ogl(glQueryCounter(util->_queries[set][util->_numSpans[set]][0], GL_TIMESTAMP));
+	}
+}
 
-fail:
-	if (bmp_data)
+static void EndGpuSpan(RenderingContext_t *rctx)
+{
+	struct RenderUtilisation *util = &rctx->_utilisation;
+	size_t set = util->_frameQuerySet;
+	if (util->_frameMeasured && (util->_numSpans[set] < UTILISATION_MAX_SPANS))
 	{
-		free(bmp_data);
-		bmp_data = NULL;
+		ogl(glQueryCounter(util->_queries[set][util->_numSpans[set]][1], GL_TIMESTAMP));
+		util->_numSpans[set]++;
 	}
-	ogl(glActiveTexture(GL_TEXTURE0));
-	ogl(glBindTexture(GL_TEXTURE_2D, 0));
-	return;
 }
 
-static void InitializeLayeredFramebuffer(struct RenderingContext *rctx)
+static void EndFrameUtilisation(RenderingContext_t *rctx)
 {
-	InitializeCarOverlay(rctx);
+	struct RenderUtilisation *util = &rctx->_utilisation;
+	size_t set = util->_frameQuerySet;
 
-	ogl(glGenTextures(NUM_FB_ARRAY_LAYERS, rctx->_textureFbColorbuffer));
-	ogl(glGenFramebuffers(NUM_FB_ARRAY_LAYERS, rctx->_layeredFramebuffers));
+	if (util->_frameMeasured && util->_numSpans[set]) {
+		util->_queryPending[set] = 1;
+	}
 
-	size_t fbIdx;
-	for (fbIdx = 0; fbIdx < NUM_FB_ARRAY_LAYERS; fbIdx++)
+	util->_frames++;
+	if (util->_frames < SHADER_COST_PRINT_PERIOD) {
+		return;
+	}
+
+	uint64_t nowUs = GetTimestampUs();
+	uint64_t cpuUs = GetThreadCpuTimeUs();
+	double wallUs = (double)(nowUs - util->_periodStartUs);
+	if (wallUs > 0.0)
 	{
-		ogl(glActiveTexture(GL_TEXTURE0));
-		ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureFbColorbuffer[fbIdx]));
+		double cpuPercent = 100.0 * (cpuUs - util->_periodStartCpuUs) / wallUs;
+		double readbackPercent = 100.0 * util->_readbackUs / wallUs;
+		if (util->_timestampsSupported) {
+			DPRINT_UTILISATION("pipeline depth %d: %.1f fps, render thread CPU %.0f%% (%.0f%% in readback), GPU %.0f%%",
+					RENDER_PIPELINE_DEPTH,
+					util->_frames * 1e6 / wallUs,
+					cpuPercent,
+					readbackPercent,
+					util->_gpuBusyNs / 10.0 / wallUs);
+		} else {
+			DPRINT_UTILISATION("pipeline depth %d: %.1f fps, render thread CPU %.0f%% (%.0f%% in readback), GPU n/a",
+					RENDER_PIPELINE_DEPTH,
+					util->_frames * 1e6 / wallUs,
+					cpuPercent,
+					readbackPercent);
+		}
+	}
 
-		ogl(glTexImage2D(
-					GL_TEXTURE_2D,
-					0,
-					GL_RGB,
-					OUTPUT_WIDTH,
-					OUTPUT_HEIGHT,
-					0,
-					GL_RGB,
-					GL_UNSIGNED_BYTE,
-					NULL));
+	util->_frames = 0;
+	util->_gpuBusyNs = 0;
+	util->_readbackUs = 0;
+	util->_periodStartUs = nowUs;
+	util->_periodStartCpuUs = cpuUs;
+}
+
+static bool AcquireOutputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	if (!TryGetEncoderInputBuffer(frameData, output_idx))
+	{
+		return false;
+	}
+	if (!frameData->rawPixelData)
+	{
+		fprintf(stderr, "%s: frameData.rawPixelData is NULL\n", __func__);
+		return false;
+	}
+	return true;
+}
+
+static void SubmitOutputFrame(struct RenderingContext *rctx,
+		size_t rig,
+		size_t resolution,
+		struct FrameData *frameData,
+		const uint64_t sourceTimestampsUs[NUM_LATENCY_TIMESTAMPS],
+		int64_t outputPtsUs,
+		uint64_t outputTickUs)
+{
+	/* the latency statistics follow the master resolution only */
+	if (resolution == 0) {
+		memcpy(frameData->timestampsUs, sourceTimestampsUs, sizeof(frameData->timestampsUs));
+	}
+	frameData->timestampsUs[LATENCY_TS_READBACK] = GetTimestampUs();
+	frameData->sourcePtsUs = outputPtsUs;
+	frameData->skippedOutputFrames = rctx->_rigs[rig]._skippedOutputFrames;
+	frameData->outputTickUs = outputTickUs;
+
+	SubmitEncoderInputBuffer(frameData, GetOutputIndex(rig, resolution));
+}
+
+static bool DownloadFramebuffer(struct RenderingContext *rctx,
+		size_t rig,
+		size_t resolution,
+		const uint64_t sourceTimestampsUs[NUM_LATENCY_TIMESTAMPS],
+		int64_t outputPtsUs,
+		uint64_t outputTickUs)
+{
+	size_t output_idx = GetOutputIndex(rig, resolution);
+	struct OutputResolution res = GetOutputResolution(output_idx);
+
+	ogl(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+	ogl(glPixelStorei(GL_PACK_SKIP_ROWS, 0));
+	ogl(glPixelStorei(GL_PACK_SKIP_PIXELS, 0));
+
+	struct FrameData frameData = {};
+	if (!AcquireOutputBuffer(&frameData, output_idx))
+	{
+		return false;
+	}
+	BeginGpuSpan(rctx);
+	if (GetEncoderPixelFormat() == ENCODER_FORMAT_I420)
+	{
+		ReadbackI420(rctx, &frameData, res);
+	}
+	else
+	{
+		SetReadbackRowStride(frameData.rawPixelStride);
+		ogl(glReadPixels(0, 0, res.width, res.height, GL_RGB, GL_UNSIGNED_BYTE, frameData.rawPixelData));
+	}
+	EndGpuSpan(rctx);
+
+	SubmitOutputFrame(rctx, rig, resolution, &frameData,
+			sourceTimestampsUs, outputPtsUs, outputTickUs);
+	return true;
+}
+
+/**
+ * Scales the previous resolution down into the target of this one,
+ * which becomes the read framebuffer. The first one is scaled from the
+ * master picture in masterFramebuffer.
+ */
+static void BlitScaledOutput(struct RenderingContext *rctx, size_t resolution, GLuint masterFramebuffer)
+{
+	struct OutputResolution src = GetOutputResolution(resolution - 1);
+	struct OutputResolution dst = GetOutputResolution(resolution);
+	GLuint srcFramebuffer = (resolution == 1)
+		? masterFramebuffer : rctx->_framebufferScaled[resolution - 1];
+
+	ogl(glBindFramebuffer(GL_READ_FRAMEBUFFER, srcFramebuffer));
+	ogl(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, rctx->_framebufferScaled[resolution]));
+	ogl(glBlitFramebuffer(0, 0, src.width, src.height,
+				0, 0, dst.width, dst.height,
+				GL_COLOR_BUFFER_BIT, GL_LINEAR));
+	ogl(glBindFramebuffer(GL_READ_FRAMEBUFFER, rctx->_framebufferScaled[resolution]));
+}
+
+/**
+ * Reads back every resolution of the rig from the merged picture in the
+ * default framebuffer. Each scaled output costs a blit from the one
+ * before it and a readback of its own size. Returns whether any of them
+ * reached the encoder.
+ */
+static bool DownloadRigOutputs(struct RenderingContext *rctx,
+		size_t rig,
+		const uint64_t sourceTimestampsUs[NUM_LATENCY_TIMESTAMPS],
+		int64_t outputPtsUs,
+		uint64_t outputTickUs)
+{
+	bool submitted = false;
+	size_t resolution;
+	for (resolution = 0; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++)
+	{
+		if (resolution) {
+			BeginGpuSpan(rctx);
+			BlitScaledOutput(rctx, resolution, 0);
+			EndGpuSpan(rctx);
+		} else {
+			ogl(glBindFramebuffer(GL_READ_FRAMEBUFFER, 0));
+		}
+		if (DownloadFramebuffer(rctx, rig, resolution,
+					sourceTimestampsUs, outputPtsUs, outputTickUs))
+		{
+			submitted = true;
+		}
+	}
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	return submitted;
+}
+
+/******************************************************************************
+ * Pipelined readback (RENDER_PIPELINE_DEPTH > 1)
+ *
+ * Frame N is merged into the merge target of its slot (N modulo the
+ * depth) and read back into the PBOs of the slot, followed by a fence.
+ * None of this waits for the GPU. Frame N is handed to the encoder
+ * while frame N + RENDER_PIPELINE_DEPTH - 1 is rendered, after that
+ * frame's camera passes were issued: by then the fence has usually
+ * signalled, and mapping the PBOs does not stall.
+ *****************************************************************************/
+static const GLuint64 RenderFenceTimeoutNs = 100000000;
+
+static size_t GetReadbackSize(struct OutputResolution res)
+{
+	size_t pixels = (size_t)res.width * res.height;
+	return (GetEncoderPixelFormat() == ENCODER_FORMAT_I420) ? (pixels * 3 / 2) : (pixels * 3);
+}
+
+/**
+ * Reads every resolution of the merged picture in the slot back into
+ * its PBOs. The planes are packed back to back without padding, their
+ * offsets stand in for the pointers of an encoder buffer.
+ */
+static void IssueRigReadback(struct RenderingContext *rctx, size_t rig, size_t slot)
+{
+	struct RigRenderState *rigState = &rctx->_rigs[rig];
+	size_t resolution;
+
+	BeginGpuSpan(rctx);
+	ogl(glPixelStorei(GL_PACK_SKIP_ROWS, 0));
+	ogl(glPixelStorei(GL_PACK_SKIP_PIXELS, 0));
+
+	for (resolution = 0; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++)
+	{
+		struct OutputResolution res = GetOutputResolution(resolution);
+		if (resolution) {
+			BlitScaledOutput(rctx, resolution, rigState->_mergedFramebuffers[slot]);
+		} else {
+			ogl(glBindFramebuffer(GL_READ_FRAMEBUFFER, rigState->_mergedFramebuffers[slot]));
+		}
+
+		ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, rigState->_readbackBuffers[slot][resolution]));
+		if (GetEncoderPixelFormat() == ENCODER_FORMAT_I420)
+		{
+			size_t lumaSize = (size_t)res.width * res.height;
+			struct FrameData offsets = {
+				.rawPixelData = (void*)0,
+				.rawPixelStride = res.width,
+				.rawChromaData = { (void*)lumaSize, (void*)(lumaSize + lumaSize / 4) },
+				.rawChromaStride = res.width / 2,
+			};
+			ReadbackI420(rctx, &offsets, res);
+		}
+		else
+		{
+			SetReadbackRowStride(res.width * 3);
+			ogl(glReadPixels(0, 0, res.width, res.height, GL_RGB, GL_UNSIGNED_BYTE, (void*)0));
+		}
+		ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+	}
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	EndGpuSpan(rctx);
+
+	ogl(rigState->_pending[slot]._fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+	/* get the GPU going while the next frame is prepared */
+	ogl(glFlush());
+}
+
+/**
+ * Copies a plane packed without padding out of the mapped PBO into the
+ * encoder buffer, whose rows may be padded
+ */
+static void CopyReadbackPlane(uint8_t *dst, size_t dstStride,
+		const uint8_t *src, size_t rowBytes, size_t rows)
+{
+	size_t row;
+	if (dstStride == rowBytes)
+	{
+		memcpy(dst, src, rowBytes * rows);
+		return;
+	}
+	for (row = 0; row < rows; row++) {
+		memcpy(dst + row * dstStride, src + row * rowBytes, rowBytes);
+	}
+}
+
+static bool CopyRigReadback(struct RenderingContext *rctx, size_t rig, size_t slot, size_t resolution)
+{
+	struct RigRenderState *rigState = &rctx->_rigs[rig];
+	const struct PendingOutputFrame *pending = &rigState->_pending[slot];
+	size_t output_idx = GetOutputIndex(rig, resolution);
+	struct OutputResolution res = GetOutputResolution(output_idx);
+
+	/**
+	 * Mapped first and not through ogl(): a readback which cannot be
+	 * mapped costs this frame only, and takes no encoder buffer
+	 */
+	ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, rigState->_readbackBuffers[slot][resolution]));
+	const uint8_t *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, GetReadbackSize(res), GL_MAP_READ_BIT);
+	if ((glGetError() != GL_NO_ERROR) || !pixels)
+	{
+		fprintf(stderr, "%s: failed to map the readback of output %zu\n", __func__, output_idx);
+		ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+		return false;
+	}
+
+	struct FrameData frameData = {};
+	if (!AcquireOutputBuffer(&frameData, output_idx))
+	{
+		ogl(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+		ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+		return false;
+	}
+
+	if (GetEncoderPixelFormat() == ENCODER_FORMAT_I420)
+	{
+		size_t lumaSize = (size_t)res.width * res.height;
+		CopyReadbackPlane(frameData.rawPixelData, frameData.rawPixelStride,
+				pixels, res.width, res.height);
+		CopyReadbackPlane(frameData.rawChromaData[0], frameData.rawChromaStride,
+				pixels + lumaSize, res.width / 2, res.height / 2);
+		CopyReadbackPlane(frameData.rawChromaData[1], frameData.rawChromaStride,
+				pixels + lumaSize + lumaSize / 4, res.width / 2, res.height / 2);
+	}
+	else
+	{
+		CopyReadbackPlane(frameData.rawPixelData, frameData.rawPixelStride,
+				pixels, res.width * 3, res.height);
+	}
+	ogl(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+	ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+
+	SubmitOutputFrame(rctx, rig, resolution, &frameData,
+			pending->_timestampsUs, pending->_ptsUs, pending->_tickUs);
+	return true;
+}
+
+static void QueuePendingOutput(struct RigRenderState *rigState,
+		size_t slot,
+		enum PendingOutputKind kind,
+		const uint64_t sourceTimestampsUs[NUM_LATENCY_TIMESTAMPS],
+		int64_t outputPtsUs,
+		uint64_t outputTickUs)
+{
+	struct PendingOutputFrame *pending = &rigState->_pending[slot];
+	pending->_kind = kind;
+	memcpy(pending->_timestampsUs, sourceTimestampsUs, sizeof(pending->_timestampsUs));
+	pending->_ptsUs = outputPtsUs;
+	pending->_tickUs = outputTickUs;
+}
+
+/**
+ * Hands the frame in flight in the slot to the encoder, waiting for its
+ * readback if the GPU has not finished it yet
+ */
+static void CompletePendingOutput(struct RenderingContext *rctx, size_t rig, size_t slot)
+{
+	struct RigRenderState *rigState = &rctx->_rigs[rig];
+	struct PendingOutputFrame *pending = &rigState->_pending[slot];
+	size_t resolution;
+
+	if (pending->_kind == PENDING_OUTPUT_REPEAT)
+	{
+		for (resolution = 0; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++) {
+			SubmitEncoderRepeatFrame(GetOutputIndex(rig, resolution), pending->_tickUs);
+		}
+	}
+	else if (pending->_kind == PENDING_OUTPUT_SKIPPED)
+	{
+		rigState->_skippedOutputFrames++;
+	}
+	else if (pending->_kind == PENDING_OUTPUT_READBACK)
+	{
+		uint64_t readbackStartUs = GetTimestampUs();
+		while (glClientWaitSync(pending->_fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+					RenderFenceTimeoutNs) == GL_TIMEOUT_EXPIRED) {
+		}
+		ogl(glDeleteSync(pending->_fence));
+		pending->_fence = NULL;
+
+		bool submitted = false;
+		for (resolution = 0; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++)
+		{
+			if (CopyRigReadback(rctx, rig, slot, resolution)) {
+				submitted = true;
+			}
+		}
+		if (submitted)
+		{
+			rigState->_outputSubmitted = true;
+			rigState->_skippedOutputFrames = 0;
+		}
+		rctx->_utilisation._readbackUs += GetTimestampUs() - readbackStartUs;
+	}
+	pending->_kind = PENDING_OUTPUT_NONE;
+}
+
+/**
+ * Completes all frames of the rig in flight, oldest first. The frame
+ * counter is that of the frame being rendered, or of the next one.
+ */
+static void FlushPendingOutputs(struct RenderingContext *rctx, size_t rig)
+{
+	size_t i;
+	for (i = 1; i <= RENDER_PIPELINE_DEPTH; i++) {
+		CompletePendingOutput(rctx, rig, (rctx->_frameCounter + i) % RENDER_PIPELINE_DEPTH);
+	}
+}
+
+/**
+ * The merging pass samples the camera layers from texture units
+ * 0..NUM_FB_ARRAY_LAYERS-1 and the car overlay from the next one,
+ * whichever rig is being merged
+ */
+enum {
+	MERGE_OVERLAY_TEXTURE_UNIT = NUM_FB_ARRAY_LAYERS,
+};
+
+static void BindTextureUniformsForMerging(struct RenderingContext *rctx)
+{
+	size_t fbIdx;
+	for (fbIdx = 0; fbIdx < NUM_FB_ARRAY_LAYERS; fbIdx++)
+	{
+		static const char *texNames[4] = {
+			"textureSrc0",
+			"textureSrc1",
+			"textureSrc2",
+			"textureSrc3",
+		};
+		ogl(rctx->_textureFbUniform[fbIdx] = glGetUniformLocation(rctx->_programId_MergeSources, texNames[fbIdx]));
+		ogl(glUniform1i(rctx->_textureFbUniform[fbIdx], fbIdx));
+	}
+
+	ogl(rctx->_textureCarOverlayUniform = glGetUniformLocation(rctx->_programId_MergeSources, "textureOverlayCar"));
+	ogl(glUniform1i(rctx->_textureCarOverlayUniform, MERGE_OVERLAY_TEXTURE_UNIT));
+}
+
+static void InitializeCarOverlay(struct RenderingContext *rctx)
+{
+	ogl(glGenTextures(1, &rctx->_textureCarOverlay));
+	ogl(glActiveTexture(GL_TEXTURE0));
+	ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureCarOverlay));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER));
+
+	ogl(glTexImage2D(
+		GL_TEXTURE_2D,
+		0,
+		GL_RGB,
+		OVL_WIDTH,
+		OVL_HEIGHT,
+		0,
+		GL_BGRA,
+		GL_UNSIGNED_BYTE,
+		NULL));
+
+	Retcode rc = RC_FAILED;
+	void *bmp_data = NULL;
+	struct BmpHeader bmp_header = {};
+	size_t data_size = OVL_WIDTH * OVL_HEIGHT * 4;
+
+	bmp_data = malloc(data_size);
+	CHECK(NULL != bmp_data);
+
+	rc = BmpRead("car.bmp", BMP_RGBA8888, &bmp_header, bmp_data, data_size);
+	CHECK(RC_FAILED != rc);
+
+	ogl(glTexImage2D(
+		GL_TEXTURE_2D,
+		0,
+		GL_RGB,
+		OVL_WIDTH,
+		OVL_HEIGHT,
+		0,
+		GL_BGRA,
+		GL_UNSIGNED_BYTE,
+		bmp_data));
+
+fail:
+	if (bmp_data)
+	{
+		free(bmp_data);
+		bmp_data = NULL;
+	}
+	ogl(glActiveTexture(GL_TEXTURE0));
+	ogl(glBindTexture(GL_TEXTURE_2D, 0));
+	return;
+}
+
+/**
+ * RENDER_PIPELINE_DEPTH > 1: the merge target and the PBOs of a slot
+ */
+static void InitializePipelineSlot(struct RigRenderState *rig, size_t slot)
+{
+	ogl(glGenTextures(1, &rig->_mergedTextures[slot]));
+	ogl(glActiveTexture(GL_TEXTURE0));
+	ogl(glBindTexture(GL_TEXTURE_2D, rig->_mergedTextures[slot]));
+	ogl(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8,
+				OUTPUT_WIDTH, OUTPUT_HEIGHT, 0,
+				GL_RGB, GL_UNSIGNED_BYTE, NULL));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+
+	ogl(glGenFramebuffers(1, &rig->_mergedFramebuffers[slot]));
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, rig->_mergedFramebuffers[slot]));
+	ogl(glFramebufferTexture2D(
+			GL_FRAMEBUFFER,
+			GL_COLOR_ATTACHMENT0,
+			GL_TEXTURE_2D,
+			rig->_mergedTextures[slot],
+			0));
+
+	GLenum fbStatus = 0;
+	ogl(fbStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER));
+	assert(fbStatus == GL_FRAMEBUFFER_COMPLETE);
+
+	ogl(glGenBuffers(NUM_OUTPUT_RESOLUTIONS, rig->_readbackBuffers[slot]));
+	size_t resolution;
+	for (resolution = 0; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++)
+	{
+		ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, rig->_readbackBuffers[slot][resolution]));
+		ogl(glBufferData(GL_PIXEL_PACK_BUFFER,
+					GetReadbackSize(GetOutputResolution(resolution)),
+					NULL, GL_STREAM_READ));
+	}
+	ogl(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+}
+
+static void InitializeLayerSet(struct RigRenderState *rig, size_t set)
+{
+	ogl(glGenTextures(NUM_FB_ARRAY_LAYERS, rig->_textureFbColorbuffer[set]));
+	ogl(glGenFramebuffers(NUM_FB_ARRAY_LAYERS, rig->_layeredFramebuffers[set]));
+
+	size_t fbIdx;
+	for (fbIdx = 0; fbIdx < NUM_FB_ARRAY_LAYERS; fbIdx++)
+	{
+		ogl(glActiveTexture(GL_TEXTURE0));
+		ogl(glBindTexture(GL_TEXTURE_2D, rig->_textureFbColorbuffer[set][fbIdx]));
+
+		ogl(glTexImage2D(
+					GL_TEXTURE_2D,
+					0,
+					GL_RGB,
+					OUTPUT_WIDTH,
+					OUTPUT_HEIGHT,
+					0,
+					GL_RGB,
+					GL_UNSIGNED_BYTE,
+					NULL));
 
 		ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
         ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
         ogl(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
         ogl(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
 
-		ogl(glBindFramebuffer(GL_FRAMEBUFFER, rctx->_layeredFramebuffers[fbIdx]));
+		ogl(glBindFramebuffer(GL_FRAMEBUFFER, rig->_layeredFramebuffers[set][fbIdx]));
+
+		ogl(glFramebufferTexture2D(
+				GL_FRAMEBUFFER,
+				GL_COLOR_ATTACHMENT0,
+				GL_TEXTURE_2D,
+				rig->_textureFbColorbuffer[set][fbIdx],
+				0));
+
+		GLenum fbStatus = 0;
+		ogl(fbStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER));
+		assert(fbStatus == GL_FRAMEBUFFER_COMPLETE);
+	}
+}
+
+static void InitializeRigFramebuffers(struct RigRenderState *rig)
+{
+	size_t slot;
+	for (slot = 0; slot < RENDER_PIPELINE_DEPTH; slot++)
+	{
+		InitializeLayerSet(rig, slot);
+		if (RENDER_PIPELINE_DEPTH > 1) {
+			InitializePipelineSlot(rig, slot);
+		}
+	}
+
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	ogl(glActiveTexture(GL_TEXTURE0));
+	ogl(glBindTexture(GL_TEXTURE_2D, 0));
+
+	rig->_offline.firstPtsUs = AV_NOPTS_VALUE;
+	rig->_offline.lastPtsUs = AV_NOPTS_VALUE;
+}
+
+static void InitializeYuvConversion(struct RenderingContext *rctx)
+{
+	ogl(glGenTextures(1, &rctx->_textureConvertSrc));
+	ogl(glActiveTexture(GL_TEXTURE0));
+	ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureConvertSrc));
+	ogl(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8,
+				OUTPUT_WIDTH, OUTPUT_HEIGHT, 0,
+				GL_RGB, GL_UNSIGNED_BYTE, NULL));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+	ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+
+	ogl(glGenTextures(3, rctx->_texturePlanes));
+	ogl(glGenFramebuffers(3, rctx->_framebufferPlanes));
+
+	size_t plane;
+	for (plane = 0; plane < 3; plane++)
+	{
+		GLsizei width;
+		GLsizei height;
+		GetPlaneSize(plane, GetOutputResolution(0), &width, &height);
+
+		ogl(glBindTexture(GL_TEXTURE_2D, rctx->_texturePlanes[plane]));
+		ogl(glTexImage2D(GL_TEXTURE_2D, 0, GL_R8,
+					width, height, 0,
+					GL_RED, GL_UNSIGNED_BYTE, NULL));
+		ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+		ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+
+		ogl(glBindFramebuffer(GL_FRAMEBUFFER, rctx->_framebufferPlanes[plane]));
+		ogl(glFramebufferTexture2D(
+				GL_FRAMEBUFFER,
+				GL_COLOR_ATTACHMENT0,
+				GL_TEXTURE_2D,
+				rctx->_texturePlanes[plane],
+				0));
+
+		GLenum fbStatus = 0;
+		ogl(fbStatus = glCheckFramebufferStatus(GL_FRAMEBUFFER));
+		assert(fbStatus == GL_FRAMEBUFFER_COMPLETE);
+	}
+
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	ogl(glBindTexture(GL_TEXTURE_2D, 0));
+
+	rctx->_programId_RgbToYuv = oglCreateProgramCached(SHADER_CACHE_DIR,
+			VERT_PASSTHRU,
+			FRAG_RGB_TO_YUV_PLANE);
+	ogl(glUseProgram(rctx->_programId_RgbToYuv));
+	GLint textureRgbUniform = -1;
+	ogl(textureRgbUniform = glGetUniformLocation(rctx->_programId_RgbToYuv, "textureRgb"));
+	ogl(glUniform1i(textureRgbUniform, 0));
+	ogl(rctx->_yuvPlaneUniform = glGetUniformLocation(rctx->_programId_RgbToYuv, "plane"));
+}
+
+static void InitializeScaledOutputs(struct RenderingContext *rctx)
+{
+	size_t resolution;
+	for (resolution = 1; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++)
+	{
+		struct OutputResolution res = GetOutputResolution(resolution);
+
+		ogl(glGenTextures(1, &rctx->_textureScaled[resolution]));
+		ogl(glActiveTexture(GL_TEXTURE0));
+		ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureScaled[resolution]));
+		ogl(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8,
+					res.width, res.height, 0,
+					GL_RGB, GL_UNSIGNED_BYTE, NULL));
+		ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+		ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
 
+		ogl(glGenFramebuffers(1, &rctx->_framebufferScaled[resolution]));
+		ogl(glBindFramebuffer(GL_FRAMEBUFFER, rctx->_framebufferScaled[resolution]));
 		ogl(glFramebufferTexture2D(
 				GL_FRAMEBUFFER,
 				GL_COLOR_ATTACHMENT0,
 				GL_TEXTURE_2D,
-				rctx->_textureFbColorbuffer[fbIdx],
+				rctx->_textureScaled[resolution],
 				0));
 
 		GLenum fbStatus = 0;
@@ -457,62 +1487,82 @@ static void InitializeLayeredFramebuffer(struct RenderingContext *rctx)
 	}
 
 	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
-	ogl(glActiveTexture(GL_TEXTURE0));
 	ogl(glBindTexture(GL_TEXTURE_2D, 0));
+}
 
-	ogl(rctx->_programId_MergeSources = glCreateProgram());
-	const char * const vsrc = VERT_PASSTHRU;
-	const char * const fsrc = FRAG_MERGE_LAYERS;
-	GLuint vert, frag;
-	ogl(vert = glCreateShader(GL_VERTEX_SHADER));
-	ogl(frag = glCreateShader(GL_FRAGMENT_SHADER));
-
-	ogl(glShaderSource(vert, 1, &vsrc, NULL));
-	ogl(glCompileShader(vert));
-	oglShaderLog(vert);
-
-	ogl(glShaderSource(frag, 1, &fsrc, NULL));
-	ogl(glCompileShader(frag));
-	oglShaderLog(frag);
-
-	ogl(glAttachShader(rctx->_programId_MergeSources, frag));
-	ogl(glAttachShader(rctx->_programId_MergeSources, vert));
+static void InitializeLayeredFramebuffer(struct RenderingContext *rctx)
+{
+	uint64_t overlayStartUs = GetTimestampUs();
+	InitializeCarOverlay(rctx);
+	PrintStartupPhase("car overlay", overlayStartUs);
 
-	ogl(glBindAttribLocation(rctx->_programId_MergeSources, 0, "position"));
-	ogl(glBindAttribLocation(rctx->_programId_MergeSources, 2, "texcoord"));
-	ogl(glBindFragDataLocation(rctx->_programId_MergeSources, 0, "out_color"));
+	size_t rig;
+	for (rig = 0; rig < NUM_RIGS; rig++) {
+		InitializeRigFramebuffers(&rctx->_rigs[rig]);
+	}
 
-	ogl(glLinkProgram(rctx->_programId_MergeSources));
-	ogl(oglProgramLog(rctx->_programId_MergeSources));
+	uint64_t phaseStartUs = GetTimestampUs();
+	rctx->_programId_MergeSources = oglCreateProgramCached(SHADER_CACHE_DIR,
+			VERT_PASSTHRU,
+			FRAG_MERGE_LAYERS);
+	PrintStartupPhase("merge program", phaseStartUs);
 
 	ogl(glUseProgram(rctx->_programId_MergeSources));
 	BindTextureUniformsForMerging(rctx);
+
+	if (GetEncoderPixelFormat() == ENCODER_FORMAT_I420)
+	{
+		phaseStartUs = GetTimestampUs();
+		InitializeYuvConversion(rctx);
+		PrintStartupPhase("yuv program", phaseStartUs);
+	}
+	InitializeScaledOutputs(rctx);
 }
 
-static void BindTargetFramebufferLayer(struct RenderingContext *rctx, size_t layer)
+static void BindTargetFramebufferLayer(struct RigRenderState *rig, size_t set, size_t layer)
 {
-	ogl(glBindFramebuffer(GL_FRAMEBUFFER, rctx->_layeredFramebuffers[layer]));
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, rig->_layeredFramebuffers[set][layer]));
 	ogl(glClearColor(0, 1, 1, 0.0));
 	ogl(glViewport(0, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT));
 	ogl(glClear(GL_COLOR_BUFFER_BIT));
 }
 
-static void BindOnscreenFramebuffer(struct RenderingContext *rctx)
+/**
+ * Binds the merge target, the default framebuffer or the one of the
+ * pipeline slot, and the newest layer of every camera
+ */
+static void BindMergeFramebuffer(struct RenderingContext *rctx,
+		struct RigRenderState *rig,
+		GLuint framebuffer)
 {
-	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, framebuffer));
 	ogl(glViewport(0, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT));
 	for (size_t fbIdx = 0; fbIdx < NUM_FB_ARRAY_LAYERS; fbIdx++)
 	{
-		ogl(glActiveTexture(GL_TEXTURE0 + rctx->_textureFbColorbuffer[fbIdx]));
-		ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureFbColorbuffer[fbIdx]));
+		ogl(glActiveTexture(GL_TEXTURE0 + fbIdx));
+		ogl(glBindTexture(GL_TEXTURE_2D, rig->_textureFbColorbuffer[rig->_latestLayerSet[fbIdx]][fbIdx]));
 	}
-	ogl(glActiveTexture(GL_TEXTURE0 + rctx->_textureCarOverlay));
+	ogl(glActiveTexture(GL_TEXTURE0 + MERGE_OVERLAY_TEXTURE_UNIT));
 	ogl(glBindTexture(GL_TEXTURE_2D, rctx->_textureCarOverlay));
 
 	ogl(glUseProgram(rctx->_programId_MergeSources));
 	BindTextureUniformsForMerging(rctx);
 }
 
+/**
+ * The window shows the default framebuffer, a merge into the target
+ * of a pipeline slot is copied there
+ */
+static void ShowMergedPicture(GLuint framebuffer)
+{
+	ogl(glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer));
+	ogl(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0));
+	ogl(glBlitFramebuffer(0, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT,
+				0, 0, OUTPUT_WIDTH, OUTPUT_HEIGHT,
+				GL_COLOR_BUFFER_BIT, GL_NEAREST));
+	ogl(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
 static void renderLayeredFbToScreen(struct RenderingContext *rctx)
 {
 	ogl(glBindVertexArray(rctx->_vao));
@@ -545,9 +1595,27 @@ static void renderLayeredFbToScreen(struct RenderingContext *rctx)
 	ogl(glBindVertexArray(0));
 }
 
+
 /******************************************************************************
  * De-fisheye algorithm for one YUV input
  *****************************************************************************/
+static void GetSourceFormatUniforms(GLuint program, struct SourceFormatUniforms *uniforms)
+{
+	ogl(uniforms->_chromaInterleaved = glGetUniformLocation(program, "chromaInterleaved"));
+	ogl(uniforms->_sampleScale = glGetUniformLocation(program, "sampleScale"));
+	ogl(uniforms->_yuvOffset = glGetUniformLocation(program, "yuvOffset"));
+	ogl(uniforms->_yuv2rgb = glGetUniformLocation(program, "yuv2rgb"));
+}
+
+static void SetSourceFormatUniforms(RenderingContext_t *rctx, const struct SourceFormatUniforms *uniforms)
+{
+	const struct SourceFormatLayout *layout = rctx->_sourceLayout;
+	ogl(glUniform1i(uniforms->_chromaInterleaved, layout->chromaInterleaved));
+	ogl(glUniform1f(uniforms->_sampleScale, layout->sampleScale));
+	ogl(glUniform3fv(uniforms->_yuvOffset, 1, rctx->_sourceYuvOffset));
+	ogl(glUniformMatrix3fv(uniforms->_yuv2rgb, 1, GL_FALSE, rctx->_sourceYuv2Rgb));
+}
+
 static void SetupProgramUniforms(RenderingContext_t *rctx)
 {
 	ogl(glUseProgram(rctx->_programId_ProcessOneCamera));
@@ -567,45 +1635,208 @@ static void SetupProgramUniforms(RenderingContext_t *rctx)
 	ogl(rctx->_paramStrengthUniform = glGetUniformLocation(rctx->_programId_ProcessOneCamera, "Params.strength"));
 	ogl(rctx->_paramZoomUniform = glGetUniformLocation(rctx->_programId_ProcessOneCamera, "Params.zoom"));
 	ogl(rctx->_paramAspectRatioUniform = glGetUniformLocation(rctx->_programId_ProcessOneCamera, "Params.aspectRatio"));
+
+	GetSourceFormatUniforms(rctx->_programId_ProcessOneCamera, &rctx->_formatUniforms);
 }
 
-static void InitializeRenderingContext(RenderingContext_t *rctx)
+/******************************************************************************
+ * Specialised per-camera shader variants
+ *****************************************************************************/
+static char *BuildCameraFragmentSource(const char *paramsPrelude)
 {
-	if (rctx->_initDone) {
+	size_t preludeLen = strlen(paramsPrelude);
+	size_t bodyLen = strlen(FRAG_PROCESS_CAMERA_BODY);
+	char *fsrc = malloc(preludeLen + bodyLen + 1);
+	if (fsrc) {
+		memcpy(fsrc, paramsPrelude, preludeLen);
+		memcpy(fsrc + preludeLen, FRAG_PROCESS_CAMERA_BODY, bodyLen + 1);
+	}
+	return fsrc;
+}
+
+static char *BuildSpecialisedCameraFragmentSource(const struct CameraParams *params)
+{
+	char prelude[2048];
+	GLfloat m[9];
+	if (!ComputeQuadMapping(params->trapezeROI, m)) {
+		return NULL;
+	}
+
+	snprintf(prelude, sizeof(prelude), FRAG_PROCESS_CAMERA_CONST_PARAMS_FMT,
+			params->lensCentre[0], params->lensCentre[1],
+			params->postScale[0], params->postScale[1],
+			params->strength,
+			params->zoom,
+			params->aspectRatio,
+			m[0], m[1], m[2],
+			m[3], m[4], m[5],
+			m[6], m[7], m[8]);
+	return BuildCameraFragmentSource(prelude);
+}
+
+/**
+ * Called once per frame for every camera: polls the variant being
+ * built and starts a new build when the camera parameters changed.
+ * Never waits for the compiler when the driver compiles in parallel.
+ */
+static void UpdateCameraShaderVariant(RenderingContext_t *rctx, size_t src_idx)
+{
+	struct CameraShaderVariant *variant = &rctx->_cameraVariants[src_idx];
+	unsigned generation = CameraParamsGeneration[src_idx];
+
+	if (variant->_pendingActive)
+	{
+		if (!oglPendingProgramReady(&variant->_pending)) {
+			return;
+		}
+
+		GLuint program = oglFinishProgramCached(&variant->_pending);
+		variant->_pendingActive = 0;
+		if (!program) {
+			fprintf(stderr, "%s: camera %zu variant failed to link\n", __func__, src_idx);
+			variant->_failedGeneration = variant->_pendingGeneration;
+			return;
+		}
+
+		if (variant->_program) {
+			ogl(glDeleteProgram(variant->_program));
+		}
+		variant->_program = program;
+		variant->_paramsGeneration = variant->_pendingGeneration;
+
+		const char * const texNames[NUM_TEXTURES_DEFISH_SRC] = {
+			"texture_Y",
+			"texture_U",
+			"texture_V",
+		};
+		for (size_t i = 0; i < NUM_TEXTURES_DEFISH_SRC; i++) {
+			ogl(variant->_textureLocationUniform[i] = glGetUniformLocation(program, texNames[i]));
+		}
+		GetSourceFormatUniforms(program, &variant->_formatUniforms);
+		DPRINT_RENDERER("camera %zu variant generation %u ready", src_idx, generation);
+	}
+
+	if ((variant->_paramsGeneration == generation)
+		|| (variant->_failedGeneration == generation))
+	{
 		return;
 	}
 
-	ogl(glGenVertexArrays(1, &rctx->_vao));
-	ogl(glBindVertexArray(rctx->_vao));
-	ogl(glGenBuffers(1, &rctx->_vbo));
-	ogl(glGenBuffers(1, &rctx->_vbo_idx));
+	/* a degenerate ROI stays on the uniform-driven program */
+	char *fsrc = BuildSpecialisedCameraFragmentSource(GetCameraParams(src_idx));
+	if (!fsrc)
+	{
+		fprintf(stderr, "%s: no variant for camera %zu\n", __func__, src_idx);
+		variant->_failedGeneration = generation;
+		return;
+	}
+	oglBeginProgramCached(SHADER_CACHE_DIR, VERT_PASSTHRU, fsrc, &variant->_pending);
+	free(fsrc);
+	variant->_pendingActive = 1;
+	variant->_pendingGeneration = generation;
+}
+
+/**
+ * The specialised program to use for the camera, or NULL to use the
+ * uniform-driven one (no up-to-date variant yet, or A/B cost sampling).
+ */
+static struct CameraShaderVariant *SelectCameraShaderVariant(RenderingContext_t *rctx, size_t src_idx)
+{
+	struct CameraShaderVariant *variant = &rctx->_cameraVariants[src_idx];
+	if (!CAMERA_SHADER_SPECIALISE
+		|| !variant->_program
+		|| (variant->_paramsGeneration != CameraParamsGeneration[src_idx]))
+	{
+		return NULL;
+	}
+
+	/* the A/B frames only make sense while their cost is measured */
+	if (rctx->_timerQueriesSupported
+		&& ((rctx->_frameCounter % SHADER_COST_AB_PERIOD) == 0))
+	{
+		return NULL;
+	}
+	return variant;
+}
+
+/******************************************************************************
+ * Camera pass cost measurement (GL_TIME_ELAPSED queries)
+ *****************************************************************************/
+static void InitializeFragmentCostQueries(RenderingContext_t *rctx)
+{
+	if (!PRINT_DEBUG_SHADER_COST) {
+		return;
+	}
+
+	/* timer queries need GL 3.3 or ARB_timer_query */
+	GLint counterBits = 0;
+	glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &counterBits);
+	rctx->_timerQueriesSupported = (glGetError() == GL_NO_ERROR) && (counterBits > 0);
+	if (rctx->_timerQueriesSupported) {
+		ogl(glGenQueries(NUM_SOURCES, rctx->_timerQueries));
+	}
+}
+
+/**
+ * Collects the result of the previous query for this camera without
+ * stalling. Returns false while it is still in flight.
+ */
+static bool CollectFragmentCost(RenderingContext_t *rctx, size_t src_idx)
+{
+	if (!rctx->_timerQueryPending[src_idx]) {
+		return true;
+	}
 
-	ogl(rctx->_programId_ProcessOneCamera = glCreateProgram());
+	GLint available = 0;
+	ogl(glGetQueryObjectiv(rctx->_timerQueries[src_idx], GL_QUERY_RESULT_AVAILABLE, &available));
+	if (!available) {
+		return false;
+	}
 
-	const char * const vsrc = VERT_PASSTHRU;
-	const char * const fsrc = FRAG_PROCESS_CAMERA;
+	GLuint64 elapsedNs = 0;
+	ogl(glGetQueryObjectui64v(rctx->_timerQueries[src_idx], GL_QUERY_RESULT, &elapsedNs));
+	struct FragmentCost *cost = &rctx->_fragmentCost[rctx->_timerQueryMode[src_idx]];
+	cost->_gpuTimeNs += elapsedNs;
+	cost->_numDraws++;
+	rctx->_timerQueryPending[src_idx] = 0;
+	return true;
+}
 
-	GLuint vert, frag;
-	ogl(vert = glCreateShader(GL_VERTEX_SHADER));
-	ogl(frag = glCreateShader(GL_FRAGMENT_SHADER));
+static void PrintFragmentCost(RenderingContext_t *rctx)
+{
+	const struct FragmentCost *uniform = &rctx->_fragmentCost[CAMERA_SHADER_UNIFORM];
+	const struct FragmentCost *specialised = &rctx->_fragmentCost[CAMERA_SHADER_SPECIALISED];
+	DPRINT_SHADER_COST("camera pass GPU time: uniform %.1f us (%llu draws), specialised %.1f us (%llu draws)",
+			uniform->_numDraws ? uniform->_gpuTimeNs / 1000.0 / uniform->_numDraws : 0.0,
+			(unsigned long long)uniform->_numDraws,
+			specialised->_numDraws ? specialised->_gpuTimeNs / 1000.0 / specialised->_numDraws : 0.0,
+			(unsigned long long)specialised->_numDraws);
+}
 
-	ogl(glShaderSource(vert, 1, &vsrc, NULL));
-	ogl(glCompileShader(vert));
-	oglShaderLog(vert);
+static void InitializeRenderingContext(RenderingContext_t *rctx)
+{
+	if (rctx->_initDone) {
+		return;
+	}
 
-	ogl(glShaderSource(frag, 1, &fsrc, NULL));
-	ogl(glCompileShader(frag));
-	oglShaderLog(frag);
+	uint64_t initStartUs = GetTimestampUs();
 
-	ogl(glAttachShader(rctx->_programId_ProcessOneCamera, frag));
-	ogl(glAttachShader(rctx->_programId_ProcessOneCamera, vert));
+	ogl(glGenVertexArrays(1, &rctx->_vao));
+	ogl(glBindVertexArray(rctx->_vao));
+	ogl(glGenBuffers(1, &rctx->_vbo));
+	ogl(glGenBuffers(1, &rctx->_vbo_idx));
 
-	ogl(glBindAttribLocation(rctx->_programId_ProcessOneCamera, 0, "position"));
-	ogl(glBindAttribLocation(rctx->_programId_ProcessOneCamera, 2, "texcoord"));
-	ogl(glBindFragDataLocation(rctx->_programId_ProcessOneCamera, 0, "out_color"));
+	uint64_t phaseStartUs = GetTimestampUs();
+	char *fsrc = BuildCameraFragmentSource(FRAG_PROCESS_CAMERA_UNIFORM_PARAMS);
+	assert(NULL != fsrc);
+	rctx->_programId_ProcessOneCamera = oglCreateProgramCached(SHADER_CACHE_DIR,
+			VERT_PASSTHRU,
+			fsrc);
+	free(fsrc);
+	PrintStartupPhase("camera program", phaseStartUs);
 
-	ogl(glLinkProgram(rctx->_programId_ProcessOneCamera));
-	ogl(oglProgramLog(rctx->_programId_ProcessOneCamera));
+	InitializeFragmentCostQueries(rctx);
+	InitializeUtilisation(rctx);
 
 	ogl(glGenTextures(NUM_TEXTURES_DEFISH_SRC, rctx->_textures));
 
@@ -623,22 +1854,39 @@ static void InitializeRenderingContext(RenderingContext_t *rctx)
 	 */
 	InitializeLayeredFramebuffer(&gRenderingContext);
 	rctx->_initDone = 1;
+
+	PrintStartupPhase("rendering context", initStartUs);
 }
 
-static void renderQuadWithParams(struct CameraParams *params, RenderingContext_t *rctx)
+static void renderQuadWithParams(struct CameraParams *params, RenderingContext_t *rctx, size_t src_idx)
 {
-	ogl(glUseProgram(rctx->_programId_ProcessOneCamera));
+	struct CameraShaderVariant *variant = SelectCameraShaderVariant(rctx, src_idx);
+
+	if (variant)
+	{
+		ogl(glUseProgram(variant->_program));
 
-	for (size_t i = 0; i < NUM_TEXTURES_DEFISH_SRC; i++) {
-		ogl(glUniform1i(rctx->_textureLocationUniform[i], rctx->_textures[i]));
+		for (size_t i = 0; i < NUM_TEXTURES_DEFISH_SRC; i++) {
+			ogl(glUniform1i(variant->_textureLocationUniform[i], rctx->_textures[i]));
+		}
+		SetSourceFormatUniforms(rctx, &variant->_formatUniforms);
 	}
+	else
+	{
+		ogl(glUseProgram(rctx->_programId_ProcessOneCamera));
 
-	ogl(glUniform2fv(rctx->_paramLensCentreUniform, 1, params->lensCentre));
-	ogl(glUniform2fv(rctx->_paramPostScaleUniform, 1, params->postScale));
-	ogl(glUniform2fv(rctx->_paramTrapezeROI, 4, params->trapezeROI));
-	ogl(glUniform1f(rctx->_paramAspectRatioUniform, params->aspectRatio));
-	ogl(glUniform1f(rctx->_paramStrengthUniform, params->strength));
-	ogl(glUniform1f(rctx->_paramZoomUniform, params->zoom));
+		for (size_t i = 0; i < NUM_TEXTURES_DEFISH_SRC; i++) {
+			ogl(glUniform1i(rctx->_textureLocationUniform[i], rctx->_textures[i]));
+		}
+		SetSourceFormatUniforms(rctx, &rctx->_formatUniforms);
+
+		ogl(glUniform2fv(rctx->_paramLensCentreUniform, 1, params->lensCentre));
+		ogl(glUniform2fv(rctx->_paramPostScaleUniform, 1, params->postScale));
+		ogl(glUniform2fv(rctx->_paramTrapezeROI, 4, params->trapezeROI));
+		ogl(glUniform1f(rctx->_paramAspectRatioUniform, params->aspectRatio));
+		ogl(glUniform1f(rctx->_paramStrengthUniform, params->strength));
+		ogl(glUniform1f(rctx->_paramZoomUniform, params->zoom));
+	}
 
 	ogl(glBindVertexArray(rctx->_vao));
 
@@ -660,8 +1908,19 @@ static void renderQuadWithParams(struct CameraParams *params, RenderingContext_t
 	ogl(glEnableVertexAttribArray(rctx->_positionAttr));
 	ogl(glEnableVertexAttribArray(rctx->_texCoordAttr));
 
+	bool timeThisDraw = rctx->_timerQueriesSupported && CollectFragmentCost(rctx, src_idx);
+	if (timeThisDraw) {
+		ogl(glBeginQuery(GL_TIME_ELAPSED, rctx->_timerQueries[src_idx]));
+	}
+
 	ogl(glDrawElements(GL_TRIANGLES, NumIndices, GL_UNSIGNED_INT, 0));
 
+	if (timeThisDraw) {
+		ogl(glEndQuery(GL_TIME_ELAPSED));
+		rctx->_timerQueryPending[src_idx] = 1;
+		rctx->_timerQueryMode[src_idx] = variant ? CAMERA_SHADER_SPECIALISED : CAMERA_SHADER_UNIFORM;
+	}
+
 	ogl(glDisableVertexAttribArray(rctx->_texCoordAttr));
 	ogl(glDisableVertexAttribArray(rctx->_positionAttr));
 
@@ -670,16 +1929,36 @@ static void renderQuadWithParams(struct CameraParams *params, RenderingContext_t
 	ogl(glBindVertexArray(0));
 }
 
-static void uploadGlTexture(AVFrame *src_frame, int src_idx)
+static bool uploadGlTexture(AVFrame *src_frame, int src_idx)
 {
 	AVFrame *frame = NULL;
 	if (!src_frame)
 	{
-		return;
+		return false;
 	}
 	frame = src_frame;
 
-	for (size_t i = 0; i < NUM_TEXTURES_DEFISH_SRC; i++) {
+	const struct SourceFormatLayout *layout = FindSourceFormatLayout(frame->format);
+	if (!layout)
+	{
+		static int lastUnsupportedFormat = -1;
+		if (lastUnsupportedFormat != frame->format) {
+			lastUnsupportedFormat = frame->format;
+			fprintf(stderr, "%s: source %d has unsupported pixel format %d\n",
+					__func__, src_idx, frame->format);
+		}
+		return false;
+	}
+
+	gRenderingContext._sourceLayout = layout;
+	ComputeColourConversion(frame, layout,
+			gRenderingContext._sourceYuv2Rgb,
+			gRenderingContext._sourceYuvOffset);
+
+	/* 16-bit rows are always 2-byte aligned, 8-bit rows may be odd */
+	ogl(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+
+	for (size_t i = 0; i < layout->numPlanes; i++) {
 		ogl(glActiveTexture(GL_TEXTURE0 + gRenderingContext._textures[i]));
 		ogl(glBindTexture(GL_TEXTURE_2D, gRenderingContext._textures[i]));
 
@@ -689,50 +1968,157 @@ static void uploadGlTexture(AVFrame *src_frame, int src_idx)
 		ogl(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER));
 
 		size_t height = frame->height;
+		size_t components = 1;
 		if (i) {
 			//divide by two for U and V components
-			height >>= 1;
+			height = (height + 1) >> 1;
+			if (layout->chromaInterleaved) {
+				components = 2;
+			}
 		}
 
+		/**
+		 * As before, the texture spans the whole line including padding,
+		 * the texture coordinates are not adjusted for it
+		 */
+		size_t width = frame->linesize[i] / (layout->bytesPerSample * components);
+
 		ogl(glTexImage2D(
 			GL_TEXTURE_2D,
 			0,
-			GL_RGB,
-			frame->linesize[i],
+			(components == 2) ? layout->internalFormatRG : layout->internalFormatR,
+			width,
 			height,
-			0, GL_RED,
-			GL_UNSIGNED_BYTE,
+			0,
+			(components == 2) ? GL_RG : GL_RED,
+			layout->dataType,
 			frame->data[i]));
 	}
+	return true;
 }
 
-void RenderPipelineWithGL(void)
+/**
+ * Offline mode: one of the sources of the rig has ended, finish its output
+ */
+static void FinishOfflineProcessing(RenderingContext_t *rctx, struct OfflineProgress *progress, size_t rig)
 {
-	/**
-	 * FPS counter for debugging (when enabled)
-	 */
-	double timeStart;
-	double timeEnd;
-	static double lastFPS = 0.0;
+	FlushPendingOutputs(rctx, rig);
+	progress->finished = true;
+	size_t resolution;
+	for (resolution = 0; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++) {
+		SubmitEncoderEndOfStream(GetOutputIndex(rig, resolution));
+	}
 
-	if (PRINT_DEBUG_FPS)
-	{
-		timeStart = glfwGetTime();
+	double wallS = (GetTimestampUs() - progress->startUs) / 1e6;
+	double contentS = 0.0;
+	if ((progress->firstPtsUs != AV_NOPTS_VALUE) && (progress->lastPtsUs != AV_NOPTS_VALUE)) {
+		contentS = (progress->lastPtsUs - progress->firstPtsUs) / 1e6;
+	}
+	if (contentS <= 0.0) {
+		contentS = (double)progress->frameSets / OUTPUT_FRAMERATE;
 	}
 
-	InitializeRenderingContext(&gRenderingContext);
+	fprintf(stderr, "Offline[%zu]: %llu frame sets in %.2f s, %.2f fps, %.2fx real time\n",
+			rig,
+			(unsigned long long)progress->frameSets,
+			wallS,
+			(wallS > 0.0) ? progress->frameSets / wallS : 0.0,
+			(wallS > 0.0) ? contentS / wallS : 0.0);
+}
+
+/**
+ * Renders the output frame of one rig and hands it to its encoder.
+ * Returns false once the rig has finished offline processing.
+ */
+static bool RenderRig(RenderingContext_t *rctx, size_t rig, uint64_t outputTickUs)
+{
+	struct RigRenderState *rigState = &rctx->_rigs[rig];
+	struct OfflineProgress *progress = &rigState->_offline;
+
+	if (progress->finished) {
+		return false;
+	}
+	if (gAppOptions.offline && !progress->startUs) {
+		progress->startUs = GetTimestampUs();
+	}
+
+	/* the layer set, merge target and PBOs of this frame */
+	size_t slot = rctx->_frameCounter % RENDER_PIPELINE_DEPTH;
 
 	ogl(glClearColor(1, 0.9, 1, 0.0));
 	ogl(glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT|GL_STENCIL_BUFFER_BIT));
 
-	size_t src_idx = 0;
-	for (src_idx = 0; src_idx < NUM_SRC_STREAMS;  src_idx++)
+	/**
+	 * Latency timestamps of the oldest camera frame which goes into
+	 * this output frame
+	 */
+	uint64_t outputTimestampsUs[NUM_LATENCY_TIMESTAMPS] = {};
+	int64_t outputPtsUs = AV_NOPTS_VALUE;
+	bool anyLayerUpdated = false;
+
+	size_t cam = 0;
+	for (cam = 0; cam < NUM_SRC_STREAMS; cam++)
 	{
+		size_t src_idx = GetSourceIndex(rig, cam);
+		if (CAMERA_SHADER_SPECIALISE) {
+			UpdateCameraShaderVariant(rctx, src_idx);
+		}
+
 		struct FrameData frameData = {};
-		if (TryReceiveDecodedFrame(&frameData, src_idx))
+		bool received = false;
+		if (gAppOptions.offline)
+		{
+			/**
+			 * Lock-step: the output frame needs the next frame of
+			 * every camera, the set is incomplete once any ends
+			 */
+			received = WaitDecodedFrame(&frameData, src_idx);
+			if (!received) {
+				FinishOfflineProcessing(rctx, progress, rig);
+				return false;
+			}
+			if (cam == 0) {
+				outputPtsUs = frameData.sourcePtsUs;
+			}
+		}
+		else
+		{
+			received = TryReceiveDecodedFrame(&frameData, src_idx);
+		}
+
+		/**
+		 * The layer still holds this picture, unless the camera
+		 * parameters changed since it was drawn
+		 */
+		if (received && CHANGE_DETECTION)
+		{
+			bool skip = frameData.unchanged
+				&& (rigState->_layerGeneration[cam] == CameraParamsGeneration[src_idx]);
+			ChangeStatsRecordCamera(skip);
+			if (skip)
+			{
+				ReturnFrameToDecoderQueue(frameData.frame, src_idx);
+				continue;
+			}
+		}
+
+		if (received)
 		{
 			DPRINT_RENDERER("frame data=%p", frameData.frame->data[0]);
-			uploadGlTexture(frameData.frame, src_idx);
+			BeginGpuSpan(rctx);
+			if (!uploadGlTexture(frameData.frame, src_idx))
+			{
+				EndGpuSpan(rctx);
+				ReturnFrameToDecoderQueue(frameData.frame, src_idx);
+				continue;
+			}
+
+			frameData.timestampsUs[LATENCY_TS_UPLOADED] = GetTimestampUs();
+			if (!outputTimestampsUs[LATENCY_TS_DEMUX]
+				|| (frameData.timestampsUs[LATENCY_TS_DEMUX] < outputTimestampsUs[LATENCY_TS_DEMUX]))
+			{
+				memcpy(outputTimestampsUs, frameData.timestampsUs, sizeof(outputTimestampsUs));
+			}
 
 			/**
 			 * This function should never block because it is inside the rendering loop.
@@ -740,7 +2126,9 @@ void RenderPipelineWithGL(void)
 			 * conditions:
 			 *
 			 * If the decoder is too fast, it will block on the
-			 * FrameQueuesDecoded.
+			 * FrameQueuesDecoded. A network camera in mailbox mode
+			 * replaces the pending frame instead, and the replaced
+			 * frame goes back to FrameQueuesReturnedToDecoder.
 			 *
 			 * Otherwise, FrameQueuesReturned can not be full since
 			 * we are owning one frame
@@ -754,18 +2142,197 @@ void RenderPipelineWithGL(void)
 			 * Do this only when we receive a decoded frame
 			 * because framebuffer is cleared before drawing.
 			 */
-			BindTargetFramebufferLayer(&gRenderingContext, src_idx);
-			renderQuadWithParams(&AllCameraParams[src_idx], &gRenderingContext);
+			BindTargetFramebufferLayer(rigState, slot, cam);
+			renderQuadWithParams(GetCameraParams(src_idx), rctx, src_idx);
+			EndGpuSpan(rctx);
+			rigState->_latestLayerSet[cam] = slot;
+			rigState->_layerGeneration[cam] = CameraParamsGeneration[src_idx];
+			anyLayerUpdated = true;
 		}
 	};
 
+	/**
+	 * The camera passes of this frame are queued behind the merge and
+	 * the readback of the oldest frame in flight, which goes to the
+	 * encoder now. Its slot is the next one to be rendered into.
+	 */
+	if (RENDER_PIPELINE_DEPTH > 1) {
+		CompletePendingOutput(rctx, rig, (slot + 1) % RENDER_PIPELINE_DEPTH);
+	}
+
 	/**
 	 * Merge all input images into a single one and draw to the screen
 	 */
-	BindOnscreenFramebuffer(&gRenderingContext);
-	renderLayeredFbToScreen(&gRenderingContext);
+	GLuint mergeFramebuffer = (RENDER_PIPELINE_DEPTH > 1) ? rigState->_mergedFramebuffers[slot] : 0;
+	BeginGpuSpan(rctx);
+	BindMergeFramebuffer(rctx, rigState, mergeFramebuffer);
+	renderLayeredFbToScreen(rctx);
+	if (mergeFramebuffer) {
+		ShowMergedPicture(mergeFramebuffer);
+	}
+	EndGpuSpan(rctx);
+
+	/**
+	 * The draw calls are only queued at this point, the GPU time
+	 * ends up in the readback stage which waits for them.
+	 */
+	if (outputTimestampsUs[LATENCY_TS_DEMUX]) {
+		outputTimestampsUs[LATENCY_TS_RENDERED] = GetTimestampUs();
+	}
+
+	/**
+	 * Nothing new to show: the last submitted output frame is still
+	 * valid, the encoder accounts for the skipped ones in its timeline.
+	 * The merge above is kept since the window shows the default
+	 * framebuffer, which is not preserved across buffer swaps.
+	 */
+	bool skipOutput = CHANGE_DETECTION && !anyLayerUpdated && rigState->_outputSubmitted;
+	if (CHANGE_DETECTION) {
+		ChangeStatsRecordOutput(skipOutput);
+	}
+	if (RENDER_PIPELINE_DEPTH > 1)
+	{
+		/* the encoder gets the frame in order, RENDER_PIPELINE_DEPTH - 1 frames later */
+		enum PendingOutputKind kind = PENDING_OUTPUT_READBACK;
+		if (skipOutput) {
+			kind = outputTickUs ? PENDING_OUTPUT_REPEAT : PENDING_OUTPUT_SKIPPED;
+		}
+		QueuePendingOutput(rigState, slot, kind, outputTimestampsUs, outputPtsUs, outputTickUs);
+		if (!skipOutput) {
+			IssueRigReadback(rctx, rig, slot);
+		}
+	}
+	else if (skipOutput && outputTickUs)
+	{
+		/* keep the cadence without another readback */
+		size_t resolution;
+		for (resolution = 0; resolution < NUM_OUTPUT_RESOLUTIONS; resolution++) {
+			SubmitEncoderRepeatFrame(GetOutputIndex(rig, resolution), outputTickUs);
+		}
+	}
+	else if (skipOutput)
+	{
+		rigState->_skippedOutputFrames++;
+	}
+	else
+	{
+		uint64_t readbackStartUs = GetTimestampUs();
+		if (DownloadRigOutputs(rctx, rig, outputTimestampsUs, outputPtsUs, outputTickUs))
+		{
+			rigState->_outputSubmitted = true;
+			rigState->_skippedOutputFrames = 0;
+		}
+		rctx->_utilisation._readbackUs += GetTimestampUs() - readbackStartUs;
+	}
+
+	if (gAppOptions.offline)
+	{
+		progress->frameSets++;
+		if (outputPtsUs != AV_NOPTS_VALUE)
+		{
+			if (progress->firstPtsUs == AV_NOPTS_VALUE) {
+				progress->firstPtsUs = outputPtsUs;
+			}
+			progress->lastPtsUs = outputPtsUs;
+		}
+	}
+	return true;
+}
+
+/**
+ * Output cadence: sleeps until the next output tick and returns its
+ * time. When the renderer is more than a period late, the missed ticks
+ * are dropped so that the output does not run ahead of real time.
+ */
+static uint64_t WaitForOutputTick(struct RenderingContext *rctx)
+{
+	const uint64_t periodUs = 1000000 / OUTPUT_FRAMERATE;
+	uint64_t nowUs = GetTimestampUs();
+
+	if (!rctx->_nextOutputTickUs) {
+		rctx->_nextOutputTickUs = nowUs;
+	}
+
+	if (nowUs >= rctx->_nextOutputTickUs + periodUs)
+	{
+		uint64_t missed = (nowUs - rctx->_nextOutputTickUs) / periodUs;
+		rctx->_missedOutputTicks += missed;
+		rctx->_nextOutputTickUs += missed * periodUs;
+	}
+	else if (nowUs < rctx->_nextOutputTickUs)
+	{
+		struct timespec ts = {
+			.tv_sec = rctx->_nextOutputTickUs / 1000000,
+			.tv_nsec = (rctx->_nextOutputTickUs % 1000000) * 1000,
+		};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		}
+	}
+
+	uint64_t tickUs = rctx->_nextOutputTickUs;
+	rctx->_nextOutputTickUs += periodUs;
+	return tickUs;
+}
+
+bool RenderPipelineWithGL(void)
+{
+	/**
+	 * FPS counter for debugging (when enabled)
+	 */
+	double timeStart;
+	double timeEnd;
+	static double lastFPS = 0.0;
+
+	uint64_t outputTickUs = 0;
+	if (OUTPUT_CADENCE_SCHEDULER && !gAppOptions.offline) {
+		outputTickUs = WaitForOutputTick(&gRenderingContext);
+	}
+
+	if (PRINT_DEBUG_FPS)
+	{
+		timeStart = glfwGetTime();
+	}
+
+	InitializeRenderingContext(&gRenderingContext);
+
+	/**
+	 * The rigs take turns on the one GL context, each merge goes
+	 * through the default framebuffer, or the target of its pipeline
+	 * slot (RENDER_PIPELINE_DEPTH)
+	 */
+	BeginFrameUtilisation(&gRenderingContext);
+	bool anyRigActive = false;
+	size_t rig;
+	for (rig = 0; rig < NUM_RIGS; rig++)
+	{
+		if (RenderRig(&gRenderingContext, rig, outputTickUs)) {
+			anyRigActive = true;
+		}
+	}
+	if (!anyRigActive) {
+		return false;
+	}
+	EndFrameUtilisation(&gRenderingContext);
+
+	gRenderingContext._frameCounter++;
+	if (gRenderingContext._timerQueriesSupported
+		&& ((gRenderingContext._frameCounter % SHADER_COST_PRINT_PERIOD) == 0))
+	{
+		PrintFragmentCost(&gRenderingContext);
+	}
+	if (outputTickUs && gRenderingContext._missedOutputTicks
+		&& ((gRenderingContext._frameCounter % SHADER_COST_PRINT_PERIOD) == 0))
+	{
+		fprintf(stderr, "Output cadence: %llu ticks missed\n",
+				(unsigned long long)gRenderingContext._missedOutputTicks);
+	}
 
-	DownloadFramebuffer(&gRenderingContext);
+	static bool firstFrameDone = false;
+	if (!firstFrameDone)
+	{
+		firstFrameDone = true;
+		PrintStartupPhase("first frame", StartupTimeUs);
+	}
 
 	if (PRINT_DEBUG_FPS)
 	{
@@ -781,4 +2348,17 @@ void RenderPipelineWithGL(void)
 					avgFPS);
 		}
 	}
+
+	return true;
+}
+
+void FlushRenderPipeline(void)
+{
+	size_t rig;
+	if (!gRenderingContext._initDone) {
+		return;
+	}
+	for (rig = 0; rig < NUM_RIGS; rig++) {
+		FlushPendingOutputs(&gRenderingContext, rig);
+	}
 }
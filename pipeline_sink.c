@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "defish_app.h"
+
+/******************************************************************************
+ * Encoder backend selection
+ *
+ * The renderer only talks to the functions below, which forward to the
+ * backend chosen by ENCODER_SINK.
+ *****************************************************************************/
+
+static const struct EncoderSinkOps *GetEncoderSinkOps(void)
+{
+	if (ENCODER_SINK == ENCODER_SINK_AVCODEC) {
+		return &AvcodecSinkOps;
+	}
+	if (ENCODER_SINK == ENCODER_SINK_SHM) {
+		return &ShmSinkOps;
+	}
+	if (ENCODER_SINK == ENCODER_SINK_PIPE) {
+		return &PipeSinkOps;
+	}
+	return &GStreamerSinkOps;
+}
+
+void InitializeEncoderSink(void)
+{
+	GetEncoderSinkOps()->initialize();
+}
+
+void WaitAndReleaseEncoderSink(void)
+{
+	const struct EncoderSinkOps *ops = GetEncoderSinkOps();
+	size_t output_idx;
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		struct OutputResolution res = GetOutputResolution(output_idx);
+		fprintf(stderr, "Encoder[%zu] %dx%d: %zu output frames dropped (%s)\n",
+				output_idx, res.width, res.height,
+				ops->getDroppedFrameCount(output_idx), ops->name);
+	}
+	LatencyStatsDump(stderr);
+	if (CHANGE_DETECTION) {
+		ChangeStatsDump(stderr);
+	}
+
+	ops->waitAndRelease();
+}
+
+enum EncoderPixelFormat GetEncoderPixelFormat(void)
+{
+	return GetEncoderSinkOps()->pixelFormat;
+}
+
+bool TryGetEncoderInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	return GetEncoderSinkOps()->tryGetInputBuffer(frameData, output_idx);
+}
+
+void SubmitEncoderInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	GetEncoderSinkOps()->submitInputBuffer(frameData, output_idx);
+}
+
+void SubmitEncoderEndOfStream(size_t output_idx)
+{
+	GetEncoderSinkOps()->submitEndOfStream(output_idx);
+}
+
+void SubmitEncoderRepeatFrame(size_t output_idx, uint64_t outputTickUs)
+{
+	GetEncoderSinkOps()->submitRepeatFrame(output_idx, outputTickUs);
+}
+
+size_t GetEncoderDroppedFrameCount(size_t output_idx)
+{
+	return GetEncoderSinkOps()->getDroppedFrameCount(output_idx);
+}
+
+/**
+ * Inserts suffix before the extension of path, or appends it
+ */
+static void InsertPathSuffix(char *buffer, size_t size, const char *path, const char *suffix)
+{
+	const char *slash = strrchr(path, '/');
+	const char *dot = strrchr(path, '.');
+	if (!dot || (slash && (dot < slash))) {
+		snprintf(buffer, size, "%s%s", path, suffix);
+		return;
+	}
+	snprintf(buffer, size, "%.*s%s%s", (int)(dot - path), path, suffix, dot);
+}
+
+void GetOutputPath(char *buffer, size_t size, const char *path, size_t output_idx)
+{
+	size_t rig = output_idx / NUM_OUTPUT_RESOLUTIONS;
+	size_t resolution = output_idx % NUM_OUTPUT_RESOLUTIONS;
+	char suffix[64] = "";
+
+	if (rig) {
+		snprintf(suffix, sizeof(suffix), ".rig%zu", rig);
+	}
+	if (resolution)
+	{
+		struct OutputResolution res = GetOutputResolution(output_idx);
+		size_t len = strlen(suffix);
+		snprintf(suffix + len, sizeof(suffix) - len, ".%dx%d", res.width, res.height);
+	}
+	InsertPathSuffix(buffer, size, path, suffix);
+}
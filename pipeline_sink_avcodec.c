@@ -0,0 +1,318 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+
+#include "defish_app.h"
+
+/******************************************************************************
+ * In-process encoder sink (ENCODER_SINK_AVCODEC)
+ *
+ * The renderer reads I420 back into the AVFrame of the output, which is
+ * encoded and muxed on the rendering thread as soon as it is submitted.
+ * There is no queue and no other thread: the time spent encoding is the
+ * backpressure on the renderer, and nothing is ever dropped. Slice
+ * threads of the encoder keep that time short without adding latency.
+ *****************************************************************************/
+
+struct AvcodecOutput {
+	AVFormatContext *format;
+	AVStream *stream;
+	AVCodecContext *codec;
+
+	/**
+	 * The frame being rendered into, owned by the renderer between
+	 * TryGetEncoderInputBuffer and SubmitEncoderInputBuffer
+	 */
+	AVFrame *frame;
+	AVPacket *packet;
+
+	/* timestamps, in the microsecond time base of the encoder */
+	int64_t nextPtsUs;
+	int64_t lastPtsUs;
+	int64_t firstSourcePtsUs;
+	uint64_t firstTickUs;
+	bool headerWritten;
+	bool frameEncoded;
+	bool finished;
+	size_t framesDropped;
+};
+
+static struct AvcodecOutput AvcodecOutputs[NUM_OUTPUTS];
+
+static const AVRational AvcodecSinkTimeBase = { 1, 1000000 };
+
+static bool OpenAvcodecOutput(struct AvcodecOutput *output, size_t output_idx)
+{
+	struct OutputResolution res = GetOutputResolution(output_idx);
+	char outputPath[512];
+	GetOutputPath(outputPath, sizeof(outputPath),
+			gAppOptions.offline ? gAppOptions.outputPath : LIVE_DEFAULT_OUTPUT,
+			output_idx);
+
+	const AVCodec *codec = avcodec_find_encoder_by_name(AVCODEC_SINK_CODEC);
+	if (!codec) {
+		fprintf(stderr, "Encoder: no '%s' encoder\n", AVCODEC_SINK_CODEC);
+		return false;
+	}
+	if (avformat_alloc_output_context2(&output->format, NULL, AVCODEC_SINK_FORMAT, outputPath) < 0) {
+		fprintf(stderr, "Encoder: unsupported output '%s'\n", outputPath);
+		return false;
+	}
+
+	output->codec = avcodec_alloc_context3(codec);
+	if (!output->codec) {
+		return false;
+	}
+	output->codec->width = res.width;
+	output->codec->height = res.height;
+	output->codec->pix_fmt = AV_PIX_FMT_YUV420P;
+	output->codec->color_range = AVCOL_RANGE_MPEG;
+	output->codec->colorspace = AVCOL_SPC_BT470BG;
+	output->codec->time_base = AvcodecSinkTimeBase;
+	output->codec->framerate = (AVRational){ OUTPUT_FRAMERATE, 1 };
+	output->codec->gop_size = AVCODEC_SINK_GOP;
+	output->codec->bit_rate = AVCODEC_SINK_BITRATE;
+	output->codec->thread_count = AVCODEC_SINK_THREADS;
+	output->codec->thread_type = FF_THREAD_SLICE;
+	if (!gAppOptions.offline) {
+		/* no reordering delay, every submitted frame comes out right away */
+		output->codec->max_b_frames = 0;
+		av_opt_set(output->codec->priv_data, "tune", "zerolatency", 0);
+	}
+	if (output->format->oformat->flags & AVFMT_GLOBALHEADER) {
+		output->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+	if (avcodec_open2(output->codec, codec, NULL) < 0) {
+		fprintf(stderr, "Encoder: failed to open '%s'\n", AVCODEC_SINK_CODEC);
+		return false;
+	}
+
+	output->stream = avformat_new_stream(output->format, NULL);
+	if (!output->stream
+		|| (avcodec_parameters_from_context(output->stream->codecpar, output->codec) < 0))
+	{
+		return false;
+	}
+	output->stream->time_base = output->codec->time_base;
+
+	if (!(output->format->oformat->flags & AVFMT_NOFILE)
+		&& (avio_open(&output->format->pb, outputPath, AVIO_FLAG_WRITE) < 0))
+	{
+		fprintf(stderr, "Encoder: failed to create '%s'\n", outputPath);
+		return false;
+	}
+	if (avformat_write_header(output->format, NULL) < 0) {
+		fprintf(stderr, "Encoder: failed to write the header of '%s'\n", outputPath);
+		return false;
+	}
+	output->headerWritten = true;
+
+	output->frame = av_frame_alloc();
+	output->packet = av_packet_alloc();
+	if (!output->frame || !output->packet) {
+		return false;
+	}
+	output->frame->format = AV_PIX_FMT_YUV420P;
+	output->frame->width = res.width;
+	output->frame->height = res.height;
+	output->frame->color_range = AVCOL_RANGE_MPEG;
+	output->frame->colorspace = AVCOL_SPC_BT470BG;
+	if (av_frame_get_buffer(output->frame, ENCODER_BUFFER_ALIGNMENT) < 0) {
+		return false;
+	}
+
+	output->lastPtsUs = AV_NOPTS_VALUE;
+	output->firstSourcePtsUs = AV_NOPTS_VALUE;
+	return true;
+}
+
+/**
+ * Sends a frame (or NULL to flush) and muxes whatever packets come out
+ */
+static bool EncodeAvcodecFrame(struct AvcodecOutput *output, AVFrame *frame)
+{
+	if (avcodec_send_frame(output->codec, frame) < 0) {
+		return false;
+	}
+
+	for (;;)
+	{
+		int status = avcodec_receive_packet(output->codec, output->packet);
+		if ((status == AVERROR(EAGAIN)) || (status == AVERROR_EOF)) {
+			return true;
+		}
+		if (status < 0) {
+			return false;
+		}
+		av_packet_rescale_ts(output->packet, output->codec->time_base, output->stream->time_base);
+		output->packet->stream_index = output->stream->index;
+		if (av_interleaved_write_frame(output->format, output->packet) < 0) {
+			fprintf(stderr, "Encoder: failed to write a packet\n");
+			return false;
+		}
+	}
+}
+
+/**
+ * Live timestamps advance by one period per output frame, or follow the
+ * output ticks (OUTPUT_CADENCE_SCHEDULER). Offline ones are the source
+ * PTS relative to that of the first frame set. They never go backwards.
+ */
+static int64_t GetAvcodecFramePtsUs(struct AvcodecOutput *output, const struct FrameData *frameData)
+{
+	const int64_t periodUs = 1000000 / OUTPUT_FRAMERATE;
+	int64_t ptsUs = output->nextPtsUs + (int64_t)frameData->skippedOutputFrames * periodUs;
+
+	if (gAppOptions.offline && (frameData->sourcePtsUs != AV_NOPTS_VALUE))
+	{
+		if (output->firstSourcePtsUs == AV_NOPTS_VALUE) {
+			output->firstSourcePtsUs = frameData->sourcePtsUs;
+		}
+		ptsUs = frameData->sourcePtsUs - output->firstSourcePtsUs;
+	}
+	else if (frameData->outputTickUs)
+	{
+		if (!output->firstTickUs) {
+			output->firstTickUs = frameData->outputTickUs;
+		}
+		ptsUs = (int64_t)(frameData->outputTickUs - output->firstTickUs);
+	}
+
+	if ((output->lastPtsUs != AV_NOPTS_VALUE) && (ptsUs <= output->lastPtsUs)) {
+		ptsUs = output->lastPtsUs + 1;
+	}
+	output->lastPtsUs = ptsUs;
+	output->nextPtsUs = ptsUs + periodUs;
+	return ptsUs;
+}
+
+static bool AvcodecTryGetInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	struct AvcodecOutput *output = &AvcodecOutputs[output_idx];
+	if (!output->frame || output->finished) {
+		return false;
+	}
+
+	/* the encoder may still reference the previous picture */
+	if (av_frame_make_writable(output->frame) < 0) {
+		output->framesDropped++;
+		return false;
+	}
+
+	frameData->encoderBuffer = output->frame;
+	frameData->rawPixelData = output->frame->data[0];
+	frameData->rawPixelStride = output->frame->linesize[0];
+	frameData->rawChromaData[0] = output->frame->data[1];
+	frameData->rawChromaData[1] = output->frame->data[2];
+	frameData->rawChromaStride = output->frame->linesize[1];
+	return true;
+}
+
+static void AvcodecSubmitInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	struct AvcodecOutput *output = &AvcodecOutputs[output_idx];
+	if (!frameData->encoderBuffer || output->finished) {
+		return;
+	}
+
+	output->frame->pts = GetAvcodecFramePtsUs(output, frameData);
+	if (!EncodeAvcodecFrame(output, output->frame)) {
+		output->framesDropped++;
+		return;
+	}
+	output->frameEncoded = true;
+
+	frameData->timestampsUs[LATENCY_TS_PUSHED] = GetTimestampUs();
+	LatencyStatsRecord(frameData);
+}
+
+/**
+ * The frame still holds the previous picture, which is encoded again for
+ * the tick. The encoder turns an unchanged picture into a tiny frame.
+ */
+static void AvcodecSubmitRepeatFrame(size_t output_idx, uint64_t outputTickUs)
+{
+	struct AvcodecOutput *output = &AvcodecOutputs[output_idx];
+	if (!output->frameEncoded || output->finished) {
+		return;
+	}
+
+	struct FrameData frameData = {};
+	frameData.sourcePtsUs = AV_NOPTS_VALUE;
+	frameData.outputTickUs = outputTickUs;
+	output->frame->pts = GetAvcodecFramePtsUs(output, &frameData);
+	if (!EncodeAvcodecFrame(output, output->frame)) {
+		output->framesDropped++;
+	}
+}
+
+static void FinishAvcodecOutput(struct AvcodecOutput *output)
+{
+	if (output->finished) {
+		return;
+	}
+	output->finished = true;
+
+	if (output->codec && output->headerWritten) {
+		EncodeAvcodecFrame(output, NULL);
+		av_write_trailer(output->format);
+	}
+	if (output->format && output->format->pb
+		&& !(output->format->oformat->flags & AVFMT_NOFILE))
+	{
+		avio_closep(&output->format->pb);
+	}
+}
+
+static void AvcodecSubmitEndOfStream(size_t output_idx)
+{
+	FinishAvcodecOutput(&AvcodecOutputs[output_idx]);
+}
+
+static size_t AvcodecGetDroppedFrameCount(size_t output_idx)
+{
+	return AvcodecOutputs[output_idx].framesDropped;
+}
+
+static void InitializeAvcodecSink(void)
+{
+	size_t output_idx;
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++) {
+		assert(OpenAvcodecOutput(&AvcodecOutputs[output_idx], output_idx));
+	}
+}
+
+/**
+ * Live output has no end of stream, the file is finished on exit
+ */
+static void WaitAndReleaseAvcodecSink(void)
+{
+	size_t output_idx;
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		struct AvcodecOutput *output = &AvcodecOutputs[output_idx];
+		FinishAvcodecOutput(output);
+
+		av_packet_free(&output->packet);
+		av_frame_free(&output->frame);
+		avcodec_free_context(&output->codec);
+		avformat_free_context(output->format);
+		output->format = NULL;
+	}
+}
+
+const struct EncoderSinkOps AvcodecSinkOps = {
+	.name = "avcodec",
+	.pixelFormat = ENCODER_FORMAT_I420,
+	.initialize = InitializeAvcodecSink,
+	.waitAndRelease = WaitAndReleaseAvcodecSink,
+	.tryGetInputBuffer = AvcodecTryGetInputBuffer,
+	.submitInputBuffer = AvcodecSubmitInputBuffer,
+	.submitEndOfStream = AvcodecSubmitEndOfStream,
+	.submitRepeatFrame = AvcodecSubmitRepeatFrame,
+	.getDroppedFrameCount = AvcodecGetDroppedFrameCount,
+};
@@ -1,8 +1,12 @@
 #include <gst/gst.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideopool.h>
 #include <pthread.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "defish_app.h"
 
@@ -10,7 +14,12 @@
  * Encoding pipeline queues
  *****************************************************************************/
 
-static MSG_Q_ID FrameQueuesEncoderInput[1];
+/**
+ * NUM_OUTPUT_RESOLUTIONS outputs per rig, each with its own buffer pool
+ * and queue.
+ * Buffers go back to the pool once GStreamer releases them.
+ */
+static GstBufferPool *EncoderBufferPools[NUM_OUTPUTS];
 
 /**
  * After we render the frame on the screen, we return it to the decoder
@@ -22,158 +31,753 @@ static MSG_Q_ID FrameQueuesEncoderInput[1];
  * Secondly, the frame data (AVFrame) can only be destroyed from the thread
  * in which it was created (it is not thread-safe).
  */
-static MSG_Q_ID FrameQueuesReturnedToEncoder[1];
+static MSG_Q_ID FrameQueuesReturnedToEncoder[NUM_OUTPUTS];
+
+/**
+ * The mapping of the pool buffer the renderer reads back into, held from
+ * TryGetEncoderInputBuffer until SubmitEncoderInputBuffer. Only the
+ * rendering thread touches these.
+ */
+static GstMapInfo EncoderBufferMaps[NUM_OUTPUTS];
 
 /**
- * The decoder must call this function to indicate to the rendering thread
- * that the source texture must be updated.
+ * The pools and the output contexts are created on the GStreamer thread,
+ * the renderer waits for them before touching any output
  */
-static void ReturnFrameFromEncoder(struct FrameData *frameData)
+static bool EncoderOutputsReady;
+static pthread_mutex_t EncoderOutputsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t EncoderOutputsCond = PTHREAD_COND_INITIALIZER;
+
+static void MarkEncoderOutputsReady(void)
 {
-	msgQSend(FrameQueuesEncoderInput[0],
-			(char*)frameData,
-			sizeof(struct FrameData),
-			MSG_Q_WAIT_FOREVER,
-			MSG_PRI_NORMAL);
+	pthread_mutex_lock(&EncoderOutputsMutex);
+	EncoderOutputsReady = true;
+	pthread_cond_broadcast(&EncoderOutputsCond);
+	pthread_mutex_unlock(&EncoderOutputsMutex);
+}
+
+static void WaitForEncoderOutputs(void)
+{
+	pthread_mutex_lock(&EncoderOutputsMutex);
+	while (!EncoderOutputsReady) {
+		pthread_cond_wait(&EncoderOutputsCond, &EncoderOutputsMutex);
+	}
+	pthread_mutex_unlock(&EncoderOutputsMutex);
 }
 
-static bool GetFrameForEncoder(struct FrameData *frameData)
+enum {
+	/**
+	 * The idle callback pulling rendered frames of one output waits at
+	 * most this long, so that one output can not hold up the others
+	 * sharing the main loop by more than an output frame period
+	 */
+	ENCODER_PULL_TIMEOUT_MS = (1000 / OUTPUT_FRAMERATE / NUM_OUTPUTS) ? (1000 / OUTPUT_FRAMERATE / NUM_OUTPUTS) : 1,
+};
+
+/**
+ * ENCODER_PUSH_DIRECT: hands the frame to the appsrc of the output
+ * on the calling (rendering) thread
+ */
+static void PushEncoderFrame(struct FrameData *frameData, size_t output_idx);
+
+static bool MapEncoderBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	GstBuffer *buffer = (GstBuffer*)frameData->encoderBuffer;
+	GstMapInfo *map = &EncoderBufferMaps[output_idx];
+	if (!gst_buffer_map(buffer, map, GST_MAP_WRITE))
+	{
+		fprintf(stderr, "%s: failed to map the output buffer\n", __func__);
+		gst_buffer_unref(buffer);
+		frameData->encoderBuffer = NULL;
+		return false;
+	}
+
+	GstVideoMeta *meta = gst_buffer_get_video_meta(buffer);
+	frameData->rawPixelData = map->data + (meta ? meta->offset[0] : 0);
+	frameData->rawPixelStride = meta ? (size_t)meta->stride[0]
+		: (size_t)GetOutputResolution(output_idx).width * 3;
+	return true;
+}
+
+static void UnmapEncoderBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	if (frameData->rawPixelData)
+	{
+		gst_buffer_unmap((GstBuffer*)frameData->encoderBuffer, &EncoderBufferMaps[output_idx]);
+		frameData->rawPixelData = NULL;
+	}
+}
+
+static int GetFrameForEncoder(struct FrameData *frameData, size_t output_idx, int timeout)
 {
 	int q_status = -1;
-	q_status = msgQReceive(FrameQueuesReturnedToEncoder[0],
+	q_status = msgQReceive(FrameQueuesReturnedToEncoder[output_idx],
 			(char*)frameData,
 			sizeof(struct FrameData),
-			MSG_Q_WAIT_FOREVER);
+			timeout);
 	DPRINT_RENDERER("msgQReceive status=%d", q_status);
-	return (q_status == sizeof(struct FrameData));
+	return q_status;
 }
 
 /**
  * The rendering thread calls this function after downloading the GPU texture
  * to return the AVFrame resource to the encoder thread.
  */
-void SubmitEncoderInputBuffer(struct FrameData *frameData)
+static void GstSubmitInputBuffer(struct FrameData *frameData, size_t output_idx)
 {
-	msgQSend(FrameQueuesReturnedToEncoder[0],
+	UnmapEncoderBuffer(frameData, output_idx);
+	if (ENCODER_PUSH_MODE == ENCODER_PUSH_DIRECT)
+	{
+		PushEncoderFrame(frameData, output_idx);
+		return;
+	}
+	msgQSend(FrameQueuesReturnedToEncoder[output_idx],
 		(char*)frameData,
 		sizeof(struct FrameData),
 		MSG_Q_WAIT_FOREVER,
 		MSG_PRI_NORMAL);
 }
 
-bool TryGetEncoderInputBuffer(struct FrameData *frameData)
+static void GstSubmitEndOfStream(size_t output_idx)
+{
+	struct FrameData frameData = {};
+	frameData.endOfStream = true;
+	GstSubmitInputBuffer(&frameData, output_idx);
+}
+
+/**
+ * Number of rendered frames which never reached the encoder.
+ * Only updated from the rendering thread.
+ */
+static size_t EncoderFramesDropped[NUM_OUTPUTS];
+
+/* ENCODER_PUSH_DIRECT, live: the appsrc of the output drops frames itself */
+static bool DirectPushLeaks[NUM_OUTPUTS];
+
+static void GstSubmitRepeatFrame(size_t output_idx, uint64_t outputTickUs)
+{
+	struct FrameData frameData = {};
+	frameData.repeatLast = true;
+	frameData.outputTickUs = outputTickUs;
+	frameData.sourcePtsUs = AV_NOPTS_VALUE;
+
+	if (ENCODER_PUSH_MODE == ENCODER_PUSH_DIRECT)
+	{
+		PushEncoderFrame(&frameData, output_idx);
+		return;
+	}
+
+	int q_status = msgQSend(FrameQueuesReturnedToEncoder[output_idx],
+		(char*)&frameData,
+		sizeof(struct FrameData),
+		MSG_Q_NO_WAIT,
+		MSG_PRI_NORMAL);
+	if (q_status != sizeof(struct FrameData)) {
+		EncoderFramesDropped[output_idx]++;
+	}
+}
+
+/**
+ * ENCODER_INPUT_DROP_OLDEST: take back the oldest rendered frame which
+ * GStreamer has not picked up yet and reuse its buffer for the new one.
+ */
+static bool ReclaimOldestEncoderInput(struct FrameData *frameData, size_t output_idx)
 {
 	int q_status = -1;
-	q_status = msgQReceive(FrameQueuesEncoderInput[0],
-			(char*)frameData,
-			sizeof(struct FrameData),
-			MSG_Q_WAIT_FOREVER);
-	DPRINT_RENDERER("msgQReceive status=%d", q_status);
-	return (q_status == sizeof(struct FrameData));
+	do {
+		/* repeats queued in between carry no buffer to reclaim */
+		q_status = msgQReceive(FrameQueuesReturnedToEncoder[output_idx],
+				(char*)frameData,
+				sizeof(struct FrameData),
+				MSG_Q_NO_WAIT);
+		DPRINT_RENDERER("msgQReceive status=%d", q_status);
+	} while ((q_status == sizeof(struct FrameData)) && frameData->repeatLast);
+	if (q_status != sizeof(struct FrameData))
+	{
+		return false;
+	}
+
+	/* only the buffer is reused, the renderer stamps the frame anew */
+	void *encoderBuffer = frameData->encoderBuffer;
+	memset(frameData, 0, sizeof(*frameData));
+	frameData->encoderBuffer = encoderBuffer;
+	return MapEncoderBuffer(frameData, output_idx);
 }
 
-static void InitEncoderQueues(void)
+static bool AcquireEncoderBuffer(size_t output_idx, bool wait, GstBuffer **buffer)
 {
-	FrameQueuesEncoderInput[0] = msgQCreate(
-			ENCODER_QUEUE_DEPTH,
-			sizeof(struct FrameData),
-			MSG_Q_FIFO);
-	assert(NULL != FrameQueuesEncoderInput[0]);
+	GstBufferPoolAcquireParams params = {};
+	if (!wait) {
+		params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+	}
+	return GST_FLOW_OK == gst_buffer_pool_acquire_buffer(
+			EncoderBufferPools[output_idx], buffer, &params);
+}
 
-	FrameQueuesReturnedToEncoder[0] = msgQCreate(
-			ENCODER_QUEUE_DEPTH,
-			sizeof(struct FrameData),
-			MSG_Q_FIFO);
-	assert(NULL != FrameQueuesReturnedToEncoder[0]);
+static bool GstTryGetInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	GstBuffer *buffer = NULL;
+	WaitForEncoderOutputs();
 
-	size_t i;
-	for (i = 0; i < ENCODER_QUEUE_DEPTH; i++)
+	/* offline, every frame set must reach the output file */
+	bool acquired = AcquireEncoderBuffer(output_idx, gAppOptions.offline, &buffer);
+	if (!acquired && !gAppOptions.offline
+		&& (ENCODER_INPUT_POLICY == ENCODER_INPUT_BLOCK_DEADLINE))
 	{
-		void *buffer = malloc(OUTPUT_WIDTH * OUTPUT_HEIGHT * 3);
-		assert(NULL != buffer);
-		struct FrameData frameData = {};
-		frameData.rawPixelData = buffer;
-		SubmitEncoderInputBuffer(&frameData);
+		/* the pool has no timed acquire, poll it until the deadline */
+		uint64_t deadlineUs = GetTimestampUs() + ENCODER_INPUT_DEADLINE_MS * 1000;
+		while (!acquired && (GetTimestampUs() < deadlineUs))
+		{
+			g_usleep(1000);
+			acquired = AcquireEncoderBuffer(output_idx, false, &buffer);
+		}
+	}
+	if (acquired)
+	{
+		frameData->encoderBuffer = buffer;
+		return MapEncoderBuffer(frameData, output_idx);
+	}
+	if (gAppOptions.offline)
+	{
+		return false;
+	}
+
+	/**
+	 * Either way one output frame is lost: the one we are about
+	 * to render or the oldest one queued for the encoder.
+	 * When every buffer is already inside GStreamer there is nothing
+	 * to reclaim and DROP_OLDEST degrades to DROP_NEWEST.
+	 */
+	EncoderFramesDropped[output_idx]++;
+	if (ENCODER_INPUT_POLICY == ENCODER_INPUT_DROP_OLDEST)
+	{
+		return ReclaimOldestEncoderInput(frameData, output_idx);
+	}
+	return false;
+}
+
+static size_t GstGetDroppedFrameCount(size_t output_idx)
+{
+	return EncoderFramesDropped[output_idx];
+}
+
+/******************************************************************************
+ * Encoder buffer memory
+ *****************************************************************************/
+
+/**
+ * GstMemory backed by AllocStageBuffer, so that the pool buffers are
+ * bound to the NUMA node of the encode stage (STAGE_PLACEMENT_INITIALIZER)
+ * rather than to whichever node the renderer writes them from.
+ * Shared sub-memories, which gst_buffer_copy makes for the cadence
+ * repeats, point into the pages of their parent.
+ */
+typedef struct {
+	GstMemory mem;
+	guint8 *data;
+	gsize allocSize;
+} StageMemory;
+
+typedef struct {
+	GstAllocator parent;
+} StageAllocator;
+
+typedef struct {
+	GstAllocatorClass parent_class;
+} StageAllocatorClass;
+
+static GType stage_allocator_get_type(void);
+G_DEFINE_TYPE(StageAllocator, stage_allocator, GST_TYPE_ALLOCATOR);
+
+static GstMemory *stage_allocator_alloc(GstAllocator *allocator, gsize size,
+		GstAllocationParams *params)
+{
+	gsize maxsize = size + params->prefix + params->padding;
+	gsize pageSize = sysconf(_SC_PAGESIZE);
+	gsize allocSize = ((maxsize + pageSize - 1) / pageSize) * pageSize;
+
+	/* mmap hands out whole pages, which covers any alignment asked for */
+	assert(params->align < pageSize);
+	guint8 *data = AllocStageBuffer(PIPELINE_STAGE_ENCODE, allocSize);
+	if (!data) {
+		return NULL;
+	}
+
+	StageMemory *mem = g_slice_new(StageMemory);
+	gst_memory_init(GST_MEMORY_CAST(mem), params->flags, allocator, NULL,
+			maxsize, params->align, params->prefix, size);
+	mem->data = data;
+	mem->allocSize = allocSize;
+	return GST_MEMORY_CAST(mem);
+}
+
+static void stage_allocator_free(GstAllocator *allocator, GstMemory *memory)
+{
+	StageMemory *mem = (StageMemory*)memory;
+	if (!memory->parent) {
+		FreeStageBuffer(mem->data, mem->allocSize);
 	}
+	g_slice_free(StageMemory, mem);
+}
+
+static gpointer stage_memory_map(GstMemory *memory, gsize maxsize, GstMapFlags flags)
+{
+	return ((StageMemory*)memory)->data;
+}
+
+static void stage_memory_unmap(GstMemory *memory)
+{
+}
+
+static GstMemory *stage_memory_share(GstMemory *memory, gssize offset, gssize size)
+{
+	GstMemory *parent = memory->parent ? memory->parent : memory;
+	if (size == -1) {
+		size = memory->size - offset;
+	}
+
+	StageMemory *sub = g_slice_new(StageMemory);
+	gst_memory_init(GST_MEMORY_CAST(sub),
+			GST_MINI_OBJECT_FLAGS(parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+			memory->allocator, parent, memory->maxsize, memory->align,
+			memory->offset + offset, size);
+	sub->data = ((StageMemory*)memory)->data;
+	sub->allocSize = 0;
+	return GST_MEMORY_CAST(sub);
+}
+
+static void stage_allocator_init(StageAllocator *self)
+{
+	GstAllocator *allocator = GST_ALLOCATOR_CAST(self);
+	allocator->mem_type = "StageMemory";
+	allocator->mem_map = stage_memory_map;
+	allocator->mem_unmap = stage_memory_unmap;
+	allocator->mem_share = stage_memory_share;
+}
+
+static void stage_allocator_class_init(StageAllocatorClass *klass)
+{
+	GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS(klass);
+	allocator_class->alloc = stage_allocator_alloc;
+	allocator_class->free = stage_allocator_free;
+}
+
+/**
+ * RGB buffers for the output caps with GstVideoMeta, the rows aligned to
+ * ENCODER_BUFFER_ALIGNMENT. The rows are padded by whole pixels, so that
+ * the readback can express the stride as GL_PACK_ROW_LENGTH. Downstream
+ * sees the stride through the meta whenever it differs from the default.
+ */
+static GstBufferPool *CreateEncoderBufferPool(size_t output_idx)
+{
+	struct OutputResolution res = GetOutputResolution(output_idx);
+	GstVideoInfo info;
+	gst_video_info_init(&info);
+	gst_video_info_set_format(&info, GST_VIDEO_FORMAT_RGB, res.width, res.height);
+	GST_VIDEO_INFO_FPS_N(&info) = OUTPUT_FRAMERATE;
+	GST_VIDEO_INFO_FPS_D(&info) = 1;
+
+	GstVideoAlignment align;
+	gst_video_alignment_reset(&align);
+	align.padding_right = ((res.width + ENCODER_BUFFER_ALIGNMENT - 1)
+			/ ENCODER_BUFFER_ALIGNMENT) * ENCODER_BUFFER_ALIGNMENT - res.width;
+	align.stride_align[0] = ENCODER_BUFFER_ALIGNMENT - 1;
+	gst_video_info_align(&info, &align);
+	assert((GST_VIDEO_INFO_PLANE_STRIDE(&info, 0) % 3) == 0);
+
+	GstCaps *caps = gst_video_info_to_caps(&info);
+	GstBufferPool *pool = gst_video_buffer_pool_new();
+	GstStructure *config = gst_buffer_pool_get_config(pool);
+	gst_buffer_pool_config_set_params(config, caps,
+			GST_VIDEO_INFO_SIZE(&info),
+			ENCODER_QUEUE_DEPTH,
+			ENCODER_QUEUE_DEPTH);
+	gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+	gst_buffer_pool_config_add_option(config, GST_BUFFER_POOL_OPTION_VIDEO_ALIGNMENT);
+	gst_buffer_pool_config_set_video_alignment(config, &align);
+
+	/* the config and then the pool hold their own references */
+	GstAllocator *allocator = gst_object_ref_sink(
+			g_object_new(stage_allocator_get_type(), NULL));
+	gst_buffer_pool_config_set_allocator(config, allocator, NULL);
+	gst_object_unref(allocator);
+
+	assert(gst_buffer_pool_set_config(pool, config));
+	assert(gst_buffer_pool_set_active(pool, TRUE));
+	gst_caps_unref(caps);
+	return pool;
+}
+
+/**
+ * Bytes of one pool buffer, the padding of the rows included, which is
+ * what the appsrc queue limits count
+ */
+static guint64 GetEncoderBufferBytes(size_t output_idx)
+{
+	guint size = 0;
+	GstStructure *config = gst_buffer_pool_get_config(EncoderBufferPools[output_idx]);
+	gst_buffer_pool_config_get_params(config, NULL, &size, NULL, NULL);
+	gst_structure_free(config);
+	return size;
+}
+
+static void InitEncoderQueues(size_t output_idx)
+{
+	EncoderBufferPools[output_idx] = CreateEncoderBufferPool(output_idx);
+	assert(NULL != EncoderBufferPools[output_idx]);
+
+	/* room for a repeat per rendered frame (OUTPUT_CADENCE_SCHEDULER) */
+	FrameQueuesReturnedToEncoder[output_idx] = msgQCreate(
+			2 * ENCODER_QUEUE_DEPTH,
+			sizeof(struct FrameData),
+			MSG_Q_FIFO);
+	assert(NULL != FrameQueuesReturnedToEncoder[output_idx]);
 }
 
 /******************************************************************************
  * Bridging the GStreamer and the renderer.
  *****************************************************************************/
-static void *get_next_image(void)
+enum {
+	NEXT_IMAGE_OK,
+	NEXT_IMAGE_REPEAT,
+	NEXT_IMAGE_NONE_YET,
+	NEXT_IMAGE_END,
+};
+
+static int get_next_image(size_t output_idx, struct FrameData *frameData, int timeout)
 {
-	void *fbData = NULL;
-	struct FrameData frameData = {};
-	bool ok = false;
+	int result = NEXT_IMAGE_END;
 
 	DPRINT_ENCODER("+++");
-	ok = GetFrameForEncoder(&frameData);
+	int q_status = GetFrameForEncoder(frameData, output_idx, timeout);
 	DPRINT_ENCODER("---");
-	if (!ok)
+	if ((q_status != sizeof(struct FrameData)) && (timeout != MSG_Q_WAIT_FOREVER))
+	{
+		result = NEXT_IMAGE_NONE_YET;
+		goto done;
+	}
+	if (q_status != sizeof(struct FrameData))
 	{
 		fprintf(stderr, "%s: failed to obtain the buffer for the encoder\n", __func__);
 		goto done;
 	}
-	fbData = frameData.rawPixelData;
+	if (frameData->endOfStream)
+	{
+		DPRINT_ENCODER("end of stream");
+		goto done;
+	}
+	if (frameData->repeatLast) {
+		result = NEXT_IMAGE_REPEAT;
+		goto done;
+	}
+	if (NULL != frameData->encoderBuffer) {
+		result = NEXT_IMAGE_OK;
+	}
 
 done:
-	return fbData;
+	return result;
 }
 
 /******************************************************************************
  * Generic GStreamer appsrc pipeline
  *****************************************************************************/
 typedef struct {
+    size_t output_idx;
+    GstElement *pipeline;
     GstClockTime timestamp;
+
+    /**
+     * Offline mode: output timestamps are the source PTS relative
+     * to that of the first frame set
+     */
+    int64_t firstSourcePtsUs;
+
+    /**
+     * Output cadence: pipeline running time minus GetTimestampUs() in
+     * nanoseconds, sampled once the pipeline has a clock, and the last
+     * pushed buffer which a tick without changes repeats.
+     * The repeated buffer keeps one encoder buffer out of the pool.
+     */
+    bool tickClockOffsetValid;
+    gint64 tickClockOffsetNs;
+    GstBuffer *lastBuffer;
+
     guint sourceid;
     GstElement *appsrc;
+
+    /**
+     * Tags GstReferenceTimestampMeta carrying the CLOCK_MONOTONIC demux
+     * time of the source frame, so that downstream can measure latency
+     */
+    GstCaps *sourceTimestampCaps;
 } StreamContext;
 
-static StreamContext *stream_context_new(GstElement *appsrc)
+static StreamContext *stream_context_new(size_t output_idx, GstElement *pipeline, GstElement *appsrc)
 {
     StreamContext *ctx = g_new0(StreamContext, 1);
+    ctx->output_idx = output_idx;
+    ctx->pipeline = pipeline;
     ctx->timestamp = 0;
+    ctx->firstSourcePtsUs = AV_NOPTS_VALUE;
     ctx->sourceid = 0;
     ctx->appsrc = appsrc;
+    ctx->sourceTimestampCaps = gst_caps_new_empty_simple("timestamp/x-defish-source-monotonic");
     return ctx;
 }
 
-static void encoder_buffer_destroy_notify(gpointer data)
+static bool UseOutputCadence(void)
 {
-	DPRINT_ENCODER("data=%p", data);
-	struct FrameData frameData = {};
-	frameData.rawPixelData = data;
-	ReturnFrameFromEncoder(&frameData);
+	return OUTPUT_CADENCE_SCHEDULER && !gAppOptions.offline;
 }
 
-static gboolean read_data(StreamContext *ctx)
+/**
+ * Running time of the output tick on the pipeline clock, or
+ * GST_CLOCK_TIME_NONE while the pipeline has no clock yet.
+ * The offset is only sampled once so that the tick period is kept
+ * exactly, both clocks advance at the same rate.
+ */
+static GstClockTime OutputTickRunningTime(StreamContext *ctx, uint64_t tickUs)
 {
-    static const gsize size = OUTPUT_WIDTH * OUTPUT_HEIGHT * 3;
+	if (!ctx->tickClockOffsetValid)
+	{
+		GstClock *clock = gst_element_get_clock(ctx->pipeline);
+		if (!clock) {
+			return GST_CLOCK_TIME_NONE;
+		}
+		GstClockTime now = gst_clock_get_time(clock);
+		uint64_t nowUs = GetTimestampUs();
+		gst_object_unref(clock);
+
+		ctx->tickClockOffsetNs = (gint64)(now - gst_element_get_base_time(ctx->pipeline))
+			- (gint64)(nowUs * GST_USECOND);
+		ctx->tickClockOffsetValid = true;
+	}
+
+	gint64 runningTime = (gint64)(tickUs * GST_USECOND) + ctx->tickClockOffsetNs;
+	return (runningTime > 0) ? (GstClockTime)runningTime : 0;
+}
+
+/**
+ * Stamps a buffer for an output tick, and returns false when it would
+ * not come after the previous one
+ */
+static bool StampOutputTick(StreamContext *ctx, GstBuffer *buffer, uint64_t tickUs)
+{
+	GstClockTime pts = OutputTickRunningTime(ctx, tickUs);
+	if (pts == GST_CLOCK_TIME_NONE) {
+		pts = ctx->timestamp;
+	}
+	if (ctx->lastBuffer && (pts <= GST_BUFFER_PTS(ctx->lastBuffer))) {
+		return false;
+	}
+	GST_BUFFER_PTS(buffer) = pts;
+	GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale_int(1, GST_SECOND, OUTPUT_FRAMERATE);
+	ctx->timestamp = pts + GST_BUFFER_DURATION(buffer);
+	return true;
+}
 
-    guchar *pixels = (guchar*)get_next_image();
-	if (!pixels)
+/**
+ * A leaky appsrc drops a frame, the pushed one or the oldest queued,
+ * when its queue is full at the push. The level is read just before
+ * the push, a frame the streaming thread takes meanwhile may make this
+ * count one drop too many.
+ */
+static void CountLeakedFrame(StreamContext *ctx)
+{
+	GstAppSrc *appsrc = GST_APP_SRC(ctx->appsrc);
+	if (DirectPushLeaks[ctx->output_idx]
+		&& (gst_app_src_get_current_level_bytes(appsrc) >= gst_app_src_get_max_bytes(appsrc)))
 	{
-		return FALSE;
+		EncoderFramesDropped[ctx->output_idx]++;
 	}
+}
 
-    GstBuffer *buffer = gst_buffer_new_wrapped_full(
-			0,
-			pixels,
-			size,
-			0,
-			size,
-			pixels,
-			encoder_buffer_destroy_notify);
+static void repeat_frame(StreamContext *ctx, struct FrameData *frameData)
+{
+	if (!ctx->lastBuffer) {
+		return;
+	}
 
+	/* shares the pixels of the previous buffer, only the metadata is new */
+	GstBuffer *buffer = gst_buffer_copy(ctx->lastBuffer);
+	if (!StampOutputTick(ctx, buffer, frameData->outputTickUs)) {
+		gst_buffer_unref(buffer);
+		return;
+	}
+
+	gst_buffer_unref(ctx->lastBuffer);
+	ctx->lastBuffer = gst_buffer_ref(buffer);
+	CountLeakedFrame(ctx);
+	gst_app_src_push_buffer(GST_APP_SRC(ctx->appsrc), buffer);
+}
+
+static void push_frame(StreamContext *ctx, struct FrameData *frameData)
+{
+	/* the frame owns a reference to the pool buffer, pushed on below */
+	GstBuffer *buffer = (GstBuffer*)frameData->encoderBuffer;
+	frameData->encoderBuffer = NULL;
+
+	/* output frames skipped by change detection still take their slot */
+	ctx->timestamp += frameData->skippedOutputFrames
+		* gst_util_uint64_scale_int(1, GST_SECOND, OUTPUT_FRAMERATE);
     GST_BUFFER_PTS(buffer) = ctx->timestamp;
     GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale_int(1, GST_SECOND, OUTPUT_FRAMERATE);
-    ctx->timestamp += GST_BUFFER_DURATION(buffer);
+	if (gAppOptions.offline && (frameData->sourcePtsUs != AV_NOPTS_VALUE))
+	{
+		if (ctx->firstSourcePtsUs == AV_NOPTS_VALUE) {
+			ctx->firstSourcePtsUs = frameData->sourcePtsUs;
+		}
+		GST_BUFFER_PTS(buffer) = (frameData->sourcePtsUs - ctx->firstSourcePtsUs) * GST_USECOND;
+		GST_BUFFER_DURATION(buffer) = GST_CLOCK_TIME_NONE;
+		ctx->timestamp = GST_BUFFER_PTS(buffer);
+	}
+	/**
+	 * Without a running time for the tick, StampOutputTick falls back to
+	 * ctx->timestamp, which must still be the pts of this frame then
+	 */
+	if (UseOutputCadence() && frameData->outputTickUs)
+	{
+		if (!StampOutputTick(ctx, buffer, frameData->outputTickUs))
+		{
+			/* the buffer goes back to the pool */
+			gst_buffer_unref(buffer);
+			return;
+		}
+	}
+	else
+	{
+		ctx->timestamp += gst_util_uint64_scale_int(1, GST_SECOND, OUTPUT_FRAMERATE);
+	}
 
-	GstFlowReturn ret = TRUE;
-	g_signal_emit_by_name(ctx->appsrc, "push-buffer", buffer, &ret);
-	gst_buffer_unref(buffer);
+	if (frameData->timestampsUs[LATENCY_TS_DEMUX])
+	{
+		gst_buffer_add_reference_timestamp_meta(buffer,
+				ctx->sourceTimestampCaps,
+				frameData->timestampsUs[LATENCY_TS_DEMUX] * GST_USECOND,
+				GST_CLOCK_TIME_NONE);
+	}
 
-    return TRUE;
+	if (UseOutputCadence())
+	{
+		if (ctx->lastBuffer) {
+			gst_buffer_unref(ctx->lastBuffer);
+		}
+		ctx->lastBuffer = gst_buffer_ref(buffer);
+	}
+	/* takes over the reference, may block offline while the queue is full */
+	CountLeakedFrame(ctx);
+	gst_app_src_push_buffer(GST_APP_SRC(ctx->appsrc), buffer);
+
+	frameData->timestampsUs[LATENCY_TS_PUSHED] = GetTimestampUs();
+	LatencyStatsRecord(frameData);
+}
+
+/**
+ * ENCODER_PUSH_DIRECT: the contexts of the outputs, set before the
+ * outputs are marked ready. Only the rendering thread pushes into them.
+ */
+static StreamContext *OutputContexts[NUM_OUTPUTS];
+
+static StreamContext *GetOutputContext(size_t output_idx)
+{
+	WaitForEncoderOutputs();
+	return OutputContexts[output_idx];
+}
+
+static void PushEncoderFrame(struct FrameData *frameData, size_t output_idx)
+{
+	StreamContext *ctx = GetOutputContext(output_idx);
+	if (frameData->endOfStream) {
+		gst_app_src_end_of_stream(GST_APP_SRC(ctx->appsrc));
+	} else if (frameData->repeatLast) {
+		repeat_frame(ctx, frameData);
+	} else if (frameData->encoderBuffer) {
+		push_frame(ctx, frameData);
+	}
+}
+
+static gboolean read_data(StreamContext *ctx)
+{
+	struct FrameData frameData = {};
+	switch (get_next_image(ctx->output_idx, &frameData, ENCODER_PULL_TIMEOUT_MS))
+	{
+	case NEXT_IMAGE_OK:
+		push_frame(ctx, &frameData);
+		return TRUE;
+	case NEXT_IMAGE_REPEAT:
+		repeat_frame(ctx, &frameData);
+		return TRUE;
+	case NEXT_IMAGE_NONE_YET:
+		/* let the other outputs run, try again on the next idle */
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static void wait_for_eos(StreamContext *ctx)
+{
+	/* wait until the muxer has finished the file */
+	GstBus *bus = gst_element_get_bus(ctx->pipeline);
+	GstMessage *msg = gst_bus_timed_pop_filtered(bus,
+			GST_CLOCK_TIME_NONE,
+			GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	if (msg && (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR))
+	{
+		GError *err = NULL;
+		gst_message_parse_error(msg, &err, NULL);
+		fprintf(stderr, "Encoder: %s\n", err ? err->message : "error");
+		if (err) {
+			g_error_free(err);
+		}
+	}
+	if (msg) {
+		gst_message_unref(msg);
+	}
+	gst_object_unref(bus);
+}
+
+/**
+ * Offline mode: instead of the need-data/enough-data idle callback,
+ * push every rendered frame as soon as it arrives. The appsrc blocks
+ * while its queue is full, which holds back the renderer in turn.
+ *
+ * The renderer produces the frames of all outputs in output order (rig
+ * after rig, largest resolution first), so taking them in the same order
+ * never waits for the wrong output.
+ */
+static void run_offline(StreamContext *ctxs[NUM_OUTPUTS])
+{
+	bool active[NUM_OUTPUTS];
+	size_t numActive = NUM_OUTPUTS;
+	size_t output_idx;
+
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++) {
+		active[output_idx] = true;
+	}
+
+	while (numActive)
+	{
+		for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+		{
+			struct FrameData frameData = {};
+			if (!active[output_idx]) {
+				continue;
+			}
+			if (NEXT_IMAGE_OK == get_next_image(output_idx, &frameData, MSG_Q_WAIT_FOREVER))
+			{
+				push_frame(ctxs[output_idx], &frameData);
+				continue;
+			}
+			gst_app_src_end_of_stream(GST_APP_SRC(ctxs[output_idx]->appsrc));
+			active[output_idx] = false;
+			numActive--;
+		}
+	}
+
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++) {
+		wait_for_eos(ctxs[output_idx]);
+	}
 }
 
 static void enough_data(GstElement *appsrc, StreamContext *ctx)
@@ -193,39 +797,254 @@ static void need_data(GstElement *appsrc, guint size, StreamContext *ctx)
 
 static GMainLoop *loop;
 
-static void *threadTopViewGStreamerServer(void *arg)
+/**
+ * ENCODER_PUSH_DIRECT: bounds the appsrc queue to half of the encoder
+ * buffers, so that it leaks before the renderer runs out of buffers.
+ * The leak direction follows ENCODER_INPUT_POLICY, the deadline policy
+ * is left to the buffer pool. leaky-type needs GStreamer 1.20, older
+ * versions only emit enough-data and keep queueing.
+ */
+static void ConfigureDirectPush(GstElement *appsrc, size_t output_idx)
 {
-	int argc = 0;
-	char **argv = NULL;
-    gst_init(&argc, &argv);
+	guint64 frameBytes = GetEncoderBufferBytes(output_idx);
+	guint64 maxFrames = (ENCODER_QUEUE_DEPTH > 2) ? (ENCODER_QUEUE_DEPTH / 2) : 1;
 
-	InitEncoderQueues();
-    loop = g_main_loop_new(NULL, FALSE);
+	g_object_set(G_OBJECT(appsrc),
+			"block", FALSE,
+			"max-bytes", maxFrames * frameBytes,
+			NULL);
+
+	const char *leakyType = NULL;
+	if (ENCODER_INPUT_POLICY == ENCODER_INPUT_DROP_NEWEST) {
+		leakyType = "upstream";
+	} else if (ENCODER_INPUT_POLICY == ENCODER_INPUT_DROP_OLDEST) {
+		leakyType = "downstream";
+	}
+	if (leakyType && g_object_class_find_property(G_OBJECT_GET_CLASS(appsrc), "leaky-type"))
+	{
+		gst_util_set_object_arg(G_OBJECT(appsrc), "leaky-type", leakyType);
+		DirectPushLeaks[output_idx] = true;
+	}
+}
+
+/**
+ * Frames dropped by the queue of each live branch, counted from the
+ * "overrun" signal of the leaky queues on the GStreamer threads
+ */
+enum {
+	LIVE_BRANCH_INDEX_FILE,
+	LIVE_BRANCH_INDEX_RTP,
+	LIVE_BRANCH_INDEX_PREVIEW,
+	NUM_LIVE_BRANCHES,
+};
+
+static const char *LiveBranchNames[NUM_LIVE_BRANCHES] = {
+	"file",
+	"rtp",
+	"preview",
+};
+
+static volatile gint LiveBranchOverruns[NUM_OUTPUTS][NUM_LIVE_BRANCHES];
+
+static void AppendLiveBranchQueue(GString *pipeline, const char *tee, size_t branch)
+{
+	g_string_append_printf(pipeline,
+			" %s. ! queue name=branch_%s leaky=downstream"
+			" max-size-buffers=%d max-size-bytes=0 max-size-time=0 !",
+			tee, LiveBranchNames[branch], LIVE_BRANCH_QUEUE_BUFFERS);
+}
+
+/**
+ * The elements of GetGstPipelineString between the appsrc and the sink,
+ * i.e. the conversion and the encoder which the encoded branches share
+ */
+static gchar *GetLiveEncodeChain(void)
+{
+	gchar **elements = g_strsplit(GetGstPipelineString(), " ! ", -1);
+	guint count = g_strv_length(elements);
+	assert(count >= 3);
+
+	g_free(elements[count - 1]);
+	elements[count - 1] = NULL;
+	gchar *chain = g_strjoinv(" ! ", elements + 1);
+	g_strfreev(elements);
+	return chain;
+}
+
+/**
+ * appsrc ! tee name=raw ! queue ! <encode chain> ! tee name=enc
+ * with one leaky branch per enabled output after the matching tee
+ */
+static gchar *BuildLivePipelineString(const char *outputPath, size_t output_idx)
+{
+	if (!LIVE_OUTPUT_BRANCHES) {
+		return g_strdup_printf(GetGstPipelineString(), outputPath);
+	}
+
+	gchar *encodeChain = GetLiveEncodeChain();
+	GString *pipeline = g_string_new(NULL);
+	g_string_append_printf(pipeline,
+			"appsrc name=imagesrc ! tee name=raw allow-not-linked=true"
+			" raw. ! queue ! %s ! tee name=enc allow-not-linked=true", encodeChain);
+	g_free(encodeChain);
+
+	if (LIVE_OUTPUT_BRANCHES & LIVE_BRANCH_FILE)
+	{
+		AppendLiveBranchQueue(pipeline, "enc", LIVE_BRANCH_INDEX_FILE);
+		g_string_append_printf(pipeline, " filesink location=%s async=false", outputPath);
+	}
+	if (LIVE_OUTPUT_BRANCHES & LIVE_BRANCH_RTP)
+	{
+		AppendLiveBranchQueue(pipeline, "enc", LIVE_BRANCH_INDEX_RTP);
+		g_string_append_printf(pipeline,
+				" " LIVE_GST_RTP_PAYLOADER " ! udpsink host=%s port=%d sync=false async=false",
+				LIVE_RTP_HOST, LIVE_RTP_PORT + 2 * (int)output_idx);
+	}
+	if (LIVE_OUTPUT_BRANCHES & LIVE_BRANCH_PREVIEW)
+	{
+		AppendLiveBranchQueue(pipeline, "raw", LIVE_BRANCH_INDEX_PREVIEW);
+		g_string_append(pipeline, " videoconvert ! autovideosink sync=false async=false");
+	}
+	return g_string_free(pipeline, FALSE);
+}
+
+static void live_branch_overrun(GstElement *queue, gpointer data)
+{
+	g_atomic_int_inc((gint*)data);
+}
+
+static void ConnectLiveBranchCounters(GstElement *pipeline, size_t output_idx)
+{
+	size_t branch;
+	for (branch = 0; branch < NUM_LIVE_BRANCHES; branch++)
+	{
+		gchar *name = g_strdup_printf("branch_%s", LiveBranchNames[branch]);
+		GstElement *queue = gst_bin_get_by_name(GST_BIN(pipeline), name);
+		g_free(name);
+		if (!queue) {
+			continue;
+		}
+		g_signal_connect(queue, "overrun", G_CALLBACK(live_branch_overrun),
+				(gpointer)&LiveBranchOverruns[output_idx][branch]);
+		gst_object_unref(queue);
+	}
+}
+
+static void DumpLiveBranchCounters(void)
+{
+	size_t output_idx;
+	size_t branch;
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++) {
+		for (branch = 0; branch < NUM_LIVE_BRANCHES; branch++) {
+			if (LIVE_OUTPUT_BRANCHES & (1 << branch)) {
+				fprintf(stderr, "Encoder[%zu]: %s branch dropped %d times\n",
+						output_idx, LiveBranchNames[branch],
+						g_atomic_int_get(&LiveBranchOverruns[output_idx][branch]));
+			}
+		}
+	}
+}
 
-    GstElement *pipeline = gst_parse_launch(GetGstPipelineString(), NULL);
+static StreamContext *create_output(size_t output_idx)
+{
+	struct OutputResolution res = GetOutputResolution(output_idx);
+	char outputPath[512];
+	GetOutputPath(outputPath, sizeof(outputPath),
+			gAppOptions.offline ? gAppOptions.outputPath : LIVE_DEFAULT_OUTPUT,
+			output_idx);
+
+	gchar *pipelineString = gAppOptions.offline
+		? g_strdup_printf(GetOfflineGstPipelineFormat(), outputPath)
+		: BuildLivePipelineString(outputPath, output_idx);
+    GstElement *pipeline = gst_parse_launch(pipelineString, NULL);
+	g_free(pipelineString);
+	if (!gAppOptions.offline) {
+		ConnectLiveBranchCounters(pipeline, output_idx);
+	}
     GstElement *appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "imagesrc");
 
     gst_util_set_object_arg(G_OBJECT(appsrc), "format", "time");
     gst_app_src_set_caps(GST_APP_SRC(appsrc), gst_caps_new_simple("video/x-raw",
         "format", G_TYPE_STRING, "RGB",
-        "width", G_TYPE_INT, OUTPUT_WIDTH,
-        "height", G_TYPE_INT, OUTPUT_HEIGHT,
+        "width", G_TYPE_INT, res.width,
+        "height", G_TYPE_INT, res.height,
         "framerate", GST_TYPE_FRACTION, OUTPUT_FRAMERATE, 1, NULL));
 
-    StreamContext *ctx = stream_context_new(appsrc);
+    StreamContext *ctx = stream_context_new(output_idx, pipeline, appsrc);
+
+	if (gAppOptions.offline)
+	{
+		g_object_set(G_OBJECT(appsrc),
+				"block", TRUE,
+				"max-bytes", (guint64)ENCODER_QUEUE_DEPTH * GetEncoderBufferBytes(output_idx),
+				NULL);
+	}
+	else
+	{
+		if (UseOutputCadence()) {
+			g_object_set(G_OBJECT(appsrc), "is-live", TRUE, NULL);
+		}
+		if (ENCODER_PUSH_MODE == ENCODER_PUSH_DIRECT) {
+			ConfigureDirectPush(appsrc, output_idx);
+		} else {
+			g_signal_connect(appsrc, "need-data", G_CALLBACK(need_data), ctx);
+			g_signal_connect(appsrc, "enough-data", G_CALLBACK(enough_data), ctx);
+		}
+	}
+	gst_element_set_state(pipeline, GST_STATE_PLAYING);
+	return ctx;
+}
+
+static void *threadTopViewGStreamerServer(void *arg)
+{
+	int argc = 0;
+	char **argv = NULL;
+	StreamContext *ctxs[NUM_OUTPUTS] = {};
+	size_t output_idx;
+
+	/* the streaming threads GStreamer creates inherit this */
+	ApplyStagePlacement(PIPELINE_STAGE_ENCODE);
+    gst_init(&argc, &argv);
 
-    g_signal_connect(appsrc, "need-data", G_CALLBACK(need_data), ctx);
-    g_signal_connect(appsrc, "enough-data", G_CALLBACK(enough_data), ctx);
+    loop = g_main_loop_new(NULL, FALSE);
 
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+	/* every output is driven from this thread and its main loop */
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		InitEncoderQueues(output_idx);
+		ctxs[output_idx] = create_output(output_idx);
+	}
 
-    g_main_loop_run(loop);
+	memcpy(OutputContexts, ctxs, sizeof(OutputContexts));
+	MarkEncoderOutputsReady();
+
+	if (gAppOptions.offline && (ENCODER_PUSH_MODE == ENCODER_PUSH_DIRECT)) {
+		/* the renderer pushes the frames and the end of stream */
+		for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++) {
+			wait_for_eos(ctxs[output_idx]);
+		}
+	} else if (gAppOptions.offline) {
+		run_offline(ctxs);
+	} else {
+		g_main_loop_run(loop);
+	}
 	DPRINT_ENCODER("finished");
 
-    gst_element_set_state(pipeline, GST_STATE_NULL);
-	DPRINT_ENCODER("STATE_NULL");
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		StreamContext *ctx = ctxs[output_idx];
+		gst_element_set_state(ctx->pipeline, GST_STATE_NULL);
+		DPRINT_ENCODER("STATE_NULL");
 
-    g_free(ctx);
+		if (ctx->lastBuffer) {
+			gst_buffer_unref(ctx->lastBuffer);
+		}
+		gst_caps_unref(ctx->sourceTimestampCaps);
+		g_free(ctx);
+
+		gst_buffer_pool_set_active(EncoderBufferPools[output_idx], FALSE);
+		gst_object_unref(EncoderBufferPools[output_idx]);
+	}
     g_free(loop);
 
     return NULL;
@@ -233,7 +1052,7 @@ static void *threadTopViewGStreamerServer(void *arg)
 
 static pthread_t ServerThreadHandle;
 
-void InitializeGStreamerServer(void)
+static void InitializeGStreamerServer(void)
 {
 	assert(0 == pthread_create(&ServerThreadHandle,
 				NULL,
@@ -241,9 +1060,28 @@ void InitializeGStreamerServer(void)
 				NULL));
 }
 
-void WaitAndReleaseGStreamerServer(void)
+static void WaitAndReleaseGStreamerServer(void)
 {
-	pthread_kill(ServerThreadHandle, SIGKILL);
+	if (!gAppOptions.offline) {
+		DumpLiveBranchCounters();
+	}
+
+	/* offline, the thread ends by itself once the file is complete */
+	if (!gAppOptions.offline) {
+		pthread_kill(ServerThreadHandle, SIGKILL);
+	}
 	void *retval = NULL;
 	pthread_join(ServerThreadHandle, &retval);
 }
+
+const struct EncoderSinkOps GStreamerSinkOps = {
+	.name = "gstreamer",
+	.pixelFormat = ENCODER_FORMAT_RGB24,
+	.initialize = InitializeGStreamerServer,
+	.waitAndRelease = WaitAndReleaseGStreamerServer,
+	.tryGetInputBuffer = GstTryGetInputBuffer,
+	.submitInputBuffer = GstSubmitInputBuffer,
+	.submitEndOfStream = GstSubmitEndOfStream,
+	.submitRepeatFrame = GstSubmitRepeatFrame,
+	.getDroppedFrameCount = GstGetDroppedFrameCount,
+};
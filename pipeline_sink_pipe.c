@@ -0,0 +1,672 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "defish_app.h"
+
+/******************************************************************************
+ * Raw frame streaming sink (ENCODER_SINK_PIPE)
+ *
+ * Every output is written uncompressed, as Y4M or as bare I420 planes, to
+ * stdout or to a named pipe for another program to read. The renderer
+ * reads back into page-aligned frame buffers, and a writer thread per
+ * output hands them to the pipe with vmsplice, so the kernel references
+ * the pages instead of copying them. A buffer is only reused after the
+ * reader has consumed all bytes up to its end, which the writer tracks
+ * with FIONREAD. When the output is not a pipe, the frames queued at the
+ * moment go out in one writev instead.
+ *
+ * Live, a frame is dropped when no buffer is free or nobody reads the
+ * pipe yet. Offline, the renderer waits for the reader instead.
+ *****************************************************************************/
+
+enum {
+	PIPE_SINK_QUEUE_DEPTH = 2 * PIPE_SINK_BUFFERS,
+	PIPE_SINK_POLL_MS = 100,
+	PIPE_SINK_PAGE_SIZE = 4096,
+};
+
+static const char PipeFrameHeader[] = "FRAME\n";
+
+struct PipeFrameBuffer {
+	uint8_t *data;
+
+	/* frames queued or being sent from this buffer */
+	size_t pending;
+
+	/* offset in the stream of the end of the last send */
+	uint64_t endOffset;
+};
+
+struct PipeOutput {
+	char path[512];
+	int width;
+	int height;
+	size_t frameSize;
+
+	/**
+	 * -1 until a reader opened the pipe. Only the writer thread opens
+	 * and closes it, under the lock.
+	 */
+	int fd;
+	bool useVmsplice;
+
+	struct PipeFrameBuffer buffers[PIPE_SINK_BUFFERS];
+	size_t nextBuffer;
+
+	/* the buffer sent last, which a repeat sends again */
+	int lastBuffer;
+
+	/**
+	 * Waiting for the writer thread. A buffer sent several times in a
+	 * row, for frames skipped as unchanged or cadence repeats, takes a
+	 * single entry, so the queue never runs out while frames repeat.
+	 */
+	struct PipeQueueEntry {
+		int buffer;
+		size_t count;
+	} queue[PIPE_SINK_QUEUE_DEPTH];
+	size_t queueHead;
+	size_t queueCount;
+
+	/* bytes sent since the pipe was opened */
+	uint64_t bytesSent;
+
+	bool endOfStream;
+	bool stopping;
+	bool finished;
+
+	size_t framesDropped;
+	size_t framesSent;
+	size_t vmspliceCalls;
+	size_t writevCalls;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool threadStarted;
+};
+
+static struct PipeOutput PipeOutputs[NUM_OUTPUTS];
+
+/**
+ * Bytes the reader has taken out of the pipe. Bytes still in the pipe
+ * may be pages of our buffers. A send in progress is not in bytesSent
+ * yet, which only makes the count lower.
+ */
+static uint64_t GetPipeConsumedBytes(struct PipeOutput *output)
+{
+	int queued = 0;
+	if ((ioctl(output->fd, FIONREAD, &queued) < 0)
+		|| ((uint64_t)queued > output->bytesSent))
+	{
+		return 0;
+	}
+	return output->bytesSent - (uint64_t)queued;
+}
+
+static bool IsPipeBufferFree(struct PipeOutput *output, size_t idx)
+{
+	struct PipeFrameBuffer *buffer = &output->buffers[idx];
+	if (buffer->pending || ((int)idx == output->lastBuffer)) {
+		return false;
+	}
+	if ((output->fd < 0) || !output->useVmsplice) {
+		return true;
+	}
+	return GetPipeConsumedBytes(output) >= buffer->endOffset;
+}
+
+/**
+ * Queues count sends of the buffer, as part of the last entry when that
+ * is the same buffer. Only fails when every entry holds another buffer,
+ * which takes more buffers than there are.
+ */
+static bool QueuePipeSend(struct PipeOutput *output, int idx, size_t count)
+{
+	struct PipeQueueEntry *tail = NULL;
+	if (!count) {
+		return true;
+	}
+	if (output->queueCount) {
+		tail = &output->queue[(output->queueHead + output->queueCount - 1) % PIPE_SINK_QUEUE_DEPTH];
+	}
+
+	if (tail && (tail->buffer == idx))
+	{
+		tail->count += count;
+	}
+	else if (output->queueCount < PIPE_SINK_QUEUE_DEPTH)
+	{
+		tail = &output->queue[(output->queueHead + output->queueCount) % PIPE_SINK_QUEUE_DEPTH];
+		tail->buffer = idx;
+		tail->count = count;
+		output->queueCount++;
+	}
+	else
+	{
+		output->framesDropped += count;
+		return false;
+	}
+	output->buffers[idx].pending += count;
+	pthread_cond_broadcast(&output->cond);
+	return true;
+}
+
+/******************************************************************************
+ * Writer thread
+ *****************************************************************************/
+
+/**
+ * Opens the pipe without blocking on the reader, retrying until one
+ * shows up. A missing path is created as a named pipe.
+ */
+static int OpenPipeOutput(struct PipeOutput *output)
+{
+	if (!strcmp(output->path, "-")) {
+		return dup(STDOUT_FILENO);
+	}
+
+	while (!output->stopping)
+	{
+		int fd = open(output->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd >= 0) {
+			return fd;
+		}
+		if ((errno == ENOENT) && (mkfifo(output->path, 0644) == 0)) {
+			continue;
+		}
+		if (errno != ENXIO)
+		{
+			fprintf(stderr, "Pipe: failed to open '%s': %s\n", output->path, strerror(errno));
+			return -1;
+		}
+		usleep(PIPE_SINK_POLL_MS * 1000);
+	}
+	return -1;
+}
+
+/**
+ * When stopping, a reader which still reads gets the rest of the frame,
+ * one which does not is given up on after PIPE_SINK_POLL_MS
+ */
+static bool WaitPipeWritable(struct PipeOutput *output)
+{
+	struct pollfd pfd = { .fd = output->fd, .events = POLLOUT };
+	while (1)
+	{
+		int status = poll(&pfd, 1, PIPE_SINK_POLL_MS);
+		if (status > 0) {
+			return !(pfd.revents & (POLLERR | POLLNVAL));
+		}
+		if (((status < 0) && (errno != EINTR)) || output->stopping) {
+			return false;
+		}
+	}
+}
+
+/**
+ * Sends all of iov, resuming after partial writes. Falls back to writev
+ * for good when the kernel refuses vmsplice on the descriptor. Data
+ * which does not outlive the call is copied with canSplice false.
+ */
+static bool SendPipeIovecs(struct PipeOutput *output, struct iovec *iov, int iovcnt, bool canSplice)
+{
+	while (iovcnt > 0)
+	{
+		if (!WaitPipeWritable(output)) {
+			return false;
+		}
+
+		ssize_t sent;
+		if (canSplice && output->useVmsplice) {
+			sent = vmsplice(output->fd, iov, iovcnt, SPLICE_F_NONBLOCK);
+			output->vmspliceCalls++;
+		} else {
+			sent = writev(output->fd, iov, iovcnt);
+			output->writevCalls++;
+		}
+
+		if (sent < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EINTR)) {
+				continue;
+			}
+			if (canSplice && output->useVmsplice && ((errno == EINVAL) || (errno == ENOSYS)))
+			{
+				pthread_mutex_lock(&output->lock);
+				output->useVmsplice = false;
+				pthread_mutex_unlock(&output->lock);
+				continue;
+			}
+			if (errno != EPIPE) {
+				fprintf(stderr, "Pipe: writing '%s' failed: %s\n", output->path, strerror(errno));
+			}
+			return false;
+		}
+
+		while (iovcnt && ((size_t)sent >= iov->iov_len))
+		{
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt)
+		{
+			iov->iov_base = (uint8_t*)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return true;
+}
+
+static bool SendPipeStreamHeader(struct PipeOutput *output)
+{
+	char header[128];
+	struct iovec iov;
+
+	if (!PIPE_SINK_Y4M) {
+		return true;
+	}
+	iov.iov_base = header;
+	iov.iov_len = snprintf(header, sizeof(header),
+			"YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+			output->width, output->height, OUTPUT_FRAMERATE);
+
+	/* the header lives on the stack, it is copied rather than spliced */
+	bool ok = SendPipeIovecs(output, &iov, 1, false);
+
+	pthread_mutex_lock(&output->lock);
+	output->bytesSent += ok ? iov.iov_len : 0;
+	pthread_mutex_unlock(&output->lock);
+	return ok;
+}
+
+static bool ConnectPipeOutput(struct PipeOutput *output)
+{
+	struct stat st;
+	int fd = OpenPipeOutput(output);
+	if (fd < 0) {
+		return false;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	bool isPipe = !fstat(fd, &st) && S_ISFIFO(st.st_mode);
+	if (isPipe) {
+		/* room for a whole frame when the system allows it */
+		fcntl(fd, F_SETPIPE_SZ, (int)(output->frameSize + sizeof(PipeFrameHeader)));
+	}
+
+	pthread_mutex_lock(&output->lock);
+	output->fd = fd;
+	output->useVmsplice = isPipe;
+	output->bytesSent = 0;
+	pthread_mutex_unlock(&output->lock);
+
+	fprintf(stderr, "Pipe: streaming %dx%d to '%s' (%s)\n",
+			output->width, output->height, output->path,
+			isPipe ? "vmsplice" : "writev");
+	return SendPipeStreamHeader(output);
+}
+
+/**
+ * At the end of the stream, waits for the reader to take the spliced
+ * pages out of the pipe before the buffers can be freed
+ */
+static void DrainPipeOutput(struct PipeOutput *output)
+{
+	while (!output->stopping && output->useVmsplice)
+	{
+		pthread_mutex_lock(&output->lock);
+		bool drained = GetPipeConsumedBytes(output) >= output->bytesSent;
+		pthread_mutex_unlock(&output->lock);
+		if (drained) {
+			break;
+		}
+		usleep(1000);
+	}
+}
+
+/**
+ * Once the reader is gone, our pages in the old pipe are released
+ * together with it
+ */
+static void DisconnectPipeOutput(struct PipeOutput *output)
+{
+	size_t i;
+	pthread_mutex_lock(&output->lock);
+	if (output->fd >= 0) {
+		close(output->fd);
+	}
+	output->fd = -1;
+	for (i = 0; i < PIPE_SINK_BUFFERS; i++) {
+		output->buffers[i].endOffset = 0;
+	}
+	pthread_cond_broadcast(&output->cond);
+	pthread_mutex_unlock(&output->lock);
+}
+
+/**
+ * Takes up to PIPE_SINK_QUEUE_DEPTH queued frames and sends them with
+ * one call, unless the reader is slower than the renderer and only part
+ * of them fits. A long run of repeats goes out over several batches.
+ */
+static bool SendPipeBatch(struct PipeOutput *output)
+{
+	struct iovec iov[2 * PIPE_SINK_QUEUE_DEPTH];
+	int batch[PIPE_SINK_QUEUE_DEPTH];
+	size_t numFrames = 0;
+	size_t i;
+
+	pthread_mutex_lock(&output->lock);
+	while (!output->queueCount && !output->endOfStream && !output->stopping) {
+		pthread_cond_wait(&output->cond, &output->lock);
+	}
+	while (output->queueCount && !output->stopping && (numFrames < PIPE_SINK_QUEUE_DEPTH))
+	{
+		struct PipeQueueEntry *head = &output->queue[output->queueHead];
+		batch[numFrames++] = head->buffer;
+		if (--head->count) {
+			continue;
+		}
+		output->queueHead = (output->queueHead + 1) % PIPE_SINK_QUEUE_DEPTH;
+		output->queueCount--;
+	}
+	pthread_mutex_unlock(&output->lock);
+
+	if (!numFrames) {
+		return false;
+	}
+
+	int iovcnt = 0;
+	for (i = 0; i < numFrames; i++)
+	{
+		if (PIPE_SINK_Y4M)
+		{
+			iov[iovcnt].iov_base = (void*)PipeFrameHeader;
+			iov[iovcnt].iov_len = sizeof(PipeFrameHeader) - 1;
+			iovcnt++;
+		}
+		iov[iovcnt].iov_base = output->buffers[batch[i]].data;
+		iov[iovcnt].iov_len = output->frameSize;
+		iovcnt++;
+	}
+	bool ok = SendPipeIovecs(output, iov, iovcnt, true);
+
+	pthread_mutex_lock(&output->lock);
+	for (i = 0; i < numFrames; i++)
+	{
+		struct PipeFrameBuffer *buffer = &output->buffers[batch[i]];
+		if (ok)
+		{
+			output->bytesSent += output->frameSize + (PIPE_SINK_Y4M ? sizeof(PipeFrameHeader) - 1 : 0);
+			buffer->endOffset = output->bytesSent;
+			output->framesSent++;
+		}
+		else
+		{
+			output->framesDropped++;
+		}
+		buffer->pending--;
+	}
+	pthread_cond_broadcast(&output->cond);
+	pthread_mutex_unlock(&output->lock);
+	return ok;
+}
+
+static void *PipeWriterThreadRoutine(void *context)
+{
+	struct PipeOutput *output = (struct PipeOutput*)context;
+
+	ApplyStagePlacement(PIPELINE_STAGE_ENCODE);
+
+	while (!output->stopping)
+	{
+		if (!ConnectPipeOutput(output)) {
+			DisconnectPipeOutput(output);
+			break;
+		}
+		while (SendPipeBatch(output)) {
+		}
+		if (output->endOfStream) {
+			DrainPipeOutput(output);
+		}
+		DisconnectPipeOutput(output);
+
+		/* stdout and the end of the stream do not come back */
+		if (!strcmp(output->path, "-") || output->endOfStream) {
+			break;
+		}
+		fprintf(stderr, "Pipe: reader of '%s' went away\n", output->path);
+	}
+
+	pthread_mutex_lock(&output->lock);
+	output->finished = true;
+	/* drop whatever the reader is not going to get */
+	while (output->queueCount)
+	{
+		struct PipeQueueEntry *head = &output->queue[output->queueHead];
+		output->buffers[head->buffer].pending -= head->count;
+		output->framesDropped += head->count;
+		output->queueHead = (output->queueHead + 1) % PIPE_SINK_QUEUE_DEPTH;
+		output->queueCount--;
+	}
+	pthread_cond_broadcast(&output->cond);
+	pthread_mutex_unlock(&output->lock);
+	return NULL;
+}
+
+/******************************************************************************
+ * Sink operations, called by the renderer
+ *****************************************************************************/
+
+/**
+ * Offline, waits for the writer thread and the reader. Both the lock
+ * and FIONREAD are polled, the reader signals nothing.
+ */
+static int AcquirePipeBuffer(struct PipeOutput *output)
+{
+	size_t i;
+	while (1)
+	{
+		if (output->finished || (!gAppOptions.offline && (output->fd < 0))) {
+			return -1;
+		}
+		for (i = 0; i < PIPE_SINK_BUFFERS; i++)
+		{
+			size_t idx = (output->nextBuffer + i) % PIPE_SINK_BUFFERS;
+			if (IsPipeBufferFree(output, idx))
+			{
+				output->nextBuffer = (idx + 1) % PIPE_SINK_BUFFERS;
+				return (int)idx;
+			}
+		}
+		if (!gAppOptions.offline) {
+			return -1;
+		}
+
+		pthread_mutex_unlock(&output->lock);
+		usleep(1000);
+		pthread_mutex_lock(&output->lock);
+	}
+}
+
+static bool PipeTryGetInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	struct PipeOutput *output = &PipeOutputs[output_idx];
+	if (!output->threadStarted) {
+		return false;
+	}
+
+	pthread_mutex_lock(&output->lock);
+	int idx = AcquirePipeBuffer(output);
+	if (idx < 0) {
+		output->framesDropped++;
+	}
+	pthread_mutex_unlock(&output->lock);
+	if (idx < 0) {
+		return false;
+	}
+
+	/* planes back to back, as they go into the stream */
+	uint8_t *data = output->buffers[idx].data;
+	size_t lumaSize = (size_t)output->width * output->height;
+	frameData->encoderBuffer = &output->buffers[idx];
+	frameData->rawPixelData = data;
+	frameData->rawPixelStride = output->width;
+	frameData->rawChromaData[0] = data + lumaSize;
+	frameData->rawChromaData[1] = data + lumaSize + lumaSize / 4;
+	frameData->rawChromaStride = output->width / 2;
+	return true;
+}
+
+/**
+ * Y4M has no timestamps, so output frames skipped as unchanged are sent
+ * again as copies of the previous one to keep the frame rate
+ */
+static void PipeSubmitInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	struct PipeOutput *output = &PipeOutputs[output_idx];
+	if (!frameData->encoderBuffer) {
+		return;
+	}
+	int idx = (struct PipeFrameBuffer*)frameData->encoderBuffer - output->buffers;
+
+	pthread_mutex_lock(&output->lock);
+	if (output->lastBuffer >= 0) {
+		QueuePipeSend(output, output->lastBuffer, frameData->skippedOutputFrames);
+	}
+	if (QueuePipeSend(output, idx, 1)) {
+		output->lastBuffer = idx;
+	}
+	pthread_mutex_unlock(&output->lock);
+
+	frameData->timestampsUs[LATENCY_TS_PUSHED] = GetTimestampUs();
+	LatencyStatsRecord(frameData);
+}
+
+static void PipeSubmitRepeatFrame(size_t output_idx, uint64_t outputTickUs)
+{
+	struct PipeOutput *output = &PipeOutputs[output_idx];
+	if (!output->threadStarted) {
+		return;
+	}
+
+	pthread_mutex_lock(&output->lock);
+	if ((output->lastBuffer >= 0) && (output->fd >= 0)) {
+		QueuePipeSend(output, output->lastBuffer, 1);
+	}
+	pthread_mutex_unlock(&output->lock);
+}
+
+static void PipeSubmitEndOfStream(size_t output_idx)
+{
+	struct PipeOutput *output = &PipeOutputs[output_idx];
+	pthread_mutex_lock(&output->lock);
+	output->endOfStream = true;
+	pthread_cond_broadcast(&output->cond);
+	pthread_mutex_unlock(&output->lock);
+}
+
+static size_t PipeGetDroppedFrameCount(size_t output_idx)
+{
+	return PipeOutputs[output_idx].framesDropped;
+}
+
+static void InitializePipeSink(void)
+{
+	size_t output_idx;
+	size_t i;
+
+	/* a reader going away must not kill the process */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		struct PipeOutput *output = &PipeOutputs[output_idx];
+		struct OutputResolution res = GetOutputResolution(output_idx);
+
+		/* stdout carries a single stream */
+		if (!strcmp(PIPE_SINK_PATH, "-") && output_idx)
+		{
+			fprintf(stderr, "Pipe[%zu]: not streamed, only output 0 goes to stdout\n", output_idx);
+			continue;
+		}
+		GetOutputPath(output->path, sizeof(output->path), PIPE_SINK_PATH, output_idx);
+
+		output->width = res.width;
+		output->height = res.height;
+		output->frameSize = (size_t)res.width * res.height * 3 / 2;
+		output->fd = -1;
+		output->lastBuffer = -1;
+		for (i = 0; i < PIPE_SINK_BUFFERS; i++)
+		{
+			size_t size = (output->frameSize + PIPE_SINK_PAGE_SIZE - 1) & ~(size_t)(PIPE_SINK_PAGE_SIZE - 1);
+			assert(0 == posix_memalign((void**)&output->buffers[i].data, PIPE_SINK_PAGE_SIZE, size));
+		}
+		pthread_mutex_init(&output->lock, NULL);
+		pthread_cond_init(&output->cond, NULL);
+		assert(0 == pthread_create(&output->thread, NULL, PipeWriterThreadRoutine, output));
+		output->threadStarted = true;
+	}
+}
+
+/**
+ * Offline, the writer threads drain their queues into the readers.
+ * Live, frames still queued are dropped.
+ */
+static void WaitAndReleasePipeSink(void)
+{
+	size_t output_idx;
+	size_t i;
+
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		struct PipeOutput *output = &PipeOutputs[output_idx];
+		if (!output->threadStarted) {
+			continue;
+		}
+
+		pthread_mutex_lock(&output->lock);
+		output->endOfStream = true;
+		output->stopping = !gAppOptions.offline;
+		pthread_cond_broadcast(&output->cond);
+		pthread_mutex_unlock(&output->lock);
+
+		pthread_join(output->thread, NULL);
+		output->threadStarted = false;
+		fprintf(stderr, "Pipe[%zu]: %zu frames sent, %zu vmsplice and %zu writev calls\n",
+				output_idx, output->framesSent, output->vmspliceCalls, output->writevCalls);
+
+		for (i = 0; i < PIPE_SINK_BUFFERS; i++)
+		{
+			free(output->buffers[i].data);
+			output->buffers[i].data = NULL;
+		}
+		pthread_cond_destroy(&output->cond);
+		pthread_mutex_destroy(&output->lock);
+	}
+}
+
+const struct EncoderSinkOps PipeSinkOps = {
+	.name = "pipe",
+	.pixelFormat = ENCODER_FORMAT_I420,
+	.initialize = InitializePipeSink,
+	.waitAndRelease = WaitAndReleasePipeSink,
+	.tryGetInputBuffer = PipeTryGetInputBuffer,
+	.submitInputBuffer = PipeSubmitInputBuffer,
+	.submitEndOfStream = PipeSubmitEndOfStream,
+	.submitRepeatFrame = PipeSubmitRepeatFrame,
+	.getDroppedFrameCount = PipeGetDroppedFrameCount,
+};
@@ -0,0 +1,135 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "defish_app.h"
+#include "shm_frame_ring.h"
+
+/******************************************************************************
+ * Shared-memory frame export (ENCODER_SINK_SHM)
+ *
+ * Every output is a ring of raw frames in shared memory, which other
+ * processes on the machine map read-only. The renderer reads back
+ * straight into the next slot of the ring and publishes it, nothing is
+ * copied or encoded on the way. Publishing never waits for the readers,
+ * so the sink drops nothing and a slow reader misses frames instead.
+ *****************************************************************************/
+
+static struct ShmRingWriter *ShmOutputs[NUM_OUTPUTS];
+
+/**
+ * Readers get the source PTS offline, and the output tick or the
+ * readback time on CLOCK_MONOTONIC live
+ */
+static int64_t GetShmFramePtsUs(const struct FrameData *frameData)
+{
+	if (frameData->sourcePtsUs != AV_NOPTS_VALUE) {
+		return frameData->sourcePtsUs;
+	}
+	if (frameData->outputTickUs) {
+		return (int64_t)frameData->outputTickUs;
+	}
+	return (int64_t)frameData->timestampsUs[LATENCY_TS_READBACK];
+}
+
+static bool ShmTryGetInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	struct ShmRingWriter *writer = ShmOutputs[output_idx];
+	uint8_t *planes[SHM_RING_MAX_PLANES];
+	if (!writer) {
+		return false;
+	}
+
+	const struct ShmRingHeader *header = shmWriterGetHeader(writer);
+	if (!shmWriterBeginFrame(writer, planes)) {
+		return false;
+	}
+	frameData->encoderBuffer = writer;
+	frameData->rawPixelData = planes[0];
+	frameData->rawPixelStride = header->linesizes[0];
+	frameData->rawChromaData[0] = planes[1];
+	frameData->rawChromaData[1] = planes[2];
+	frameData->rawChromaStride = header->linesizes[1];
+	return true;
+}
+
+static void ShmSubmitInputBuffer(struct FrameData *frameData, size_t output_idx)
+{
+	if (!frameData->encoderBuffer) {
+		return;
+	}
+	shmWriterPublishFrame(ShmOutputs[output_idx], GetShmFramePtsUs(frameData));
+
+	frameData->timestampsUs[LATENCY_TS_PUSHED] = GetTimestampUs();
+	LatencyStatsRecord(frameData);
+}
+
+static void ShmSubmitEndOfStream(size_t output_idx)
+{
+	if (ShmOutputs[output_idx]) {
+		shmWriterEndOfStream(ShmOutputs[output_idx]);
+	}
+}
+
+/**
+ * The newest slot still holds the picture, readers simply see no new
+ * frame for the tick
+ */
+static void ShmSubmitRepeatFrame(size_t output_idx, uint64_t outputTickUs)
+{
+}
+
+static size_t ShmGetDroppedFrameCount(size_t output_idx)
+{
+	return 0;
+}
+
+static void InitializeShmSink(void)
+{
+	enum ShmRingPixelFormat pixelFormat = (SHM_SINK_PIXEL_FORMAT == ENCODER_FORMAT_I420)
+		? SHM_RING_FORMAT_I420 : SHM_RING_FORMAT_RGB24;
+	size_t output_idx;
+
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		struct OutputResolution res = GetOutputResolution(output_idx);
+		char socketPath[512];
+		GetOutputPath(socketPath, sizeof(socketPath), SHM_SINK_SOCKET_PATH, output_idx);
+
+		ShmOutputs[output_idx] = shmWriterOpen(socketPath, pixelFormat,
+				res.width, res.height, SHM_SINK_SLOTS, 0);
+		assert(NULL != ShmOutputs[output_idx]);
+		fprintf(stderr, "Shm[%zu]: %dx%d frames at '%s'\n",
+				output_idx, res.width, res.height, socketPath);
+	}
+}
+
+static void WaitAndReleaseShmSink(void)
+{
+	size_t output_idx;
+	for (output_idx = 0; output_idx < NUM_OUTPUTS; output_idx++)
+	{
+		struct ShmRingWriter *writer = ShmOutputs[output_idx];
+		if (!writer) {
+			continue;
+		}
+		fprintf(stderr, "Shm[%zu]: %llu frames published, %zu readers left\n",
+				output_idx,
+				(unsigned long long)shmWriterGetHeader(writer)->published,
+				shmWriterNumReaders(writer));
+		shmWriterEndOfStream(writer);
+		shmWriterClose(writer);
+		ShmOutputs[output_idx] = NULL;
+	}
+}
+
+const struct EncoderSinkOps ShmSinkOps = {
+	.name = "shm",
+	.pixelFormat = SHM_SINK_PIXEL_FORMAT,
+	.initialize = InitializeShmSink,
+	.waitAndRelease = WaitAndReleaseShmSink,
+	.tryGetInputBuffer = ShmTryGetInputBuffer,
+	.submitInputBuffer = ShmSubmitInputBuffer,
+	.submitEndOfStream = ShmSubmitEndOfStream,
+	.submitRepeatFrame = ShmSubmitRepeatFrame,
+	.getDroppedFrameCount = ShmGetDroppedFrameCount,
+};
@@ -1,10 +1,17 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/pixdesc.h>
+
 #include "defish_app.h"
+#include "raw_frame_file.h"
+#include "shm_frame_ring.h"
 
 /******************************************************************************
  * Decoding pipeline queues
  *****************************************************************************/
 
-static MSG_Q_ID FrameQueuesDecoded[NUM_SRC_STREAMS];
+static MSG_Q_ID FrameQueuesDecoded[NUM_SOURCES];
 
 /**
  * After we render the frame on the screen, we return it to the decoder
@@ -13,20 +20,213 @@ static MSG_Q_ID FrameQueuesDecoded[NUM_SRC_STREAMS];
  * This serves a dual purpose.
  * Firstly, it allows to have a fixed number of buffers without the dynamic
  * allocation.
- * Secondly, the frame data (AVFrame) can only be destroyed from the thread
- * in which it was created (it is not thread-safe).
+ * Secondly, the frame data (AVFrame) is not thread-safe: it is only
+ * touched by the renderer or by the decoder worker which currently
+ * services the source.
+ */
+static MSG_Q_ID FrameQueuesReturnedToDecoder[NUM_SOURCES];
+
+/**
+ * Number of decoded frames which were replaced in the mailbox before
+ * the renderer could pick them up (only with DECODER_QUEUE_MAILBOX).
+ */
+static size_t FramesReplacedInMailbox[NUM_SOURCES];
+
+/**
+ * Sources whose FrameQueuesDecoded is a mailbox: the network cameras.
+ * A file decoder blocks on a full queue instead, that is what paces it.
+ */
+static bool MailboxSources[NUM_SOURCES];
+
+/* see the decoder worker pool below */
+static void KickDecoderScheduler(void);
+static void NoteDecodedFrameConsumed(size_t src_idx);
+
+/**
+ * Mailbox mode: take the stale frame(s) out of FrameQueuesDecoded and
+ * hand them back to the decoder so that the next submitted frame is the
+ * only one pending.
+ *
+ * Only the decoder thread of this source sends to FrameQueuesDecoded,
+ * so the renderer may race us for the pending frame but can never make
+ * the queue grow while we are draining it.
+ */
+static bool EvictPendingDecodedFrames(int index)
+{
+	bool evictedChanged = false;
+	while (msgQNumMsgs(FrameQueuesDecoded[index]) > 0)
+	{
+		struct FrameData staleFrameData = {};
+		int q_status = -1;
+		q_status = msgQReceive(FrameQueuesDecoded[index],
+				(char*)&staleFrameData,
+				sizeof(struct FrameData),
+				MSG_Q_NO_WAIT);
+		if (q_status != sizeof(struct FrameData))
+		{
+			/* the renderer took it first */
+			break;
+		}
+
+		FramesReplacedInMailbox[index]++;
+		if (!staleFrameData.unchanged) {
+			evictedChanged = true;
+		}
+		ReturnFrameToDecoderQueue(staleFrameData.frame, index);
+	}
+	return evictedChanged;
+}
+
+/******************************************************************************
+ * Change detection (CHANGE_DETECTION)
+ *
+ * Runs on the thread decoding or replaying the source, which is the only
+ * one touching its signature at a time.
+ *****************************************************************************/
+enum {
+	CHANGE_DETECT_NUM_SAMPLES = CHANGE_DETECT_GRID_COLS * CHANGE_DETECT_GRID_ROWS,
+};
+
+struct ChangeSignature {
+	bool valid;
+	int width;
+	int height;
+	int format;
+	uint8_t samples[CHANGE_DETECT_NUM_SAMPLES];
+};
+
+/* of the last frame of each source which was reported as changed */
+static struct ChangeSignature ChangeSignatures[NUM_SOURCES];
+
+static bool SampleLumaGrid(const AVFrame *frame, uint8_t samples[CHANGE_DETECT_NUM_SAMPLES])
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	size_t row;
+	size_t col;
+
+	if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) || !frame->data[0]
+		|| (frame->width <= 0) || (frame->height <= 0))
+	{
+		return false;
+	}
+
+	int step = desc->comp[0].step;
+	int shift = desc->comp[0].shift + desc->comp[0].depth - 8;
+	for (row = 0; row < CHANGE_DETECT_GRID_ROWS; row++)
+	{
+		/* sample the centres of the grid cells */
+		int y = (int)((2 * row + 1) * frame->height / (2 * CHANGE_DETECT_GRID_ROWS));
+		const uint8_t *line = frame->data[0] + (ptrdiff_t)y * frame->linesize[0]
+			+ desc->comp[0].offset;
+		for (col = 0; col < CHANGE_DETECT_GRID_COLS; col++)
+		{
+			int x = (int)((2 * col + 1) * frame->width / (2 * CHANGE_DETECT_GRID_COLS));
+			const uint8_t *p = line + x * step;
+			unsigned value = (step >= 2) ? (p[0] | (p[1] << 8)) : p[0];
+			samples[row * CHANGE_DETECT_GRID_COLS + col] = (uint8_t)(value >> shift);
+		}
+	}
+	return true;
+}
+
+/**
+ * Compares the frame with the last changed frame of the source, which
+ * it replaces when it differs. Slow drifts thus still add up to a change.
+ */
+static bool IsFrameUnchanged(const AVFrame *frame, int index)
+{
+	struct ChangeSignature *signature = &ChangeSignatures[index];
+	uint8_t samples[CHANGE_DETECT_NUM_SAMPLES];
+	size_t i;
+
+	if (!CHANGE_DETECTION) {
+		return false;
+	}
+	if (!SampleLumaGrid(frame, samples)) {
+		signature->valid = false;
+		return false;
+	}
+
+	if (signature->valid
+		&& (signature->width == frame->width)
+		&& (signature->height == frame->height)
+		&& (signature->format == frame->format))
+	{
+		/* a small object moving changes a few samples a lot */
+		uint64_t sad = 0;
+		int maxDiff = 0;
+		for (i = 0; i < CHANGE_DETECT_NUM_SAMPLES; i++) {
+			int diff = (int)samples[i] - (int)signature->samples[i];
+			diff = (diff < 0) ? -diff : diff;
+			sad += diff;
+			if (diff > maxDiff) {
+				maxDiff = diff;
+			}
+		}
+		if ((sad <= (uint64_t)CHANGE_DETECT_MAX_MEAN_SAD * CHANGE_DETECT_NUM_SAMPLES)
+			&& (maxDiff <= CHANGE_DETECT_MAX_SAMPLE_DIFF))
+		{
+			return true;
+		}
+	}
+
+	signature->valid = true;
+	signature->width = frame->width;
+	signature->height = frame->height;
+	signature->format = frame->format;
+	memcpy(signature->samples, samples, sizeof(samples));
+	return false;
+}
+
+/**
+ * Offline mode needs every frame, so the mailbox is only used live
  */
-static MSG_Q_ID FrameQueuesReturnedToDecoder[NUM_SRC_STREAMS];
+static bool UseDecoderMailbox(int index)
+{
+	return DECODER_QUEUE_MAILBOX && !gAppOptions.offline && MailboxSources[index];
+}
 
 /**
  * The decoder must call this function to indicate to the rendering thread
  * that the source texture must be updated.
  */
-static void SubmitFrameFromDecoder(AVFrame *frame, int index)
+static void SubmitFrameFromDecoder(AVFrame *frame, int index, uint64_t demuxUs,
+		int64_t ptsUs)
 {
 	struct FrameData frameData = {};
 	frameData.frame = frame;
 	frameData.rawPixelData = NULL;
+	frameData.sourcePtsUs = ptsUs;
+	frameData.timestampsUs[LATENCY_TS_DEMUX] = demuxUs;
+	frameData.unchanged = IsFrameUnchanged(frame, index);
+	frameData.timestampsUs[LATENCY_TS_DECODED] = GetTimestampUs();
+
+	/**
+	 * A changed frame replaced in the mailbox never reaches the
+	 * renderer, so this one has to be drawn in its place
+	 */
+	if (UseDecoderMailbox(index) && EvictPendingDecodedFrames(index))
+	{
+		frameData.unchanged = false;
+	}
+
+	msgQSend(FrameQueuesDecoded[index],
+			(char*)&frameData,
+			sizeof(struct FrameData),
+			MSG_Q_WAIT_FOREVER,
+			MSG_PRI_NORMAL);
+}
+
+/**
+ * Offline mode: tells the renderer that the source has no more frames
+ */
+static void SubmitEndOfStreamFromDecoder(int index)
+{
+	struct FrameData frameData = {};
+	if (!gAppOptions.offline) {
+		return;
+	}
+	frameData.endOfStream = true;
 	msgQSend(FrameQueuesDecoded[index],
 			(char*)&frameData,
 			sizeof(struct FrameData),
@@ -49,6 +249,7 @@ void ReturnFrameToDecoderQueue(AVFrame *frame, int index)
 		sizeof(struct FrameData),
 		MSG_Q_WAIT_FOREVER,
 		MSG_PRI_NORMAL);
+	KickDecoderScheduler();
 }
 
 bool TryReceiveDecodedFrame(struct FrameData *frameData, int src_idx)
@@ -59,40 +260,224 @@ bool TryReceiveDecodedFrame(struct FrameData *frameData, int src_idx)
 			sizeof(struct FrameData),
 			MSG_Q_NO_WAIT);
 	DPRINT_RENDERER("msgQReceive src=%zu status=%d", src_idx, q_status);
-	return (q_status == sizeof(struct FrameData));
+	if (q_status != sizeof(struct FrameData)) {
+		return false;
+	}
+	NoteDecodedFrameConsumed(src_idx);
+	return true;
+}
+
+bool WaitDecodedFrame(struct FrameData *frameData, int src_idx)
+{
+	int q_status = -1;
+	q_status = msgQReceive(FrameQueuesDecoded[src_idx],
+			(char*)frameData,
+			sizeof(struct FrameData),
+			MSG_Q_WAIT_FOREVER);
+	DPRINT_RENDERER("msgQReceive src=%d status=%d", src_idx, q_status);
+	if ((q_status != sizeof(struct FrameData)) || frameData->endOfStream) {
+		return false;
+	}
+	NoteDecodedFrameConsumed(src_idx);
+	return true;
 }
 
 /******************************************************************************
  * FFMpeg GLUE for reading video frames
+ *
+ * Every source is split into two stages connected by a bounded packet
+ * queue (see packet_queue.h):
+ * - the demux stage reads compressed packets from the file or network.
+ *   A single thread services all file sources, each live source has a
+ *   thread of its own because its reads block until the camera sends.
+ * - the decode stage owns the codec context and only ever waits for
+ *   packets or for the renderer to hand a frame back.
+ *
+ * (Re)opening an input sends a NEW_STREAM marker carrying the codec
+ * parameters, so that the decoder can be re-created after a live source
+ * reconnects. The end of a file is signalled with an EOS marker.
  *****************************************************************************/
 struct Demo_VideoContext {
-	const char *stream_paths[NUM_SRC_STREAMS];
+	const char *stream_paths[NUM_SOURCES];
 
-	AVFormatContext *format_contexts[NUM_SRC_STREAMS];
-	AVCodecContext *codec_contexts[NUM_SRC_STREAMS];
-	int stream_indices[NUM_SRC_STREAMS];
-	AVFrame *frames[NUM_SRC_STREAMS];
-};
+	/* owned by the demux thread of the source */
+	AVFormatContext *format_contexts[NUM_SOURCES];
+	int stream_indices[NUM_SOURCES];
+	/* offline chunk: pts of the first keyframe past the range, once read */
+	int64_t range_end_key_pts[NUM_SOURCES];
+
+	/* owned by the decoder thread of the source */
+	AVCodecContext *codec_contexts[NUM_SOURCES];
+	int64_t stream_start_us[NUM_SOURCES];
+
+	/* record mode: decoded frames are also written here */
+	struct RawFrameWriter *recorders[NUM_SOURCES];
 
-static struct Demo_VideoContext video_context = {
-	.stream_paths = SRC_PATHS_INITIALIZER,
+	/* replay sources: the mapped .dfraw file */
+	struct RawFrameReader *raw_readers[NUM_SOURCES];
+
+	/* shm:// sources: the ring still mapped when the source was stopped */
+	struct ShmRingReader *shm_readers[NUM_SOURCES];
+
+	PKT_Q_ID packet_queues[NUM_SOURCES];
 };
 
-#define IS_VIDEO(stream) (stream->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+/**
+ * Indexed by the source index of all rigs (see NUM_RIGS), the demux
+ * threads and the decoder worker pool serve every rig alike
+ */
+static struct Demo_VideoContext video_context;
+
+static const char *RawRecordDir = RAW_RECORD_DIR;
+
+/**
+ * Set before the queues are deleted so that the demux threads stop
+ * reconnecting and abort blocking reads.
+ */
+static volatile bool DemuxStopRequested;
+
+/**
+ * Live sources: time when the current blocking read started, checked by
+ * the libavformat interrupt callback to detect a lost stream.
+ */
+static uint64_t LiveSourceLastActivityUs[NUM_SOURCES];
+
+#define IS_VIDEO(stream) (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+
+static bool IsLiveSourcePath(const char *path)
+{
+	static const char *livePrefixes[] = { "rtp://", "udp://", "tcp://", };
+	size_t i;
+	for (i = 0; i < sizeof(livePrefixes) / sizeof(livePrefixes[0]); i++)
+	{
+		if (!strncmp(path, livePrefixes[i], strlen(livePrefixes[i]))) {
+			return true;
+		}
+	}
+
+	size_t len = strlen(path);
+	return (len > 4) && !strcmp(path + len - 4, ".sdp");
+}
+
+static bool IsReplaySourcePath(const char *path)
+{
+	size_t len = strlen(path);
+	size_t suffixLen = strlen(RAW_FRAME_FILE_SUFFIX);
+	return (len > suffixLen) && !strcmp(path + len - suffixLen, RAW_FRAME_FILE_SUFFIX);
+}
+
+static bool IsShmSourcePath(const char *path)
+{
+	return !strncmp(path, SHM_SOURCE_PREFIX, strlen(SHM_SOURCE_PREFIX));
+}
+
+/**
+ * Sleeps LIVE_RECONNECT_DELAY_MS before the next attempt to open a lost
+ * source. Returns false as soon as the demux threads are asked to stop,
+ * so shutdown never waits for a camera which is down.
+ */
+static bool WaitBeforeReconnect(void)
+{
+	enum { RECONNECT_POLL_MS = 50 };
+	int waitedMs;
+	for (waitedMs = 0; waitedMs < LIVE_RECONNECT_DELAY_MS; waitedMs += RECONNECT_POLL_MS)
+	{
+		if (DemuxStopRequested) {
+			return false;
+		}
+		usleep(RECONNECT_POLL_MS * 1000);
+	}
+	return !DemuxStopRequested;
+}
+
+static int LiveSourceInterruptCallback(void *opaque)
+{
+	uint64_t lastActivityUs = *(uint64_t*)opaque;
+	if (DemuxStopRequested) {
+		return 1;
+	}
+	return (GetTimestampUs() - lastActivityUs) > (LIVE_STALL_TIMEOUT_MS * 1000ULL);
+}
+
+static void SetLiveSourceOptions(AVDictionary **dict)
+{
+	av_dict_set_int(dict, "probesize", LIVE_PROBESIZE, 0);
+	av_dict_set_int(dict, "analyzeduration", LIVE_ANALYZEDURATION_US, 0);
+	av_dict_set(dict, "fflags", "nobuffer", 0);
+	av_dict_set_int(dict, "reorder_queue_size", LIVE_JITTER_DEPTH, 0);
+	av_dict_set_int(dict, "max_delay", 0, 0);
+}
+
+/**
+ * Offline range (see AppOptions) support
+ */
+static int64_t StreamStartUs(const AVStream *stream)
+{
+	if (stream->start_time == AV_NOPTS_VALUE) {
+		return 0;
+	}
+	return av_rescale_q(stream->start_time, stream->time_base, AV_TIME_BASE_Q);
+}
+
+static bool HasOfflineRangeEnd(void)
+{
+	return gAppOptions.offline && (gAppOptions.rangeEndUs != INT64_MAX);
+}
+
+static bool IsInOfflineRange(int64_t ptsUs, int64_t streamStartUs)
+{
+	if (!gAppOptions.offline || (ptsUs == AV_NOPTS_VALUE)) {
+		return true;
+	}
+	int64_t relativeUs = ptsUs - streamStartUs;
+	return (relativeUs >= gAppOptions.rangeStartUs)
+		&& (relativeUs < gAppOptions.rangeEndUs);
+}
+
+void GetSourcePacketQueueStats(int src_idx, struct PacketQueueStats *stats)
+{
+	pktQGetStats(video_context.packet_queues[src_idx], stats);
+}
 
-static bool InitOneSourceAtIndex(struct Demo_VideoContext *video_context,
+/******************************************************************************
+ * Demux stage
+ *****************************************************************************/
+static bool OpenInputAtIndex(struct Demo_VideoContext *video_context,
 		size_t thisDecoderIndex)
 {
 	int stream = -1;
 	AVFormatContext *format_context = NULL;
-	AVCodecContext *codec_context = NULL;
-	AVCodec *codec = NULL;
 
 	const char *path = video_context->stream_paths[thisDecoderIndex];
+	bool isLive = IsLiveSourcePath(path);
+
+	format_context = avformat_alloc_context();
+	if (!format_context) {
+		DPRINT_DECODER("Failed to allocate the format context");
+		goto fail;
+	}
 
 	AVDictionary *dict = NULL;
 	av_dict_set(&dict, "protocol_whitelist", "file,crypto,rtp,udp,tcp", 0);
-	if (avformat_open_input(&format_context, path, NULL, &dict) < 0) {
+	if (isLive) {
+		SetLiveSourceOptions(&dict);
+		LiveSourceLastActivityUs[thisDecoderIndex] = GetTimestampUs();
+		format_context->interrupt_callback.callback = LiveSourceInterruptCallback;
+		format_context->interrupt_callback.opaque = &LiveSourceLastActivityUs[thisDecoderIndex];
+	}
+	else {
+		/**
+		 * Files share one demux thread, which must not get stuck
+		 * on any of them. Protocols which can not tell that a read
+		 * would block (plain local files) simply ignore the flag.
+		 */
+		format_context->flags |= AVFMT_FLAG_NONBLOCK;
+	}
+
+	/* on failure, avformat_open_input frees the context */
+	int open_status = avformat_open_input(&format_context, path, NULL, &dict);
+	av_dict_free(&dict);
+	if (open_status < 0) {
 		DPRINT_DECODER("Failed to open the input '%s'", path);
 		goto fail;
 	}
@@ -114,192 +499,1138 @@ static bool InitOneSourceAtIndex(struct Demo_VideoContext *video_context,
 		goto fail;
 	}
 
-	codec_context = format_context->streams[stream]->codec;
-	if (!codec_context) {
-		DPRINT_DECODER("No codec context found");
-		goto fail;
-	}
-
-	codec = avcodec_find_decoder(codec_context->codec_id);
-	if (!codec) {
-		DPRINT_DECODER("No codec decoder found");
-		goto fail;
-	}
-
-	if (avcodec_open2(codec_context, codec, NULL) < 0) {
-		DPRINT_DECODER("Failed to open codec");
-		goto fail;
-	}
-
-	AVFrame *frame = av_frame_alloc();
-	if (!frame) {
-		DPRINT_DECODER("Failed to allocate a frame");
-		goto fail;
+	/**
+	 * Offline chunk: start at the keyframe before the range, the
+	 * decoder drops the frames up to its start
+	 */
+	if (gAppOptions.offline && (gAppOptions.rangeStartUs > 0))
+	{
+		AVStream *st = format_context->streams[stream];
+		int64_t target = av_rescale_q(StreamStartUs(st) + gAppOptions.rangeStartUs,
+				AV_TIME_BASE_Q, st->time_base);
+		if (av_seek_frame(format_context, stream, target, AVSEEK_FLAG_BACKWARD) < 0) {
+			DPRINT_DECODER("Failed to seek to the start of the range");
+			goto fail;
+		}
 	}
 
 	video_context->format_contexts[thisDecoderIndex] = format_context;
-	video_context->codec_contexts[thisDecoderIndex] = codec_context;
-	video_context->frames[thisDecoderIndex] = frame;
 	video_context->stream_indices[thisDecoderIndex] = stream;
+	video_context->range_end_key_pts[thisDecoderIndex] = AV_NOPTS_VALUE;
 
 	return true;
 
 fail:
+	if (format_context) {
+		avformat_close_input(&format_context);
+	}
 	return false;
 }
 
-static bool InitVideoSources(struct Demo_VideoContext *video_context)
+static void CloseInputAtIndex(struct Demo_VideoContext *video_context,
+		size_t i)
 {
-	size_t i;
-	for (i = 0; i < NUM_SRC_STREAMS; i++)
-	{
-		if (true != InitOneSourceAtIndex(video_context, i)) {
-			return false;
-		}
+	if (NULL != video_context->format_contexts[i]) {
+		avformat_close_input(&video_context->format_contexts[i]);
 	}
-
-	return true;
 }
 
-static void FreeVideoSources(struct Demo_VideoContext *video_context)
+/**
+ * Every entry put into a packet queue may make its source ready
+ * for the decoder workers
+ */
+static PKT_Q_STATUS QueuePacketAtIndex(struct Demo_VideoContext *video_context,
+		size_t src_idx,
+		struct PacketQueueEntry *entry,
+		int timeout)
 {
-	size_t i;
-	for (i = 0; i < NUM_SRC_STREAMS; i++)
-	{
-		if (NULL != video_context->format_contexts[i]) {
-			avformat_close_input(&video_context->format_contexts[i]);
-		}
-		if (NULL != video_context->codec_contexts[i]) {
-			avcodec_close(video_context->codec_contexts[i]);
-		}
-		if (NULL != video_context->frames[i])
-		{
-			av_frame_free(&video_context->frames[i]);
-		}
+	PKT_Q_STATUS status = pktQPut(video_context->packet_queues[src_idx], entry, timeout);
+	if (status == PKT_Q_OK) {
+		KickDecoderScheduler();
 	}
+	return status;
 }
 
-struct DecoderThreadContext {
-	struct Demo_VideoContext *video_context;
-	size_t decoderIndex;
-};
-
-static void *DecoderThreadRoutine(void *context)
+/**
+ * Tells the decoder which stream the following packets belong to
+ */
+static PKT_Q_STATUS SendNewStreamMarker(struct Demo_VideoContext *video_context,
+		size_t thisDecoderIndex)
 {
-	size_t thisDecoderIndex = 0;
-	AVPacket packet = {};
-	struct Demo_VideoContext *video_context = NULL;
-	struct DecoderThreadContext *thread_context = NULL;
+	AVFormatContext *format_context = video_context->format_contexts[thisDecoderIndex];
+	AVStream *stream = format_context->streams[video_context->stream_indices[thisDecoderIndex]];
+	struct PacketQueueEntry entry = {};
 
-	if (!context)
+	entry.flags = PKT_Q_FLAG_NEW_STREAM;
+	entry.timeBase = stream->time_base;
+	entry.streamStartUs = StreamStartUs(stream);
+	entry.codecpar = avcodec_parameters_alloc();
+	if (!entry.codecpar
+		|| (avcodec_parameters_copy(entry.codecpar, stream->codecpar) < 0))
 	{
-		DPRINT_DECODER("context is NULL");
-		goto done;
+		DPRINT_DECODER("Failed to copy the codec parameters");
+		pktQEntryRelease(&entry);
+		return PKT_Q_ERROR;
 	}
 
-	thread_context = (struct DecoderThreadContext*)context;
-	if (!thread_context->video_context)
-	{
-		DPRINT_DECODER("video_context is NULL");
-		goto done;
+	PKT_Q_STATUS status = QueuePacketAtIndex(video_context, thisDecoderIndex,
+			&entry,
+			MSG_Q_WAIT_FOREVER);
+	pktQEntryRelease(&entry);
+	return status;
+}
+
+static PKT_Q_STATUS SendEosMarker(struct Demo_VideoContext *video_context,
+		size_t thisDecoderIndex)
+{
+	struct PacketQueueEntry entry = {};
+	entry.flags = PKT_Q_FLAG_EOS;
+	return QueuePacketAtIndex(video_context, thisDecoderIndex,
+			&entry,
+			MSG_Q_WAIT_FOREVER);
+}
+
+/**
+ * Playback duration of a packet for the queue limits. Containers which
+ * do not store packet durations fall back to the average frame rate.
+ */
+static int64_t PacketDurationUs(const AVStream *stream, const AVPacket *packet)
+{
+	if (packet->duration > 0) {
+		return av_rescale_q(packet->duration, stream->time_base, AV_TIME_BASE_Q);
 	}
+	if ((stream->avg_frame_rate.num > 0) && (stream->avg_frame_rate.den > 0)) {
+		return (int64_t)AV_TIME_BASE * stream->avg_frame_rate.den
+			/ stream->avg_frame_rate.num;
+	}
+	return 0;
+}
 
-	video_context = (struct Demo_VideoContext *)thread_context->video_context;
-	thisDecoderIndex = thread_context->decoderIndex;
+/**
+ * Reads the next packet of the video stream into the entry.
+ * Returns 0 on success, AVERROR(EAGAIN) when there is nothing to queue
+ * right now, or another negative AVERROR at the end of the input.
+ */
+static int ReadPacketAtIndex(struct Demo_VideoContext *video_context,
+		size_t thisDecoderIndex,
+		struct PacketQueueEntry *entry)
+{
+	AVFormatContext *format_context = video_context->format_contexts[thisDecoderIndex];
+	int stream_index = video_context->stream_indices[thisDecoderIndex];
 
-	if (true != InitOneSourceAtIndex(video_context, thisDecoderIndex))
-	{
-		DPRINT_DECODER("failed to initialize the input");
-		goto done;
+	memset(entry, 0, sizeof(*entry));
+	int status = av_read_frame(format_context, &entry->packet);
+	if (status < 0) {
+		return status;
 	}
 
-	size_t tmpFrame = 0;
-	for (tmpFrame = 0; tmpFrame < DECODER_QUEUE_DEPTH; tmpFrame++)
-	{
-		AVFrame *frame = av_frame_alloc();
-		if (!frame) {
-			DPRINT_DECODER("Failed to allocate a frame");
-			goto done;
-		}
-		ReturnFrameToDecoderQueue(frame, thisDecoderIndex);
+	if (stream_index != entry->packet.stream_index) {
+		av_packet_unref(&entry->packet);
+		return AVERROR(EAGAIN);
 	}
 
-	size_t decodedFrameIndex = 0;
-	while (1)
+	/**
+	 * Offline chunk: the range ends on pts, the decoder drops every
+	 * frame at or past its end. With open GOPs the leading B-frames of
+	 * the first keyframe past the range still belong to it, and follow
+	 * that keyframe in decode order. So the keyframe is read as their
+	 * reference, and the first packet after it presenting later than it
+	 * ends the chunk.
+	 */
+	AVStream *stream = format_context->streams[stream_index];
+	int64_t *rangeEndKeyPts = &video_context->range_end_key_pts[thisDecoderIndex];
+	if (HasOfflineRangeEnd() && (entry->packet.pts != AV_NOPTS_VALUE))
 	{
-		DPRINT_DECODER("decodedFrameIndex=%zu", decodedFrameIndex);
-		++decodedFrameIndex;
-		if (av_read_frame(video_context->format_contexts[thisDecoderIndex], &packet) < 0) {
-			DPRINT_DECODER("failed to read the frame");
-			goto done;
-		}
-		if (video_context->stream_indices[thisDecoderIndex] != packet.stream_index) {
-			DPRINT_DECODER("invalid stream index");
-			continue;
+		if (*rangeEndKeyPts != AV_NOPTS_VALUE)
+		{
+			if (entry->packet.pts > *rangeEndKeyPts)
+			{
+				av_packet_unref(&entry->packet);
+				return AVERROR_EOF;
+			}
 		}
-
-		struct FrameData frameData = {};
-		int q_status = -1;
-		q_status = msgQReceive(FrameQueuesReturnedToDecoder[thisDecoderIndex],
-				(char*)&frameData,
-				sizeof(frameData),
-				MSG_Q_WAIT_FOREVER);
-		if (q_status != sizeof(struct FrameData))
+		else if ((entry->packet.flags & AV_PKT_FLAG_KEY)
+			&& (av_rescale_q(entry->packet.pts, stream->time_base, AV_TIME_BASE_Q)
+				- StreamStartUs(stream) >= gAppOptions.rangeEndUs))
 		{
-			DPRINT_DECODER("failed to get the temporary frame");
-			continue;
+			*rangeEndKeyPts = entry->packet.pts;
 		}
+	}
 
-		AVFrame *frame = NULL;
-		frame = frameData.frame;
+	entry->demuxUs = GetTimestampUs();
+	entry->durationUs = PacketDurationUs(stream, &entry->packet);
+	return 0;
+}
 
-		int frame_done = 0;
-		avcodec_decode_video2(
-				video_context->codec_contexts[thisDecoderIndex],
-				frame,
-				&frame_done,
-				&packet);
-		if (!frame_done) {
-			DPRINT_DECODER("failed to decode the frame");
+struct DemuxThreadContext {
+	struct Demo_VideoContext *video_context;
+	size_t sourceIndices[NUM_SOURCES];
+	size_t numSources;
+};
 
-			/**
-			 * after initialization, for some time the frames are not decoded
-			 * perhaps FFMPEG uses some kind of a non-blocking queue internally
-			 */
-			if (decodedFrameIndex < 100) {
-				ReturnFrameToDecoderQueue(frame, thisDecoderIndex);
-				continue;
-			}
+/**
+ * Demuxes one live source, re-opening it whenever the stream is lost.
+ * The last picture stays on screen meanwhile.
+ */
+static void *LiveDemuxThreadRoutine(void *context)
+{
+	struct DemuxThreadContext *thread_context = (struct DemuxThreadContext*)context;
+	struct Demo_VideoContext *video_context = thread_context->video_context;
+	size_t thisDecoderIndex = thread_context->sourceIndices[0];
+
+	ApplyStagePlacement(PIPELINE_STAGE_DEMUX);
+
+	while (!DemuxStopRequested)
+	{
+		if (true != OpenInputAtIndex(video_context, thisDecoderIndex))
+		{
+			fprintf(stderr, "Decoder[%zu]: waiting for '%s'\n",
+					thisDecoderIndex,
+					video_context->stream_paths[thisDecoderIndex]);
+			if (!WaitBeforeReconnect()) {
+				break;
+			}
+			continue;
+		}
+
+		if (PKT_Q_OK != SendNewStreamMarker(video_context, thisDecoderIndex)) {
+			goto done;
+		}
+
+		while (1)
+		{
+			struct PacketQueueEntry entry;
 
 			/**
-			 * should we break the loop if we still have not received
-			 * a frame after 100 iterations?
+			 * The stall timeout covers this read only, not the time
+			 * we spent waiting for the decoder to drain the queue
 			 */
+			LiveSourceLastActivityUs[thisDecoderIndex] = GetTimestampUs();
+			int status = ReadPacketAtIndex(video_context, thisDecoderIndex, &entry);
+			if (status == AVERROR(EAGAIN)) {
+				continue;
+			}
+			if (status < 0) {
+				DPRINT_DECODER("failed to read the frame");
+				break;
+			}
+
+			if (PKT_Q_OK != QueuePacketAtIndex(video_context, thisDecoderIndex, &entry, MSG_Q_WAIT_FOREVER)) {
+				pktQEntryRelease(&entry);
+				goto done;
+			}
+		}
+
+		CloseInputAtIndex(video_context, thisDecoderIndex);
+		if (!DemuxStopRequested) {
+			fprintf(stderr, "Decoder[%zu]: stream lost, reconnecting\n", thisDecoderIndex);
+		}
+	}
+
+done:
+	CloseInputAtIndex(video_context, thisDecoderIndex);
+	DPRINT_DECODER("demux done");
+	return NULL;
+}
+
+/**
+ * Demuxes all file sources round-robin. A source is skipped while its
+ * packet queue is full or its input reports EAGAIN, so one slow decoder
+ * or input never holds back the others.
+ */
+static void *FileDemuxThreadRoutine(void *context)
+{
+	struct DemuxThreadContext *thread_context = (struct DemuxThreadContext*)context;
+	struct Demo_VideoContext *video_context = thread_context->video_context;
+	bool active[NUM_SOURCES] = {};
+	size_t numActive = 0;
+	size_t i;
+
+	ApplyStagePlacement(PIPELINE_STAGE_DEMUX);
+
+	for (i = 0; i < thread_context->numSources; i++)
+	{
+		size_t thisDecoderIndex = thread_context->sourceIndices[i];
+		if (true != OpenInputAtIndex(video_context, thisDecoderIndex))
+		{
+			fprintf(stderr, "Decoder[%zu]: failed to open '%s'\n",
+					thisDecoderIndex,
+					video_context->stream_paths[thisDecoderIndex]);
+			SendEosMarker(video_context, thisDecoderIndex);
+			continue;
+		}
+		if (PKT_Q_OK != SendNewStreamMarker(video_context, thisDecoderIndex)) {
+			goto done;
+		}
+		active[i] = true;
+		numActive++;
+	}
+
+	while (numActive && !DemuxStopRequested)
+	{
+		bool progress = false;
+		for (i = 0; i < thread_context->numSources; i++)
+		{
+			size_t thisDecoderIndex = thread_context->sourceIndices[i];
+			PKT_Q_ID packet_queue = video_context->packet_queues[thisDecoderIndex];
+			struct PacketQueueEntry entry;
+
+			if (!active[i] || pktQIsFull(packet_queue)) {
+				continue;
+			}
+
+			int status = ReadPacketAtIndex(video_context, thisDecoderIndex, &entry);
+			if (status == AVERROR(EAGAIN)) {
+				continue;
+			}
+			progress = true;
+
+			if (status < 0)
+			{
+				DPRINT_DECODER("end of input");
+				CloseInputAtIndex(video_context, thisDecoderIndex);
+				active[i] = false;
+				numActive--;
+
+				/* the queue was not full, so this does not block */
+				if (PKT_Q_OK != SendEosMarker(video_context, thisDecoderIndex)) {
+					goto done;
+				}
+				continue;
+			}
+
+			/* we are the only producer, so the queue is still not full */
+			if (PKT_Q_OK != QueuePacketAtIndex(video_context, thisDecoderIndex, &entry, MSG_Q_NO_WAIT)) {
+				pktQEntryRelease(&entry);
+				goto done;
+			}
+		}
+
+		if (!progress) {
+			usleep(DEMUX_IDLE_SLEEP_US);
+		}
+	}
+
+done:
+	for (i = 0; i < thread_context->numSources; i++)
+	{
+		CloseInputAtIndex(video_context, thread_context->sourceIndices[i]);
+	}
+	return NULL;
+}
+
+/******************************************************************************
+ * Decode stage
+ *****************************************************************************/
+static void CloseDecoderAtIndex(struct Demo_VideoContext *video_context,
+		size_t i)
+{
+	if (NULL != video_context->codec_contexts[i]) {
+		avcodec_free_context(&video_context->codec_contexts[i]);
+	}
+}
+
+/**
+ * Creates the decoder for the stream announced by a NEW_STREAM marker.
+ *
+ * Decoded frames are reference counted, so frames still held by the
+ * renderer stay valid after the previous decoder has been closed.
+ */
+static bool OpenDecoderAtIndex(struct Demo_VideoContext *video_context,
+		size_t thisDecoderIndex,
+		const AVCodecParameters *codecpar,
+		AVRational timeBase)
+{
+	AVCodecContext *codec_context = NULL;
+	AVCodec *codec = NULL;
+
+	CloseDecoderAtIndex(video_context, thisDecoderIndex);
+
+	codec = avcodec_find_decoder(codecpar->codec_id);
+	if (!codec) {
+		DPRINT_DECODER("No codec decoder found");
+		goto fail;
+	}
+
+	codec_context = avcodec_alloc_context3(codec);
+	if (!codec_context) {
+		DPRINT_DECODER("No codec context found");
+		goto fail;
+	}
+
+	if (avcodec_parameters_to_context(codec_context, codecpar) < 0) {
+		DPRINT_DECODER("Failed to set the codec parameters");
+		goto fail;
+	}
+
+	codec_context->refcounted_frames = 1;
+	codec_context->pkt_timebase = timeBase;
+	if (IsLiveSourcePath(video_context->stream_paths[thisDecoderIndex])) {
+		codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	}
+
+	if (avcodec_open2(codec_context, codec, NULL) < 0) {
+		DPRINT_DECODER("Failed to open codec");
+		goto fail;
+	}
+
+	video_context->codec_contexts[thisDecoderIndex] = codec_context;
+	return true;
+
+fail:
+	if (codec_context) {
+		avcodec_free_context(&codec_context);
+	}
+	return false;
+}
+
+/**
+ * Decodes one packet into a frame handed back by the renderer.
+ * An empty packet drains the frames delayed inside the decoder.
+ * Returns true if a frame was submitted.
+ */
+static bool DecodePacketAtIndex(struct Demo_VideoContext *video_context,
+		size_t thisDecoderIndex,
+		AVPacket *packet,
+		uint64_t demuxUs,
+		size_t decodedFrameIndex)
+{
+	AVCodecContext *codec_context = video_context->codec_contexts[thisDecoderIndex];
+
+	struct FrameData frameData = {};
+	int q_status = -1;
+	q_status = msgQReceive(FrameQueuesReturnedToDecoder[thisDecoderIndex],
+			(char*)&frameData,
+			sizeof(frameData),
+			MSG_Q_WAIT_FOREVER);
+	if (q_status != sizeof(struct FrameData))
+	{
+		DPRINT_DECODER("failed to get the temporary frame");
+		return false;
+	}
+
+	AVFrame *frame = NULL;
+	frame = frameData.frame;
+	av_frame_unref(frame);
+
+	/**
+	 * The decoder may reorder and delay frames, so let it carry the
+	 * demux timestamp through to the frame it actually outputs.
+	 */
+	codec_context->reordered_opaque = demuxUs;
+
+	int frame_done = 0;
+	avcodec_decode_video2(
+			codec_context,
+			frame,
+			&frame_done,
+			packet);
+	if (!frame_done) {
+		DPRINT_DECODER("failed to decode the frame");
+
+		/**
+		 * after initialization, for some time the frames are not decoded
+		 * perhaps FFMPEG uses some kind of a non-blocking queue internally
+		 */
+		if (!packet->size || (decodedFrameIndex < 100) || gAppOptions.offline) {
+			ReturnFrameToDecoderQueue(frame, thisDecoderIndex);
+			return false;
+		}
+
+		/**
+		 * should we break the loop if we still have not received
+		 * a frame after 100 iterations?
+		 */
+	}
+
+	DPRINT_DECODER("Decoded frame data=%p fmt=%x width=%d height=%d",
+		frame->data[0],
+		frame->format,
+		frame->width,
+		frame->height);
+
+	int64_t ptsUs = AV_NOPTS_VALUE;
+	if (frame_done && (frame->best_effort_timestamp != AV_NOPTS_VALUE)) {
+		ptsUs = av_rescale_q(frame->best_effort_timestamp,
+				codec_context->pkt_timebase, AV_TIME_BASE_Q);
+	}
+
+	if (frame_done
+		&& !IsInOfflineRange(ptsUs, video_context->stream_start_us[thisDecoderIndex]))
+	{
+		/* outside of the chunk given to this process */
+		ReturnFrameToDecoderQueue(frame, thisDecoderIndex);
+		return true;
+	}
+
+	if (frame_done && video_context->recorders[thisDecoderIndex])
+	{
+		rawWriterAppend(video_context->recorders[thisDecoderIndex], frame, ptsUs);
+	}
+
+	SubmitFrameFromDecoder(frame, thisDecoderIndex, frame->reordered_opaque, ptsUs);
+	return true;
+}
+
+/******************************************************************************
+ * Decoder worker pool
+ *
+ * DECODER_WORKER_THREADS workers service all sources. A source is ready
+ * when it has a queued packet and a free frame to decode into; a worker
+ * then performs one step for it (one packet or marker) with the source
+ * marked busy, so each codec context is only ever used by one worker at
+ * a time.
+ *
+ * Ready sources are served earliest deadline first. The deadline is the
+ * output tick by which the renderer wants the next frame of the source:
+ * one frame period after it last took a frame, plus one period for
+ * every decoded frame already waiting for it.
+ * Among sources with about the same deadline, a worker keeps to the
+ * ones it decoded last so that their codec state stays in its caches.
+ *****************************************************************************/
+enum {
+	OUTPUT_FRAME_PERIOD_US = 1000000 / OUTPUT_FRAMERATE,
+
+	/* deadlines closer than this are treated as equal for stickiness */
+	DECODER_STICKY_SLACK_US = OUTPUT_FRAME_PERIOD_US / 2,
+
+	DECODER_NO_WORKER = -1,
+};
+
+struct DecoderSourceState {
+	bool busy;
+	bool finished;
+
+	/* the EOS marker was seen, the delayed frames are being flushed */
+	bool draining;
+
+	int lastWorker;
+	size_t decodedFrameIndex;
+
+	/* GetTimestampUs() when the renderer last took a frame */
+	uint64_t lastConsumedUs;
+};
+
+struct DecoderWorkerStats {
+	uint64_t steps;
+	uint64_t stickySteps;
+	uint64_t idleWaits;
+};
+
+static pthread_mutex_t DecoderSchedulerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t DecoderSchedulerCond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Bumped by every event which may make a source ready, so that a worker
+ * which found nothing to do does not miss a kick while scanning
+ */
+static uint64_t DecoderSchedulerGeneration;
+static bool DecoderSchedulerStopRequested;
+
+static struct DecoderSourceState DecoderSources[NUM_SOURCES];
+static struct DecoderWorkerStats DecoderWorkers[DECODER_WORKER_THREADS];
+
+static void NoteDecodedFrameConsumed(size_t src_idx)
+{
+	pthread_mutex_lock(&DecoderSchedulerMutex);
+	DecoderSources[src_idx].lastConsumedUs = GetTimestampUs();
+	pthread_mutex_unlock(&DecoderSchedulerMutex);
+}
+
+static void KickDecoderScheduler(void)
+{
+	pthread_mutex_lock(&DecoderSchedulerMutex);
+	DecoderSchedulerGeneration++;
+	pthread_mutex_unlock(&DecoderSchedulerMutex);
+	pthread_cond_broadcast(&DecoderSchedulerCond);
+}
+
+/**
+ * Must be called with DecoderSchedulerMutex held
+ */
+static bool IsDecoderSourceReady(struct Demo_VideoContext *video_context,
+		size_t src_idx)
+{
+	struct DecoderSourceState *source = &DecoderSources[src_idx];
+	if (source->busy || source->finished) {
+		return false;
+	}
+	if (msgQNumMsgs(FrameQueuesReturnedToDecoder[src_idx]) <= 0) {
+		return false;
+	}
+	return source->draining
+		|| (pktQNumEntries(video_context->packet_queues[src_idx]) > 0);
+}
+
+static uint64_t DecoderSourceDeadlineUs(size_t src_idx)
+{
+	int pending = msgQNumMsgs(FrameQueuesDecoded[src_idx]);
+	if (pending < 0) {
+		pending = 0;
+	}
+	return DecoderSources[src_idx].lastConsumedUs
+		+ (uint64_t)OUTPUT_FRAME_PERIOD_US * (1 + pending);
+}
+
+/**
+ * Must be called with DecoderSchedulerMutex held.
+ * Returns the source to decode next, or -1 if none is ready.
+ */
+static int PickDecoderSource(struct Demo_VideoContext *video_context, int worker)
+{
+	int best = -1;
+	uint64_t bestDeadlineUs = 0;
+	int sticky = -1;
+	uint64_t stickyDeadlineUs = 0;
+	size_t src_idx;
+
+	for (src_idx = 0; src_idx < NUM_SOURCES; src_idx++)
+	{
+		if (!IsDecoderSourceReady(video_context, src_idx)) {
+			continue;
+		}
+
+		uint64_t deadlineUs = DecoderSourceDeadlineUs(src_idx);
+		if ((best < 0) || (deadlineUs < bestDeadlineUs)) {
+			best = src_idx;
+			bestDeadlineUs = deadlineUs;
+		}
+		if ((DecoderSources[src_idx].lastWorker == worker)
+			&& ((sticky < 0) || (deadlineUs < stickyDeadlineUs)))
+		{
+			sticky = src_idx;
+			stickyDeadlineUs = deadlineUs;
+		}
+	}
+
+	if ((sticky >= 0) && (stickyDeadlineUs <= bestDeadlineUs + DECODER_STICKY_SLACK_US)) {
+		return sticky;
+	}
+	return best;
+}
+
+static bool AllDecoderSourcesFinished(void)
+{
+	size_t src_idx;
+	for (src_idx = 0; src_idx < NUM_SOURCES; src_idx++)
+	{
+		if (!DecoderSources[src_idx].finished) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Handles one entry of the packet queue of a source (or one flush step
+ * while draining). Called without the scheduler lock, with the source
+ * marked busy.
+ */
+static void DecoderStepAtIndex(struct Demo_VideoContext *video_context,
+		size_t thisDecoderIndex)
+{
+	struct DecoderSourceState *source = &DecoderSources[thisDecoderIndex];
+	PKT_Q_ID packet_queue = video_context->packet_queues[thisDecoderIndex];
+	struct PacketQueueEntry entry;
+
+	if (source->draining)
+	{
+		AVPacket flushPacket = {};
+		av_init_packet(&flushPacket);
+		if (video_context->codec_contexts[thisDecoderIndex]
+			&& DecodePacketAtIndex(video_context, thisDecoderIndex,
+				&flushPacket, 0, source->decodedFrameIndex))
+		{
+			source->decodedFrameIndex++;
+			return;
+		}
+		DPRINT_DECODER("drained");
+		CloseDecoderAtIndex(video_context, thisDecoderIndex);
+		source->finished = true;
+		SubmitEndOfStreamFromDecoder(thisDecoderIndex);
+		return;
+	}
+
+	PKT_Q_STATUS status = pktQGet(packet_queue, &entry, MSG_Q_NO_WAIT);
+	if (status == PKT_Q_TIMEOUT) {
+		return;
+	}
+	if (status != PKT_Q_OK)
+	{
+		DPRINT_DECODER("packet queue closed");
+		source->finished = true;
+		return;
+	}
+
+	if (PRINT_DEBUG_DECODER)
+	{
+		struct PacketQueueStats stats;
+		pktQGetStats(packet_queue, &stats);
+		DPRINT_DECODER("packet queue: %zu packets %zu bytes %lld us",
+				stats.packets, stats.bytes, (long long)stats.durationUs);
+	}
+
+	if (entry.flags & PKT_Q_FLAG_NEW_STREAM)
+	{
+		if (true != OpenDecoderAtIndex(video_context, thisDecoderIndex,
+				entry.codecpar, entry.timeBase))
+		{
+			/* packets are discarded until the next NEW_STREAM */
+			fprintf(stderr, "Decoder[%zu]: failed to open the decoder\n",
+					thisDecoderIndex);
+		}
+		video_context->stream_start_us[thisDecoderIndex] = entry.streamStartUs;
+		source->decodedFrameIndex = 0;
+	}
+	else if (entry.flags & PKT_Q_FLAG_EOS)
+	{
+		source->draining = true;
+	}
+	else if (video_context->codec_contexts[thisDecoderIndex])
+	{
+		DPRINT_DECODER("decodedFrameIndex=%zu", source->decodedFrameIndex);
+		++source->decodedFrameIndex;
+		DecodePacketAtIndex(video_context, thisDecoderIndex,
+				&entry.packet, entry.demuxUs, source->decodedFrameIndex);
+	}
+	pktQEntryRelease(&entry);
+}
+
+struct DecoderWorkerContext {
+	struct Demo_VideoContext *video_context;
+	int workerIndex;
+};
+
+static void *DecoderWorkerRoutine(void *context)
+{
+	struct DecoderWorkerContext *worker_context = (struct DecoderWorkerContext*)context;
+	struct Demo_VideoContext *video_context = worker_context->video_context;
+	int worker = worker_context->workerIndex;
+	struct DecoderWorkerStats *stats = &DecoderWorkers[worker];
+	int lastSource = -1;
+
+	ApplyStagePlacement(PIPELINE_STAGE_DECODE);
+
+	pthread_mutex_lock(&DecoderSchedulerMutex);
+	while (!DecoderSchedulerStopRequested && !AllDecoderSourcesFinished())
+	{
+		uint64_t generation = DecoderSchedulerGeneration;
+		int src_idx = PickDecoderSource(video_context, worker);
+		if (src_idx < 0)
+		{
+			stats->idleWaits++;
+			while (!DecoderSchedulerStopRequested
+				&& (generation == DecoderSchedulerGeneration))
+			{
+				pthread_cond_wait(&DecoderSchedulerCond, &DecoderSchedulerMutex);
+			}
+			continue;
+		}
+
+		DecoderSources[src_idx].busy = true;
+		DecoderSources[src_idx].lastWorker = worker;
+		pthread_mutex_unlock(&DecoderSchedulerMutex);
+
+		stats->steps++;
+		if (src_idx == lastSource) {
+			stats->stickySteps++;
+		}
+		lastSource = src_idx;
+		DecoderStepAtIndex(video_context, src_idx);
+
+		pthread_mutex_lock(&DecoderSchedulerMutex);
+		DecoderSources[src_idx].busy = false;
+
+		/* the source may still be ready, let the other workers look */
+		DecoderSchedulerGeneration++;
+		pthread_cond_broadcast(&DecoderSchedulerCond);
+	}
+	pthread_mutex_unlock(&DecoderSchedulerMutex);
+
+	return NULL;
+}
+
+static pthread_t DecoderWorkerHandles[DECODER_WORKER_THREADS];
+static struct DecoderWorkerContext decoderWorkerContexts[DECODER_WORKER_THREADS] = {};
+
+/******************************************************************************
+ * Replay of recorded frames
+ *
+ * A .dfraw source has neither demux nor decode stage: its thread points
+ * the AVFrames handed back by the renderer into the mapped file and
+ * submits them, paced by the recorded PTS (REPLAY_REALTIME) or as fast
+ * as the renderer takes them.
+ *****************************************************************************/
+struct ReplayThreadContext {
+	struct Demo_VideoContext *video_context;
+	size_t sourceIndex;
+};
+
+static void *ReplayThreadRoutine(void *context)
+{
+	struct ReplayThreadContext *thread_context = (struct ReplayThreadContext*)context;
+	struct Demo_VideoContext *video_context = thread_context->video_context;
+	size_t thisDecoderIndex = thread_context->sourceIndex;
+	struct RawFrameReader *reader = NULL;
+
+	ApplyStagePlacement(PIPELINE_STAGE_DECODE);
+
+	reader = rawReaderOpen(video_context->stream_paths[thisDecoderIndex]);
+	video_context->raw_readers[thisDecoderIndex] = reader;
+	if (!reader || !rawReaderNumFrames(reader)) {
+		DPRINT_DECODER("nothing to replay");
+		SubmitEndOfStreamFromDecoder(thisDecoderIndex);
+		goto done;
+	}
+
+	size_t numFrames = rawReaderNumFrames(reader);
+	size_t frameIndex = 0;
+	uint64_t passStartUs = 0;
+	int64_t passFirstPtsUs = AV_NOPTS_VALUE;
+	while (1)
+	{
+		if (frameIndex == numFrames)
+		{
+			if (!REPLAY_LOOP || gAppOptions.offline) {
+				SubmitEndOfStreamFromDecoder(thisDecoderIndex);
+				goto done;
+			}
+			frameIndex = 0;
+		}
+
+		struct FrameData frameData = {};
+		int q_status = -1;
+		q_status = msgQReceive(FrameQueuesReturnedToDecoder[thisDecoderIndex],
+				(char*)&frameData,
+				sizeof(frameData),
+				MSG_Q_WAIT_FOREVER);
+		if (q_status != sizeof(struct FrameData))
+		{
+			DPRINT_DECODER("queue closed");
+			goto done;
+		}
+
+		AVFrame *frame = frameData.frame;
+		int64_t ptsUs = AV_NOPTS_VALUE;
+		av_frame_unref(frame);
+		if (!rawReaderWrapFrame(reader, frameIndex, frame, &ptsUs))
+		{
+			ReturnFrameToDecoderQueue(frame, thisDecoderIndex);
+			goto done;
 		}
 
-		DPRINT_DECODER("Decoded frame data=%p fmt=%x width=%d height=%d",
-			frame->data[0],
-			frame->format,
-			frame->width,
-			frame->height);
+		if (REPLAY_REALTIME && !gAppOptions.offline)
+		{
+			if (frameIndex == 0) {
+				passStartUs = GetTimestampUs();
+				passFirstPtsUs = ptsUs;
+			}
+
+			int64_t offsetUs = (int64_t)frameIndex * OUTPUT_FRAME_PERIOD_US;
+			if ((ptsUs != AV_NOPTS_VALUE) && (passFirstPtsUs != AV_NOPTS_VALUE)) {
+				offsetUs = ptsUs - passFirstPtsUs;
+			}
 
-		SubmitFrameFromDecoder(frame, thisDecoderIndex);
+			uint64_t nowUs = GetTimestampUs();
+			uint64_t targetUs = passStartUs + offsetUs;
+			if (targetUs > nowUs) {
+				usleep(targetUs - nowUs);
+			}
+		}
+
+		SubmitFrameFromDecoder(frame, thisDecoderIndex, GetTimestampUs(), ptsUs);
+		frameIndex++;
 	}
 
 done:
-	DPRINT_DECODER("done");
+	DPRINT_DECODER("replay done");
 	return NULL;
 }
 
-static pthread_t DecoderThreadHandles[NUM_SRC_STREAMS];
-static struct DecoderThreadContext decoderThreadContexts[NUM_SRC_STREAMS] = {};
+static pthread_t ReplayThreadHandles[NUM_SOURCES];
+static struct ReplayThreadContext replayThreadContexts[NUM_SOURCES] = {};
+static size_t NumReplayThreads;
+
+/******************************************************************************
+ * Shared-memory camera ingest
+ *
+ * A shm:// source has neither demux nor decode stage either: its thread
+ * points the AVFrames handed back by the renderer at the slots of the
+ * producer's ring as they are published. A slot goes back to the
+ * producer when its frame comes back through FrameQueuesReturnedToDecoder,
+ * so the producer never overwrites a frame which is still queued or being
+ * uploaded. When the producer goes away, the thread waits for all frames
+ * of the source before unmapping the ring and connecting again.
+ *****************************************************************************/
+enum ShmIngestResult {
+	SHM_INGEST_STOPPED,
+	SHM_INGEST_PRODUCER_GONE,
+	SHM_INGEST_END_OF_STREAM,
+};
+
+struct ShmIngestThreadContext {
+	struct Demo_VideoContext *video_context;
+	size_t sourceIndex;
+};
+
+/**
+ * A frame pointing into the ring carries its slot + 1 in opaque,
+ * which av_frame_unref clears
+ */
+static void ReleaseShmIngestFrame(struct ShmRingReader *reader, AVFrame *frame)
+{
+	if (frame->opaque) {
+		shmReaderReleaseFrame(reader, (uint32_t)((uintptr_t)frame->opaque - 1));
+	}
+	av_frame_unref(frame);
+}
+
+static void WrapShmIngestFrame(const struct ShmRingHeader *header,
+		const struct ShmRingFrame *shmFrame,
+		AVFrame *frame)
+{
+	int plane;
+	frame->format = AV_PIX_FMT_YUV420P;
+	frame->width = header->width;
+	frame->height = header->height;
+	frame->colorspace = AVCOL_SPC_BT470BG;
+	frame->color_range = AVCOL_RANGE_MPEG;
+	for (plane = 0; plane < 3; plane++)
+	{
+		frame->data[plane] = (uint8_t*)shmFrame->planes[plane];
+		frame->linesize[plane] = header->linesizes[plane];
+	}
+	frame->opaque = (void*)(uintptr_t)(shmFrame->slot + 1);
+}
+
+/**
+ * Waits until every frame of the source has come back, releasing their
+ * slots, and hands them back to the queue. Fails once the queues are
+ * deleted.
+ */
+static bool CollectShmIngestFrames(struct ShmRingReader *reader, int index, AVFrame *inHand)
+{
+	AVFrame *frames[DECODER_QUEUE_DEPTH];
+	size_t numFrames = 0;
+	size_t i;
+
+	frames[numFrames++] = inHand;
+	while (numFrames < DECODER_QUEUE_DEPTH)
+	{
+		struct FrameData frameData = {};
+		int q_status = -1;
+		q_status = msgQReceive(FrameQueuesReturnedToDecoder[index],
+				(char*)&frameData,
+				sizeof(frameData),
+				MSG_Q_WAIT_FOREVER);
+		if (q_status != sizeof(struct FrameData)) {
+			return false;
+		}
+		ReleaseShmIngestFrame(reader, frameData.frame);
+		frames[numFrames++] = frameData.frame;
+	}
+
+	for (i = 0; i < numFrames; i++) {
+		ReturnFrameToDecoderQueue(frames[i], index);
+	}
+	return true;
+}
+
+static enum ShmIngestResult RunShmIngest(struct ShmRingReader *reader, size_t thisDecoderIndex)
+{
+	int index = (int)thisDecoderIndex;
+	const struct ShmRingHeader *header = shmReaderGetHeader(reader);
+
+	while (1)
+	{
+		struct FrameData frameData = {};
+		int q_status = -1;
+		q_status = msgQReceive(FrameQueuesReturnedToDecoder[index],
+				(char*)&frameData,
+				sizeof(frameData),
+				MSG_Q_WAIT_FOREVER);
+		if (q_status != sizeof(struct FrameData))
+		{
+			DPRINT_DECODER("queue closed");
+			return SHM_INGEST_STOPPED;
+		}
+
+		AVFrame *frame = frameData.frame;
+		ReleaseShmIngestFrame(reader, frame);
+
+		struct ShmRingFrame shmFrame;
+		enum ShmReadStatus status;
+		while (1)
+		{
+			status = shmReaderAcquireFrame(reader, &shmFrame);
+			if ((status != SHM_READ_NO_FRAME)
+				|| shmReaderWriterGone(reader)
+				|| DemuxStopRequested)
+			{
+				break;
+			}
+			shmReaderWait(reader, LIVE_STALL_TIMEOUT_MS);
+		}
+
+		if (status != SHM_READ_FRAME)
+		{
+			if (!CollectShmIngestFrames(reader, index, frame) || DemuxStopRequested) {
+				return SHM_INGEST_STOPPED;
+			}
+			return (status == SHM_READ_END_OF_STREAM)
+				? SHM_INGEST_END_OF_STREAM : SHM_INGEST_PRODUCER_GONE;
+		}
+
+		WrapShmIngestFrame(header, &shmFrame, frame);
+		SubmitFrameFromDecoder(frame, index, shmFrame.publishedUs, shmFrame.ptsUs);
+	}
+}
+
+static void *ShmIngestThreadRoutine(void *context)
+{
+	struct ShmIngestThreadContext *thread_context = (struct ShmIngestThreadContext*)context;
+	struct Demo_VideoContext *video_context = thread_context->video_context;
+	size_t thisDecoderIndex = thread_context->sourceIndex;
+	const char *socketPath = video_context->stream_paths[thisDecoderIndex]
+		+ strlen(SHM_SOURCE_PREFIX);
+
+	ApplyStagePlacement(PIPELINE_STAGE_DECODE);
+
+	while (!DemuxStopRequested)
+	{
+		struct ShmRingReader *reader = shmReaderConnect(socketPath);
+		if (!reader)
+		{
+			if (!WaitBeforeReconnect()) {
+				break;
+			}
+			continue;
+		}
+
+		const struct ShmRingHeader *header = shmReaderGetHeader(reader);
+		if ((header->pixelFormat != SHM_RING_FORMAT_I420)
+			|| !(header->flags & SHM_RING_FLAG_RETURN_SLOTS))
+		{
+			fprintf(stderr, "Decoder[%zu]: '%s' is not an I420 ring returning its slots\n",
+					thisDecoderIndex, socketPath);
+			shmReaderClose(reader);
+			if (!WaitBeforeReconnect()) {
+				break;
+			}
+			continue;
+		}
+		DPRINT_DECODER("connected to '%s' %dx%d", socketPath, header->width, header->height);
+
+		enum ShmIngestResult result = RunShmIngest(reader, thisDecoderIndex);
+		if (result == SHM_INGEST_STOPPED)
+		{
+			/* the renderer may still point into the ring */
+			video_context->shm_readers[thisDecoderIndex] = reader;
+			break;
+		}
+		shmReaderClose(reader);
+
+		if ((result == SHM_INGEST_END_OF_STREAM) || gAppOptions.offline)
+		{
+			SubmitEndOfStreamFromDecoder(thisDecoderIndex);
+			break;
+		}
+		DPRINT_DECODER("producer of '%s' went away, reconnecting", socketPath);
+		if (!WaitBeforeReconnect()) {
+			break;
+		}
+	}
+
+	DPRINT_DECODER("shm ingest done");
+	return NULL;
+}
+
+static pthread_t ShmIngestThreadHandles[NUM_SOURCES];
+static struct ShmIngestThreadContext shmIngestThreadContexts[NUM_SOURCES] = {};
+static size_t NumShmIngestThreads;
+
+/**
+ * One thread per live source plus one shared by all file sources
+ */
+static pthread_t DemuxThreadHandles[NUM_SOURCES];
+static struct DemuxThreadContext demuxThreadContexts[NUM_SOURCES] = {};
+static size_t NumDemuxThreads;
+
+static void StartDemuxThreads(struct Demo_VideoContext *video_context)
+{
+	struct DemuxThreadContext *fileContext = NULL;
+	size_t streamIndex;
+
+	for (streamIndex = 0; streamIndex < NUM_SOURCES; streamIndex++)
+	{
+		if (IsReplaySourcePath(video_context->stream_paths[streamIndex]))
+		{
+			struct ReplayThreadContext *replayContext = replayThreadContexts + NumReplayThreads;
+			replayContext->video_context = video_context;
+			replayContext->sourceIndex = streamIndex;
+			assert(0 == pthread_create(ReplayThreadHandles + NumReplayThreads,
+					NULL,
+					ReplayThreadRoutine,
+					replayContext));
+			NumReplayThreads++;
+			continue;
+		}
+
+		if (IsShmSourcePath(video_context->stream_paths[streamIndex]))
+		{
+			struct ShmIngestThreadContext *shmContext = shmIngestThreadContexts + NumShmIngestThreads;
+			shmContext->video_context = video_context;
+			shmContext->sourceIndex = streamIndex;
+			assert(0 == pthread_create(ShmIngestThreadHandles + NumShmIngestThreads,
+					NULL,
+					ShmIngestThreadRoutine,
+					shmContext));
+			NumShmIngestThreads++;
+			continue;
+		}
+
+		if (IsLiveSourcePath(video_context->stream_paths[streamIndex]))
+		{
+			struct DemuxThreadContext *liveContext = demuxThreadContexts + NumDemuxThreads;
+			liveContext->video_context = video_context;
+			liveContext->sourceIndices[liveContext->numSources++] = streamIndex;
+			assert(0 == pthread_create(DemuxThreadHandles + NumDemuxThreads,
+					NULL,
+					LiveDemuxThreadRoutine,
+					liveContext));
+			NumDemuxThreads++;
+			continue;
+		}
+
+		if (!fileContext) {
+			fileContext = demuxThreadContexts + NumDemuxThreads++;
+			fileContext->video_context = video_context;
+		}
+		fileContext->sourceIndices[fileContext->numSources++] = streamIndex;
+	}
+
+	if (fileContext) {
+		assert(0 == pthread_create(DemuxThreadHandles + (fileContext - demuxThreadContexts),
+				NULL,
+				FileDemuxThreadRoutine,
+				fileContext));
+	}
+}
 
 extern void InitializeDecoders(void) {
 	size_t streamIndex;
 	av_register_all();
 	avformat_network_init();
 
-	for (streamIndex = 0; streamIndex < NUM_SRC_STREAMS; streamIndex++)
+	for (streamIndex = 0; streamIndex < NUM_SOURCES; streamIndex++)
+	{
+		video_context.stream_paths[streamIndex] = gAppOptions.sourcePaths[streamIndex]
+			? gAppOptions.sourcePaths[streamIndex]
+			: GetDefaultSourcePath(streamIndex);
+		MailboxSources[streamIndex] = IsLiveSourcePath(video_context.stream_paths[streamIndex]);
+	}
+
+	for (streamIndex = 0; streamIndex < NUM_SOURCES; streamIndex++)
 	{
 		FrameQueuesDecoded[streamIndex] = msgQCreate(
 				DECODER_QUEUE_DEPTH,
@@ -312,18 +1643,54 @@ extern void InitializeDecoders(void) {
 				sizeof(struct FrameData),
 				MSG_Q_FIFO);
 		assert(NULL != FrameQueuesReturnedToDecoder[streamIndex]);
+
+		video_context.packet_queues[streamIndex] = pktQCreate(
+				PACKET_QUEUE_MAX_BYTES,
+				PACKET_QUEUE_MAX_DURATION_MS * 1000LL);
+		assert(NULL != video_context.packet_queues[streamIndex]);
+	}
+
+	for (streamIndex = 0; streamIndex < NUM_SOURCES; streamIndex++)
+	{
+		DecoderSources[streamIndex].lastWorker = DECODER_NO_WORKER;
+		DecoderSources[streamIndex].lastConsumedUs = GetTimestampUs();
+
+		const char *path = video_context.stream_paths[streamIndex];
+		if (IsReplaySourcePath(path) || IsShmSourcePath(path))
+		{
+			/* fed by its own thread, the decoder workers skip it */
+			DecoderSources[streamIndex].finished = true;
+		}
+		else if (RawRecordDir)
+		{
+			char recordPath[512];
+			snprintf(recordPath, sizeof(recordPath), "%s/cam%zu%s",
+					RawRecordDir, streamIndex, RAW_FRAME_FILE_SUFFIX);
+			video_context.recorders[streamIndex] = rawWriterOpen(recordPath);
+		}
+
+		size_t tmpFrame = 0;
+		for (tmpFrame = 0; tmpFrame < DECODER_QUEUE_DEPTH; tmpFrame++)
+		{
+			AVFrame *frame = av_frame_alloc();
+			assert(NULL != frame);
+			ReturnFrameToDecoderQueue(frame, streamIndex);
+		}
 	}
 
-	for (streamIndex = 0; streamIndex < NUM_SRC_STREAMS; streamIndex++)
+	int worker;
+	for (worker = 0; worker < DECODER_WORKER_THREADS; worker++)
 	{
-		decoderThreadContexts[streamIndex].video_context = &video_context;
-		decoderThreadContexts[streamIndex].decoderIndex = streamIndex;
-		assert(0 == pthread_create(DecoderThreadHandles + streamIndex,
+		decoderWorkerContexts[worker].video_context = &video_context;
+		decoderWorkerContexts[worker].workerIndex = worker;
+		assert(0 == pthread_create(DecoderWorkerHandles + worker,
 				NULL,
-				DecoderThreadRoutine,
-				decoderThreadContexts + streamIndex));
+				DecoderWorkerRoutine,
+				decoderWorkerContexts + worker));
 	}
 
+	StartDemuxThreads(&video_context);
+
 done:
 	return;
 }
@@ -331,19 +1698,90 @@ done:
 extern void WaitAndReleaseDecoders(void)
 {
 	size_t streamIndex;
-	for (streamIndex = 0; streamIndex < NUM_SRC_STREAMS; streamIndex++)
+
+	DemuxStopRequested = true;
+	pthread_mutex_lock(&DecoderSchedulerMutex);
+	DecoderSchedulerStopRequested = true;
+	pthread_mutex_unlock(&DecoderSchedulerMutex);
+	pthread_cond_broadcast(&DecoderSchedulerCond);
+
+	for (streamIndex = 0; streamIndex < NUM_SOURCES; streamIndex++)
 	{
 		/**
 		 * msgQDelete currently does not release memory but instead
 		 * unblocks all waiters and returns an error code to them.
 		 *
-		 * This way we can unblock all the decoder threads and wait
-		 * until they terminate using pthread_join
+		 * This way we can unblock all the decoder and demux threads
+		 * and wait until they terminate using pthread_join
 		 */
 		msgQDelete(FrameQueuesDecoded[streamIndex]);
 		msgQDelete(FrameQueuesReturnedToDecoder[streamIndex]);
+		pktQDelete(video_context.packet_queues[streamIndex]);
+	}
+
+	int worker;
+	for (worker = 0; worker < DECODER_WORKER_THREADS; worker++)
+	{
+		void *retval;
+		pthread_join(DecoderWorkerHandles[worker], &retval);
+
+		struct DecoderWorkerStats *stats = &DecoderWorkers[worker];
+		fprintf(stderr, "DecoderWorker[%d]: %llu steps, %llu on the same source, "
+				"%llu idle waits\n",
+				worker,
+				(unsigned long long)stats->steps,
+				(unsigned long long)stats->stickySteps,
+				(unsigned long long)stats->idleWaits);
+	}
+
+	for (streamIndex = 0; streamIndex < NUM_SOURCES; streamIndex++)
+	{
+		CloseDecoderAtIndex(&video_context, streamIndex);
+
+		if (UseDecoderMailbox(streamIndex))
+		{
+			fprintf(stderr, "Decoder[%zu]: %zu frames replaced in mailbox\n",
+					streamIndex, FramesReplacedInMailbox[streamIndex]);
+		}
 
+		struct PacketQueueStats stats;
+		GetSourcePacketQueueStats(streamIndex, &stats);
+		fprintf(stderr, "Decoder[%zu]: %llu packets, peak queue %zu/%zu bytes "
+				"%lld/%lld ms, demuxer waited %llu\n",
+				streamIndex,
+				(unsigned long long)stats.totalPackets,
+				stats.peakBytes, stats.maxBytes,
+				(long long)stats.peakDurationUs / 1000,
+				(long long)stats.maxDurationUs / 1000,
+				(unsigned long long)stats.putWaits);
+	}
+
+	for (streamIndex = 0; streamIndex < NumDemuxThreads; streamIndex++)
+	{
+		void *retval;
+		pthread_join(DemuxThreadHandles[streamIndex], &retval);
+	}
+
+	for (streamIndex = 0; streamIndex < NumReplayThreads; streamIndex++)
+	{
 		void *retval;
-		pthread_join(DecoderThreadHandles[streamIndex], &retval);
+		pthread_join(ReplayThreadHandles[streamIndex], &retval);
+	}
+
+	for (streamIndex = 0; streamIndex < NumShmIngestThreads; streamIndex++)
+	{
+		void *retval;
+		pthread_join(ShmIngestThreadHandles[streamIndex], &retval);
+	}
+
+	/* the renderer has stopped, nothing points into the mappings any more */
+	for (streamIndex = 0; streamIndex < NUM_SOURCES; streamIndex++)
+	{
+		rawWriterClose(video_context.recorders[streamIndex]);
+		video_context.recorders[streamIndex] = NULL;
+		rawReaderClose(video_context.raw_readers[streamIndex]);
+		video_context.raw_readers[streamIndex] = NULL;
+		shmReaderClose(video_context.shm_readers[streamIndex]);
+		video_context.shm_readers[streamIndex] = NULL;
 	}
 }
@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include "defish_app.h"
+
+/******************************************************************************
+ * Glass-to-glass latency statistics
+ *
+ * Samples are recorded by the encoder side once a frame has been pushed
+ * to GStreamer and may be queried from any thread while running.
+ *****************************************************************************/
+
+static pthread_mutex_t LatencyStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct LatencyHistogram LatencyHistograms[NUM_LATENCY_HISTOGRAMS];
+
+static const char *LatencyHistogramNames[NUM_LATENCY_HISTOGRAMS] = {
+	"demux->decode",
+	"decode->upload",
+	"upload->render",
+	"render->readback",
+	"readback->push",
+	"end-to-end",
+};
+
+static size_t LatencyBucketIndex(uint64_t us)
+{
+	size_t bucket = 0;
+	while (us && (bucket < NUM_LATENCY_BUCKETS - 1))
+	{
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void LatencyHistogramAdd(struct LatencyHistogram *hist, uint64_t us)
+{
+	hist->count++;
+	hist->sumUs += us;
+	if (us > hist->maxUs) {
+		hist->maxUs = us;
+	}
+	hist->buckets[LatencyBucketIndex(us)]++;
+}
+
+void LatencyStatsRecord(const struct FrameData *frameData)
+{
+	const uint64_t *ts = frameData->timestampsUs;
+	size_t stage;
+
+	/**
+	 * Output frames which did not carry any new camera frame
+	 * have nothing to measure
+	 */
+	if (!ts[LATENCY_TS_DEMUX] || !ts[LATENCY_TS_PUSHED]) {
+		return;
+	}
+
+	pthread_mutex_lock(&LatencyStatsMutex);
+	for (stage = 0; stage < NUM_LATENCY_STAGES; stage++)
+	{
+		if (ts[stage] && ts[stage + 1] >= ts[stage]) {
+			LatencyHistogramAdd(&LatencyHistograms[stage],
+					ts[stage + 1] - ts[stage]);
+		}
+	}
+	if (ts[LATENCY_TS_PUSHED] >= ts[LATENCY_TS_DEMUX]) {
+		LatencyHistogramAdd(&LatencyHistograms[LATENCY_END_TO_END],
+				ts[LATENCY_TS_PUSHED] - ts[LATENCY_TS_DEMUX]);
+	}
+	pthread_mutex_unlock(&LatencyStatsMutex);
+}
+
+void LatencyStatsGet(struct LatencyHistogram histograms[NUM_LATENCY_HISTOGRAMS])
+{
+	pthread_mutex_lock(&LatencyStatsMutex);
+	memcpy(histograms, LatencyHistograms, sizeof(LatencyHistograms));
+	pthread_mutex_unlock(&LatencyStatsMutex);
+}
+
+/**
+ * Upper bound of the bucket containing the given percentile
+ */
+static uint64_t LatencyPercentileUs(const struct LatencyHistogram *hist, unsigned percent)
+{
+	uint64_t target = (hist->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	size_t bucket;
+	for (bucket = 0; bucket < NUM_LATENCY_BUCKETS; bucket++)
+	{
+		seen += hist->buckets[bucket];
+		if (seen >= target) {
+			return 1ULL << bucket;
+		}
+	}
+	return hist->maxUs;
+}
+
+void LatencyStatsDump(FILE *out)
+{
+	struct LatencyHistogram histograms[NUM_LATENCY_HISTOGRAMS];
+	size_t idx;
+
+	LatencyStatsGet(histograms);
+
+	fprintf(out, "Latency (us): %-16s %8s %10s %10s %10s %10s\n",
+			"stage", "frames", "avg", "p50<=", "p99<=", "max");
+	for (idx = 0; idx < NUM_LATENCY_HISTOGRAMS; idx++)
+	{
+		const struct LatencyHistogram *hist = &histograms[idx];
+		if (!hist->count) {
+			fprintf(out, "Latency (us): %-16s %8d\n", LatencyHistogramNames[idx], 0);
+			continue;
+		}
+		fprintf(out, "Latency (us): %-16s %8llu %10llu %10llu %10llu %10llu\n",
+				LatencyHistogramNames[idx],
+				(unsigned long long)hist->count,
+				(unsigned long long)(hist->sumUs / hist->count),
+				(unsigned long long)LatencyPercentileUs(hist, 50),
+				(unsigned long long)LatencyPercentileUs(hist, 99),
+				(unsigned long long)hist->maxUs);
+	}
+}
+
+/******************************************************************************
+ * Change detection statistics
+ *****************************************************************************/
+
+static pthread_mutex_t ChangeStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ChangeDetectionStats ChangeStats;
+
+void ChangeStatsRecordCamera(bool skipped)
+{
+	pthread_mutex_lock(&ChangeStatsMutex);
+	ChangeStats.cameraFrames++;
+	if (skipped) {
+		ChangeStats.cameraFramesSkipped++;
+	}
+	pthread_mutex_unlock(&ChangeStatsMutex);
+}
+
+void ChangeStatsRecordOutput(bool skipped)
+{
+	pthread_mutex_lock(&ChangeStatsMutex);
+	ChangeStats.outputFrames++;
+	if (skipped) {
+		ChangeStats.outputFramesSkipped++;
+	}
+	pthread_mutex_unlock(&ChangeStatsMutex);
+}
+
+void ChangeStatsGet(struct ChangeDetectionStats *stats)
+{
+	pthread_mutex_lock(&ChangeStatsMutex);
+	*stats = ChangeStats;
+	pthread_mutex_unlock(&ChangeStatsMutex);
+}
+
+static double SkipPercent(uint64_t skipped, uint64_t total)
+{
+	return total ? 100.0 * skipped / total : 0.0;
+}
+
+void ChangeStatsDump(FILE *out)
+{
+	struct ChangeDetectionStats stats;
+	ChangeStatsGet(&stats);
+
+	fprintf(out, "Change detection: %llu camera frames, %.1f%% skipped;"
+			" %llu output frames, %.1f%% skipped\n",
+			(unsigned long long)stats.cameraFrames,
+			SkipPercent(stats.cameraFramesSkipped, stats.cameraFrames),
+			(unsigned long long)stats.outputFrames,
+			SkipPercent(stats.outputFramesSkipped, stats.outputFrames));
+}
@@ -15,6 +15,7 @@
  * [x] msgQSend priority
  * [x] msgQReceive
  * [x] msgQDelete
+ * [x] msgQSend/msgQReceive timeout (in milliseconds)
  * [ ] msgQDelete safe -> needs VxWorks-like wrapper struct
  */
 
@@ -42,6 +43,20 @@ struct msg_q {
 
 typedef struct msg_q msg_q;
 
+/**
+ * Converts a relative timeout in milliseconds to the absolute deadline
+ * expected by pthread_cond_timedwait.
+ * MSG_Q_NO_WAIT (0) yields "now", i.e. the wait expires immediately.
+ */
+static void msgQDeadline(struct timespec *ts, int timeout) {
+  struct timeval now = {};
+  gettimeofday(&now, NULL);
+
+  uint64_t nsec = now.tv_usec * 1000ULL + (uint64_t)timeout * 1000000ULL;
+  ts->tv_sec = now.tv_sec + nsec / 1000000000ULL;
+  ts->tv_nsec = nsec % 1000000000ULL;
+}
+
 MSG_Q_ID msgQCreate(int maxMsgs, int maxMsgLength, int options) {
   msg_q *q = NULL;
   MSG_Q_CHECK(maxMsgs > 0);
@@ -94,9 +109,18 @@ MSG_Q_STATUS msgQSend(MSG_Q_ID msgQId, char *buffer, size_t nBytes, int timeout,
   MSG_Q_STATUS rc = MSG_Q_ERROR;
   MSG_Q_CHECK(NULL != msgQId);
 
+  struct timespec ts = {};
+  if (timeout != MSG_Q_WAIT_FOREVER) {
+    msgQDeadline(&ts, timeout);
+  }
+
   pthread_mutex_lock(&msgQId->q_mutex);
   while ((!msgQId->isDestroyed) && (msgQId->used >= msgQId->capacity)) {
-    pthread_cond_wait(&msgQId->q_cond, &msgQId->q_mutex);
+    if (timeout == MSG_Q_WAIT_FOREVER) {
+      pthread_cond_wait(&msgQId->q_cond, &msgQId->q_mutex);
+    } else if (pthread_cond_timedwait(&msgQId->q_cond, &msgQId->q_mutex, &ts)) {
+      goto timeout;
+    }
   }
 
   MSG_Q_CHECK(!msgQId->isDestroyed);
@@ -122,12 +146,20 @@ failed:
   pthread_mutex_unlock(&msgQId->q_mutex);
   pthread_cond_broadcast(&msgQId->q_cond);
   return rc;
+timeout:
+  pthread_mutex_unlock(&msgQId->q_mutex);
+  return rc;
 }
 
 MSG_Q_STATUS msgQReceive(MSG_Q_ID msgQId, char *buffer, size_t maxNBytes, int timeout) {
   MSG_Q_STATUS rc = MSG_Q_ERROR;
   MSG_Q_CHECK(NULL != msgQId);
 
+  struct timespec ts = {};
+  if (timeout != MSG_Q_WAIT_FOREVER) {
+    msgQDeadline(&ts, timeout);
+  }
+
   pthread_mutex_lock(&msgQId->q_mutex);
   while ((!msgQId->isDestroyed) && (msgQId->used <= 0)) {
 	if (timeout == MSG_Q_WAIT_FOREVER)
@@ -136,17 +168,7 @@ MSG_Q_STATUS msgQReceive(MSG_Q_ID msgQId, char *buffer, size_t maxNBytes, int ti
 	}
 	else
 	{
-		/**
-		 * for now, return immediately if queue is empty
-		 */
-
 		int pthr_status = -1;
-		struct timespec ts = {};
-		struct timeval now = {};
-		gettimeofday(&now, NULL);
-		ts.tv_sec = now.tv_sec;
-		ts.tv_nsec = now.tv_usec * 1000UL;
-
 		pthr_status = pthread_cond_timedwait(&msgQId->q_cond, &msgQId->q_mutex, &ts);
 
 		if (pthr_status) {
@@ -172,18 +194,23 @@ MSG_Q_STATUS msgQReceive(MSG_Q_ID msgQId, char *buffer, size_t maxNBytes, int ti
   memset(&msgQId->data[idx * maxMsgLength], 0, maxNBytes);
   rc = maxNBytes;
 
-timeout:
-  pthread_mutex_unlock(&msgQId->q_mutex);
-  return rc;
 failed:
   pthread_mutex_unlock(&msgQId->q_mutex);
+  /* wake up the senders waiting for a free slot */
   pthread_cond_broadcast(&msgQId->q_cond);
   return rc;
+timeout:
+  pthread_mutex_unlock(&msgQId->q_mutex);
+  return rc;
 }
 
 int msgQNumMsgs(MSG_Q_ID msgQId) {
+  int used;
   MSG_Q_CHECK(NULL != msgQId);
-  return msgQId->used;
+  pthread_mutex_lock(&msgQId->q_mutex);
+  used = msgQId->used;
+  pthread_mutex_unlock(&msgQId->q_mutex);
+  return used;
 failed:
   return MSG_Q_ERROR;
 }
@@ -17,11 +17,15 @@ typedef struct msg_q *MSG_Q_ID;
 MSG_Q_ID msgQCreate(int maxMsgs, int maxMsgLength, int options);
 MSG_Q_STATUS msgQDelete(MSG_Q_ID msgQId);
 
+/**
+ * Timeouts are given in milliseconds
+ */
 #define MSG_Q_NO_WAIT 0
 #define MSG_Q_WAIT_FOREVER (-1)
 
 MSG_Q_STATUS msgQSend(MSG_Q_ID msgQId, char *buffer, size_t nBytes, int timeout,
                 int priority);
 MSG_Q_STATUS msgQReceive(MSG_Q_ID msgQId, char *buffer, size_t maxNBytes, int timeout);
+int msgQNumMsgs(MSG_Q_ID msgQId);
 
 #endif //__QLIB_H__
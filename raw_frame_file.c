@@ -0,0 +1,337 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "raw_frame_file.h"
+
+enum {
+	RAW_FRAME_MAGIC = 0x57524644, /* "DFRW" */
+	RAW_FRAME_VERSION = 1,
+	RAW_FRAME_INITIAL_INDEX = 1024,
+};
+
+#define RAW_ALIGN(x, a) ((((x) + (a) - 1) / (a)) * (a))
+
+/******************************************************************************
+ * Common helpers
+ *****************************************************************************/
+static bool WriteFully(int fd, const void *data, size_t size, off_t offset)
+{
+	const uint8_t *ptr = (const uint8_t*)data;
+	while (size)
+	{
+		ssize_t written = pwrite(fd, ptr, size, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		ptr += written;
+		offset += written;
+		size -= written;
+	}
+	return true;
+}
+
+static int PlaneHeight(const AVPixFmtDescriptor *desc, int plane, int height)
+{
+	/* planes 1 and 2 are chroma, 0 and 3 luma and alpha */
+	if ((plane == 1) || (plane == 2)) {
+		return -((-height) >> desc->log2_chroma_h);
+	}
+	return height;
+}
+
+/******************************************************************************
+ * Writer
+ *****************************************************************************/
+struct RawFrameWriter {
+	int fd;
+	char path[512];
+
+	struct RawFrameFileHeader header;
+	bool formatKnown;
+	int rowBytes[RAW_FRAME_MAX_PLANES];
+	int planeHeights[RAW_FRAME_MAX_PLANES];
+
+	/* one frame in the file layout, page aligned */
+	uint8_t *scratch;
+
+	struct RawFrameIndexEntry *index;
+	size_t indexCapacity;
+	size_t skippedFrames;
+};
+
+struct RawFrameWriter *rawWriterOpen(const char *path)
+{
+	struct RawFrameWriter *writer = calloc(1, sizeof(struct RawFrameWriter));
+	if (!writer) {
+		return NULL;
+	}
+
+	writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (writer->fd < 0) {
+		fprintf(stderr, "Record: failed to create '%s': %s\n", path, strerror(errno));
+		free(writer);
+		return NULL;
+	}
+	snprintf(writer->path, sizeof(writer->path), "%s", path);
+	return writer;
+}
+
+static bool SetupWriterLayout(struct RawFrameWriter *writer, const AVFrame *frame)
+{
+	struct RawFrameFileHeader *header = &writer->header;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int numPlanes = av_pix_fmt_count_planes(frame->format);
+	int plane;
+	uint64_t offset = 0;
+
+	if (!desc || (numPlanes <= 0) || (numPlanes > RAW_FRAME_MAX_PLANES)) {
+		return false;
+	}
+	if (av_image_fill_linesizes(writer->rowBytes, frame->format, frame->width) < 0) {
+		return false;
+	}
+
+	snprintf(header->pixFmtName, sizeof(header->pixFmtName), "%s", desc->name);
+	header->width = frame->width;
+	header->height = frame->height;
+	header->colorspace = frame->colorspace;
+	header->colorRange = frame->color_range;
+	header->numPlanes = numPlanes;
+
+	for (plane = 0; plane < numPlanes; plane++)
+	{
+		writer->planeHeights[plane] = PlaneHeight(desc, plane, frame->height);
+		header->linesizes[plane] = RAW_ALIGN(writer->rowBytes[plane], RAW_FRAME_LINE_ALIGN);
+		header->planeOffsets[plane] = offset;
+		offset += (uint64_t)header->linesizes[plane] * writer->planeHeights[plane];
+	}
+	header->frameStride = RAW_ALIGN(offset, RAW_FRAME_PAGE_SIZE);
+
+	if (posix_memalign((void**)&writer->scratch, RAW_FRAME_PAGE_SIZE, header->frameStride)) {
+		writer->scratch = NULL;
+		return false;
+	}
+	memset(writer->scratch, 0, header->frameStride);
+
+	writer->formatKnown = true;
+	return true;
+}
+
+bool rawWriterAppend(struct RawFrameWriter *writer, const AVFrame *frame, int64_t ptsUs)
+{
+	struct RawFrameFileHeader *header = &writer->header;
+	int plane;
+
+	if (!writer->formatKnown)
+	{
+		if (!SetupWriterLayout(writer, frame)) {
+			writer->skippedFrames++;
+			return false;
+		}
+	}
+	else if ((frame->width != header->width)
+		|| (frame->height != header->height)
+		|| (av_pix_fmt_desc_get(frame->format) != av_pix_fmt_desc_get(av_get_pix_fmt(header->pixFmtName))))
+	{
+		writer->skippedFrames++;
+		return false;
+	}
+
+	for (plane = 0; plane < header->numPlanes; plane++)
+	{
+		av_image_copy_plane(writer->scratch + header->planeOffsets[plane],
+				header->linesizes[plane],
+				frame->data[plane],
+				frame->linesize[plane],
+				writer->rowBytes[plane],
+				writer->planeHeights[plane]);
+	}
+
+	if (header->numFrames == writer->indexCapacity)
+	{
+		size_t capacity = writer->indexCapacity ? 2 * writer->indexCapacity : RAW_FRAME_INITIAL_INDEX;
+		void *index = realloc(writer->index, capacity * sizeof(struct RawFrameIndexEntry));
+		if (!index) {
+			writer->skippedFrames++;
+			return false;
+		}
+		writer->index = index;
+		writer->indexCapacity = capacity;
+	}
+
+	uint64_t offset = RAW_FRAME_PAGE_SIZE + header->numFrames * header->frameStride;
+	if (!WriteFully(writer->fd, writer->scratch, header->frameStride, offset)) {
+		writer->skippedFrames++;
+		return false;
+	}
+
+	writer->index[header->numFrames].ptsUs = ptsUs;
+	writer->index[header->numFrames].offset = offset;
+	header->numFrames++;
+	return true;
+}
+
+void rawWriterClose(struct RawFrameWriter *writer)
+{
+	struct RawFrameFileHeader *header = NULL;
+	if (!writer) {
+		return;
+	}
+	header = &writer->header;
+
+	header->magic = RAW_FRAME_MAGIC;
+	header->version = RAW_FRAME_VERSION;
+	header->indexOffset = RAW_FRAME_PAGE_SIZE + header->numFrames * header->frameStride;
+
+	bool ok = WriteFully(writer->fd, writer->index,
+			header->numFrames * sizeof(struct RawFrameIndexEntry),
+			header->indexOffset)
+		&& WriteFully(writer->fd, header, sizeof(*header), 0);
+	ok = (0 == close(writer->fd)) && ok;
+
+	fprintf(stderr, "Record: '%s' %llu frames, %zu skipped%s\n",
+			writer->path,
+			(unsigned long long)header->numFrames,
+			writer->skippedFrames,
+			ok ? "" : ", FAILED to write the index");
+
+	free(writer->scratch);
+	free(writer->index);
+	free(writer);
+}
+
+/******************************************************************************
+ * Reader
+ *****************************************************************************/
+struct RawFrameReader {
+	uint8_t *mapping;
+	size_t mappingSize;
+
+	const struct RawFrameFileHeader *header;
+	const struct RawFrameIndexEntry *index;
+	enum AVPixelFormat format;
+};
+
+struct RawFrameReader *rawReaderOpen(const char *path)
+{
+	struct RawFrameReader *reader = NULL;
+	struct stat st = {};
+	int fd = -1;
+	int flags = MAP_PRIVATE;
+
+	fd = open(path, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st) || (st.st_size < RAW_FRAME_PAGE_SIZE)) {
+		fprintf(stderr, "Replay: failed to open '%s'\n", path);
+		goto fail;
+	}
+
+	reader = calloc(1, sizeof(struct RawFrameReader));
+	if (!reader) {
+		goto fail;
+	}
+
+#if defined(MAP_POPULATE)
+	/* fault everything in now rather than while measuring the renderer */
+	flags |= MAP_POPULATE;
+#endif
+	reader->mappingSize = st.st_size;
+	reader->mapping = mmap(NULL, reader->mappingSize, PROT_READ, flags, fd, 0);
+	if (reader->mapping == MAP_FAILED) {
+		reader->mapping = NULL;
+		fprintf(stderr, "Replay: failed to map '%s': %s\n", path, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	const struct RawFrameFileHeader *header = (const struct RawFrameFileHeader*)reader->mapping;
+	reader->header = header;
+	if ((header->magic != RAW_FRAME_MAGIC)
+		|| (header->version != RAW_FRAME_VERSION)
+		|| (header->numPlanes <= 0)
+		|| (header->numPlanes > RAW_FRAME_MAX_PLANES)
+		|| (header->indexOffset + header->numFrames * sizeof(struct RawFrameIndexEntry)
+			> reader->mappingSize))
+	{
+		fprintf(stderr, "Replay: '%s' is not a complete %s file\n",
+				path, RAW_FRAME_FILE_SUFFIX);
+		goto fail;
+	}
+
+	reader->format = av_get_pix_fmt(header->pixFmtName);
+	if (reader->format == AV_PIX_FMT_NONE) {
+		fprintf(stderr, "Replay: unknown pixel format '%.32s'\n", header->pixFmtName);
+		goto fail;
+	}
+
+	reader->index = (const struct RawFrameIndexEntry*)(reader->mapping + header->indexOffset);
+	return reader;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	rawReaderClose(reader);
+	return NULL;
+}
+
+size_t rawReaderNumFrames(const struct RawFrameReader *reader)
+{
+	return reader->header->numFrames;
+}
+
+bool rawReaderWrapFrame(const struct RawFrameReader *reader,
+		size_t frameIndex,
+		AVFrame *frame,
+		int64_t *ptsUs)
+{
+	const struct RawFrameFileHeader *header = reader->header;
+	const struct RawFrameIndexEntry *entry = NULL;
+	int plane;
+
+	if (frameIndex >= header->numFrames) {
+		return false;
+	}
+	entry = &reader->index[frameIndex];
+	if (entry->offset + header->frameStride > reader->mappingSize) {
+		return false;
+	}
+
+	frame->format = reader->format;
+	frame->width = header->width;
+	frame->height = header->height;
+	frame->colorspace = header->colorspace;
+	frame->color_range = header->colorRange;
+	for (plane = 0; plane < header->numPlanes; plane++)
+	{
+		frame->data[plane] = reader->mapping + entry->offset + header->planeOffsets[plane];
+		frame->linesize[plane] = header->linesizes[plane];
+	}
+
+	*ptsUs = entry->ptsUs;
+	return true;
+}
+
+void rawReaderClose(struct RawFrameReader *reader)
+{
+	if (!reader) {
+		return;
+	}
+	if (reader->mapping) {
+		munmap(reader->mapping, reader->mappingSize);
+	}
+	free(reader);
+}
@@ -0,0 +1,85 @@
+#ifndef __RAW_FRAME_FILE__H__
+#define __RAW_FRAME_FILE__H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/frame.h>
+
+/******************************************************************************
+ * Raw decoded-frame container (.dfraw)
+ *
+ * Stores the decoded frames of one camera so that they can be replayed
+ * without decoding. All frames share the pixel format and size of the
+ * first one.
+ *
+ * Layout, every part starting on a RAW_FRAME_PAGE_SIZE boundary:
+ * - header page (struct RawFrameFileHeader)
+ * - frames, frameStride bytes each, planes at fixed offsets inside
+ * - index: one struct RawFrameIndexEntry per frame
+ *
+ * The reader maps the file and points AVFrames straight into the
+ * mapping, so replaying costs no copies at all.
+ *****************************************************************************/
+enum {
+	RAW_FRAME_PAGE_SIZE = 4096,
+	RAW_FRAME_MAX_PLANES = 4,
+	RAW_FRAME_LINE_ALIGN = 64,
+};
+
+#define RAW_FRAME_FILE_SUFFIX ".dfraw"
+
+struct RawFrameFileHeader {
+	uint32_t magic;
+	uint32_t version;
+
+	/* by name, the AVPixelFormat values differ between FFmpeg versions */
+	char pixFmtName[32];
+	int32_t width;
+	int32_t height;
+	int32_t colorspace;
+	int32_t colorRange;
+
+	int32_t numPlanes;
+	int32_t linesizes[RAW_FRAME_MAX_PLANES];
+	uint64_t planeOffsets[RAW_FRAME_MAX_PLANES];
+	uint64_t frameStride;
+
+	uint64_t numFrames;
+	uint64_t indexOffset;
+} __attribute__((packed));
+
+struct RawFrameIndexEntry {
+	/* presentation time in microseconds, AV_NOPTS_VALUE if unknown */
+	int64_t ptsUs;
+	uint64_t offset;
+} __attribute__((packed));
+
+struct RawFrameWriter;
+struct RawFrameReader;
+
+/**
+ * Frames which do not match the format of the first frame are skipped.
+ * rawWriterClose writes the index and must be called for the file to
+ * be readable.
+ */
+struct RawFrameWriter *rawWriterOpen(const char *path);
+bool rawWriterAppend(struct RawFrameWriter *writer, const AVFrame *frame, int64_t ptsUs);
+void rawWriterClose(struct RawFrameWriter *writer);
+
+struct RawFrameReader *rawReaderOpen(const char *path);
+size_t rawReaderNumFrames(const struct RawFrameReader *reader);
+
+/**
+ * Points the (unreferenced) frame at the mapped frame data.
+ * The frame is read-only and stays valid until rawReaderClose.
+ */
+bool rawReaderWrapFrame(const struct RawFrameReader *reader,
+		size_t frameIndex,
+		AVFrame *frame,
+		int64_t *ptsUs);
+void rawReaderClose(struct RawFrameReader *reader);
+
+#endif //__RAW_FRAME_FILE__H__
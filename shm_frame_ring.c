@@ -0,0 +1,822 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shm_frame_ring.h"
+
+enum {
+	SHM_RING_MAGIC = 0x52464844, /* "DHFR" */
+	SHM_RING_VERSION = 1,
+
+	/* a reader retries a slot the writer came back to while copying */
+	SHM_RING_READ_ATTEMPTS = 4,
+};
+
+#define SHM_ALIGN(x, a) ((((x) + (a) - 1) / (a)) * (a))
+
+/**
+ * Sent with the memfd and the eventfd of the reader right after it
+ * connects. Frames after lastPublished are held for a returning reader.
+ */
+struct ShmRingHello {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t totalSize;
+	uint64_t lastPublished;
+};
+
+/**
+ * Sent by a returning reader for every slot it is done with
+ */
+struct ShmRingRelease {
+	uint32_t slot;
+	uint32_t reserved;
+};
+
+/******************************************************************************
+ * Common helpers
+ *****************************************************************************/
+static uint64_t ShmTimestampUs(void)
+{
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static struct ShmRingSlot *GetSlot(const struct ShmRingHeader *header, uint64_t frameIndex)
+{
+	uint8_t *base = (uint8_t*)header;
+	return (struct ShmRingSlot*)(base + header->slotsOffset
+			+ (frameIndex % header->numSlots) * header->slotStride);
+}
+
+static bool SetupLayout(struct ShmRingHeader *header,
+		enum ShmRingPixelFormat pixelFormat,
+		int width,
+		int height,
+		size_t numSlots,
+		uint32_t flags)
+{
+	int planeHeights[SHM_RING_MAX_PLANES] = {};
+	uint64_t offset = SHM_ALIGN(sizeof(struct ShmRingSlot), SHM_RING_LINE_ALIGN);
+	uint32_t plane;
+
+	if ((width <= 0) || (height <= 0) || (numSlots < 2)) {
+		return false;
+	}
+
+	header->magic = SHM_RING_MAGIC;
+	header->version = SHM_RING_VERSION;
+	header->pixelFormat = pixelFormat;
+	header->width = width;
+	header->height = height;
+	header->numSlots = numSlots;
+	header->flags = flags;
+
+	if (pixelFormat == SHM_RING_FORMAT_I420)
+	{
+		if ((width % 2) || (height % 2)) {
+			return false;
+		}
+		header->numPlanes = 3;
+		header->linesizes[0] = SHM_ALIGN(width, SHM_RING_LINE_ALIGN);
+		header->linesizes[1] = SHM_ALIGN(width / 2, SHM_RING_LINE_ALIGN);
+		header->linesizes[2] = header->linesizes[1];
+		planeHeights[0] = height;
+		planeHeights[1] = height / 2;
+		planeHeights[2] = height / 2;
+	}
+	else
+	{
+		/* whole pixels per row, which glPixelStorei can express */
+		header->numPlanes = 1;
+		header->linesizes[0] = SHM_ALIGN(width, SHM_RING_LINE_ALIGN) * 3;
+		planeHeights[0] = height;
+	}
+
+	for (plane = 0; plane < header->numPlanes; plane++)
+	{
+		header->planeOffsets[plane] = offset;
+		offset += SHM_ALIGN((uint64_t)header->linesizes[plane] * planeHeights[plane],
+				SHM_RING_LINE_ALIGN);
+	}
+	header->slotsOffset = SHM_RING_PAGE_SIZE;
+	header->slotStride = SHM_ALIGN(offset, SHM_RING_PAGE_SIZE);
+	header->totalSize = header->slotsOffset + header->numSlots * header->slotStride;
+	return true;
+}
+
+static int GetPlaneHeight(const struct ShmRingHeader *header, uint32_t plane)
+{
+	return plane ? (header->height / 2) : header->height;
+}
+
+/******************************************************************************
+ * Writer
+ *****************************************************************************/
+struct ShmReaderConnection {
+	int connFd;
+	int eventFd;
+};
+
+struct ShmRingWriter {
+	int memfd;
+	struct ShmRingHeader *header;
+	char socketPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+	int listenFd;
+	/* stops the server thread */
+	int wakeFd;
+	pthread_t serverThread;
+	bool serverStarted;
+
+	/**
+	 * Added and removed by the server thread, notified by the
+	 * publishing thread. With SHM_RING_FLAG_RETURN_SLOTS, the slots
+	 * the reader has not sent back yet are held.
+	 */
+	pthread_mutex_t readersMutex;
+	struct ShmReaderConnection readers[SHM_RING_MAX_READERS];
+	size_t numReaders;
+	bool *slotHeld;
+};
+
+static bool ReturnsSlots(const struct ShmRingHeader *header)
+{
+	return header->flags & SHM_RING_FLAG_RETURN_SLOTS;
+}
+
+static bool SendWithFds(int sock, const void *data, size_t size, const int *fds, size_t numFds)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { (void*)data, size };
+	struct msghdr msg = {};
+
+	if (numFds > 2) {
+		return false;
+	}
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)size;
+}
+
+static void RemoveReader(struct ShmRingWriter *writer, size_t idx)
+{
+	pthread_mutex_lock(&writer->readersMutex);
+	close(writer->readers[idx].connFd);
+	close(writer->readers[idx].eventFd);
+	writer->readers[idx] = writer->readers[writer->numReaders - 1];
+	writer->numReaders--;
+	if (ReturnsSlots(writer->header)) {
+		memset(writer->slotHeld, 0, writer->header->numSlots * sizeof(bool));
+	}
+	pthread_mutex_unlock(&writer->readersMutex);
+}
+
+static void AcceptReader(struct ShmRingWriter *writer)
+{
+	size_t maxReaders = ReturnsSlots(writer->header) ? 1 : SHM_RING_MAX_READERS;
+	int connFd = accept4(writer->listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (connFd < 0) {
+		return;
+	}
+	if (writer->numReaders == maxReaders) {
+		fprintf(stderr, "Shm: '%s' has %zu readers already\n",
+				writer->socketPath, maxReaders);
+		close(connFd);
+		return;
+	}
+
+	int eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (eventFd < 0) {
+		close(connFd);
+		return;
+	}
+
+	struct ShmRingHello hello = {
+		.magic = SHM_RING_MAGIC,
+		.version = SHM_RING_VERSION,
+		.totalSize = writer->header->totalSize,
+	};
+	pthread_mutex_lock(&writer->readersMutex);
+	writer->readers[writer->numReaders].connFd = connFd;
+	writer->readers[writer->numReaders].eventFd = eventFd;
+	writer->numReaders++;
+	hello.lastPublished = writer->header->published;
+	pthread_mutex_unlock(&writer->readersMutex);
+
+	int fds[2] = { writer->memfd, eventFd };
+	if (!SendWithFds(connFd, &hello, sizeof(hello), fds, 2)) {
+		RemoveReader(writer, writer->numReaders - 1);
+	}
+}
+
+static void ReleaseSlot(struct ShmRingWriter *writer, uint32_t slot)
+{
+	if (!ReturnsSlots(writer->header) || (slot >= writer->header->numSlots)) {
+		return;
+	}
+	pthread_mutex_lock(&writer->readersMutex);
+	writer->slotHeld[slot] = false;
+	pthread_mutex_unlock(&writer->readersMutex);
+}
+
+/**
+ * Accepts readers, takes the slots returning readers send back and
+ * notices the readers which went away
+ */
+static void *ShmServerThread(void *arg)
+{
+	struct ShmRingWriter *writer = (struct ShmRingWriter*)arg;
+	struct pollfd fds[2 + SHM_RING_MAX_READERS];
+
+	for (;;)
+	{
+		size_t numReaders = writer->numReaders;
+		size_t idx;
+
+		fds[0].fd = writer->wakeFd;
+		fds[0].events = POLLIN;
+		fds[1].fd = writer->listenFd;
+		fds[1].events = POLLIN;
+		for (idx = 0; idx < numReaders; idx++) {
+			fds[2 + idx].fd = writer->readers[idx].connFd;
+			fds[2 + idx].events = POLLIN;
+		}
+
+		if (poll(fds, 2 + numReaders, -1) < 0)
+		{
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[0].revents) {
+			break;
+		}
+
+		/* backwards, removing swaps the last reader in */
+		for (idx = numReaders; idx > 0; idx--)
+		{
+			struct ShmRingRelease release;
+			if (!fds[1 + idx].revents) {
+				continue;
+			}
+
+			ssize_t received = recv(fds[1 + idx].fd, &release, sizeof(release), MSG_DONTWAIT);
+			if (received == sizeof(release)) {
+				ReleaseSlot(writer, release.slot);
+			} else if ((received == 0) || ((received < 0) && (errno != EAGAIN))) {
+				RemoveReader(writer, idx - 1);
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			AcceptReader(writer);
+		}
+	}
+	return NULL;
+}
+
+static bool CreateSharedMemory(struct ShmRingWriter *writer, const struct ShmRingHeader *layout)
+{
+	writer->memfd = memfd_create("defish-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (writer->memfd < 0) {
+		fprintf(stderr, "Shm: memfd_create failed: %s\n", strerror(errno));
+		return false;
+	}
+	if (ftruncate(writer->memfd, layout->totalSize) < 0) {
+		fprintf(stderr, "Shm: failed to size the ring: %s\n", strerror(errno));
+		return false;
+	}
+
+	void *base = mmap(NULL, layout->totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, writer->memfd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Shm: failed to map the ring: %s\n", strerror(errno));
+		return false;
+	}
+	writer->header = (struct ShmRingHeader*)base;
+	memcpy(writer->header, layout, sizeof(*layout));
+
+	/**
+	 * The size is fixed for the readers, and where supported they can
+	 * not map the ring writable
+	 */
+	int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+#ifdef F_SEAL_FUTURE_WRITE
+	seals |= F_SEAL_FUTURE_WRITE;
+#endif
+	fcntl(writer->memfd, F_ADD_SEALS, seals | F_SEAL_SEAL);
+	return true;
+}
+
+static bool CreateServerSocket(struct ShmRingWriter *writer, const char *socketPath)
+{
+	struct sockaddr_un addr = {};
+
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Shm: socket path '%s' is too long\n", socketPath);
+		return false;
+	}
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath);
+	snprintf(writer->socketPath, sizeof(writer->socketPath), "%s", socketPath);
+
+	writer->listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (writer->listenFd < 0) {
+		return false;
+	}
+	unlink(socketPath);
+	if ((bind(writer->listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		|| (listen(writer->listenFd, SHM_RING_MAX_READERS) < 0))
+	{
+		fprintf(stderr, "Shm: failed to listen on '%s': %s\n", socketPath, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+struct ShmRingWriter *shmWriterOpen(const char *socketPath,
+		enum ShmRingPixelFormat pixelFormat,
+		int width,
+		int height,
+		size_t numSlots,
+		uint32_t flags)
+{
+	struct ShmRingHeader layout = {};
+	struct ShmRingWriter *writer = NULL;
+
+	if (!SetupLayout(&layout, pixelFormat, width, height, numSlots, flags)) {
+		fprintf(stderr, "Shm: unsupported ring %dx%d, %zu slots\n", width, height, numSlots);
+		return NULL;
+	}
+
+	writer = calloc(1, sizeof(struct ShmRingWriter));
+	if (!writer) {
+		return NULL;
+	}
+	writer->memfd = -1;
+	writer->listenFd = -1;
+	writer->wakeFd = -1;
+	pthread_mutex_init(&writer->readersMutex, NULL);
+
+	writer->slotHeld = calloc(numSlots, sizeof(bool));
+	if (!writer->slotHeld) {
+		goto fail;
+	}
+	if (!CreateSharedMemory(writer, &layout)
+		|| !CreateServerSocket(writer, socketPath))
+	{
+		goto fail;
+	}
+	writer->wakeFd = eventfd(0, EFD_CLOEXEC);
+	if (writer->wakeFd < 0) {
+		goto fail;
+	}
+	if (pthread_create(&writer->serverThread, NULL, ShmServerThread, writer)) {
+		goto fail;
+	}
+	writer->serverStarted = true;
+	return writer;
+
+fail:
+	shmWriterClose(writer);
+	return NULL;
+}
+
+const struct ShmRingHeader *shmWriterGetHeader(const struct ShmRingWriter *writer)
+{
+	return writer->header;
+}
+
+bool shmWriterBeginFrame(struct ShmRingWriter *writer, uint8_t *planes[SHM_RING_MAX_PLANES])
+{
+	struct ShmRingHeader *header = writer->header;
+	struct ShmRingSlot *slot = GetSlot(header, header->published);
+	uint32_t plane;
+
+	if (ReturnsSlots(header))
+	{
+		pthread_mutex_lock(&writer->readersMutex);
+		bool held = writer->slotHeld[header->published % header->numSlots];
+		pthread_mutex_unlock(&writer->readersMutex);
+		if (held) {
+			return false;
+		}
+	}
+
+	/* a frame begun but never published keeps its odd sequence */
+	uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	if (!(sequence & 1))
+	{
+		__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+		/* the odd sequence is visible before any of the pixels */
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	for (plane = 0; plane < SHM_RING_MAX_PLANES; plane++) {
+		planes[plane] = (plane < header->numPlanes)
+			? (uint8_t*)slot + header->planeOffsets[plane] : NULL;
+	}
+	return true;
+}
+
+/**
+ * Called with readersMutex held
+ */
+static void NotifyReaders(struct ShmRingWriter *writer)
+{
+	const uint64_t one = 1;
+	size_t idx;
+
+	/* non-blocking, a reader that does not drain its eventfd just stays signalled */
+	for (idx = 0; idx < writer->numReaders; idx++) {
+		if (write(writer->readers[idx].eventFd, &one, sizeof(one)) < 0) {
+			continue;
+		}
+	}
+}
+
+void shmWriterPublishFrame(struct ShmRingWriter *writer, int64_t ptsUs)
+{
+	struct ShmRingHeader *header = writer->header;
+	uint64_t published = header->published;
+	struct ShmRingSlot *slot = GetSlot(header, published);
+
+	slot->frameNumber = published + 1;
+	slot->ptsUs = ptsUs;
+	slot->publishedUs = ShmTimestampUs();
+
+	uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sequence, (sequence | 1) + 1, __ATOMIC_RELEASE);
+
+	/* a connecting reader either gets this frame as held or not at all */
+	pthread_mutex_lock(&writer->readersMutex);
+	if (ReturnsSlots(header)) {
+		writer->slotHeld[published % header->numSlots] = (writer->numReaders > 0);
+	}
+	__atomic_store_n(&header->published, published + 1, __ATOMIC_RELEASE);
+	NotifyReaders(writer);
+	pthread_mutex_unlock(&writer->readersMutex);
+}
+
+void shmWriterEndOfStream(struct ShmRingWriter *writer)
+{
+	pthread_mutex_lock(&writer->readersMutex);
+	__atomic_store_n(&writer->header->endOfStream, 1, __ATOMIC_RELEASE);
+	NotifyReaders(writer);
+	pthread_mutex_unlock(&writer->readersMutex);
+}
+
+size_t shmWriterNumReaders(struct ShmRingWriter *writer)
+{
+	pthread_mutex_lock(&writer->readersMutex);
+	size_t numReaders = writer->numReaders;
+	pthread_mutex_unlock(&writer->readersMutex);
+	return numReaders;
+}
+
+/**
+ * Readers keep their mapping, the memory is freed once the last of
+ * them unmaps it
+ */
+void shmWriterClose(struct ShmRingWriter *writer)
+{
+	if (!writer) {
+		return;
+	}
+
+	if (writer->serverStarted)
+	{
+		const uint64_t one = 1;
+		if (write(writer->wakeFd, &one, sizeof(one)) == sizeof(one)) {
+			pthread_join(writer->serverThread, NULL);
+		}
+	}
+	while (writer->numReaders) {
+		RemoveReader(writer, writer->numReaders - 1);
+	}
+
+	if (writer->listenFd >= 0) {
+		close(writer->listenFd);
+		unlink(writer->socketPath);
+	}
+	if (writer->wakeFd >= 0) {
+		close(writer->wakeFd);
+	}
+	if (writer->header) {
+		munmap(writer->header, writer->header->totalSize);
+	}
+	if (writer->memfd >= 0) {
+		close(writer->memfd);
+	}
+	pthread_mutex_destroy(&writer->readersMutex);
+	free(writer->slotHeld);
+	free(writer);
+}
+
+/******************************************************************************
+ * Reader
+ *****************************************************************************/
+struct ShmRingReader {
+	int connFd;
+	int memfd;
+	int eventFd;
+	const struct ShmRingHeader *header;
+	size_t size;
+
+	uint64_t lastFrameNumber;
+	uint64_t missedFrames;
+	bool writerGone;
+};
+
+static bool ReceiveWithFds(int sock, void *data, size_t size, int *fds, size_t numFds)
+{
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { data, size };
+	struct msghdr msg = {};
+
+	if (numFds > 2) {
+		return false;
+	}
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)size) {
+		return false;
+	}
+
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if ((cmsg->cmsg_level == SOL_SOCKET)
+			&& (cmsg->cmsg_type == SCM_RIGHTS)
+			&& (cmsg->cmsg_len == CMSG_LEN(numFds * sizeof(int))))
+		{
+			memcpy(fds, CMSG_DATA(cmsg), numFds * sizeof(int));
+			return true;
+		}
+	}
+	return false;
+}
+
+struct ShmRingReader *shmReaderConnect(const char *socketPath)
+{
+	struct sockaddr_un addr = {};
+	struct ShmRingHello hello = {};
+	int fds[2] = { -1, -1 };
+
+	struct ShmRingReader *reader = calloc(1, sizeof(struct ShmRingReader));
+	if (!reader) {
+		return NULL;
+	}
+	reader->connFd = -1;
+	reader->memfd = -1;
+	reader->eventFd = -1;
+
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		goto fail;
+	}
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socketPath);
+
+	reader->connFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if ((reader->connFd < 0)
+		|| (connect(reader->connFd, (struct sockaddr*)&addr, sizeof(addr)) < 0))
+	{
+		fprintf(stderr, "Shm: failed to connect to '%s': %s\n", socketPath, strerror(errno));
+		goto fail;
+	}
+	if (!ReceiveWithFds(reader->connFd, &hello, sizeof(hello), fds, 2)) {
+		fprintf(stderr, "Shm: no ring received from '%s'\n", socketPath);
+		goto fail;
+	}
+	reader->memfd = fds[0];
+	reader->eventFd = fds[1];
+	if ((hello.magic != SHM_RING_MAGIC) || (hello.version != SHM_RING_VERSION)) {
+		fprintf(stderr, "Shm: '%s' serves an unknown ring version\n", socketPath);
+		goto fail;
+	}
+
+	void *base = mmap(NULL, hello.totalSize, PROT_READ, MAP_SHARED, reader->memfd, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "Shm: failed to map the ring: %s\n", strerror(errno));
+		goto fail;
+	}
+	reader->header = (const struct ShmRingHeader*)base;
+	reader->size = hello.totalSize;
+	if ((reader->header->magic != SHM_RING_MAGIC)
+		|| (reader->header->totalSize != hello.totalSize))
+	{
+		goto fail;
+	}
+
+	/**
+	 * A returning reader takes the frames held for it, any other
+	 * starts with the newest one
+	 */
+	if (ReturnsSlots(reader->header)) {
+		reader->lastFrameNumber = hello.lastPublished;
+		return reader;
+	}
+	reader->lastFrameNumber = __atomic_load_n(&reader->header->published, __ATOMIC_ACQUIRE);
+	if (reader->lastFrameNumber) {
+		reader->lastFrameNumber--;
+	}
+	return reader;
+
+fail:
+	shmReaderClose(reader);
+	return NULL;
+}
+
+const struct ShmRingHeader *shmReaderGetHeader(const struct ShmRingReader *reader)
+{
+	return reader->header;
+}
+
+bool shmReaderWait(struct ShmRingReader *reader, int timeoutMs)
+{
+	struct pollfd fds[2] = {
+		{ .fd = reader->eventFd, .events = POLLIN },
+		{ .fd = reader->connFd, .events = POLLIN },
+	};
+
+	if (poll(fds, 2, timeoutMs) <= 0) {
+		return false;
+	}
+	if (fds[1].revents) {
+		/* the writer closed the connection */
+		reader->writerGone = true;
+		return false;
+	}
+
+	uint64_t count;
+	return read(reader->eventFd, &count, sizeof(count)) == sizeof(count);
+}
+
+static void CopySlotPlanes(const struct ShmRingHeader *header,
+		const struct ShmRingSlot *slot,
+		uint8_t *const planes[SHM_RING_MAX_PLANES],
+		const int linesizes[SHM_RING_MAX_PLANES])
+{
+	uint32_t plane;
+	for (plane = 0; plane < header->numPlanes; plane++)
+	{
+		const uint8_t *src = (const uint8_t*)slot + header->planeOffsets[plane];
+		int height = GetPlaneHeight(header, plane);
+		size_t rowBytes = (header->pixelFormat == SHM_RING_FORMAT_I420)
+			? (size_t)(plane ? header->width / 2 : header->width)
+			: (size_t)header->width * 3;
+		int row;
+
+		if (linesizes[plane] == header->linesizes[plane]) {
+			memcpy(planes[plane], src, (size_t)header->linesizes[plane] * height);
+			continue;
+		}
+		for (row = 0; row < height; row++) {
+			memcpy(planes[plane] + (size_t)row * linesizes[plane],
+					src + (size_t)row * header->linesizes[plane],
+					rowBytes);
+		}
+	}
+}
+
+enum ShmReadStatus shmReaderCopyLatest(struct ShmRingReader *reader,
+		uint8_t *const planes[SHM_RING_MAX_PLANES],
+		const int linesizes[SHM_RING_MAX_PLANES],
+		int64_t *ptsUs)
+{
+	const struct ShmRingHeader *header = reader->header;
+	size_t attempt;
+
+	for (attempt = 0; attempt < SHM_RING_READ_ATTEMPTS; attempt++)
+	{
+		uint64_t published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+		if (published <= reader->lastFrameNumber) {
+			break;
+		}
+
+		const struct ShmRingSlot *slot = GetSlot(header, published - 1);
+		uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) {
+			/* the writer has come round to this slot again */
+			continue;
+		}
+		uint64_t frameNumber = __atomic_load_n(&slot->frameNumber, __ATOMIC_RELAXED);
+		int64_t slotPtsUs = __atomic_load_n(&slot->ptsUs, __ATOMIC_RELAXED);
+
+		CopySlotPlanes(header, slot, planes, linesizes);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+			continue;
+		}
+		if (frameNumber <= reader->lastFrameNumber) {
+			break;
+		}
+
+		reader->missedFrames += frameNumber - reader->lastFrameNumber - 1;
+		reader->lastFrameNumber = frameNumber;
+		if (ptsUs) {
+			*ptsUs = slotPtsUs;
+		}
+		return SHM_READ_FRAME;
+	}
+
+	if (__atomic_load_n(&header->endOfStream, __ATOMIC_ACQUIRE)) {
+		return SHM_READ_END_OF_STREAM;
+	}
+	return SHM_READ_NO_FRAME;
+}
+
+uint64_t shmReaderMissedFrames(const struct ShmRingReader *reader)
+{
+	return reader->missedFrames;
+}
+
+enum ShmReadStatus shmReaderAcquireFrame(struct ShmRingReader *reader, struct ShmRingFrame *frame)
+{
+	const struct ShmRingHeader *header = reader->header;
+	uint32_t plane;
+
+	/* every frame after lastFrameNumber is held, none can be overwritten */
+	uint64_t published = __atomic_load_n(&header->published, __ATOMIC_ACQUIRE);
+	if (!ReturnsSlots(header) || (published <= reader->lastFrameNumber))
+	{
+		if (__atomic_load_n(&header->endOfStream, __ATOMIC_ACQUIRE)) {
+			return SHM_READ_END_OF_STREAM;
+		}
+		return SHM_READ_NO_FRAME;
+	}
+
+	const struct ShmRingSlot *slot = GetSlot(header, reader->lastFrameNumber);
+	frame->slot = reader->lastFrameNumber % header->numSlots;
+	frame->frameNumber = slot->frameNumber;
+	frame->ptsUs = slot->ptsUs;
+	frame->publishedUs = slot->publishedUs;
+	for (plane = 0; plane < SHM_RING_MAX_PLANES; plane++) {
+		frame->planes[plane] = (plane < header->numPlanes)
+			? (const uint8_t*)slot + header->planeOffsets[plane] : NULL;
+	}
+	reader->lastFrameNumber++;
+	return SHM_READ_FRAME;
+}
+
+bool shmReaderReleaseFrame(struct ShmRingReader *reader, uint32_t slot)
+{
+	struct ShmRingRelease release = { .slot = slot };
+	if (send(reader->connFd, &release, sizeof(release), MSG_NOSIGNAL) != sizeof(release))
+	{
+		reader->writerGone = true;
+		return false;
+	}
+	return true;
+}
+
+bool shmReaderWriterGone(const struct ShmRingReader *reader)
+{
+	return reader->writerGone;
+}
+
+void shmReaderClose(struct ShmRingReader *reader)
+{
+	if (!reader) {
+		return;
+	}
+	if (reader->header) {
+		munmap((void*)reader->header, reader->size);
+	}
+	if (reader->eventFd >= 0) {
+		close(reader->eventFd);
+	}
+	if (reader->memfd >= 0) {
+		close(reader->memfd);
+	}
+	if (reader->connFd >= 0) {
+		close(reader->connFd);
+	}
+	free(reader);
+}
@@ -0,0 +1,166 @@
+#ifndef __SHM_FRAME_RING__H__
+#define __SHM_FRAME_RING__H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+ * Shared-memory frame ring
+ *
+ * A writer exports a ring of raw frames in a memfd to readers in other
+ * processes on the same machine. A reader connects to the UNIX socket of
+ * the writer and receives the memfd and an eventfd of its own through
+ * SCM_RIGHTS. The eventfd is signalled after every published frame.
+ *
+ * Layout:
+ * - header page (struct ShmRingHeader)
+ * - numSlots slots of slotStride bytes, each a struct ShmRingSlot
+ *   followed by the planes at planeOffsets from the start of the slot
+ *
+ * Every slot is guarded by a sequence lock. The writer makes the sequence
+ * odd, writes the pixels, makes it even again and then bumps published.
+ * A reader copies the newest slot and keeps the copy only when the
+ * sequence was the same even value before and after. Readers never hold
+ * up the writer: one that falls numSlots - 1 frames behind misses frames.
+ *
+ * With SHM_RING_FLAG_RETURN_SLOTS the ring has a single reader, which
+ * takes every frame in order and uses the pixels in place. Each slot
+ * published while the reader is connected stays with it until it sends
+ * the slot back over the socket, and the writer does not begin a frame
+ * in a slot the reader still holds.
+ *****************************************************************************/
+enum {
+	SHM_RING_PAGE_SIZE = 4096,
+	SHM_RING_LINE_ALIGN = 64,
+	SHM_RING_MAX_PLANES = 3,
+	SHM_RING_MAX_READERS = 16,
+};
+
+enum ShmRingFlags {
+	SHM_RING_FLAG_RETURN_SLOTS = 1 << 0,
+};
+
+enum ShmRingPixelFormat {
+	/* packed RGB */
+	SHM_RING_FORMAT_RGB24,
+	/* planar 4:2:0, BT.601 limited range */
+	SHM_RING_FORMAT_I420,
+};
+
+struct ShmRingHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pixelFormat;
+	uint32_t numPlanes;
+	int32_t width;
+	int32_t height;
+	int32_t linesizes[SHM_RING_MAX_PLANES];
+	uint32_t numSlots;
+	uint64_t planeOffsets[SHM_RING_MAX_PLANES];
+	uint64_t slotsOffset;
+	uint64_t slotStride;
+	uint64_t totalSize;
+
+	/**
+	 * Updated by the writer while running and accessed atomically:
+	 * the number of frames published so far, the newest one being in
+	 * slot (published - 1) % numSlots, and whether the stream ended
+	 */
+	uint64_t published;
+	uint32_t endOfStream;
+	/* ShmRingFlags */
+	uint32_t flags;
+};
+
+struct ShmRingSlot {
+	/* odd while the writer is filling the slot */
+	uint64_t sequence;
+	/* 1 for the first published frame */
+	uint64_t frameNumber;
+	/* presentation time in microseconds */
+	int64_t ptsUs;
+	/* CLOCK_MONOTONIC time of publishing in microseconds */
+	uint64_t publishedUs;
+};
+
+struct ShmRingWriter;
+struct ShmRingReader;
+
+/**
+ * Creates the ring and starts serving readers on socketPath, replacing
+ * a stale socket left at the path. Rows are stored in the order the
+ * writer fills them in.
+ */
+struct ShmRingWriter *shmWriterOpen(const char *socketPath,
+		enum ShmRingPixelFormat pixelFormat,
+		int width,
+		int height,
+		size_t numSlots,
+		uint32_t flags);
+
+const struct ShmRingHeader *shmWriterGetHeader(const struct ShmRingWriter *writer);
+
+/**
+ * Returns the planes of the slot the next frame goes to. Readers skip
+ * the slot until shmWriterPublishFrame. Fails only with
+ * SHM_RING_FLAG_RETURN_SLOTS, while the reader still holds the slot.
+ */
+bool shmWriterBeginFrame(struct ShmRingWriter *writer, uint8_t *planes[SHM_RING_MAX_PLANES]);
+void shmWriterPublishFrame(struct ShmRingWriter *writer, int64_t ptsUs);
+void shmWriterEndOfStream(struct ShmRingWriter *writer);
+size_t shmWriterNumReaders(struct ShmRingWriter *writer);
+void shmWriterClose(struct ShmRingWriter *writer);
+
+enum ShmReadStatus {
+	SHM_READ_FRAME,
+	/* nothing newer than the last frame read */
+	SHM_READ_NO_FRAME,
+	SHM_READ_END_OF_STREAM,
+};
+
+struct ShmRingReader *shmReaderConnect(const char *socketPath);
+const struct ShmRingHeader *shmReaderGetHeader(const struct ShmRingReader *reader);
+
+/**
+ * Waits up to timeoutMs (-1 forever) for the writer to publish a frame.
+ * Returns false on timeout and once the writer has gone away.
+ */
+bool shmReaderWait(struct ShmRingReader *reader, int timeoutMs);
+
+/**
+ * Copies the newest frame into the given planes, when it is newer than
+ * the last one copied. Frames published in between count as missed.
+ */
+enum ShmReadStatus shmReaderCopyLatest(struct ShmRingReader *reader,
+		uint8_t *const planes[SHM_RING_MAX_PLANES],
+		const int linesizes[SHM_RING_MAX_PLANES],
+		int64_t *ptsUs);
+uint64_t shmReaderMissedFrames(const struct ShmRingReader *reader);
+
+/**
+ * A frame held by the reader (SHM_RING_FLAG_RETURN_SLOTS)
+ */
+struct ShmRingFrame {
+	const uint8_t *planes[SHM_RING_MAX_PLANES];
+	uint32_t slot;
+	uint64_t frameNumber;
+	int64_t ptsUs;
+	uint64_t publishedUs;
+};
+
+/**
+ * SHM_RING_FLAG_RETURN_SLOTS: takes the next frame in publishing order.
+ * Its pixels stay valid and unchanged until shmReaderReleaseFrame.
+ */
+enum ShmReadStatus shmReaderAcquireFrame(struct ShmRingReader *reader, struct ShmRingFrame *frame);
+bool shmReaderReleaseFrame(struct ShmRingReader *reader, uint32_t slot);
+
+/**
+ * Whether the writer closed the connection, after which no frames
+ * are published any more
+ */
+bool shmReaderWriterGone(const struct ShmRingReader *reader);
+void shmReaderClose(struct ShmRingReader *reader);
+
+#endif //__SHM_FRAME_RING__H__
@@ -0,0 +1,138 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shm_frame_ring.h"
+
+/******************************************************************************
+ * Test producer for shm:// sources
+ *
+ * Stands in for a capture process which decodes a camera on its own:
+ * publishes a moving I420 test pattern into a ring returning its slots,
+ * paced at the given frame rate. A frame is dropped when the consumer
+ * still holds every slot.
+ *
+ * Usage: shm_test_producer SOCKET [WIDTHxHEIGHT] [FPS]
+ *****************************************************************************/
+enum {
+	PRODUCER_DEFAULT_WIDTH = 1280,
+	PRODUCER_DEFAULT_HEIGHT = 960,
+	PRODUCER_DEFAULT_FPS = 30,
+	PRODUCER_SLOTS = 4,
+	PRODUCER_BAR_WIDTH = 64,
+};
+
+static volatile sig_atomic_t StopRequested;
+
+static void HandleStopSignal(int signum)
+{
+	StopRequested = 1;
+}
+
+static void FillTestPattern(const struct ShmRingHeader *header,
+		uint8_t *planes[SHM_RING_MAX_PLANES],
+		uint64_t frameNumber)
+{
+	int bar = (int)((frameNumber * 4) % header->width);
+	int x, y;
+
+	for (y = 0; y < header->height; y++)
+	{
+		uint8_t *row = planes[0] + (size_t)y * header->linesizes[0];
+		for (x = 0; x < header->width; x++)
+		{
+			int inBar = ((x - bar + header->width) % header->width) < PRODUCER_BAR_WIDTH;
+			row[x] = inBar ? 235 : (uint8_t)(16 + ((x + y) & 0x7f));
+		}
+	}
+
+	for (y = 0; y < header->height / 2; y++)
+	{
+		memset(planes[1] + (size_t)y * header->linesizes[1],
+				(uint8_t)(frameNumber & 0xff), header->width / 2);
+		memset(planes[2] + (size_t)y * header->linesizes[2],
+				(uint8_t)(255 - (frameNumber & 0xff)), header->width / 2);
+	}
+}
+
+static void AdvanceTimespec(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int width = PRODUCER_DEFAULT_WIDTH;
+	int height = PRODUCER_DEFAULT_HEIGHT;
+	int fps = PRODUCER_DEFAULT_FPS;
+	uint64_t published = 0;
+	uint64_t dropped = 0;
+	struct timespec next;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s SOCKET [WIDTHxHEIGHT] [FPS]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if ((argc > 2) && (2 != sscanf(argv[2], "%dx%d", &width, &height)))
+	{
+		fprintf(stderr, "bad size '%s'\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 3) {
+		fps = atoi(argv[3]);
+	}
+	if ((width <= 0) || (height <= 0) || (width & 1) || (height & 1) || (fps <= 0))
+	{
+		fprintf(stderr, "need an even size and a positive frame rate\n");
+		return EXIT_FAILURE;
+	}
+
+	struct ShmRingWriter *writer = shmWriterOpen(argv[1], SHM_RING_FORMAT_I420,
+			width, height, PRODUCER_SLOTS, SHM_RING_FLAG_RETURN_SLOTS);
+	if (!writer)
+	{
+		fprintf(stderr, "failed to create the ring at '%s'\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	const struct ShmRingHeader *header = shmWriterGetHeader(writer);
+
+	signal(SIGINT, HandleStopSignal);
+	signal(SIGTERM, HandleStopSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "%dx%d I420 at %d fps on '%s'\n", width, height, fps, argv[1]);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!StopRequested)
+	{
+		uint8_t *planes[SHM_RING_MAX_PLANES];
+		uint64_t frameNumber = published + dropped;
+
+		if (shmWriterBeginFrame(writer, planes))
+		{
+			FillTestPattern(header, planes, frameNumber);
+			shmWriterPublishFrame(writer, (int64_t)(frameNumber * 1000000 / fps));
+			published++;
+		}
+		else
+		{
+			dropped++;
+		}
+
+		AdvanceTimespec(&next, 1000000000L / fps);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	fprintf(stderr, "%llu frames published, %llu dropped\n",
+			(unsigned long long)published, (unsigned long long)dropped);
+	shmWriterEndOfStream(writer);
+	shmWriterClose(writer);
+	return EXIT_SUCCESS;
+}
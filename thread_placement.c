@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+	#include <sys/syscall.h>
+#endif
+
+#include "defish_app.h"
+
+/******************************************************************************
+ * Thread placement: CPU affinity, scheduling class and NUMA memory policy
+ * of the pipeline stages.
+ *
+ * The memory policy calls go through syscall() so that libnuma is not
+ * needed; on systems without them only the scheduling part applies.
+ *****************************************************************************/
+
+static const struct StagePlacement StagePlacements[NUM_PIPELINE_STAGES] =
+	STAGE_PLACEMENT_INITIALIZER;
+
+static const char *StageNames[NUM_PIPELINE_STAGES] = {
+	"demux",
+	"decode",
+	"render",
+	"encode",
+};
+
+/**
+ * The stage consuming the buffers a stage allocates: packets go to the
+ * decoder, decoded frames to the renderer, and the renderer writes into
+ * buffers pre-allocated for the encoder.
+ */
+static const enum PipelineStage StageBufferConsumer[NUM_PIPELINE_STAGES] = {
+	[PIPELINE_STAGE_DEMUX] = PIPELINE_STAGE_DECODE,
+	[PIPELINE_STAGE_DECODE] = PIPELINE_STAGE_RENDER,
+	[PIPELINE_STAGE_RENDER] = PIPELINE_STAGE_RENDER,
+	[PIPELINE_STAGE_ENCODE] = PIPELINE_STAGE_ENCODE,
+};
+
+enum {
+	PLACEMENT_MPOL_DEFAULT = 0,
+	PLACEMENT_MPOL_PREFERRED = 1,
+	PLACEMENT_NODEMASK_BITS = 64,
+	PLACEMENT_REPORT_SIZE = 256,
+};
+
+static pthread_mutex_t PlacementReportMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+ * Helpers
+ *****************************************************************************/
+static int SetThreadAffinity(uint64_t cpuMask)
+{
+#if defined(__linux__)
+	cpu_set_t cpus;
+	int cpu;
+	CPU_ZERO(&cpus);
+	for (cpu = 0; cpu < 64; cpu++)
+	{
+		if (cpuMask & (1ULL << cpu)) {
+			CPU_SET(cpu, &cpus);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+	return ENOSYS;
+#endif
+}
+
+static int SetThreadScheduling(const struct StagePlacement *placement)
+{
+	struct sched_param param = {};
+	int policy = SCHED_OTHER;
+
+	if (placement->fifoPriority > 0) {
+		policy = SCHED_FIFO;
+		param.sched_priority = placement->fifoPriority;
+	}
+
+	/* also undoes a SCHED_FIFO inherited from the creating thread */
+	int status = pthread_setschedparam(pthread_self(), policy, &param);
+	if (status || (policy != SCHED_OTHER)) {
+		return status;
+	}
+
+#if defined(__linux__)
+	/* on Linux the nice level is per thread */
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), placement->nice)) {
+		return errno;
+	}
+	return 0;
+#else
+	return placement->nice ? ENOSYS : 0;
+#endif
+}
+
+static int SetThreadMemoryPolicy(int numaNode)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+	unsigned long nodemask = 0;
+	int mode = PLACEMENT_MPOL_DEFAULT;
+	if (numaNode >= 0) {
+		nodemask = 1UL << numaNode;
+		mode = PLACEMENT_MPOL_PREFERRED;
+	}
+	if (syscall(SYS_set_mempolicy, mode,
+			(numaNode >= 0) ? &nodemask : NULL,
+			PLACEMENT_NODEMASK_BITS + 1))
+	{
+		return errno;
+	}
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+static int BindBufferToNode(void *buffer, size_t size, int numaNode)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long nodemask = 1UL << numaNode;
+	if (syscall(SYS_mbind, buffer, size, PLACEMENT_MPOL_PREFERRED,
+			&nodemask, PLACEMENT_NODEMASK_BITS + 1, 0))
+	{
+		return errno;
+	}
+	return 0;
+#else
+	return ENOSYS;
+#endif
+}
+
+static void ReportStatus(char *report, size_t size, const char *what, int status)
+{
+	if (status) {
+		size_t len = strlen(report);
+		snprintf(report + len, size - len, " [%s failed: %s]", what, strerror(status));
+	}
+}
+
+/******************************************************************************
+ * Public API
+ *****************************************************************************/
+void ApplyStagePlacement(enum PipelineStage stage)
+{
+	const struct StagePlacement *placement = &StagePlacements[stage];
+	int memoryNode = StagePlacements[StageBufferConsumer[stage]].numaNode;
+	char report[PLACEMENT_REPORT_SIZE] = {};
+	char cpus[32] = "any";
+	char sched[32] = {};
+	char memory[32] = "default";
+
+	if (placement->cpuMask) {
+		snprintf(cpus, sizeof(cpus), "0x%llx", (unsigned long long)placement->cpuMask);
+	}
+	if (placement->fifoPriority > 0) {
+		snprintf(sched, sizeof(sched), "fifo/%d", placement->fifoPriority);
+	} else {
+		snprintf(sched, sizeof(sched), "nice %d", placement->nice);
+	}
+	if (memoryNode >= 0) {
+		snprintf(memory, sizeof(memory), "node %d", memoryNode);
+	}
+
+	snprintf(report, sizeof(report), "Placement: %-6s cpus=%s sched=%s memory=%s",
+			StageNames[stage], cpus, sched, memory);
+
+	if (placement->cpuMask) {
+		ReportStatus(report, sizeof(report), "affinity",
+				SetThreadAffinity(placement->cpuMask));
+	}
+	ReportStatus(report, sizeof(report), "scheduling",
+			SetThreadScheduling(placement));
+
+	/* reset an inherited policy too, unless nothing is configured at all */
+	if ((memoryNode >= 0) || (placement->numaNode >= 0)) {
+		ReportStatus(report, sizeof(report), "memory policy",
+				SetThreadMemoryPolicy(memoryNode));
+	}
+
+	pthread_mutex_lock(&PlacementReportMutex);
+	fprintf(stderr, "%s\n", report);
+	pthread_mutex_unlock(&PlacementReportMutex);
+}
+
+void *AllocStageBuffer(enum PipelineStage consumer, size_t size)
+{
+	int numaNode = StagePlacements[consumer].numaNode;
+
+	void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED) {
+		return NULL;
+	}
+
+	/**
+	 * The pages are only allocated when first touched, by whichever
+	 * thread writes them, but the policy set here decides the node
+	 */
+	if (numaNode >= 0)
+	{
+		int status = BindBufferToNode(buffer, size, numaNode);
+		if (status) {
+			fprintf(stderr, "Placement: %s buffer not bound to node %d: %s\n",
+					StageNames[consumer], numaNode, strerror(status));
+		}
+	}
+	return buffer;
+}
+
+void FreeStageBuffer(void *buffer, size_t size)
+{
+	if (buffer) {
+		munmap(buffer, size);
+	}
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "opengl_common.h"
 #include "opengl_utils.h"
@@ -20,22 +21,113 @@ static void glfw_error_callback(int error, const char *description)
 	fprintf(stderr, "GL error [%d]: '%s'\n", error, description);
 }
 
-int main(void) {
+uint64_t StartupTimeUs;
+
+struct AppOptions gAppOptions = {
+	.outputPath = OFFLINE_DEFAULT_OUTPUT,
+	.rangeStartUs = 0,
+	.rangeEndUs = INT64_MAX,
+	.chunkSeconds = OFFLINE_DEFAULT_CHUNK_SECONDS,
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-b] [-o output] [-j jobs] [-c seconds] [source ...]\n"
+			"  -b         offline batch mode: process every frame set once,\n"
+			"             as fast as possible, until the first source ends\n"
+			"  -o output  offline output file (default %s)\n"
+			"  -j jobs    offline, split the inputs into chunks processed\n"
+			"             by this many processes in parallel\n"
+			"  -c seconds minimum chunk length for -j (default %d)\n"
+			"  -S/-E us   offline, only process this range (used by -j)\n"
+			"  source     up to %d inputs replacing the built-in paths,\n"
+			"             %d cameras per rig\n",
+			argv0, OFFLINE_DEFAULT_OUTPUT, OFFLINE_DEFAULT_CHUNK_SECONDS,
+			NUM_SOURCES, NUM_SRC_STREAMS);
+}
+
+static bool ParseOptions(int argc, char **argv)
+{
+	int opt;
+	int src_idx;
+	while ((opt = getopt(argc, argv, "bo:j:c:S:E:h")) != -1)
+	{
+		switch (opt) {
+		case 'b':
+			gAppOptions.offline = true;
+			break;
+		case 'o':
+			gAppOptions.outputPath = optarg;
+			break;
+		case 'j':
+			gAppOptions.jobs = atoi(optarg);
+			gAppOptions.offline = true;
+			break;
+		case 'c':
+			gAppOptions.chunkSeconds = atoi(optarg);
+			break;
+		case 'S':
+			gAppOptions.rangeStartUs = strtoll(optarg, NULL, 10);
+			break;
+		case 'E':
+			gAppOptions.rangeEndUs = strtoll(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return false;
+		}
+	}
+
+	if (argc - optind > NUM_SOURCES) {
+		usage(argv[0]);
+		return false;
+	}
+	for (src_idx = 0; optind < argc; src_idx++, optind++) {
+		gAppOptions.sourcePaths[src_idx] = argv[optind];
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+		StartupTimeUs = GetTimestampUs();
+		uint64_t phaseStartUs = StartupTimeUs;
+
+		if (!ParseOptions(argc, argv)) {
+			return EXIT_FAILURE;
+		}
+
+		/**
+		 * The chunked driver only starts and combines other instances
+		 */
+		if (gAppOptions.jobs > 0) {
+			return RunChunkedOfflineDriver(argv[0]);
+		}
+
+		/**
+		 * The main thread renders. Apply its placement before any other
+		 * thread is created, each of them then applies its own.
+		 */
+		ApplyStagePlacement(PIPELINE_STAGE_RENDER);
+
 		/**
 		 * Initialize FFMPEG source
 		 */
 
 		InitializeDecoders();
+		PrintStartupPhase("decoders", phaseStartUs);
 
 		/**
-		 * Initialize GStreamer server
+		 * Initialize the encoder (GStreamer server or libavcodec)
 		 */
-		InitializeGStreamerServer();
+		phaseStartUs = GetTimestampUs();
+		InitializeEncoderSink();
+		PrintStartupPhase("encoder", phaseStartUs);
 
 		/**
 		 * Create OpenGL Core Profile (3.2) context
 		 */
 
+        phaseStartUs = GetTimestampUs();
         glfwInit();
 		glfwSetErrorCallback(glfw_error_callback);
         glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
@@ -52,6 +144,14 @@ int main(void) {
         GLFWwindow* window = glfwCreateWindow(PREVIEW_WIDTH, PREVIEW_HEIGHT,
                 "OpenGL", NULL, NULL);
         glfwMakeContextCurrent(window);
+		if (gAppOptions.offline || OUTPUT_CADENCE_SCHEDULER) {
+			/**
+			 * never wait for vsync when processing recordings,
+			 * and live output is paced by the output ticks instead
+			 */
+			glfwSwapInterval(0);
+		}
+		PrintStartupPhase("GL context", phaseStartUs);
 
 		/**
 		 * At this point we can invoke the actual processing pipeline
@@ -60,11 +160,23 @@ int main(void) {
 #ifdef SHOW_IMAGE
         while (!glfwWindowShouldClose(window)) {
 				ogl(glViewport(0, 0, PREVIEW_WIDTH, PREVIEW_HEIGHT));
-				RenderPipelineWithGL();
+				if (!RenderPipelineWithGL()) {
+					break;
+				}
                 glfwSwapBuffers(window);
                 glfwPollEvents();
         }
+#else
+		/**
+		 * Offline mode runs headless, without vsync and swaps
+		 */
+		if (gAppOptions.offline) {
+			ogl(glViewport(0, 0, PREVIEW_WIDTH, PREVIEW_HEIGHT));
+			while (RenderPipelineWithGL()) {
+			}
+		}
 #endif
+		FlushRenderPipeline();
         glfwTerminate();
 
 		/**
@@ -73,8 +185,8 @@ int main(void) {
 		WaitAndReleaseDecoders();
 
 		/**
-		 * Wait for the GStreamer to terminate and cleanup
+		 * Wait for the encoder to terminate and cleanup
 		 */
-		WaitAndReleaseGStreamerServer();
+		WaitAndReleaseEncoderSink();
         return 0;
 }